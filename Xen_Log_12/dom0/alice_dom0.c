@@ -7,20 +7,46 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_dom0.ko domid=<domid> port=<evtchn>
+ * insmod alice_dom0.ko domid=<domid>[,<domid>...] port=<evtchn>[,<evtchn>...]
+ *        [rounds=<n>] [spread=<policy>] [rebalance_ms=<ms>] [work_us=<us>]
  *
- * <domid>  domID of remote domU
+ * <domid>  domID of remote domU owning each evtchn, the last one is used
+ *          for the rest of evtchns
  *
- * <evtchn> evtchn allocated by remote domU
+ * <evtchn> evtchn allocated by remote domU, up to 16, all ping-pong at once
  *
- * This Module is running in dom0 after domU module to communicate with domU
+ * <n>      Round trips on each evtchn, default 10000
+ *
+ * <policy> vCPU each evtchn is bound to, 0 left where Xen puts it,
+ *          1 round-robin, 2 spread over cpus of local node first,
+ *          3 cpu with fewest evtchns. Default 1
+ *
+ * <ms>     Every <ms> move a busy evtchn off the busiest cpu by event
+ *          rate, 0 never. A run of the default rounds lasts well under
+ *          a second, so default 10
+ *
+ * <us>     Busy this long on each event before bouncing it, as a handler
+ *          with real work would be, so events/s is bound by vCPUs.
+ *          Default 0
+ *
+ * This Module is running in dom0 after domU module to communicate with domU.
+ * domU bounces every event back, dom0 times each round trip and reports
+ * latency percentiles of each evtchn and events/s of them all
  */
 
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
 
 #include <xen/grant_table.h>
 #include <asm/xen/hypercall.h>
@@ -30,54 +56,292 @@
 
 #include <xen/events.h>
 
+#include "../../xen_bench/alice_hist.h"
+
+#define MAX_PORTS 16
+
+/* irq_set_affinity is exported from 5.13 on. Before that the hint sets
+ * affinity too, as Xen_Log_15 uses it, and is cleared before unbind */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+#define alice_set_affinity(irq, mask)   irq_set_affinity(irq, mask)
+#define alice_clear_affinity(irq)       do { } while ( 0 )
+#else
+#define alice_set_affinity(irq, mask)   irq_set_affinity_hint(irq, mask)
+#define alice_clear_affinity(irq)       irq_set_affinity_hint(irq, NULL)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+#include <linux/irq.h>
+#define irq_get_affinity_mask(irq)      (irq_get_irq_data(irq)->affinity)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+/* i-th online cpu, those of node first, as cpumask_local_spread of 4.1 */
+static unsigned int cpumask_local_spread(unsigned int i, int node)
+{
+    int cpu;
+
+    i %= num_online_cpus();
+    for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+        if ( i-- == 0 )
+            return cpu;
+    for_each_online_cpu(cpu) {
+        if ( cpumask_test_cpu(cpu, cpumask_of_node(node)) )
+            continue;
+        if ( i-- == 0 )
+            return cpu;
+    }
+    return cpumask_first(cpu_online_mask);
+}
+#endif
+
 typedef struct info {
     int irq;
     int evtchn;
     int remoteDomID;
+    int cpu;                    /* vCPU evtchn is bound to */
+    int event_cpu;              /* vCPU last event was handled on */
+    unsigned long events;       /* Events handled */
+    unsigned long last_events;  /* At last rebalance */
+    u64 sent;                   /* ns of last ping */
+    unsigned long done;         /* Round trips finished */
+    struct alice_hist rtt;      /* Round trips in ns */
 } info_t;
 
-info_t global_info;
-int domid;
-int port;
+enum {
+    SPREAD_NONE,
+    SPREAD_ROUND_ROBIN,
+    SPREAD_LOCAL,
+    SPREAD_LEAST_LOADED,
+};
 
-module_param(domid, int, 0644);
-module_param(port, int, 0644);
+info_t infos[MAX_PORTS];
+int domid[MAX_PORTS];
+int port[MAX_PORTS];
+static int nr_domids;
+static int nr_ports;
+static int nr_bound;
+static int rounds = 10000;
+static atomic_t ports_running;
+static DECLARE_COMPLETION(all_done);
+static int spread = SPREAD_ROUND_ROBIN;
+static int rebalance_ms = 10;
+static int work_us;
+static unsigned long *cpu_load;     /* Events/period or evtchns of each cpu */
+static unsigned long nr_moves;
+static void rebalance(struct work_struct *work);
+static DECLARE_DELAYED_WORK(rebalance_work, rebalance);
+
+module_param_array(domid, int, &nr_domids, 0644);
+module_param_array(port, int, &nr_ports, 0644);
+module_param(rounds, int, 0644);
+module_param(spread, int, 0644);
+module_param(rebalance_ms, int, 0644);
+module_param(work_us, int, 0644);
 
 static irqreturn_t dom0_handler(int irq, void *dev_id)
 {
     /* Usually, dev_id is address of info struct, 
      * so this handler can make use of this */
     info_t *info = dev_id;
-    pr_info("Dom0: Handled, domid: %d, port: %d, local_irq:%d\n", 
-            info->remoteDomID, info->evtchn, irq);
-    /* Revice event from domU */
+    u64 now = ktime_to_ns(ktime_get());
+
+    /* Revice event from domU, no printing here, it is what we time */
+    if ( info->done >= rounds )
+        return IRQ_HANDLED;
+
+    info->events++;
+    info->event_cpu = raw_smp_processor_id();
+    alice_hist_add(&info->rtt, now - info->sent);
+
+    if ( work_us > 0 )
+        udelay(work_us);
+
+    if ( ++info->done < rounds ) {
+        info->sent = ktime_to_ns(ktime_get());
+        notify_remote_via_irq(irq);
+    } else if ( atomic_dec_and_test(&ports_running) ) {
+        complete(&all_done);
+    }
     return IRQ_HANDLED;
 }
 
+/* Bind evtchn to cpu, Xen irq chip does EVTCHNOP_bind_vcpu for us.
+ * False if the irq did not end up there */
+static bool move_port(info_t *info, int cpu)
+{
+    int err = alice_set_affinity(info->irq, cpumask_of(cpu));
+
+    if ( !err && !cpumask_test_cpu(cpu, irq_get_affinity_mask(info->irq)) )
+        err = -EIO;
+    if ( err ) {
+        pr_err("Dom0: Cant bind evtchn %d to cpu %d, err:%d\n",
+                info->evtchn, cpu, err);
+        return false;
+    }
+    info->cpu = cpu;
+    return true;
+}
+
+/* Pick a cpu for the i-th evtchn by spread policy */
+static void place_port(info_t *info, int i)
+{
+    static int next_cpu = -1;
+    int cpu, best = -1;
+
+    switch ( spread ) {
+    case SPREAD_ROUND_ROBIN:
+        next_cpu = cpumask_next(next_cpu, cpu_online_mask);
+        if ( next_cpu >= nr_cpu_ids )
+            next_cpu = cpumask_first(cpu_online_mask);
+        best = next_cpu;
+        break;
+    case SPREAD_LOCAL:
+        best = cpumask_local_spread(i, numa_node_id());
+        break;
+    case SPREAD_LEAST_LOADED:
+        for_each_online_cpu(cpu)
+            if ( best < 0 || cpu_load[cpu] < cpu_load[best] )
+                best = cpu;
+        cpu_load[best]++;
+        break;
+    default:
+        /* Where Xen put it, rebalance may move it from there */
+        info->cpu = cpumask_first(irq_get_affinity_mask(info->irq));
+        return;
+    }
+    move_port(info, best);
+}
+
+/* Move one evtchn from busiest cpu to idlest by events since last
+ * time, when that lowers the load of the busiest */
+static void rebalance(struct work_struct *work)
+{
+    unsigned long events, gap, rate, best_rate = 0;
+    info_t *info, *best = NULL;
+    int i, cpu, busiest = -1, idlest = -1;
+
+    memset(cpu_load, 0, nr_cpu_ids * sizeof(*cpu_load));
+    for ( i = 0; i < nr_bound; i++ ) {
+        info = &infos[i];
+        events = READ_ONCE(info->events);
+        if ( info->cpu >= 0 )
+            cpu_load[info->cpu] += events - info->last_events;
+    }
+    for_each_online_cpu(cpu) {
+        if ( busiest < 0 || cpu_load[cpu] > cpu_load[busiest] )
+            busiest = cpu;
+        if ( idlest < 0 || cpu_load[cpu] < cpu_load[idlest] )
+            idlest = cpu;
+    }
+
+    /* Biggest evtchn that still leaves busiest above idlest */
+    gap = cpu_load[busiest] - cpu_load[idlest];
+    for ( i = 0; i < nr_bound; i++ ) {
+        info = &infos[i];
+        events = READ_ONCE(info->events);
+        rate = events - info->last_events;
+        info->last_events = events;
+        if ( info->cpu == busiest && rate < gap && rate > best_rate ) {
+            best = info;
+            best_rate = rate;
+        }
+    }
+    if ( best && move_port(best, idlest) )
+        nr_moves++;
+
+    schedule_delayed_work(&rebalance_work, msecs_to_jiffies(rebalance_ms));
+}
+
+static void report(u64 elapsed)
+{
+    unsigned long total = 0;
+    info_t *info;
+    int i;
+
+    for ( i = 0; i < nr_bound; i++ ) {
+        info = &infos[i];
+        total += info->done;
+        pr_info("Dom0: port %d: cpu %d, %lu round trips, p50 %llu ns, "
+                "p99 %llu ns, max %llu ns\n", info->evtchn, info->cpu,
+                info->done, alice_hist_percentile(&info->rtt, 500),
+                alice_hist_percentile(&info->rtt, 990), info->rtt.max);
+        /* Affinity took, or the last events would have run there */
+        if ( info->done > 0 && info->event_cpu != info->cpu )
+            pr_err("Dom0: port %d bound to cpu %d, events ran on cpu %d\n",
+                    info->evtchn, info->cpu, info->event_cpu);
+    }
+    /* Each round trip is two events */
+    pr_info("Dom0: %d ports, %lu round trips in %llu us, %llu events/s\n",
+            nr_bound, total, div_u64(elapsed, 1000),
+            elapsed ? div64_u64(2ULL * total * NSEC_PER_SEC, elapsed) : 0);
+    pr_info("Dom0: evtchns moved by rebalance: %lu\n", nr_moves);
+}
+
 int init_alice(void)
 {
-    int err;
-    
-    global_info.remoteDomID = domid;
-    global_info.evtchn = port;
+    ktime_t start;
+    int err = 0, i;
+
+    if ( nr_ports == 0 || nr_domids == 0 || rounds <= 0 ) {
+        pr_err("Dom0: need domid=<domid> port=<evtchn> and rounds > 0\n");
+        return -EINVAL;
+    }
 
-    pr_info("Dom0: init info with remoteDomID:%d, port:%d\n", domid, port);
+    cpu_load = kcalloc(nr_cpu_ids, sizeof(*cpu_load), GFP_KERNEL);
+    if ( cpu_load == NULL )
+        return -ENOMEM;
 
-    err = bind_interdomain_evtchn_to_irqhandler(global_info.remoteDomID,
-            global_info.evtchn, dom0_handler, 0, "alice_dev", &global_info);
+    for ( nr_bound = 0; nr_bound < nr_ports; nr_bound++ ) {
+        info_t *info = &infos[nr_bound];
 
-    global_info.irq = err;
-    if ( err > 0 ) {
-        pr_info("Dom0: bound local irq:%d to evtchn:%d\n", err, global_info.evtchn);
+        info->remoteDomID = domid[min(nr_bound, nr_domids - 1)];
+        info->evtchn = port[nr_bound];
+        pr_info("Dom0: init info with remoteDomID:%d, port:%d\n",
+                info->remoteDomID, info->evtchn);
+
+        err = bind_interdomain_evtchn_to_irqhandler(info->remoteDomID,
+                info->evtchn, dom0_handler, 0, "alice_dev", info);
+        if ( err <= 0 ) {
+            pr_err("Dom0: Cant bind evtchn %d, err:%d\n", info->evtchn, err);
+            break;
+        }
+        info->irq = err;
+        pr_info("Dom0: bound local irq:%d to evtchn:%d\n", err, info->evtchn);
+        place_port(info, nr_bound);
+    }
+    if ( nr_bound == 0 ) {
+        kfree(cpu_load);
+        return err ? err : -EINVAL;
+    }
+    if ( rebalance_ms > 0 )
+        schedule_delayed_work(&rebalance_work, msecs_to_jiffies(rebalance_ms));
+
+    /* Kick off all ports at once, handlers keep them going */
+    atomic_set(&ports_running, nr_bound);
+    start = ktime_get();
+    for ( i = 0; i < nr_bound; i++ ) {
+        infos[i].sent = ktime_to_ns(ktime_get());
+        notify_remote_via_irq(infos[i].irq);
     }
 
-    notify_remote_via_irq(global_info.irq);
+    if ( !wait_for_completion_timeout(&all_done, 10 * HZ) )
+        pr_err("Dom0: timed out, %d ports still running\n",
+                atomic_read(&ports_running));
+    report(ktime_to_ns(ktime_sub(ktime_get(), start)));
     return 0;
 }
 
 void exit_alice(void)
 {
-    unbind_from_irqhandler(global_info.irq, &global_info);
+    int i;
+
+    cancel_delayed_work_sync(&rebalance_work);
+    for ( i = 0; i < nr_bound; i++ ) {
+        alice_clear_affinity(infos[i].irq);
+        unbind_from_irqhandler(infos[i].irq, &infos[i]);
+    }
+    kfree(cpu_load);
     pr_info("Dom0: Exit Successfully\n");
 }
 
@@ -7,16 +7,21 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_domU.ko
+ * insmod alice_domU.ko [nr_ports=<n>]
+ *
+ * <n>  Event channels to allocate, each bounces every event back to
+ *      dom0. Default 1, at most 16
  *
  * This Module is running in domU before dom0 module to communicate with dom0
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 #include <linux/gfp.h>
 #include <linux/proc_fs.h>
+#include <linux/interrupt.h>
 
 #include <asm/xen/page.h>
 #include <xen/grant_table.h>
@@ -27,27 +32,31 @@
 
 
 #define DOM0_ID 0
+#define MAX_PORTS 16
 
 typedef struct info {
     int irq;
     int evtchn;
+    unsigned long nr_events;    /* Events bounced back */
 } info_t;
 
-info_t global_info;
+info_t infos[MAX_PORTS];
+static int nr_ports = 1;
+static int nr_bound;
+module_param(nr_ports, int, 0444);
 
 static irqreturn_t domU_handler(int irq, void *dev_id)
 {
     info_t *info = (info_t *)dev_id;
-    pr_info("DomU: Handled! irq: %d, evtchn:%d\n", irq, info->evtchn);
-    /* After domU handle irq, notify dom0 */
+    /* Bounce at once, no printing on this path, dom0 is timing it */
+    info->nr_events++;
     notify_remote_via_irq(irq);
     return IRQ_HANDLED;
 }
 
-
-static int init_alice(void)
+/* Alloc an unbound evtchn for dom0 and handle it */
+static int bind_port(info_t *info)
 {
-
     struct evtchn_alloc_unbound alloc_unbound;
     int err;
 
@@ -59,28 +68,50 @@ static int init_alice(void)
 
     if ( err < 0 ) {
         pr_err("DomU: Can't alloc unbound evtchn, err:%d\n", err);
-        return 0;
+        return err;
     } else {
-        global_info.evtchn = alloc_unbound.port;
-        pr_info("DomU: Get new evtchn: %d\n", global_info.evtchn);
+        info->evtchn = alloc_unbound.port;
+        pr_info("DomU: Get new evtchn: %d\n", info->evtchn);
     }
-    err = bind_evtchn_to_irq(global_info.evtchn);
-    pr_info("DomU: Bound local irq: %d to evtchn:%d\n", err, global_info.evtchn);
-    global_info.irq = err;
+    err = bind_evtchn_to_irq(info->evtchn);
+    if ( err < 0 ) {
+        pr_err("DomU: Cant bind evtchn %d, err:%d\n", info->evtchn, err);
+        return err;
+    }
+    pr_info("DomU: Bound local irq: %d to evtchn:%d\n", err, info->evtchn);
+    info->irq = err;
 
-    err = request_irq(global_info.irq, domU_handler, 0, "alice_dev", &global_info);
+    err = request_irq(info->irq, domU_handler, 0, "alice_dev", info);
     if ( err != 0 ) {
         pr_err("DomU: Cant bound to handler\n");
-        unbind_from_irqhandler(global_info.irq, "alice_dev");
-        return 0;
+        unbind_from_irq(info->irq);
+        return err;
     }
 
     return 0;
 }
 
+static int init_alice(void)
+{
+    if ( nr_ports < 1 || nr_ports > MAX_PORTS )
+        nr_ports = 1;
+
+    for ( nr_bound = 0; nr_bound < nr_ports; nr_bound++ )
+        if ( bind_port(&infos[nr_bound]) )
+            break;
+
+    return 0;
+}
+
 static void exit_alice(void)
 {
-    unbind_from_irqhandler(global_info.irq, "alice_dev");
+    int i;
+
+    for ( i = 0; i < nr_bound; i++ ) {
+        unbind_from_irqhandler(infos[i].irq, &infos[i]);
+        pr_info("DomU: evtchn %d bounced %lu events\n", infos[i].evtchn,
+                infos[i].nr_events);
+    }
     pr_info("DomU: Exit Successfully\n");
     return ;
 }
@@ -89,6 +120,3 @@ module_init(init_alice);
 module_exit(exit_alice);
 
 MODULE_LICENSE("GPL");
-
-
-
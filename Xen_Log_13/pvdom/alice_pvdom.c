@@ -6,14 +6,51 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_dom0.ko
+ * insmod alice_dom0.ko [ring_gfn=<gfn> ring_port=<port>] [spin_us=<us>]
+ *                     [activate=<domid>] [bench=<n> [bench_len=<len>]]
+ *                     [bytewise=1]
+ *
+ * Store ring and event channel of xen_start_info are used, as long as
+ * xenbus of the kernel has not bound that channel. A second reader of
+ * the ring xenbus reads would take replies xenbus waits for, so the
+ * module refuses to load then
+ *
+ * <gfn>    Xenstore ring page of this module alone instead, as a second
+ *          connection xensim hands out
+ * <port>   Event channel of that ring
+ * <us>     Spin this long for ring to move before sleeping on event
+ *          channel, default 5. spin_only=1 never sleeps, as the demo
+ *          first did
+ * <domid>  Also activate alice_dev of this domU in one transaction,
+ *          same keys as Xen_Log_15/dom0/activate.sh writes. race=<r>
+ *          rewrites a key of it outside the transaction on the first r
+ *          tries, as another writer would
+ * <n>      Also time n writes and reads of a value of <len> bytes,
+ *          default 2048, bench_depth of them in flight, default 8
+ * bytewise Copy to and from ring a byte at a time with a barrier for
+ *          each, as this demo first did, to compare with memcpy
  *
  * This Module is running in dom0 to write/read info to/from xenstore
  */
 
 #include <linux/module.h>           /* Needed by all modules */
-//#include <linux/moduleparam.h>      /* Param, dont need here indeed */
+#include <linux/moduleparam.h>      /* Param */
 //#include <linux/kernel.h>           /* KERN_WARN etc */
+#include <linux/slab.h>             /* kmalloc */
+#include <linux/list.h>             /* Pending requests */
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>       /* Wait for response */
+#include <linux/kthread.h>          /* Response reader */
+#include <linux/wait.h>             /* Sleep until event */
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>           /* Backoff of retries */
+#include <linux/delay.h>
+#include <linux/hashtable.h>        /* Cached keys */
+#include <linux/jhash.h>
+#include <linux/workqueue.h>        /* Watch callbacks */
 
 //#include <xen/xen.h>                /* Included by events.h */
 #include <xen/events.h>             /* Event channel */
@@ -23,184 +60,1273 @@
 //#include <asm/xen/hypercall.h>        /* Included by events */
 
 /* Notify backend */
-#define NOTIFY()\
-    do {\
-        struct evtchn_send event;\
-        event.port = xenstore_evtchn;\
-        HYPERVISOR_event_channel_op(EVTCHNOP_send, &event);\
-    } while ( 0 )
+#define NOTIFY() notify_remote_via_evtchn(xenstore_evtchn)
+
+/* Wait until cond holds. Spin a short while first so fast replies stay
+ * cheap, then sleep until back end sends an event, or spin on without
+ * an irq or with spin_only. A cond that holds at once is no wait at all.
+ * 0, or -ERESTARTSYS if intr and a signal came first */
+#define WAIT_RING(cond, intr)\
+    ({\
+        ktime_t end;\
+        int ret = 0;\
+        if ( !(cond) ) {\
+            end = ktime_add_us(ktime_get(), spin_us);\
+            while ( !(cond) && ktime_before(ktime_get(), end) )\
+                cpu_relax();\
+            if ( cond ) {\
+                nr_spin_hits++;\
+            } else if ( xenstore_irq > 0 && !spin_only ) {\
+                nr_sleeps++;\
+                if ( intr )\
+                    ret = wait_event_interruptible(xenstore_wq, (cond));\
+                else\
+                    wait_event(xenstore_wq, (cond));\
+            } else {\
+                while ( !(cond) ) {\
+                    if ( (intr) && signal_pending(current) ) {\
+                        ret = -ERESTARTSYS;\
+                        break;\
+                    }\
+                    cond_resched();\
+                }\
+            }\
+        }\
+        ret;\
+    })
 
 /* Ignore some msg */
 #define IGNORE(n)\
     do {\
         char buffer[XENSTORE_RING_SIZE];\
-        read_response(buffer, n);\
+        int left = (n), chunk;\
+        while ( left > 0 ) {\
+            chunk = min_t(int, left, sizeof(buffer));\
+            if ( read_response(buffer, chunk) )\
+                break;\
+            left -= chunk;\
+        }\
     } while ( 0 )
 
+/* Request in flight, matched with its response by req_id */
+struct alice_xs_req;
+typedef void (*alice_xs_cb_t)(struct alice_xs_req *req, void *data);
+
+struct alice_xs_req {
+    struct list_head list;
+    uint32_t req_id;
+    struct xsd_sockmsg reply;   /* Response header */
+    char *body;                 /* Response payload, NUL terminated */
+    int err;
+    struct completion done;
+    alice_xs_cb_t cb;           /* Called instead of completing if set */
+    void *data;
+    atomic_t ref;               /* Caller's, and cb's until it is called */
+};
+
+/* One op of a batch, value of XS_SET_PERMS is perms separated by NUL */
+struct alice_xs_op {
+    enum xsd_sockmsg_type type;
+    const char *key;
+    const char *value;
+    int value_len;
+};
+
+/* Transactions ending with EAGAIN are tried this many times */
+#define ALICE_XS_RETRIES 16
+/* Wait before a retry, doubled each time up to the max */
+#define ALICE_XS_BACKOFF_MIN_US  50
+#define ALICE_XS_BACKOFF_MAX_US  20000
+
+/* Value of a key under a cached subtree */
+struct alice_xs_centry {
+    struct hlist_node hash;
+    struct list_head lru;       /* Most recently used first */
+    char *key;
+    char *value;
+    int len;
+};
+
+#define ALICE_XS_CACHE_BITS     6
+#define ALICE_XS_MAX_SUBTREES   8
+/* Token of watches keeping the cache fresh */
+#define ALICE_XS_CACHE_TOKEN    "alice_cache"
+
+/* Watch on a path, cb runs from a worker with the path that changed.
+ * Events on the same path not yet delivered are merged into one, so cb
+ * sees the latest state rather than every change */
+struct alice_xs_watch;
+typedef void (*alice_xs_watch_cb_t)(struct alice_xs_watch *w, const char *path);
+
+struct alice_xs_watch {
+    struct list_head list;
+    const char *path;
+    alice_xs_watch_cb_t cb;
+    char token[24];             /* Set on register, tells watches apart */
+};
+
+/* Event queued for the worker */
+struct alice_xs_event {
+    struct hlist_node hash;
+    struct list_head list;
+    struct alice_xs_watch *watch;
+    char path[];
+};
+
+#define ALICE_XS_EVENT_BITS     8
+
 /* Interface */
 int alice_xs_write(char *key, char *value);
 int alice_xs_read(char *key, char *value, int value_len);
+struct alice_xs_req *alice_xs_submit(enum xsd_sockmsg_type type,
+        uint32_t tx_id, const char *key, const char *value, int value_len,
+        alice_xs_cb_t cb, void *data);
+int alice_xs_wait(struct alice_xs_req *req);
+void alice_xs_put(struct alice_xs_req *req);
+int alice_xs_transaction_start(uint32_t *tx_id);
+int alice_xs_transaction_end(uint32_t tx_id, bool abort);
+int alice_xs_batch(const struct alice_xs_op *ops, int nr);
+int alice_xs_cache_subtree(const char *path);
+int alice_xs_cached_read(char *key, char *value, int value_len);
+int alice_xs_register_watch(struct alice_xs_watch *w);
+void alice_xs_unregister_watch(struct alice_xs_watch *w);
 
 /* Shared interface */
 static struct xenstore_domain_interface *xenstore;
 /* guest frame number */
 static unsigned long xenstore_gfn;
 /* Init req_id is 0 */
-static int req_id = 0;
+static atomic_t req_id = ATOMIC_INIT(0);
 /* Event Channel of shared xenstore interface */
 static evtchn_port_t xenstore_evtchn;
+/* Irq of it, and those waiting for it */
+static int xenstore_irq;
+static DECLARE_WAIT_QUEUE_HEAD(xenstore_wq);
+
+static unsigned long ring_gfn;
+module_param(ring_gfn, ulong, 0444);
+static int ring_port;
+module_param(ring_port, int, 0444);
+
+static int spin_us = 5;
+module_param(spin_us, int, 0644);
+static bool spin_only;
+module_param(spin_only, bool, 0644);
+static int activate;
+module_param(activate, int, 0644);
+static int race;
+module_param(race, int, 0644);
+static int bench;
+module_param(bench, int, 0444);
+static int bench_len = 2048;
+module_param(bench_len, int, 0444);
+static int bench_depth = 8;
+module_param(bench_depth, int, 0444);
+static bool bytewise;
+module_param(bytewise, bool, 0644);
 
-/* Fill request */
-static int fill_request(char *msg, int len)
+/* Waits done by spinning and by sleeping */
+static unsigned long nr_spin_hits;
+static unsigned long nr_sleeps;
+module_param(nr_spin_hits, ulong, 0444);
+module_param(nr_sleeps, ulong, 0444);
+/* Transactions retried on EAGAIN */
+static unsigned long nr_tx_retries;
+module_param(nr_tx_retries, ulong, 0444);
+
+/* Entries kept in cache at most */
+static int cache_max = 128;
+module_param(cache_max, int, 0644);
+static unsigned long nr_cache_hits;
+static unsigned long nr_cache_misses;
+static unsigned long nr_cache_invals;
+module_param(nr_cache_hits, ulong, 0444);
+module_param(nr_cache_misses, ulong, 0444);
+module_param(nr_cache_invals, ulong, 0444);
+
+/* Only keys under a watched subtree are cached, the watch tells us
+ * when they change. cache_gen is bumped by every invalidation, so a read
+ * racing with one does not put a stale value in */
+static DEFINE_HASHTABLE(cache_hash, ALICE_XS_CACHE_BITS);
+static LIST_HEAD(cache_lru);
+static DEFINE_SPINLOCK(cache_lock);
+static int cache_nr;
+static unsigned long cache_gen;
+static char *cache_subtrees[ALICE_XS_MAX_SUBTREES];
+static int nr_cache_subtrees;
+
+/* Watch events got, merged into one still queued, and delivered */
+static unsigned long nr_watch_events;
+static unsigned long nr_watch_coalesced;
+static unsigned long nr_watch_callbacks;
+module_param(nr_watch_events, ulong, 0444);
+module_param(nr_watch_coalesced, ulong, 0444);
+module_param(nr_watch_callbacks, ulong, 0444);
+
+/* Registered watches, and events waiting for callback. Events are also
+ * hashed by watch and path to find the one a new event merges into */
+static LIST_HEAD(watches);
+/* Last watch registered, its token is made of this */
+static atomic_t watch_ids = ATOMIC_INIT(0);
+static LIST_HEAD(watch_events);
+static DEFINE_HASHTABLE(watch_events_hash, ALICE_XS_EVENT_BITS);
+static DEFINE_SPINLOCK(watch_lock);
+/* Held while a callback runs, so unregister can wait it out */
+static DEFINE_MUTEX(watch_cb_mutex);
+static void watch_work_fn(struct work_struct *work);
+static DECLARE_WORK(watch_work, watch_work_fn);
+
+/* Requests waiting for response */
+static LIST_HEAD(pending);
+static DEFINE_SPINLOCK(pending_lock);
+/* Whole message must go into ring in one piece */
+static DEFINE_MUTEX(send_lock);
+/* Reads responses and hands them to requests */
+static struct task_struct *reader;
+
+/* Copy the way this demo first did, byte by byte */
+static void copy_bytes(char *dst, const char *src, int len)
 {
     int i;
-    int ring_index;
-    /* len must < XENSTORE_RING_SIZE */
-    if ( len > XENSTORE_RING_SIZE )
-        return -1;
-    
-    /* Wait for back end to clear enough space in buffer */
-    /* Message may be long, we will clean byte by byte */
-    for ( i = xenstore->req_prod; len > 0; i++, len-- ) {
-        XENSTORE_RING_IDX data;
-        do {
-            data = i - xenstore->req_cons;
-            mb();
-        } while ( data >= sizeof(xenstore->req) ); /* Wait back end */
-
-        /* Copy a byte */
-        ring_index = MASK_XENSTORE_IDX(i);
-        xenstore->req[ring_index] = *msg;
-        msg ++;
-    }
-
-    /* Ensure data is into ring */
-    wmb();
-    xenstore->req_prod = i;
+
+    for ( i = 0; i < len; i++ ) {
+        mb();
+        dst[i] = src[i];
+    }
+}
+
+/* Fill request, copy in contiguous chunks. A chunk ends at the wrap of
+ * ring or where back end has not freed space yet. Each chunk is notified
+ * at once, back end can't free space it is not told about. A signal
+ * stops the wait only while none of msg is on ring and intr is set, a
+ * message cut in two would garble the stream */
+static int fill_request(const char *msg, int len, bool intr)
+{
+    XENSTORE_RING_IDX cons, prod;
+    int chunk, err;
+    bool sent = false;
+
+    /* Ring is streamed, len can be up to a full payload */
+    if ( len > XENSTORE_PAYLOAD_MAX )
+        return -E2BIG;
+
+    prod = xenstore->req_prod;
+    while ( len > 0 ) {
+        /* Wait for back end to clear space in buffer */
+        err = WAIT_RING(prod - READ_ONCE(xenstore->req_cons) < XENSTORE_RING_SIZE,
+                intr && !sent);
+        if ( err )
+            return err;
+        cons = READ_ONCE(xenstore->req_cons);
+        /* Read req_cons before writing into space it freed */
+        mb();
+
+        chunk = min_t(int, len, XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod));
+        chunk = min_t(int, chunk, XENSTORE_RING_SIZE - (prod - cons));
+        if ( bytewise )
+            copy_bytes(xenstore->req + MASK_XENSTORE_IDX(prod), msg, chunk);
+        else
+            memcpy(xenstore->req + MASK_XENSTORE_IDX(prod), msg, chunk);
+        msg += chunk;
+        len -= chunk;
+        prod += chunk;
+
+        /* Ensure data is into ring */
+        wmb();
+        xenstore->req_prod = prod;
+        NOTIFY();
+        sent = true;
+    }
     return 0;
 }
 
-/* Read msg from response */
+/* Read msg from response in contiguous chunks, give up if reader is
+ * asked to stop or signalled. Back end is told of each chunk taken, a response
+ * bigger than ring waits for that space */
 static int read_response(char *msg, int len)
 {
-    int i;
-    int ring_index;
-    for ( i = xenstore->rsp_cons; len > 0; i++, len-- ) {
+    XENSTORE_RING_IDX cons, prod;
+    int chunk, err;
+
+    cons = xenstore->rsp_cons;
+    while ( len > 0 ) {
         /* Wait back end fill data into response */
-        XENSTORE_RING_IDX data;
-        do {
-            data = xenstore->rsp_prod - i;
-            mb();
-        } while ( data == 0 ); /* No res in ring */
-
-        /* Copy this byte */
-        ring_index = MASK_XENSTORE_IDX(i);
-        *msg = xenstore->rsp[ring_index];
-        msg++;
-    }
-    xenstore->rsp_cons = i;
+        err = WAIT_RING(READ_ONCE(xenstore->rsp_prod) != cons ||
+                kthread_should_stop(), true);
+        if ( err )
+            return err;
+        prod = READ_ONCE(xenstore->rsp_prod);
+        if ( prod == cons )
+            return -EINTR;
+        /* Read rsp_prod before data it covers */
+        rmb();
+
+        chunk = min_t(int, len, XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(cons));
+        chunk = min_t(int, chunk, prod - cons);
+        if ( bytewise )
+            copy_bytes(msg, xenstore->rsp + MASK_XENSTORE_IDX(cons), chunk);
+        else
+            memcpy(msg, xenstore->rsp + MASK_XENSTORE_IDX(cons), chunk);
+        msg += chunk;
+        len -= chunk;
+        cons += chunk;
+
+        /* Done reading before back end may reuse the space */
+        mb();
+        xenstore->rsp_cons = cons;
+        /* rsp_cons is out before back end hears of it */
+        mb();
+        NOTIFY();
+    }
     return 0;
 }
 
+/* Back end moved ring indexes */
+static irqreturn_t xenstore_interrupt(int irq, void *dev_id)
+{
+    wake_up(&xenstore_wq);
+    return IRQ_HANDLED;
+}
+
+/* Take the pending request a response belongs to */
+static struct alice_xs_req *take_pending(uint32_t id)
+{
+    struct alice_xs_req *req;
+
+    spin_lock(&pending_lock);
+    list_for_each_entry(req, &pending, list) {
+        if ( req->req_id == id ) {
+            list_del(&req->list);
+            spin_unlock(&pending_lock);
+            return req;
+        }
+    }
+    spin_unlock(&pending_lock);
+    return NULL;
+}
+
+static void complete_request(struct alice_xs_req *req, int err)
+{
+    req->err = err;
+    if ( req->cb ) {
+        req->cb(req, req->data);
+        alice_xs_put(req);
+    } else {
+        complete(&req->done);
+    }
+}
+
+/* key is path or under it, empty path covers everything */
+static bool under_path(const char *key, const char *path)
+{
+    int len = strlen(path);
+
+    if ( len == 0 )
+        return true;
+    return strncmp(key, path, len) == 0 &&
+        (key[len] == '\0' || key[len] == '/');
+}
+
+/* Called with cache_lock held */
+static bool cache_covers(const char *key)
+{
+    int i;
+
+    for ( i = 0; i < nr_cache_subtrees; i++ )
+        if ( under_path(key, cache_subtrees[i]) )
+            return true;
+    return false;
+}
+
+/* Called with cache_lock held */
+static struct alice_xs_centry *cache_find(const char *key)
+{
+    struct alice_xs_centry *e;
+
+    hash_for_each_possible(cache_hash, e, hash, jhash(key, strlen(key), 0))
+        if ( strcmp(e->key, key) == 0 )
+            return e;
+    return NULL;
+}
+
+static void cache_free(struct alice_xs_centry *e)
+{
+    kfree(e->key);
+    kfree(e->value);
+    kfree(e);
+}
+
+/* Called with cache_lock held */
+static void cache_drop(struct alice_xs_centry *e)
+{
+    hash_del(&e->hash);
+    list_del(&e->lru);
+    cache_nr--;
+    cache_free(e);
+}
+
+/* Something at or under path changed */
+static void cache_invalidate(const char *path)
+{
+    struct alice_xs_centry *e, *tmp;
+
+    spin_lock(&cache_lock);
+    cache_gen++;
+    list_for_each_entry_safe(e, tmp, &cache_lru, lru) {
+        if ( under_path(e->key, path) ) {
+            cache_drop(e);
+            nr_cache_invals++;
+        }
+    }
+    spin_unlock(&cache_lock);
+}
+
+/* Remember value read when cache_gen was gen, evict least recently
+ * used ones past cache_max */
+static void cache_insert(const char *key, const char *value, int len,
+        unsigned long gen)
+{
+    struct alice_xs_centry *e;
+
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if ( e == NULL )
+        return;
+    e->key = kstrdup(key, GFP_KERNEL);
+    e->value = kmemdup(value, len, GFP_KERNEL);
+    e->len = len;
+    if ( e->key == NULL || e->value == NULL ) {
+        cache_free(e);
+        return;
+    }
+
+    spin_lock(&cache_lock);
+    if ( gen != cache_gen || cache_find(key) ) {
+        spin_unlock(&cache_lock);
+        cache_free(e);
+        return;
+    }
+    hash_add(cache_hash, &e->hash, jhash(key, strlen(key), 0));
+    list_add(&e->lru, &cache_lru);
+    cache_nr++;
+    while ( cache_nr > max(cache_max, 0) )
+        cache_drop(list_last_entry(&cache_lru, struct alice_xs_centry, lru));
+    spin_unlock(&cache_lock);
+}
+
+static u32 event_hash(struct alice_xs_watch *w, const char *path)
+{
+    return jhash(path, strlen(path), (u32)(unsigned long)w);
+}
+
+/* Queue path for w unless the same is already queued. Called with
+ * watch_lock held */
+static void queue_event(struct alice_xs_watch *w, const char *path)
+{
+    struct alice_xs_event *ev;
+    u32 hash = event_hash(w, path);
+
+    hash_for_each_possible(watch_events_hash, ev, hash, hash) {
+        if ( ev->watch == w && strcmp(ev->path, path) == 0 ) {
+            nr_watch_coalesced++;
+            return;
+        }
+    }
+
+    ev = kmalloc(sizeof(*ev) + strlen(path) + 1, GFP_ATOMIC);
+    if ( ev == NULL )
+        return;
+    ev->watch = w;
+    strcpy(ev->path, path);
+    hash_add(watch_events_hash, &ev->hash, hash);
+    list_add_tail(&ev->list, &watch_events);
+    schedule_work(&watch_work);
+}
+
+/* Run callbacks of queued events, one at a time */
+static void watch_work_fn(struct work_struct *work)
+{
+    struct alice_xs_event *ev;
+
+    for ( ;; ) {
+        mutex_lock(&watch_cb_mutex);
+        spin_lock(&watch_lock);
+        ev = list_first_entry_or_null(&watch_events, struct alice_xs_event, list);
+        if ( ev ) {
+            list_del(&ev->list);
+            hash_del(&ev->hash);
+        }
+        spin_unlock(&watch_lock);
+
+        if ( ev == NULL ) {
+            mutex_unlock(&watch_cb_mutex);
+            return;
+        }
+        ev->watch->cb(ev->watch, ev->path);
+        nr_watch_callbacks++;
+        mutex_unlock(&watch_cb_mutex);
+        kfree(ev);
+        cond_resched();
+    }
+}
+
+/* Body of watch event is path and token, both NUL terminated. Cache is
+ * invalidated right here, before any later reply can be read, other
+ * watches go to the worker */
+static void watch_event(const char *body, int len)
+{
+    struct alice_xs_watch *w;
+    int path_len;
+
+    nr_watch_events++;
+    /* Lost the event, can't tell what changed, so say all did */
+    if ( body == NULL ) {
+        cache_invalidate("");
+        spin_lock(&watch_lock);
+        list_for_each_entry(w, &watches, list)
+            queue_event(w, w->path);
+        spin_unlock(&watch_lock);
+        return;
+    }
+    path_len = strnlen(body, len);
+    if ( path_len + 1 >= len )
+        return;
+    if ( strcmp(body + path_len + 1, ALICE_XS_CACHE_TOKEN) == 0 ) {
+        cache_invalidate(body);
+        return;
+    }
+
+    spin_lock(&watch_lock);
+    list_for_each_entry(w, &watches, list) {
+        if ( strcmp(body + path_len + 1, w->token) == 0 ) {
+            queue_event(w, body);
+            break;
+        }
+    }
+    spin_unlock(&watch_lock);
+}
+
+/* Only thread reading responses, so many requests can be in flight */
+static int reader_thread(void *unused)
+{
+    struct alice_xs_req *req;
+    struct xsd_sockmsg msg;
+    char *body;
+
+    while ( !kthread_should_stop() ) {
+        if ( read_response((char *)&msg, sizeof(msg)) )
+            break;
+
+        body = kmalloc(msg.len + 1, GFP_KERNEL);
+        if ( body == NULL ) {
+            IGNORE(msg.len);
+        } else {
+            if ( read_response(body, msg.len) ) {
+                kfree(body);
+                break;
+            }
+            body[msg.len] = '\0';
+        }
+
+        /* Watch events are not replies, they come whenever store changes */
+        if ( msg.type == XS_WATCH_EVENT ) {
+            watch_event(body, msg.len);
+            kfree(body);
+            continue;
+        }
+
+        req = take_pending(msg.req_id);
+        if ( req == NULL ) {
+            pr_info("Alice: drop response of unknown req_id %u\n", msg.req_id);
+            kfree(body);
+            continue;
+        }
+        req->reply = msg;
+        req->body = body;
+        complete_request(req, body ? 0 : -ENOMEM);
+    }
+
+    /* Nobody will answer the rest */
+    spin_lock(&pending_lock);
+    while ( !list_empty(&pending) ) {
+        req = list_first_entry(&pending, struct alice_xs_req, list);
+        list_del(&req->list);
+        spin_unlock(&pending_lock);
+        complete_request(req, -ESHUTDOWN);
+        spin_lock(&pending_lock);
+    }
+    spin_unlock(&pending_lock);
+    return 0;
+}
+
+/* Send a request without waiting for its response. Response is handed
+ * to cb from reader thread if cb is set, otherwise use alice_xs_wait().
+ * Either way caller drops req with alice_xs_put() once done with it.
+ * value_len bytes of value follow NUL of key, tx_id 0 is no transaction.
+ * ERR_PTR on failure, -E2BIG if payload is over XENSTORE_PAYLOAD_MAX */
+struct alice_xs_req *alice_xs_submit(enum xsd_sockmsg_type type,
+        uint32_t tx_id, const char *key, const char *value, int value_len,
+        alice_xs_cb_t cb, void *data)
+{
+    struct alice_xs_req *req;
+    struct xsd_sockmsg msg;
+    int key_length = strlen(key);
+    int err;
+
+    /* Back end drops the connection on a bigger one */
+    if ( 1 + key_length + (value ? value_len : 0) > XENSTORE_PAYLOAD_MAX )
+        return ERR_PTR(-E2BIG);
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if ( req == NULL )
+        return ERR_PTR(-ENOMEM);
+    init_completion(&req->done);
+    req->cb = cb;
+    req->data = data;
+    atomic_set(&req->ref, cb ? 2 : 1);
+    req->req_id = atomic_inc_return(&req_id);
+
+    /* Fill Message */
+    msg.type = type;
+    msg.req_id = req->req_id;
+    msg.tx_id = tx_id;
+    msg.len = 1 + key_length + (value ? value_len : 0);
+
+    /* Be pending before response can come */
+    spin_lock(&pending_lock);
+    list_add_tail(&req->list, &pending);
+    spin_unlock(&pending_lock);
+
+    /* Write the message */
+    mutex_lock(&send_lock);
+    err = fill_request((char *)&msg, sizeof(msg), true);
+    if ( err == 0 )
+        err = fill_request(key, key_length + 1, false);
+    if ( err == 0 && value )
+        err = fill_request(value, value_len, false);
+    mutex_unlock(&send_lock);
+
+    if ( err ) {
+        spin_lock(&pending_lock);
+        list_del(&req->list);
+        spin_unlock(&pending_lock);
+        kfree(req);
+        return ERR_PTR(err);
+    }
+    return req;
+}
+
+/* Wait response of a request submitted without cb */
+int alice_xs_wait(struct alice_xs_req *req)
+{
+    wait_for_completion(&req->done);
+    if ( req->err )
+        return req->err;
+    if ( req->reply.type == XS_ERROR ) {
+        /* Body is errno name, EAGAIN means transaction should retry */
+        if ( strcmp(req->body, "EAGAIN") == 0 )
+            return -EAGAIN;
+        if ( strcmp(req->body, "ENOENT") == 0 )
+            return -ENOENT;
+        pr_err("Alice: req %u error: %s\n", req->req_id, req->body);
+        return -EIO;
+    }
+    return 0;
+}
+
+void alice_xs_put(struct alice_xs_req *req)
+{
+    if ( !atomic_dec_and_test(&req->ref) )
+        return;
+    kfree(req->body);
+    kfree(req);
+}
+
+/* Copy value of len bytes out, NUL terminate if there is room. -2 if
+ * truncated */
+static int copy_value(char *value, int value_length, const char *body, int len)
+{
+    /* If we have enough space in the buffer */
+    if ( value_length >= len ) {
+        memcpy(value, body, len);
+        if ( value_length > len )
+            value[len] = '\0';
+        return 0;
+    }
+
+    /* Truncate */
+    memcpy(value, body, value_length);
+    return -2;
+}
+
+/* Cache keys at or under path from now on */
+int alice_xs_cache_subtree(const char *path)
+{
+    struct alice_xs_req *req;
+    char *copy;
+    int err;
+
+    if ( nr_cache_subtrees == ALICE_XS_MAX_SUBTREES )
+        return -ENOSPC;
+    copy = kstrdup(path, GFP_KERNEL);
+    if ( copy == NULL )
+        return -ENOMEM;
+
+    req = alice_xs_submit(XS_WATCH, 0, path, ALICE_XS_CACHE_TOKEN,
+            sizeof(ALICE_XS_CACHE_TOKEN), NULL, NULL);
+    if ( IS_ERR(req) ) {
+        kfree(copy);
+        return PTR_ERR(req);
+    }
+    err = alice_xs_wait(req);
+    alice_xs_put(req);
+    if ( err ) {
+        kfree(copy);
+        return err;
+    }
+
+    spin_lock(&cache_lock);
+    cache_subtrees[nr_cache_subtrees++] = copy;
+    spin_unlock(&cache_lock);
+    return 0;
+}
+
+/* Same as alice_xs_read, but served from cache when key is under a
+ * cached subtree */
+int alice_xs_cached_read(char *key, char *value, int value_length)
+{
+    struct alice_xs_centry *e;
+    struct alice_xs_req *req;
+    unsigned long gen;
+    bool covered;
+    int err;
+
+    spin_lock(&cache_lock);
+    e = cache_find(key);
+    if ( e ) {
+        list_move(&e->lru, &cache_lru);
+        nr_cache_hits++;
+        err = copy_value(value, value_length, e->value, e->len);
+        spin_unlock(&cache_lock);
+        return err;
+    }
+    nr_cache_misses++;
+    gen = cache_gen;
+    covered = cache_covers(key);
+    spin_unlock(&cache_lock);
+
+    req = alice_xs_submit(XS_READ, 0, key, NULL, 0, NULL, NULL);
+    if ( IS_ERR(req) )
+        return PTR_ERR(req);
+
+    err = alice_xs_wait(req);
+    if ( err ) {
+        alice_xs_put(req);
+        return -1;
+    }
+
+    if ( covered )
+        cache_insert(key, req->body, req->reply.len, gen);
+    err = copy_value(value, value_length, req->body, req->reply.len);
+    alice_xs_put(req);
+    return err;
+}
+
+/* Start watching w->path. w->cb is called once right away, as
+ * xenstored fires a new watch at once */
+int alice_xs_register_watch(struct alice_xs_watch *w)
+{
+    struct alice_xs_req *req;
+    int err;
+
+    /* Token goes to xenstored, so no kernel address in it */
+    snprintf(w->token, sizeof(w->token), "alice%u",
+            (unsigned)atomic_inc_return(&watch_ids));
+
+    /* Be on the list before the first event can come */
+    spin_lock(&watch_lock);
+    list_add(&w->list, &watches);
+    spin_unlock(&watch_lock);
+
+    req = alice_xs_submit(XS_WATCH, 0, w->path, w->token,
+            strlen(w->token) + 1, NULL, NULL);
+    err = IS_ERR(req) ? PTR_ERR(req) : alice_xs_wait(req);
+    if ( !IS_ERR(req) )
+        alice_xs_put(req);
+    if ( err )
+        alice_xs_unregister_watch(w);
+    return err;
+}
+
+/* Stop watching, no callback of w runs after this returns. Must not be
+ * called from a watch callback */
+void alice_xs_unregister_watch(struct alice_xs_watch *w)
+{
+    struct alice_xs_event *ev, *tmp;
+    struct alice_xs_req *req;
+
+    req = alice_xs_submit(XS_UNWATCH, 0, w->path, w->token,
+            strlen(w->token) + 1, NULL, NULL);
+    if ( !IS_ERR(req) ) {
+        alice_xs_wait(req);
+        alice_xs_put(req);
+    }
+
+    spin_lock(&watch_lock);
+    list_del(&w->list);
+    list_for_each_entry_safe(ev, tmp, &watch_events, list) {
+        if ( ev->watch == w ) {
+            list_del(&ev->list);
+            hash_del(&ev->hash);
+            kfree(ev);
+        }
+    }
+    spin_unlock(&watch_lock);
+
+    /* Wait out a callback already running */
+    mutex_lock(&watch_cb_mutex);
+    mutex_unlock(&watch_cb_mutex);
+}
+
+/* Stop watching cached subtrees and forget them. Reader may still be
+ * invalidating on an event that came before the unwatch */
+static void cache_destroy(void)
+{
+    struct alice_xs_centry *e, *tmp;
+    struct alice_xs_req *req;
+    int i;
+
+    for ( i = 0; i < nr_cache_subtrees; i++ ) {
+        req = alice_xs_submit(XS_UNWATCH, 0, cache_subtrees[i],
+                ALICE_XS_CACHE_TOKEN, sizeof(ALICE_XS_CACHE_TOKEN), NULL, NULL);
+        if ( !IS_ERR(req) ) {
+            alice_xs_wait(req);
+            alice_xs_put(req);
+        }
+    }
+
+    spin_lock(&cache_lock);
+    for ( i = 0; i < nr_cache_subtrees; i++ )
+        kfree(cache_subtrees[i]);
+    nr_cache_subtrees = 0;
+    list_for_each_entry_safe(e, tmp, &cache_lru, lru)
+        cache_drop(e);
+    spin_unlock(&cache_lock);
+}
+
+int alice_xs_transaction_start(uint32_t *tx_id)
+{
+    struct alice_xs_req *req;
+    int err;
+
+    req = alice_xs_submit(XS_TRANSACTION_START, 0, "", NULL, 0, NULL, NULL);
+    if ( IS_ERR(req) )
+        return PTR_ERR(req);
+    err = alice_xs_wait(req);
+    if ( err == 0 )
+        err = kstrtou32(req->body, 10, tx_id);
+    alice_xs_put(req);
+    return err;
+}
+
+/* Commit, or abort, a transaction. -EAGAIN if it must be redone */
+int alice_xs_transaction_end(uint32_t tx_id, bool abort)
+{
+    struct alice_xs_req *req;
+    int err;
+
+    req = alice_xs_submit(XS_TRANSACTION_END, tx_id, abort ? "F" : "T",
+            NULL, 0, NULL, NULL);
+    if ( IS_ERR(req) )
+        return PTR_ERR(req);
+    err = alice_xs_wait(req);
+    alice_xs_put(req);
+    return err;
+}
+
+/* Before retry try of a transaction, a random wait below a cap growing
+ * with each try, as activate of Xen_Log_15 does */
+static void alice_xs_backoff(int try)
+{
+    unsigned long max = ALICE_XS_BACKOFF_MIN_US << min(try, 10);
+    unsigned long us;
+
+    max = min_t(unsigned long, max, ALICE_XS_BACKOFF_MAX_US);
+    us = 1 + prandom_u32() % max;
+    usleep_range(us, us + us / 4);
+}
+
+/* Do all ops in one transaction, pipelined. Others see all of them or
+ * none, the whole batch is redone after a backoff if it races with
+ * another writer */
+int alice_xs_batch(const struct alice_xs_op *ops, int nr)
+{
+    struct alice_xs_req **reqs, *req;
+    uint32_t tx_id;
+    int i, try, err, ret;
+
+    reqs = kcalloc(nr, sizeof(*reqs), GFP_KERNEL);
+    if ( reqs == NULL )
+        return -ENOMEM;
+
+    for ( try = 0; try < ALICE_XS_RETRIES; try++ ) {
+        if ( try > 0 ) {
+            alice_xs_backoff(try - 1);
+            nr_tx_retries++;
+        }
+        err = alice_xs_transaction_start(&tx_id);
+        if ( err )
+            break;
+
+        /* Another writer gets in first */
+        if ( try < race ) {
+            req = alice_xs_submit(ops[0].type, 0, ops[0].key, ops[0].value,
+                    ops[0].value_len, NULL, NULL);
+            if ( !IS_ERR(req) ) {
+                alice_xs_wait(req);
+                alice_xs_put(req);
+            }
+        }
+
+        for ( i = 0; i < nr; i++ )
+            reqs[i] = alice_xs_submit(ops[i].type, tx_id, ops[i].key,
+                    ops[i].value, ops[i].value_len, NULL, NULL);
+        for ( i = 0; i < nr; i++ ) {
+            ret = IS_ERR(reqs[i]) ? PTR_ERR(reqs[i]) : alice_xs_wait(reqs[i]);
+            if ( ret && err == 0 )
+                err = ret;
+            if ( !IS_ERR(reqs[i]) )
+                alice_xs_put(reqs[i]);
+        }
+
+        ret = alice_xs_transaction_end(tx_id, err != 0);
+        if ( err == 0 )
+            err = ret;
+        if ( err != -EAGAIN )
+            break;
+    }
+
+    kfree(reqs);
+    return err;
+}
+
+/* Same keys as Xen_Log_15/dom0/activate.sh, dom0 state last */
+static int activate_alice_dev(int domu)
+{
+    char domu_key[64], dom0_key[64], path[8][96];
+    char domu_perm[16], dom0_perm[16], domid[16];
+    struct alice_xs_op ops[8];
+    int n = 0;
+
+#define OP(t, k, v, l)\
+    do {\
+        ops[n].type = (t);\
+        ops[n].key = (k);\
+        ops[n].value = (v);\
+        ops[n].value_len = (l);\
+        n++;\
+    } while ( 0 )
+
+    snprintf(domu_key, sizeof(domu_key), "/local/domain/%d/device/alice_dev/0", domu);
+    snprintf(dom0_key, sizeof(dom0_key), "/local/domain/0/backend/alice_dev/%d/0", domu);
+    snprintf(domid, sizeof(domid), "%d", domu);
+
+    /* Tell the domU about the new device and its backend */
+    snprintf(path[0], sizeof(path[0]), "%s/backend-id", domu_key);
+    OP(XS_WRITE, path[0], "0", 1);
+    snprintf(path[1], sizeof(path[1]), "%s/backend", domu_key);
+    OP(XS_WRITE, path[1], dom0_key, strlen(dom0_key));
+
+    /* Tell the dom0 about the new device and its frontend */
+    snprintf(path[2], sizeof(path[2]), "%s/frontend-id", dom0_key);
+    OP(XS_WRITE, path[2], domid, strlen(domid));
+    snprintf(path[3], sizeof(path[3]), "%s/frontend", dom0_key);
+    OP(XS_WRITE, path[3], domu_key, strlen(domu_key));
+
+    /* Make sure the domU can read the dom0 data, perms are NUL separated */
+    OP(XS_SET_PERMS, dom0_key, dom0_perm,
+            snprintf(dom0_perm, sizeof(dom0_perm), "b0%cr%d", 0, domu) + 1);
+    OP(XS_SET_PERMS, domu_key, domu_perm,
+            snprintf(domu_perm, sizeof(domu_perm), "b%d%cr0", domu, 0) + 1);
+
+    /* Activate the device, dom0 needs to be activated last */
+    snprintf(path[6], sizeof(path[6]), "%s/state", domu_key);
+    OP(XS_WRITE, path[6], "1", 1);
+    snprintf(path[7], sizeof(path[7]), "%s/state", dom0_key);
+    OP(XS_WRITE, path[7], "1", 1);
+#undef OP
+
+    return alice_xs_batch(ops, n);
+}
+
+static void alice_changed(struct alice_xs_watch *w, const char *path)
+{
+    char buffer[64];
+
+    if ( alice_xs_read((char *)path, buffer, sizeof(buffer) - 1) == 0 )
+        pr_info("Alice: %s changed to %s\n", path, buffer);
+}
+
+/* Writes and reads of alice_bench alternate, each moves bench_len bytes
+ * over ring one way */
+static void alice_bench(void)
+{
+    struct alice_xs_req *reqs[16];
+    char *value;
+    ktime_t start;
+    u64 ns;
+    int i, j, n;
+
+    value = kmalloc(bench_len, GFP_KERNEL);
+    if ( value == NULL )
+        return;
+    memset(value, 'a', bench_len);
+
+    start = ktime_get();
+    for ( i = 0; i < bench; i += n ) {
+        n = clamp_t(int, bench_depth, 1, ARRAY_SIZE(reqs));
+        n = min(bench - i, n);
+        for ( j = 0; j < n; j++ )
+            reqs[j] = alice_xs_submit(j % 2 ? XS_READ : XS_WRITE, 0,
+                    "alice_bench", j % 2 ? NULL : value,
+                    j % 2 ? 0 : bench_len, NULL, NULL);
+        for ( j = 0; j < n; j++ ) {
+            if ( IS_ERR(reqs[j]) )
+                continue;
+            alice_xs_wait(reqs[j]);
+            alice_xs_put(reqs[j]);
+        }
+    }
+    ns = max_t(u64, ktime_to_ns(ktime_sub(ktime_get(), start)), 1);
+    kfree(value);
+
+    pr_info("Alice: bench %d messages of %d bytes in %llu ns, %llu msgs/s, %llu KB/s\n",
+            bench, bench_len, ns, div64_u64((u64)bench * NSEC_PER_SEC, ns),
+            div64_u64((u64)bench * bench_len * (NSEC_PER_SEC / 1024), ns));
+}
+
+static DECLARE_COMPLETION(alice_read);
+
+/* Reply to a read handed over by reader thread */
+static void alice_read_done(struct alice_xs_req *req, void *data)
+{
+    if ( req->err == 0 && req->reply.type != XS_ERROR )
+        pr_info("Alice: callback %s:%s\n", (char *)data, req->body);
+    complete(&alice_read);
+}
+
+static struct alice_xs_watch alice_watch = {
+    .path = "alice",
+    .cb = alice_changed,
+};
+static bool alice_watched;
+
 int init_alice(void)
 {
+    static char * const keys[] = { "name", "domid", "vm", "alice" };
+    struct alice_xs_req *reqs[ARRAY_SIZE(keys)];
     /* Get shared xenstore interface */
-    char buffer[1024];
-    xenstore_gfn = xen_start_info->store_mfn;
+    char buffer[1024], *big, *p;
+    struct alice_xs_req *req;
+    unsigned long hits;
+    int i, err;
+
+    if ( ring_gfn ) {
+        xenstore_gfn = ring_gfn;
+        xenstore_evtchn = ring_port;
+    } else {
+        xenstore_gfn = xen_start_info->store_mfn;
+        xenstore_evtchn = xen_start_info->store_evtchn;
+    }
     xenstore = gfn_to_virt(xenstore_gfn);
 
-    xenstore_evtchn = xen_start_info->store_evtchn;
+    /* Sleep on event channel while waiting for ring. Its irq may be
+     * there already, and is not ours if it has a handler */
+    xenstore_irq = irq_from_evtchn(xenstore_evtchn);
+    if ( xenstore_irq < 0 )
+        xenstore_irq = bind_evtchn_to_irq(xenstore_evtchn);
+    err = xenstore_irq < 0 ? xenstore_irq :
+        request_irq(xenstore_irq, xenstore_interrupt, 0, "alice_xs", &xenstore_wq);
+    if ( err && ring_gfn == 0 ) {
+        pr_err("Alice: store evtchn %d is taken: %d, xenbus reads the ring\n",
+                xenstore_evtchn, err);
+        return err;
+    }
+    /* Keep spinning on a ring of our own */
+    if ( err ) {
+        pr_info("Alice: bind evtchn %d failed: %d, spin instead\n",
+                xenstore_evtchn, err);
+        xenstore_irq = 0;
+    }
+
+    reader = kthread_run(reader_thread, NULL, "alice_xs_reader");
+    if ( IS_ERR(reader) ) {
+        pr_err("Alice: Could not start reader\n");
+        if ( xenstore_irq > 0 )
+            free_irq(xenstore_irq, &xenstore_wq);
+        return PTR_ERR(reader);
+    }
 
-    /* We should setup event channel here.
-     * But I will just add entry to xenstore in this demo
-     * */
     pr_info("Alice: Begin xenstore test\n");
     alice_xs_read("name", buffer, 1023);
     pr_info("Alice: Name: %s\n", buffer);
     alice_xs_write("alice", "test");
     alice_xs_read("alice", buffer, 1023);
     pr_info("Alice: read alice:%s\n", buffer);
+
+    /* Too big for xenstored, refused before any of it goes on ring */
+    big = kzalloc(XENSTORE_PAYLOAD_MAX, GFP_KERNEL);
+    if ( big ) {
+        req = alice_xs_submit(XS_WRITE, 0, "alice", big, XENSTORE_PAYLOAD_MAX,
+                NULL, NULL);
+        pr_info("Alice: write of %d bytes: %ld\n", XENSTORE_PAYLOAD_MAX,
+                IS_ERR(req) ? PTR_ERR(req) : 0L);
+        if ( !IS_ERR(req) ) {
+            alice_xs_wait(req);
+            alice_xs_put(req);
+        }
+        kfree(big);
+    }
+
+    /* A listing may not fit in ring, it comes in pieces */
+    req = alice_xs_submit(XS_DIRECTORY, 0, "alice_dir", NULL, 0, NULL, NULL);
+    if ( !IS_ERR(req) ) {
+        if ( alice_xs_wait(req) == 0 ) {
+            for ( i = 0, p = req->body; p < req->body + req->reply.len;
+                    p += strlen(p) + 1 )
+                i++;
+            pr_info("Alice: alice_dir has %d children in %u bytes\n", i,
+                    req->reply.len);
+        }
+        alice_xs_put(req);
+    }
+
+    /* A burst of writes ends in few callbacks, each reads latest value */
+    alice_watched = alice_xs_register_watch(&alice_watch) == 0;
+    for ( i = 0; i < 10; i++ ) {
+        snprintf(buffer, sizeof(buffer), "test%d", i);
+        alice_xs_write("alice", buffer);
+    }
+
+    /* Pipelined: all requests are sent before any response is read */
+    for ( i = 0; i < ARRAY_SIZE(keys); i++ )
+        reqs[i] = alice_xs_submit(XS_READ, 0, keys[i], NULL, 0, NULL, NULL);
+    for ( i = 0; i < ARRAY_SIZE(keys); i++ ) {
+        if ( IS_ERR(reqs[i]) )
+            continue;
+        if ( alice_xs_wait(reqs[i]) == 0 )
+            pr_info("Alice: %s:%s\n", keys[i], reqs[i]->body);
+        alice_xs_put(reqs[i]);
+    }
+
+    /* Same with a callback, req is still ours after it ran */
+    req = alice_xs_submit(XS_READ, 0, "domid", NULL, 0, alice_read_done,
+            "domid");
+    if ( !IS_ERR(req) ) {
+        wait_for_completion(&alice_read);
+        pr_info("Alice: callback of req %u done\n", req->req_id);
+        alice_xs_put(req);
+    }
+
+    if ( activate > 0 ) {
+        ktime_t start = ktime_get();
+
+        err = activate_alice_dev(activate);
+
+        pr_info("Alice: activate alice_dev of dom%d: %d after %lu retries in %lld us\n",
+                activate, err, nr_tx_retries,
+                ktime_to_us(ktime_sub(ktime_get(), start)));
+    }
+
+    /* Repeated reads of a cached key stay off the ring */
+    if ( alice_xs_cache_subtree("name") == 0 ) {
+        ktime_t start = ktime_get();
+        for ( i = 0; i < 100; i++ )
+            alice_xs_read("name", buffer, 1023);
+        pr_info("Alice: 100 reads took %lld ns\n",
+                ktime_to_ns(ktime_sub(ktime_get(), start)));
+        start = ktime_get();
+        for ( i = 0; i < 100; i++ )
+            alice_xs_cached_read("name", buffer, 1023);
+        pr_info("Alice: 100 cached reads took %lld ns\n",
+                ktime_to_ns(ktime_sub(ktime_get(), start)));
+    }
+
+    /* A write drops the cached value once its watch event is in, the
+     * event may come after the reply to the write */
+    if ( alice_xs_cache_subtree("alice") == 0 ) {
+        /* Until served from cache, the event a watch fires once on
+         * register may drop what the first read cached */
+        hits = READ_ONCE(nr_cache_hits);
+        for ( i = 0; i < 100 && READ_ONCE(nr_cache_hits) == hits; i++ )
+            alice_xs_cached_read("alice", buffer, 1023);
+        alice_xs_write("alice", "uncached");
+        for ( i = 0; i < 100; i++ ) {
+            if ( alice_xs_cached_read("alice", buffer, 1023) == 0 &&
+                    strcmp(buffer, "uncached") == 0 )
+                break;
+            msleep(1);
+        }
+        pr_info("Alice: cached alice:%s after %d retries\n", buffer, i);
+    }
+
+    if ( bench > 0 )
+        alice_bench();
     return 0;
 }
 
 /* Write a value to store */
 int alice_xs_write(char *key, char *value)
 {
-	int key_length = strlen(key);
-	int value_length = strlen(value);
-	struct xsd_sockmsg msg;
+    struct alice_xs_req *req;
+    int err;
 
-    /* Fill Message */
-	msg.type = XS_WRITE;
-	msg.req_id = req_id;
-	msg.tx_id = 0; 
-	msg.len = 2 + key_length + value_length;
-
-	/* Write the message */
-	fill_request((char*)&msg, sizeof(msg));
-	fill_request(key, key_length + 1);
-	fill_request(value, value_length + 1);
-
-	/* Notify the back end */
-    NOTIFY();
-    
-    /* Read response */
-	read_response((char*)&msg, sizeof(msg));
-
-    /* We dont need this info, just discard it */
-    IGNORE(msg.len);
-
-    /* Res is not right ? */
-    if ( msg.req_id != req_id++ ) {
-        pr_err("%s: Alice: res not right!\n", __FUNCTION__);
-        return -1;
-    }
+    req = alice_xs_submit(XS_WRITE, 0, key, value, strlen(value), NULL, NULL);
+    if ( IS_ERR(req) )
+        return PTR_ERR(req);
 
-    return 0;
+    /* We dont need reply body, just discard it */
+    err = alice_xs_wait(req);
+    alice_xs_put(req);
+    return err;
 }
 
 int alice_xs_read(char *key, char *value, int value_length)
 {
-	int key_length = strlen(key);
-	struct xsd_sockmsg msg;
-
-	msg.type = XS_READ;
-	msg.req_id = req_id;
-	msg.tx_id = 0; 
-	msg.len = 1 + key_length;
-
-	/* Write the message */
-	fill_request((char*)&msg, sizeof(msg));
-	fill_request(key, key_length + 1);
+    struct alice_xs_req *req;
+    int err;
 
-	/* Notify the back end */
-	NOTIFY();
+    req = alice_xs_submit(XS_READ, 0, key, NULL, 0, NULL, NULL);
+    if ( IS_ERR(req) )
+        return PTR_ERR(req);
 
-    /* Read value */
-	read_response((char*)&msg, sizeof(msg));
-
-    /* Res is not right */
-	if(msg.req_id != req_id++)
-	{
-		IGNORE(msg.len);
-		return -1;
-	}
-
-	/* If we have enough space in the buffer */
-	if(value_length >= msg.len)
-	{
-		read_response(value, msg.len);
-		return 0;
-	}
+    err = alice_xs_wait(req);
+    if ( err ) {
+        alice_xs_put(req);
+        return -1;
+    }
 
-	/* Truncate */
-	read_response(value, value_length);
-	IGNORE(msg.len - value_length);
-	return -2;
+    err = copy_value(value, value_length, req->body, req->reply.len);
+    alice_xs_put(req);
+    return err;
 }
 
 void exit_alice(void)
 {
+    if ( alice_watched )
+        alice_xs_unregister_watch(&alice_watch);
+    cache_destroy();
+    /* Nothing is queued any more, but worker may still be looking */
+    cancel_work_sync(&watch_work);
+    if ( !IS_ERR_OR_NULL(reader) )
+        kthread_stop(reader);
+    /* Port stays bound, the store connection goes on without us */
+    if ( xenstore_irq > 0 )
+        free_irq(xenstore_irq, &xenstore_wq);
+    pr_info("Alice: waits spun %lu, slept %lu\n", nr_spin_hits, nr_sleeps);
+    pr_info("Alice: cache hits %lu, misses %lu, invalidations %lu\n",
+            nr_cache_hits, nr_cache_misses, nr_cache_invals);
+    pr_info("Alice: watch events %lu, coalesced %lu, callbacks %lu\n",
+            nr_watch_events, nr_watch_coalesced, nr_watch_callbacks);
     pr_info("Alice: Exit Successfully\n");
 }
 
@@ -0,0 +1,58 @@
+/* Demo: PV Split Driver
+ * Post: http://silentming.net/blog/2017/03/21/xen-log-15-xenbus/
+ * This is kernel module under GPL License * Environment: Debian 8, Linux 4.10.2, Xen 4.5.1
+ *
+ * Ring protocol of alice_dev, shared by frontend and backend
+ */
+#ifndef __ALICE_DEV_H__
+#define __ALICE_DEV_H__
+
+#include <xen/interface/grant_table.h>
+#include <xen/interface/io/ring.h>
+
+/* Request operations */
+#define ALICE_OP_HELLO      0   /* No data, hi = hello + 1 */
+#define ALICE_OP_WRITE      1   /* Backend reads data pages, returns csum */
+#define ALICE_OP_READ       2   /* Backend fills data pages */
+#define ALICE_OP_INDIRECT   3   /* Segments are in indirect pages */
+
+/* Response status */
+#define ALICE_RSP_OKAY      0
+#define ALICE_RSP_ERROR     (-1)
+
+/* Segments carried in the request itself */
+#define ALICE_MAX_SEGS      11
+/* Indirect pages carried in the request, and segments they may hold.
+ * 256 segments is 1MB of payload */
+#define ALICE_MAX_INDIRECT_PAGES    8
+#define ALICE_SEGS_PER_INDIRECT     (PAGE_SIZE / sizeof(struct alice_seg))
+#define ALICE_MAX_INDIRECT_SEGS     256
+
+/* One granted data page, payload is [offset, offset + len) of it */
+struct alice_seg {
+	grant_ref_t gref;
+	uint16_t offset;
+	uint16_t len;
+};
+
+struct as_request {
+	uint64_t id;            /* Echoed in response */
+	uint8_t operation;      /* ALICE_OP_* */
+	uint8_t indirect_op;    /* Real op of ALICE_OP_INDIRECT */
+	uint16_t nr_segments;   /* Data segments, direct or indirect */
+	int hello;
+	union {
+		struct alice_seg seg[ALICE_MAX_SEGS];
+		grant_ref_t indirect_grefs[ALICE_MAX_INDIRECT_PAGES];
+	} u;
+};
+
+struct as_response {
+	uint64_t id;
+	int16_t status;         /* ALICE_RSP_* */
+	int hi;                 /* hello + 1, or csum of written data */
+};
+
+DEFINE_RING_TYPES(as, struct as_request, struct as_response);
+
+#endif
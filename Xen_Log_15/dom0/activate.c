@@ -0,0 +1,230 @@
+/* Demo: PV Split Driver
+ * Post: http://silentming.net/blog/2017/03/21/xen-log-15-xenbus/
+ * This is under GPL License * Environment: Debian 8, Linux 4.10.2, Xen 4.5.1
+ *
+ * Compile:
+ * make activate
+ *
+ * Run:
+ * ./activate [-j <threads>] [-b <batch>] <domU ID>...
+ *
+ * <threads>  Connections to xenstore working at once, default 1
+ * <batch>    domUs activated in one transaction, default 16
+ *
+ * Same keys as activate.sh, but without a process per key. Each thread
+ * opens one connection and writes keys of a whole batch of domUs in one
+ * transaction, redone if it races with another writer. Retries back off
+ * exponentially, by a random part of the wait so writers that raced once
+ * don't meet again
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <xenstore.h>
+
+#define DEVICE      "alice_dev"
+#define MAX_RETRIES 16
+/* Wait before a retry, doubled each time up to the max */
+#define BACKOFF_MIN_US  50
+#define BACKOFF_MAX_US  20000
+
+static int *domids;
+static int nr_domids;
+static int batch = 16;
+/* Next domU not yet taken by a thread */
+static int next_domid;
+
+static long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Before retry try of a transaction */
+static void backoff(int try, unsigned int *seed)
+{
+	long max = BACKOFF_MIN_US << (try < 10 ? try : 10);
+
+	if (max > BACKOFF_MAX_US)
+		max = BACKOFF_MAX_US;
+	usleep(1 + rand_r(seed) % max);
+}
+
+static bool write_key(struct xs_handle *xs, xs_transaction_t t,
+		const char *key, const char *value)
+{
+	return xs_write(xs, t, key, value, strlen(value));
+}
+
+/* All keys of one domU, dom0 state last */
+static bool activate_one(struct xs_handle *xs, xs_transaction_t t, int domu)
+{
+	char domu_key[64], dom0_key[64], path[96], value[16];
+	struct xs_permissions perms[2];
+
+	snprintf(domu_key, sizeof(domu_key), "/local/domain/%d/device/%s/0",
+			domu, DEVICE);
+	snprintf(dom0_key, sizeof(dom0_key), "/local/domain/0/backend/%s/%d/0",
+			DEVICE, domu);
+
+	/* Tell the domU about the new device and its backend */
+	snprintf(path, sizeof(path), "%s/backend-id", domu_key);
+	if (!write_key(xs, t, path, "0"))
+		return false;
+	snprintf(path, sizeof(path), "%s/backend", domu_key);
+	if (!write_key(xs, t, path, dom0_key))
+		return false;
+
+	/* Tell the dom0 about the new device and its frontend */
+	snprintf(path, sizeof(path), "%s/frontend-id", dom0_key);
+	snprintf(value, sizeof(value), "%d", domu);
+	if (!write_key(xs, t, path, value))
+		return false;
+	snprintf(path, sizeof(path), "%s/frontend", dom0_key);
+	if (!write_key(xs, t, path, domu_key))
+		return false;
+	/* Device stays while frontend closes, so both ends may reconnect */
+	snprintf(path, sizeof(path), "%s/online", dom0_key);
+	if (!write_key(xs, t, path, "1"))
+		return false;
+
+	/* Make sure the domU can read the dom0 data */
+	perms[0].id = 0;
+	perms[0].perms = XS_PERM_READ | XS_PERM_WRITE;
+	perms[1].id = domu;
+	perms[1].perms = XS_PERM_READ;
+	if (!xs_set_permissions(xs, t, dom0_key, perms, 2))
+		return false;
+	perms[0].id = domu;
+	perms[1].id = 0;
+	if (!xs_set_permissions(xs, t, domu_key, perms, 2))
+		return false;
+
+	/* Activate the device, dom0 needs to be activated last */
+	snprintf(path, sizeof(path), "%s/state", domu_key);
+	if (!write_key(xs, t, path, "1"))
+		return false;
+	snprintf(path, sizeof(path), "%s/state", dom0_key);
+	return write_key(xs, t, path, "1");
+}
+
+/* Activate domids[first, first + nr) in one transaction, retries made
+ * are added to *retries */
+static int activate_batch(struct xs_handle *xs, int first, int nr,
+		int *retries, unsigned int *seed)
+{
+	xs_transaction_t t;
+	int i, try;
+
+	for (try = 0; try < MAX_RETRIES; try++) {
+		if (try > 0) {
+			backoff(try - 1, seed);
+			(*retries)++;
+		}
+		t = xs_transaction_start(xs);
+		if (t == XBT_NULL)
+			return -errno;
+
+		for (i = 0; i < nr; i++) {
+			if (!activate_one(xs, t, domids[first + i])) {
+				i = -errno;
+				xs_transaction_end(xs, t, true);
+				return i;
+			}
+		}
+
+		if (xs_transaction_end(xs, t, false))
+			return 0;
+		if (errno != EAGAIN)
+			return -errno;
+	}
+	return -EAGAIN;
+}
+
+static void *activate_thread(void *unused)
+{
+	struct xs_handle *xs;
+	unsigned int seed = now_us() ^ (unsigned int)pthread_self();
+	long start, us;
+	int first, nr, retries, i, err;
+
+	xs = xs_open(0);
+	if (!xs) {
+		perror("xs_open");
+		return NULL;
+	}
+
+	for (;;) {
+		first = __sync_fetch_and_add(&next_domid, batch);
+		if (first >= nr_domids)
+			break;
+		nr = nr_domids - first < batch ? nr_domids - first : batch;
+
+		start = now_us();
+		retries = 0;
+		err = activate_batch(xs, first, nr, &retries, &seed);
+		us = now_us() - start;
+		for (i = 0; i < nr; i++)
+			printf("dom%d: %s, %ld us per device, %d retries\n",
+					domids[first + i],
+					err ? strerror(-err) : "activated", us / nr,
+					retries);
+	}
+
+	xs_close(xs);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	int nr_threads = 1;
+	long start;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "j:b:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc || nr_threads < 1 || batch < 1)
+		goto usage;
+
+	nr_domids = argc - optind;
+	domids = calloc(nr_domids, sizeof(*domids));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!domids || !threads)
+		return 1;
+	for (i = 0; i < nr_domids; i++)
+		domids[i] = atoi(argv[optind + i]);
+
+	start = now_us();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, activate_thread, NULL))
+			break;
+	nr_threads = i;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	printf("%d devices in %ld us\n", nr_domids, now_us() - start);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-j threads] [-b batch] [domU ID]...\n", argv[0]);
+	fprintf(stderr, "\nConnects the new devices, dom0 as backend, domU as frontend\n");
+	return 1;
+}
@@ -20,6 +20,8 @@ xenstore-write $DOMU_KEY/backend "/local/domain/0/backend/$DEVICE/$DOMU_ID/0"
 # Tell the dom0 about the new device and its frontend
 xenstore-write $DOM0_KEY/frontend-id $DOMU_ID
 xenstore-write $DOM0_KEY/frontend "/local/domain/$DOMU_ID/device/$DEVICE/0"
+# Device stays while frontend closes, so both ends may reconnect
+xenstore-write $DOM0_KEY/online 1
 
 # Make sure the domU can read the dom0 data
 xenstore-chmod $DOM0_KEY b0 r$DOMU_ID
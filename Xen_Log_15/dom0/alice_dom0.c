@@ -6,24 +6,901 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_dom0.ko
+ * insmod alice_dom0.ko [max_queues=<n>] [max_ring_order=<order>]
+ *
+ * <n>      Max queues offered to frontend, default number of online cpus
+ * <order>  Max pages of each ring as power of 2, default 4
+ * max_pgrants=<n>  Persistent grants kept mapped per queue, least
+ *                  recently used ones are unmapped over it. Default 1024
+ * copy_threshold=<bytes>  Requests up to this size are grant copied
+ *                         rather than mapped, default 2 pages
+ * copy_calibrate=<0|1>    Move threshold by timing both paths, default 1
+ * fast_negotiate=<0|1>    Publish features with state InitWait in one
+ *                         transaction, default 1
+ * intr_moderation=<0|1>   Offer to hold response events for the window
+ *                         frontend asks for, default 1
+ * service_us=<us>         Sleep this long on each request, as if a device
+ *                         behind the backend served it, default 0
  *
  * This Module is running in dom0 acting as backend
  * After insmod domU, use activate to issue communication
  */
 #include <linux/module.h>  /* Needed by all modules */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/delay.h>
 
 #include <xen/xen.h>
 #include <xen/xenbus.h>
+#include <xen/events.h>
+#include <xen/grant_table.h>
+#include <xen/page.h>
+
+#include "../alice_dev.h"
+
+/* Requests up to this many pages may be grant copied instead of mapped */
+#define ALICE_MAX_COPY_PAGES    16
+/* Samples around copy threshold before moving it */
+#define ALICE_CALIBRATE_SAMPLES 64
+/* Adaptive moderation window starts here and is dropped when shrunk
+ * below, events go out at once then */
+#define ALICE_MOD_MIN_NS        2000
+/* Requests one run of the work serves, the rest go to a new run so a
+ * busy multi-page ring can't hold the cpu. Responses are pushed every
+ * ALICE_PUSH_BATCH of them, frontend starts on them meanwhile */
+#define ALICE_WORK_BUDGET       64
+#define ALICE_PUSH_BATCH        16
+
+/* Grant kept mapped across requests, keyed by gref */
+struct alice_pgrant {
+	struct rb_node node;
+	struct list_head lru;       /* On lru, or on dead list once dropped */
+	grant_ref_t gref;
+	grant_handle_t handle;
+	struct page *page;
+};
+
+/* One ring, event channel and irq per queue */
+struct alice_back_queue {
+	struct alice_back_info *info;
+	unsigned int id;
+	struct as_back_ring ring;
+	void *ring_addr;
+	unsigned int evtchn;
+	int irq;
+	int cpu;
+	struct work_struct work;    /* Drain ring on its own cpu */
+	char name[32];
+	unsigned long nr_handled;
+	unsigned long nr_requeues;  /* Runs that ended on ALICE_WORK_BUDGET */
+
+	/* Response event held back to be shared by later responses */
+	spinlock_t mod_lock;        /* Protect below, timer takes it too */
+	struct hrtimer mod_timer;   /* Sends held event at window end */
+	u64 mod_ns;                 /* Current window, 0 sends at once */
+	unsigned int mod_pending;   /* Responses waiting for held event */
+	ktime_t last_notify;
+	unsigned long nr_notify;
+	unsigned long nr_coalesced; /* Responses that shared an event */
+
+	/* Data pages of the request being served, mapped in place */
+	struct alice_seg segs[ALICE_MAX_INDIRECT_SEGS];
+	grant_ref_t grefs[ALICE_MAX_INDIRECT_SEGS];
+	struct page *pages[ALICE_MAX_INDIRECT_SEGS];
+	struct gnttab_map_grant_ref map_ops[ALICE_MAX_INDIRECT_SEGS];
+	struct gnttab_unmap_grant_ref unmap_ops[ALICE_MAX_INDIRECT_SEGS];
+	struct page *unmap_pages[ALICE_MAX_INDIRECT_SEGS];
+	unsigned int nr_unmap;
+	struct page *seg_pages[ALICE_MAX_INDIRECT_SEGS];
+
+	/* Persistent grants, most recently used at lru tail */
+	struct rb_root pgrants;
+	struct list_head pgrant_lru;
+	struct list_head pgrant_dead;   /* Freed after next unmap */
+	unsigned int nr_pgrants;
+	struct alice_pgrant *new_pgrants[ALICE_MAX_INDIRECT_SEGS];
+	struct page *map_pages[ALICE_MAX_INDIRECT_SEGS];
+	unsigned long pgrant_hits;
+	unsigned long pgrant_misses;
+	unsigned long pgrant_evictions;
+
+	/* Grant copy of small requests into local pages */
+	struct gnttab_copy copy_ops[ALICE_MAX_COPY_PAGES];
+	struct page *copy_pages[ALICE_MAX_COPY_PAGES];
+	unsigned int copy_thresh;       /* In pages, copy if not above */
+	u64 cost_ns[2][2];              /* [threshold, +1 page][map, copy] */
+	unsigned int nr_samples;
+	unsigned int nr_explore;
+	unsigned long nr_copied;
+	unsigned long nr_mapped;
+};
+
+/* Per device context, saved as drvdata of xenbus_device */
+struct alice_back_info {
+	struct xenbus_device *dev;
+	/* State changes of frontend are handled here, off the xenbus watch
+	 * thread, so many devices connect at once. Only latest one counts */
+	struct work_struct state_work;
+	enum xenbus_state frontend_state;
+	unsigned int nr_queues;
+	unsigned int ring_order;
+	bool persistent;            /* Frontend reuses granted pages */
+	/* Moderation frontend asked for, at most one event per window or
+	 * per mod_rsps responses. No window, no moderation */
+	unsigned int mod_usecs;
+	unsigned int mod_rsps;
+	bool mod_adaptive;          /* Window shrinks on a quiet ring */
+	struct alice_back_queue *queues;
+};
+
+static unsigned int max_queues;
+static unsigned int max_ring_order = XENBUS_MAX_RING_GRANT_ORDER;
+static unsigned int max_pgrants = 1024;
+static unsigned int copy_threshold = 2 * PAGE_SIZE;
+static bool copy_calibrate = true;
+static bool fast_negotiate = true;
+static bool intr_moderation = true;
+static unsigned int service_us;
+module_param(max_queues, uint, 0644);
+module_param(max_ring_order, uint, 0644);
+module_param(max_pgrants, uint, 0644);
+module_param(copy_threshold, uint, 0644);
+module_param(copy_calibrate, bool, 0644);
+module_param(fast_negotiate, bool, 0644);
+module_param(intr_moderation, bool, 0644);
+module_param(service_us, uint, 0644);
+
+/* Connect and disconnect of all devices, unbound so they run in parallel */
+static struct workqueue_struct *alice_back_wq;
+
+/* Unmap all pages queued for unmap in one hypercall, and free persistent
+ * grants dropped meanwhile */
+static void alice_back_unmap(struct alice_back_queue *q)
+{
+	struct alice_pgrant *pg, *n;
+
+	if (q->nr_unmap &&
+	    gnttab_unmap_refs(q->unmap_ops, NULL, q->unmap_pages, q->nr_unmap))
+		pr_err("Dom0: queue %u unmap %u pages failed\n", q->id, q->nr_unmap);
+	q->nr_unmap = 0;
+
+	list_for_each_entry_safe(pg, n, &q->pgrant_dead, lru) {
+		list_del(&pg->lru);
+		gnttab_free_pages(1, &pg->page);
+		kfree(pg);
+	}
+}
+
+static struct alice_pgrant *alice_back_find_pgrant(struct alice_back_queue *q,
+		grant_ref_t gref)
+{
+	struct rb_node *n = q->pgrants.rb_node;
+	struct alice_pgrant *pg;
+
+	while (n) {
+		pg = rb_entry(n, struct alice_pgrant, node);
+		if (gref < pg->gref)
+			n = n->rb_left;
+		else if (gref > pg->gref)
+			n = n->rb_right;
+		else
+			return pg;
+	}
+	return NULL;
+}
+
+static void alice_back_add_pgrant(struct alice_back_queue *q,
+		struct alice_pgrant *pg)
+{
+	struct rb_node **n = &q->pgrants.rb_node, *parent = NULL;
+	struct alice_pgrant *this;
+
+	while (*n) {
+		parent = *n;
+		this = rb_entry(parent, struct alice_pgrant, node);
+		n = pg->gref < this->gref ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&pg->node, parent, n);
+	rb_insert_color(&pg->node, &q->pgrants);
+	list_add_tail(&pg->lru, &q->pgrant_lru);
+	q->nr_pgrants++;
+}
+
+/* Take a persistent grant out of cache, its page is freed on next
+ * alice_back_unmap(), after being unmapped if mapped */
+static void alice_back_drop_pgrant(struct alice_back_queue *q,
+		struct alice_pgrant *pg, bool mapped)
+{
+	rb_erase(&pg->node, &q->pgrants);
+	list_del(&pg->lru);
+	q->nr_pgrants--;
+
+	if (mapped) {
+		if (q->nr_unmap == ALICE_MAX_INDIRECT_SEGS)
+			alice_back_unmap(q);
+		gnttab_set_unmap_op(&q->unmap_ops[q->nr_unmap],
+				(unsigned long)pfn_to_kaddr(page_to_pfn(pg->page)),
+				GNTMAP_host_map, pg->handle);
+		q->unmap_pages[q->nr_unmap++] = pg->page;
+	}
+	list_add(&pg->lru, &q->pgrant_dead);
+}
+
+/* Look data pages of q->grefs[0, nr) up in persistent grant cache, map
+ * all misses in one hypercall and keep them mapped */
+static int alice_back_map_persistent(struct alice_back_queue *q, unsigned int nr)
+{
+	struct alice_pgrant *pg;
+	unsigned int i, nr_new = 0;
+	unsigned long addr;
+	int err = 0;
+
+	for (i = 0; i < nr; i++) {
+		pg = alice_back_find_pgrant(q, q->grefs[i]);
+		if (pg) {
+			q->pgrant_hits++;
+			list_move_tail(&pg->lru, &q->pgrant_lru);
+			q->seg_pages[i] = pg->page;
+			continue;
+		}
+
+		/* Added to cache now, so a gref used twice is mapped once */
+		q->pgrant_misses++;
+		pg = kzalloc(sizeof(*pg), GFP_KERNEL);
+		if (pg && gnttab_alloc_pages(1, &pg->page)) {
+			kfree(pg);
+			pg = NULL;
+		}
+		if (!pg) {
+			/* Still map those already added to cache */
+			err = -ENOMEM;
+			break;
+		}
+		pg->gref = q->grefs[i];
+		addr = (unsigned long)pfn_to_kaddr(page_to_pfn(pg->page));
+		gnttab_set_map_op(&q->map_ops[nr_new], addr, GNTMAP_host_map,
+				pg->gref, q->info->dev->otherend_id);
+		q->map_pages[nr_new] = pg->page;
+		q->new_pgrants[nr_new++] = pg;
+		alice_back_add_pgrant(q, pg);
+		q->seg_pages[i] = pg->page;
+	}
+	if (nr_new == 0)
+		return err;
+
+	if (gnttab_map_refs(q->map_ops, NULL, q->map_pages, nr_new))
+		err = -EIO;
+	for (i = 0; i < nr_new; i++) {
+		pg = q->new_pgrants[i];
+		if (q->map_ops[i].status != GNTST_okay) {
+			alice_back_drop_pgrant(q, pg, false);
+			err = -EIO;
+			continue;
+		}
+		pg->handle = q->map_ops[i].handle;
+	}
+	return err;
+}
+
+/* Unmap least recently used persistent grants over max_pgrants */
+static void alice_back_shrink_pgrants(struct alice_back_queue *q,
+		unsigned int max)
+{
+	struct alice_pgrant *pg;
+
+	while (q->nr_pgrants > max) {
+		pg = list_first_entry(&q->pgrant_lru, struct alice_pgrant, lru);
+		alice_back_drop_pgrant(q, pg, true);
+		q->pgrant_evictions++;
+	}
+	alice_back_unmap(q);
+}
+
+/* Map q->grefs[0, nr) onto q->pages[0, nr) in one hypercall */
+static int alice_back_map(struct alice_back_queue *q, unsigned int nr,
+		bool readonly)
+{
+	uint32_t flags = GNTMAP_host_map | (readonly ? GNTMAP_readonly : 0);
+	unsigned long addr;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		addr = (unsigned long)pfn_to_kaddr(page_to_pfn(q->pages[i]));
+		gnttab_set_map_op(&q->map_ops[i], addr, flags, q->grefs[i],
+				q->info->dev->otherend_id);
+	}
+
+	err = gnttab_map_refs(q->map_ops, NULL, q->pages, nr);
+
+	/* Remember those mapped, even on error they must be unmapped */
+	for (i = 0; i < nr; i++) {
+		if (q->map_ops[i].status != GNTST_okay) {
+			err = -EIO;
+			continue;
+		}
+		gnttab_set_unmap_op(&q->unmap_ops[q->nr_unmap],
+				q->map_ops[i].host_addr, flags, q->map_ops[i].handle);
+		q->unmap_pages[q->nr_unmap++] = q->pages[i];
+	}
+	return err;
+}
+
+/* Copy segment list out of request, from indirect pages if needed, so
+ * frontend can't change it under our feet */
+static int alice_back_get_segs(struct alice_back_queue *q,
+		struct as_request *req, unsigned int nr_segs)
+{
+	struct alice_seg *ind;
+	unsigned int nr_ind, i;
+	int err;
+
+	if (req->operation != ALICE_OP_INDIRECT) {
+		if (nr_segs > ALICE_MAX_SEGS)
+			return -EINVAL;
+		memcpy(q->segs, req->u.seg, nr_segs * sizeof(q->segs[0]));
+		return 0;
+	}
+
+	if (nr_segs > ALICE_MAX_INDIRECT_SEGS)
+		return -EINVAL;
+	nr_ind = DIV_ROUND_UP(nr_segs, ALICE_SEGS_PER_INDIRECT);
+	if (nr_ind > ALICE_MAX_INDIRECT_PAGES)
+		return -EINVAL;
+
+	for (i = 0; i < nr_ind; i++)
+		q->grefs[i] = req->u.indirect_grefs[i];
+	err = alice_back_map(q, nr_ind, true);
+	if (!err) {
+		for (i = 0; i < nr_segs; i++) {
+			ind = page_address(q->pages[i / ALICE_SEGS_PER_INDIRECT]);
+			q->segs[i] = ind[i % ALICE_SEGS_PER_INDIRECT];
+		}
+	}
+	alice_back_unmap(q);
+	return err;
+}
+
+/* Copy segments between frontend grefs and local pages by one hypercall */
+static int alice_back_copy(struct alice_back_queue *q, unsigned int nr,
+		bool from_front)
+{
+	struct gnttab_copy *op;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < nr; i++) {
+		op = &q->copy_ops[i];
+		if (from_front) {
+			op->source.u.ref = q->segs[i].gref;
+			op->source.domid = q->info->dev->otherend_id;
+			op->dest.u.gmfn = xen_page_to_gfn(q->copy_pages[i]);
+			op->dest.domid = DOMID_SELF;
+			op->flags = GNTCOPY_source_gref;
+		} else {
+			op->source.u.gmfn = xen_page_to_gfn(q->copy_pages[i]);
+			op->source.domid = DOMID_SELF;
+			op->dest.u.ref = q->segs[i].gref;
+			op->dest.domid = q->info->dev->otherend_id;
+			op->flags = GNTCOPY_dest_gref;
+		}
+		op->source.offset = q->segs[i].offset;
+		op->dest.offset = q->segs[i].offset;
+		op->len = q->segs[i].len;
+	}
+
+	gnttab_batch_copy(q->copy_ops, nr);
+	for (i = 0; i < nr; i++) {
+		if (q->copy_ops[i].status != GNTST_okay)
+			err = -EIO;
+	}
+	return err;
+}
+
+/* Copy small requests, map big ones. Near the threshold the other path
+ * is taken now and then so both keep being timed */
+static bool alice_back_use_copy(struct alice_back_queue *q, unsigned int nr)
+{
+	bool copy = nr <= q->copy_thresh;
+
+	if (q->info->persistent)
+		return false;
+	if (copy_calibrate && (nr == q->copy_thresh || nr == q->copy_thresh + 1)
+			&& ++q->nr_explore % 4 == 0)
+		copy = !copy;
+	return copy && nr <= ALICE_MAX_COPY_PAGES;
+}
+
+/* Move threshold a page towards the path found cheaper at its edge */
+static void alice_back_calibrate(struct alice_back_queue *q, unsigned int nr,
+		bool copy, u64 ns)
+{
+	unsigned int t = q->copy_thresh;
+	u64 *avg;
+
+	if (!copy_calibrate || (nr != t && nr != t + 1))
+		return;
+	avg = &q->cost_ns[nr - t][copy];
+	*avg = *avg ? (*avg * 7 + ns) / 8 : ns;
+	if (++q->nr_samples < ALICE_CALIBRATE_SAMPLES)
+		return;
+	q->nr_samples = 0;
+
+	if (t > 0 && q->cost_ns[0][0] && q->cost_ns[0][1] &&
+			q->cost_ns[0][0] < q->cost_ns[0][1])
+		t--;
+	else if (t < ALICE_MAX_COPY_PAGES && q->cost_ns[1][0] &&
+			q->cost_ns[1][1] && q->cost_ns[1][1] < q->cost_ns[1][0])
+		t++;
+	if (t != q->copy_thresh) {
+		q->copy_thresh = t;
+		memset(q->cost_ns, 0, sizeof(q->cost_ns));
+	}
+}
+
+/* Map every data page of a request by one hypercall, work on them in
+ * place and unmap them by one hypercall. No payload goes through ring.
+ * Small requests are grant copied instead, it costs less than mapping */
+static int alice_back_do_bulk(struct alice_back_queue *q,
+		struct as_request *req, int *csum)
+{
+	uint8_t op = req->operation;
+	unsigned int nr_segs = req->nr_segments;
+	unsigned int i, j;
+	uint8_t *data;
+	ktime_t start;
+	bool copy;
+	int err;
+
+	if (op == ALICE_OP_INDIRECT)
+		op = req->indirect_op;
+	if (op != ALICE_OP_WRITE && op != ALICE_OP_READ)
+		return -EINVAL;
+
+	err = alice_back_get_segs(q, req, nr_segs);
+	if (err)
+		return err;
+
+	for (i = 0; i < nr_segs; i++) {
+		if (q->segs[i].offset + q->segs[i].len > PAGE_SIZE)
+			return -EINVAL;
+		q->grefs[i] = q->segs[i].gref;
+	}
+
+	start = ktime_get();
+	copy = alice_back_use_copy(q, nr_segs);
+	if (copy) {
+		err = 0;
+		if (op == ALICE_OP_WRITE)
+			err = alice_back_copy(q, nr_segs, true);
+		for (i = 0; i < nr_segs; i++)
+			q->seg_pages[i] = q->copy_pages[i];
+	} else if (q->info->persistent) {
+		err = alice_back_map_persistent(q, nr_segs);
+	} else {
+		/* Frontend writes, we only need to read its pages */
+		err = alice_back_map(q, nr_segs, op == ALICE_OP_WRITE);
+		for (i = 0; i < nr_segs; i++)
+			q->seg_pages[i] = q->pages[i];
+	}
+	if (err)
+		goto out;
+
+	*csum = 0;
+	for (i = 0; i < nr_segs; i++) {
+		data = (uint8_t *)page_address(q->seg_pages[i]) + q->segs[i].offset;
+		if (op == ALICE_OP_WRITE) {
+			for (j = 0; j < q->segs[i].len; j++)
+				*csum += data[j];
+		} else {
+			memset(data, (uint8_t)req->hello, q->segs[i].len);
+		}
+	}
+	if (copy && op == ALICE_OP_READ)
+		err = alice_back_copy(q, nr_segs, false);
+
+out:
+	if (q->info->persistent)
+		alice_back_shrink_pgrants(q, max_pgrants);
+	else
+		alice_back_unmap(q);
+
+	if (copy)
+		q->nr_copied++;
+	else
+		q->nr_mapped++;
+	alice_back_calibrate(q, nr_segs, copy, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return err;
+}
+
+/* Adaptive window: grow while responses share events, shrink when one
+ * goes out alone, so a quiet ring gets its responses at once. From
+ * zero, come back once events are closer than the window. Lock held */
+static void alice_back_mod_adapt(struct alice_back_queue *q, ktime_t now)
+{
+	u64 max = (u64)q->info->mod_usecs * NSEC_PER_USEC;
+
+	if (q->mod_ns == 0) {
+		if (ktime_to_ns(ktime_sub(now, q->last_notify)) < max)
+			q->mod_ns = min_t(u64, ALICE_MOD_MIN_NS, max);
+	} else if (q->mod_pending > 1) {
+		q->mod_ns = min(q->mod_ns * 2, max);
+	} else {
+		q->mod_ns /= 2;
+		if (q->mod_ns < ALICE_MOD_MIN_NS)
+			q->mod_ns = 0;
+	}
+}
+
+/* Send the held event, lock held */
+static void alice_back_mod_flush(struct alice_back_queue *q)
+{
+	ktime_t now = ktime_get();
+
+	if (q->info->mod_adaptive)
+		alice_back_mod_adapt(q, now);
+	q->nr_notify++;
+	q->nr_coalesced += q->mod_pending - 1;
+	q->mod_pending = 0;
+	q->last_notify = now;
+	notify_remote_via_irq(q->irq);
+}
+
+static enum hrtimer_restart alice_back_mod_timer(struct hrtimer *timer)
+{
+	struct alice_back_queue *q =
+		container_of(timer, struct alice_back_queue, mod_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->mod_lock, flags);
+	if (q->mod_pending)
+		alice_back_mod_flush(q);
+	spin_unlock_irqrestore(&q->mod_lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+/* Tell frontend about nr responses just pushed. With moderation the
+ * event is held until the window ends or mod_rsps responses share it */
+static void alice_back_notify(struct alice_back_queue *q, int notify,
+		unsigned int nr)
+{
+	struct alice_back_info *info = q->info;
+	unsigned long flags;
+
+	if (!info->mod_usecs) {
+		if (notify) {
+			q->nr_notify++;
+			notify_remote_via_irq(q->irq);
+		}
+		return;
+	}
 
+	spin_lock_irqsave(&q->mod_lock, flags);
+	/* rsp_event was passed by responses of the held event already, so
+	 * ring macros no longer ask to notify for these, they join it */
+	if (notify || q->mod_pending)
+		q->mod_pending += nr;
+	if (q->mod_pending) {
+		if (q->mod_ns == 0 ||
+		    (info->mod_rsps && q->mod_pending >= info->mod_rsps))
+			alice_back_mod_flush(q);
+		else if (!hrtimer_is_queued(&q->mod_timer))
+			hrtimer_start(&q->mod_timer, ns_to_ktime(q->mod_ns),
+					HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&q->mod_lock, flags);
+}
+
+/* Publish responses not pushed yet and tell frontend */
+static void alice_back_push(struct alice_back_queue *q)
+{
+	RING_IDX pushed;
+	int notify;
+
+	/* We are the only one moving rsp_prod */
+	pushed = q->ring.rsp_prod_pvt - q->ring.sring->rsp_prod;
+	if (pushed == 0)
+		return;
+	RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&q->ring, notify);
+	alice_back_notify(q, notify, pushed);
+}
+
+/* Drain requests of this queue, pushing responses in batches. Stops
+ * after ALICE_WORK_BUDGET requests and queues the work again for the rest */
+static void alice_back_work(struct work_struct *work)
+{
+	struct alice_back_queue *q =
+		container_of(work, struct alice_back_queue, work);
+	unsigned int budget = ALICE_WORK_BUDGET;
+	struct as_request req;
+	struct as_response *rsp;
+	RING_IDX rc, rp;
+	int more_to_do, csum, err;
 
-/* This is where we set up path watchers and event channels */
-static void alice_back_connect(struct xenbus_device *dev)
-{ pr_info("Dom0: Connect the backend\n"); }
+	do {
+		rc = q->ring.req_cons;
+		rp = q->ring.sring->req_prod;
+		rmb(); /* Ensure we see queued requests up to rp */
 
-/* Disconnect from xenbus, do clean work (event channel etc) */
+		while (rc != rp && budget > 0 &&
+				!RING_REQUEST_CONS_OVERFLOW(&q->ring, rc)) {
+			/* Copy this info local */
+			memcpy(&req, RING_GET_REQUEST(&q->ring, rc), sizeof(req));
+			q->ring.req_cons = ++rc;
+
+			err = 0;
+			csum = req.hello + 1;
+			if (req.operation != ALICE_OP_HELLO)
+				err = alice_back_do_bulk(q, &req, &csum);
+			if (service_us)
+				usleep_range(service_us, service_us + service_us / 8);
+
+			rsp = RING_GET_RESPONSE(&q->ring, q->ring.rsp_prod_pvt);
+			rsp->id = req.id;
+			rsp->status = err ? ALICE_RSP_ERROR : ALICE_RSP_OKAY;
+			rsp->hi = csum;
+			q->ring.rsp_prod_pvt++;
+			q->nr_handled++;
+			if (--budget % ALICE_PUSH_BATCH == 0)
+				alice_back_push(q);
+		}
+		alice_back_push(q);
+
+		/* Budget spent, requests may be left and req_event is not
+		 * armed, so the next run is queued here */
+		if (budget == 0) {
+			q->nr_requeues++;
+			schedule_work_on(q->cpu, &q->work);
+			return;
+		}
+		if (rc != rp)
+			break;
+
+		RING_FINAL_CHECK_FOR_REQUESTS(&q->ring, more_to_do);
+	} while (more_to_do);
+}
+
+/* Frontend pushed requests, mapping may take long, leave irq context */
+static irqreturn_t alice_back_interrupt(int irq, void *dev_id)
+{
+	struct alice_back_queue *q = dev_id;
+
+	schedule_work_on(q->cpu, &q->work);
+	return IRQ_HANDLED;
+}
+
+/* Map rings of one queue and bind its event channel */
+static int alice_back_connect_queue(struct alice_back_queue *q)
+{
+	struct xenbus_device *dev = q->info->dev;
+	unsigned int nr_pages = 1 << q->info->ring_order;
+	grant_ref_t refs[XENBUS_MAX_RING_GRANTS];
+	char key[32];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nr_pages; i++) {
+		snprintf(key, sizeof(key), "queue-%u/ring-ref%u", q->id, i);
+		err = xenbus_scanf(XBT_NIL, dev->otherend, key, "%u", &refs[i]);
+		if (err != 1) {
+			xenbus_dev_fatal(dev, -EINVAL, "reading %s/%s",
+					dev->otherend, key);
+			return -EINVAL;
+		}
+	}
+	snprintf(key, sizeof(key), "queue-%u/event-channel", q->id);
+	err = xenbus_scanf(XBT_NIL, dev->otherend, key, "%u", &q->evtchn);
+	if (err != 1) {
+		xenbus_dev_fatal(dev, -EINVAL, "reading %s/%s", dev->otherend, key);
+		return -EINVAL;
+	}
+
+	/* Local pages small requests are copied to, kept from last
+	 * connect if any */
+	q->copy_thresh = min_t(unsigned int, copy_threshold / PAGE_SIZE,
+			ALICE_MAX_COPY_PAGES);
+	for (i = 0; i < ALICE_MAX_COPY_PAGES; i++) {
+		if (!q->copy_pages[i])
+			q->copy_pages[i] = alloc_page(GFP_KERNEL);
+		if (!q->copy_pages[i])
+			return -ENOMEM;
+	}
+
+	/* Pages to map data of requests onto */
+	if (!q->pages[0]) {
+		err = gnttab_alloc_pages(ALICE_MAX_INDIRECT_SEGS, q->pages);
+		if (err) {
+			q->pages[0] = NULL;
+			return err;
+		}
+	}
+
+	/* All pages of ring are mapped contiguously by one call */
+	err = xenbus_map_ring_valloc(dev, refs, nr_pages, &q->ring_addr);
+	if (err)
+		return err;
+	BACK_RING_INIT(&q->ring, (struct as_sring *)q->ring_addr,
+			PAGE_SIZE << q->info->ring_order);
+
+	/* Spread queues over cpus, so each one is served by its own cpu */
+	q->cpu = cpumask_local_spread(q->id, dev_to_node(&dev->dev));
+	INIT_WORK(&q->work, alice_back_work);
+
+	spin_lock_init(&q->mod_lock);
+	hrtimer_init(&q->mod_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	q->mod_timer.function = alice_back_mod_timer;
+	q->mod_ns = (u64)q->info->mod_usecs * NSEC_PER_USEC;
+	if (q->info->mod_adaptive)
+		q->mod_ns = min_t(u64, ALICE_MOD_MIN_NS, q->mod_ns);
+	q->mod_pending = 0;
+	q->last_notify = ktime_get();
+
+	snprintf(q->name, sizeof(q->name), "alice_dev-q%u", q->id);
+	err = bind_interdomain_evtchn_to_irqhandler(dev->otherend_id, q->evtchn,
+			alice_back_interrupt, 0, q->name, q);
+	if (err < 0)
+		return err;
+	q->irq = err;
+
+	irq_set_affinity_hint(q->irq, cpumask_of(q->cpu));
+	return 0;
+}
+
+/* Drop what belongs to the frontend: event channel, ring and persistent
+ * grants. Local pages stay for next connect */
+static void alice_back_disconnect_queue(struct alice_back_queue *q)
+{
+	if (q->irq > 0) {
+		/* Irq queues the work, work arms the timer, both notify
+		 * through the irq. Stop them in that order, unbind last */
+		disable_irq(q->irq);
+		cancel_work_sync(&q->work);
+		hrtimer_cancel(&q->mod_timer);
+		irq_set_affinity_hint(q->irq, NULL);
+		unbind_from_irqhandler(q->irq, q);
+		q->irq = 0;
+		pr_info("Dom0: queue %u sent %lu events, %lu responses shared one, "
+				"requeued %lu times\n", q->id, q->nr_notify,
+				q->nr_coalesced, q->nr_requeues);
+	}
+
+	/* Unmap all persistent grants */
+	alice_back_shrink_pgrants(q, 0);
+	if (q->info->persistent)
+		pr_info("Dom0: queue %u persistent grants hit %lu, miss %lu, evict %lu\n",
+				q->id, q->pgrant_hits, q->pgrant_misses,
+				q->pgrant_evictions);
+
+	if (q->ring_addr) {
+		xenbus_unmap_ring_vfree(q->info->dev, q->ring_addr);
+		q->ring_addr = NULL;
+	}
+	pr_info("Dom0: queue %u copied %lu, mapped %lu, copy threshold %u pages\n",
+			q->id, q->nr_copied, q->nr_mapped, q->copy_thresh);
+}
+
+static void alice_back_free_queue(struct alice_back_queue *q)
+{
+	unsigned int i;
+
+	if (q->pages[0]) {
+		gnttab_free_pages(ALICE_MAX_INDIRECT_SEGS, q->pages);
+		q->pages[0] = NULL;
+	}
+	for (i = 0; i < ALICE_MAX_COPY_PAGES; i++) {
+		if (q->copy_pages[i])
+			__free_page(q->copy_pages[i]);
+		q->copy_pages[i] = NULL;
+	}
+}
+
+/* Disconnect from xenbus, do clean work (event channel etc). Queues and
+ * their pages are kept, so frontend coming back connects quickly */
 static void alice_back_disconnect(struct xenbus_device *dev)
-{ pr_info("Dom0: Disconnect the backend\n"); }
+{
+	struct alice_back_info *info = dev_get_drvdata(&dev->dev);
+	unsigned int i;
+
+	pr_info("Dom0: Disconnect the backend\n");
+	if (!info->queues)
+		return;
+
+	for (i = 0; i < info->nr_queues; i++)
+		alice_back_disconnect_queue(&info->queues[i]);
+}
+
+/* Free queues for good, disconnected already */
+static void alice_back_free_queues(struct alice_back_info *info)
+{
+	unsigned int i;
+
+	if (!info->queues)
+		return;
+
+	for (i = 0; i < info->nr_queues; i++)
+		alice_back_free_queue(&info->queues[i]);
+	vfree(info->queues);
+	info->queues = NULL;
+	info->nr_queues = 0;
+}
+
+/* This is where we set up rings and event channels of all queues
+ * negotiated with the frontend */
+static int alice_back_connect(struct xenbus_device *dev)
+{
+	struct alice_back_info *info = dev_get_drvdata(&dev->dev);
+	unsigned int nr_queues, ring_order, i;
+	ktime_t start = ktime_get();
+	int err;
+
+	pr_info("Dom0: Connect the backend\n");
+
+	nr_queues = xenbus_read_unsigned(dev->otherend, "multi-queue-num-queues", 1);
+	ring_order = xenbus_read_unsigned(dev->otherend, "ring-page-order", 0);
+	if (nr_queues == 0 || nr_queues > max_queues ||
+			ring_order > max_ring_order) {
+		xenbus_dev_fatal(dev, -EINVAL, "frontend asked %u queues of order %u",
+				nr_queues, ring_order);
+		return -EINVAL;
+	}
+
+	/* Reconnect reuses queues of last connect if count still fits */
+	if (info->queues && info->nr_queues != nr_queues)
+		alice_back_free_queues(info);
+	if (!info->queues) {
+		/* Queues carry big per request arrays, don't ask for
+		 * contiguous pages */
+		info->queues = vzalloc(nr_queues * sizeof(*info->queues));
+		if (!info->queues)
+			return -ENOMEM;
+		info->nr_queues = nr_queues;
+		for (i = 0; i < nr_queues; i++) {
+			info->queues[i].info = info;
+			info->queues[i].id = i;
+			info->queues[i].pgrants = RB_ROOT;
+			INIT_LIST_HEAD(&info->queues[i].pgrant_lru);
+			INIT_LIST_HEAD(&info->queues[i].pgrant_dead);
+		}
+	}
+	info->ring_order = ring_order;
+	info->persistent = xenbus_read_unsigned(dev->otherend,
+			"feature-persistent", 0);
+	info->mod_usecs = 0;
+	if (intr_moderation) {
+		info->mod_usecs = xenbus_read_unsigned(dev->otherend,
+				"intr-moderation-usecs", 0);
+		info->mod_rsps = xenbus_read_unsigned(dev->otherend,
+				"intr-moderation-rsps", 0);
+		info->mod_adaptive = xenbus_read_unsigned(dev->otherend,
+				"intr-moderation-adaptive", 0);
+	}
+
+	for (i = 0; i < nr_queues; i++) {
+		err = alice_back_connect_queue(&info->queues[i]);
+		if (err) {
+			xenbus_dev_fatal(dev, err, "connecting queue %u", i);
+			alice_back_disconnect(dev);
+			return err;
+		}
+	}
+
+	pr_info("Dom0: Connected %u queues, ring order %u in %lld us\n",
+			nr_queues, ring_order, ktime_us_delta(ktime_get(), start));
+	if (info->mod_usecs)
+		pr_info("Dom0: Moderating events, %u us or %u responses%s\n",
+				info->mod_usecs, info->mod_rsps,
+				info->mod_adaptive ? ", adaptive" : "");
+	return 0;
+}
 
 /* We try to switch to the next state from a previous one */
 static void set_backend_state(struct xenbus_device *dev,
@@ -61,7 +938,8 @@ static void set_backend_state(struct xenbus_device *dev,
 		case XenbusStateInitWait:
 			switch (state) {
 			case XenbusStateConnected:
-				alice_back_connect(dev);
+				if (alice_back_connect(dev))
+					return;
 				xenbus_switch_state(dev, XenbusStateConnected);
 				break;
 			case XenbusStateClosing:
@@ -101,18 +979,14 @@ static void set_backend_state(struct xenbus_device *dev,
 	}
 }
 
-/* The function is called on activation of the device */
-static int alice_back_probe(struct xenbus_device *dev,
-			const struct xenbus_device_id *id)
+/* Bring backend to where the latest frontend state asks for */
+static void alice_back_state_work(struct work_struct *work)
 {
-	pr_info("Dom0: Probe called.\n");
-    xenbus_switch_state(dev, XenbusStateInitialising);
-	return 0;
-}
+	struct alice_back_info *info =
+		container_of(work, struct alice_back_info, state_work);
+	struct xenbus_device *dev = info->dev;
+	enum xenbus_state frontend_state = READ_ONCE(info->frontend_state);
 
-/* The function is called on a state change of the frontend driver */
-static void alice_back_otherend_changed(struct xenbus_device *dev, enum xenbus_state frontend_state)
-{
 	switch (frontend_state) {
 		case XenbusStateInitialising:
 			set_backend_state(dev, XenbusStateInitWait);
@@ -130,13 +1004,14 @@ static void alice_back_otherend_changed(struct xenbus_device *dev, enum xenbus_s
 			break;
 
 		case XenbusStateClosed:
-			set_backend_state(dev, XenbusStateClosed);
-			if (xenbus_dev_is_online(dev))
+			/* Closed before we came, e.g. we were reloaded. Wait in
+			 * InitWait, frontend connects again on seeing it */
+			if (dev->state == XenbusStateInitialising ||
+			    dev->state == XenbusStateInitWait) {
+				set_backend_state(dev, XenbusStateInitWait);
 				break;
-			/* fall through if not online */
-		case XenbusStateUnknown:
+			}
 			set_backend_state(dev, XenbusStateClosed);
-			device_unregister(&dev->dev);
 			break;
 
 		default:
@@ -146,6 +1021,110 @@ static void alice_back_otherend_changed(struct xenbus_device *dev, enum xenbus_s
 	}
 }
 
+/* Tell frontend what it may ask for, in one transaction. With
+ * fast_negotiate state InitWait goes in too, so frontend may connect
+ * right away instead of waiting for us to see it Initialising */
+static int alice_back_publish(struct xenbus_device *dev)
+{
+	struct xenbus_transaction xbt;
+	int err;
+
+again:
+	err = xenbus_transaction_start(&xbt);
+	if (err)
+		return err;
+
+	err = xenbus_printf(xbt, dev->nodename, "multi-queue-max-queues",
+			"%u", max_queues);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "max-ring-page-order",
+				"%u", max_ring_order);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename,
+				"feature-max-indirect-segments", "%u",
+				ALICE_MAX_INDIRECT_SEGS);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "feature-persistent",
+				"%u", 1);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename,
+				"feature-intr-moderation", "%u", intr_moderation);
+	if (!err && fast_negotiate)
+		err = xenbus_printf(xbt, dev->nodename, "state", "%d",
+				XenbusStateInitWait);
+	if (err) {
+		xenbus_transaction_end(xbt, 1);
+		return err;
+	}
+
+	err = xenbus_transaction_end(xbt, 0);
+	if (err == -EAGAIN)
+		goto again;
+	if (!err && fast_negotiate)
+		dev->state = XenbusStateInitWait;
+	return err;
+}
+
+/* The function is called on activation of the device */
+static int alice_back_probe(struct xenbus_device *dev,
+			const struct xenbus_device_id *id)
+{
+	struct alice_back_info *info;
+	int err;
+
+	pr_info("Dom0: Probe called.\n");
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	info->dev = dev;
+	INIT_WORK(&info->state_work, alice_back_state_work);
+	dev_set_drvdata(&dev->dev, info);
+
+	err = alice_back_publish(dev);
+	if (err) {
+		xenbus_dev_fatal(dev, err, "writing features");
+		dev_set_drvdata(&dev->dev, NULL);
+		kfree(info);
+		return err;
+	}
+
+	if (dev->state != XenbusStateInitWait)
+		xenbus_switch_state(dev, XenbusStateInitialising);
+	return 0;
+}
+
+/* The function is called when the device goes away */
+static int alice_back_remove(struct xenbus_device *dev)
+{
+	struct alice_back_info *info = dev_get_drvdata(&dev->dev);
+
+	cancel_work_sync(&info->state_work);
+	alice_back_disconnect(dev);
+	alice_back_free_queues(info);
+	dev_set_drvdata(&dev->dev, NULL);
+	kfree(info);
+	return 0;
+}
+
+/* The function is called on a state change of the frontend driver, in
+ * the xenbus watch thread shared by all devices. Hand it to the device's
+ * work, except going away, which must finish before we return */
+static void alice_back_otherend_changed(struct xenbus_device *dev, enum xenbus_state frontend_state)
+{
+	struct alice_back_info *info = dev_get_drvdata(&dev->dev);
+
+	if (frontend_state == XenbusStateUnknown ||
+	    (frontend_state == XenbusStateClosed && !xenbus_dev_is_online(dev))) {
+		cancel_work_sync(&info->state_work);
+		set_backend_state(dev, XenbusStateClosed);
+		device_unregister(&dev->dev);
+		return;
+	}
+
+	WRITE_ONCE(info->frontend_state, frontend_state);
+	queue_work(alice_back_wq, &info->state_work);
+}
+
 /* This defines the name of the devices the driver reacts to */
 static const struct xenbus_device_id alice_back_ids[] = {
 	{ "alice_dev" },
@@ -156,20 +1135,38 @@ static const struct xenbus_device_id alice_back_ids[] = {
 static struct xenbus_driver alice_back_driver = {
 	.ids  = alice_back_ids,
 	.probe = alice_back_probe,
+	.remove = alice_back_remove,
 	.otherend_changed = alice_back_otherend_changed,
 };
 
 /* On loading this kernel module, we register as a backend driver */
 static int __init init_alice(void)
 {
+	int err;
+
+	if (max_queues == 0 || max_queues > num_online_cpus())
+		max_queues = num_online_cpus();
+	if (max_ring_order > XENBUS_MAX_RING_GRANT_ORDER)
+		max_ring_order = XENBUS_MAX_RING_GRANT_ORDER;
+
+	alice_back_wq = alloc_workqueue("alice_back", WQ_UNBOUND, 0);
+	if (!alice_back_wq)
+		return -ENOMEM;
+
+	err = xenbus_register_backend(&alice_back_driver);
+	if (err) {
+		destroy_workqueue(alice_back_wq);
+		return err;
+	}
 	pr_info("Dom0: Alice_back inited!\n");
-	return xenbus_register_backend(&alice_back_driver);
+	return 0;
 }
 
 /* unregister when rmmod */
 static void __exit exit_alice(void)
 {
 	xenbus_unregister_driver(&alice_back_driver);
+	destroy_workqueue(alice_back_wq);
 	pr_info("Dom0: Alice Exit Successfully.\n");
 }
 
@@ -6,34 +6,1026 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_domU.ko
+ * insmod alice_domU.ko [num_queues=<n>] [ring_order=<order>]
+ *
+ * <n>      Queues wanted, cut to what backend offers. Default number
+ *          of online cpus
+ * <order>  Pages of each ring as power of 2, cut to what backend
+ *          offers. Default 0
+ * bulk_kb=<kb>  Write this much data to backend by granted pages once
+ *               connected, default 0
+ * bulk_ms=<ms>  Instead write 1, 2, 4... pages and bulk_kb, one
+ *               request in flight, each for <ms>, and report MB/s of
+ *               every size. Default 0, a single write
+ * persistent=<0|1>  Reuse granted pages kept mapped by backend if it
+ *                   supports so, default 1
+ * fast_negotiate=<0|1>  Publish rings and state Connected in one
+ *                       transaction, default 1
+ * intr_moderation_us=<us>  Ask backend to send at most one response
+ *                          event per <us>, default 0, off
+ * intr_moderation_rsps=<n> Or per <n> responses, whichever comes
+ *                          first, default 0, window only
+ * intr_moderation_adaptive=<0|1>  Let backend shrink window on a quiet
+ *                                 ring, default 1
+ * load_ms=<ms>     Keep load_depth hellos in flight on every queue for
+ *                  <ms> once connected, then report interrupts/s and
+ *                  latency of responses. Default 0
+ * load_depth=<n>   Default 8
  *
  * This Module is running in domU acting as frontend
  */
 #include <linux/module.h>  /* Needed by all modules */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
 
 #include <xen/xen.h>
 #include <xen/xenbus.h>
+#include <xen/events.h>
+#include <xen/grant_table.h>
+#include <xen/page.h>
+
+#include "../alice_dev.h"
+
+/* Page granted once and reused by many requests */
+struct alice_front_pgrant {
+	struct list_head node;
+	struct page *page;
+	grant_ref_t gref;
+};
+
+/* Request in flight, indexed by request id */
+struct alice_front_shadow {
+	unsigned int next_free;
+	ktime_t sent;
+	uint8_t op;
+	bool ok;                    /* Answered okay, read data is copied out */
+	unsigned int len;
+	unsigned int nr_grefs;
+	grant_ref_t *grefs;         /* Data grefs, revoked on response */
+	unsigned int nr_pgrants;
+	struct alice_front_pgrant **pgrants;    /* Back to free list on response */
+	struct page **user_pages;   /* Caller pages data is copied from/to */
+	unsigned int nr_indirect;
+	grant_ref_t indirect_grefs[ALICE_MAX_INDIRECT_PAGES];
+	unsigned long indirect_pages[ALICE_MAX_INDIRECT_PAGES];
+};
+
+/* One ring, event channel and irq per queue */
+struct alice_front_queue {
+	struct alice_front_info *info;
+	unsigned int id;
+	struct as_front_ring ring;
+	grant_ref_t ring_ref[XENBUS_MAX_RING_GRANTS];
+	unsigned int evtchn;
+	int irq;
+	char name[32];
+	spinlock_t lock;    /* Protect ring and shadow */
+	struct alice_front_shadow *shadow;
+	unsigned int shadow_free;
+	/* Answered data requests, chained by next_free like free ones, are
+	 * finished by done_work out of irq */
+	unsigned int shadow_done;
+	unsigned int nr_done;
+	struct work_struct done_work;
+	struct list_head pgrants;   /* Free persistent grants */
+	unsigned long nr_received;
+	unsigned long nr_irqs;
+	u64 lat_sum_ns;             /* Request sent to response seen */
+	u64 lat_max_ns;
+};
+
+/* Per device context, saved as drvdata of xenbus_device */
+struct alice_front_info {
+	struct xenbus_device *dev;
+	unsigned int nr_queues;
+	unsigned int ring_order;
+	unsigned int max_segs;      /* Segments per request backend takes */
+	bool persistent;            /* Data goes through persistent grants */
+	struct alice_front_queue *queues;
+	struct page **bulk_pages;   /* Demo payload of bulk_kb */
+	unsigned int nr_bulk_pages;
+	struct work_struct bulk_work;   /* Runs bulk_ms benchmark */
+	wait_queue_head_t bulk_wait;    /* Woken as responses come in */
+	bool bulk_stop;
+	ktime_t bringup_start;      /* To tell how long (re)connect takes */
+	struct delayed_work load_work;  /* Ends load_ms of synthetic load */
+	bool load_running;
+	ktime_t load_start;
+};
+
+static unsigned int num_queues;
+static unsigned int ring_order;
+static unsigned int bulk_kb;
+static unsigned int bulk_ms;
+static bool persistent = true;
+static bool fast_negotiate = true;
+static unsigned int intr_moderation_us;
+static unsigned int intr_moderation_rsps;
+static bool intr_moderation_adaptive = true;
+static unsigned int load_ms;
+static unsigned int load_depth = 8;
+module_param(num_queues, uint, 0644);
+module_param(ring_order, uint, 0644);
+module_param(bulk_kb, uint, 0644);
+module_param(bulk_ms, uint, 0644);
+module_param(persistent, bool, 0644);
+module_param(fast_negotiate, bool, 0644);
+module_param(intr_moderation_us, uint, 0644);
+module_param(intr_moderation_rsps, uint, 0644);
+module_param(intr_moderation_adaptive, bool, 0644);
+module_param(load_ms, uint, 0644);
+module_param(load_depth, uint, 0644);
+
+/* Take a persistent grant, grant a new page if all are busy */
+static struct alice_front_pgrant *alice_front_get_pgrant(struct alice_front_queue *q)
+{
+	struct alice_front_pgrant *pg = NULL;
+	unsigned long flags;
+	int ref;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (!list_empty(&q->pgrants)) {
+		pg = list_first_entry(&q->pgrants, struct alice_front_pgrant, node);
+		list_del(&pg->node);
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (pg)
+		return pg;
+
+	/* Working set grew, this page stays granted until disconnect */
+	pg = kzalloc(sizeof(*pg), GFP_KERNEL);
+	if (!pg)
+		return NULL;
+	pg->page = alloc_page(GFP_KERNEL);
+	if (!pg->page)
+		goto fail;
+	ref = gnttab_grant_foreign_access(q->info->dev->otherend_id,
+			xen_page_to_gfn(pg->page), 0);
+	if (ref < 0) {
+		__free_page(pg->page);
+		goto fail;
+	}
+	pg->gref = ref;
+	return pg;
+
+fail:
+	kfree(pg);
+	return NULL;
+}
+
+/* Revoke persistent grants for good, pages are freed as well */
+static void alice_front_free_pgrants(struct alice_front_queue *q)
+{
+	struct alice_front_pgrant *pg, *n;
+
+	list_for_each_entry_safe(pg, n, &q->pgrants, node) {
+		list_del(&pg->node);
+		gnttab_end_foreign_access(pg->gref, 0,
+				(unsigned long)page_address(pg->page));
+		kfree(pg);
+	}
+}
+
+/* Copy data read out of persistent grants into caller pages */
+static void alice_front_copy_back(struct alice_front_shadow *sh)
+{
+	unsigned int i, n, len = sh->len;
+
+	for (i = 0; i < sh->nr_pgrants; i++) {
+		n = min_t(unsigned int, len, PAGE_SIZE);
+		memcpy(page_address(sh->user_pages[i]),
+				page_address(sh->pgrants[i]->page), n);
+		len -= n;
+	}
+}
+
+/* Revoke grants of a finished request, indirect pages are freed as well.
+ * Persistent grants go back to free list. Lock held */
+static void alice_front_end_shadow(struct alice_front_queue *q,
+		struct alice_front_shadow *sh)
+{
+	unsigned int i;
+
+	for (i = 0; i < sh->nr_grefs; i++)
+		gnttab_end_foreign_access(sh->grefs[i], sh->op == ALICE_OP_WRITE, 0UL);
+	for (i = 0; i < sh->nr_pgrants; i++)
+		list_add(&sh->pgrants[i]->node, &q->pgrants);
+	for (i = 0; i < sh->nr_indirect; i++)
+		gnttab_end_foreign_access(sh->indirect_grefs[i], 1,
+				sh->indirect_pages[i]);
+	kfree(sh->grefs);
+	kfree(sh->pgrants);
+	kfree(sh->user_pages);
+	sh->grefs = NULL;
+	sh->pgrants = NULL;
+	sh->user_pages = NULL;
+	sh->nr_grefs = 0;
+	sh->nr_pgrants = 0;
+	sh->nr_indirect = 0;
+}
+
+static void alice_front_load_fill(struct alice_front_queue *q);
+
+/* Consume all responses of this queue */
+static irqreturn_t alice_front_interrupt(int irq, void *dev_id)
+{
+	struct alice_front_queue *q = dev_id;
+	struct alice_front_shadow *sh;
+	struct as_response *rsp;
+	RING_IDX rc, rp;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	bool done = false;
+	u64 lat;
+	int more_to_do;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->nr_irqs++;
+	do {
+		rc = q->ring.rsp_cons;
+		rp = q->ring.sring->rsp_prod;
+		rmb(); /* Ensure we see responses up to rp */
+
+		for (; rc != rp; rc++) {
+			rsp = RING_GET_RESPONSE(&q->ring, rc);
+			pr_debug("DomU: queue %u id %llu status %d hi = %d\n",
+					q->id, rsp->id, rsp->status, rsp->hi);
+			q->nr_received++;
+
+			if (rsp->id >= RING_SIZE(&q->ring))
+				continue;
+			sh = &q->shadow[rsp->id];
+			lat = ktime_to_ns(ktime_sub(now, sh->sent));
+			q->lat_sum_ns += lat;
+			q->lat_max_ns = max(q->lat_max_ns, lat);
+			if (sh->nr_grefs || sh->nr_pgrants || sh->nr_indirect) {
+				/* Up to a megabyte of read data to copy, not here */
+				sh->ok = rsp->status == ALICE_RSP_OKAY;
+				sh->next_free = q->shadow_done;
+				q->shadow_done = rsp->id;
+				q->nr_done++;
+				done = true;
+				continue;
+			}
+			sh->next_free = q->shadow_free;
+			q->shadow_free = rsp->id;
+		}
+		q->ring.rsp_cons = rc;
+
+		RING_FINAL_CHECK_FOR_RESPONSES(&q->ring, more_to_do);
+	} while (more_to_do);
+	if (READ_ONCE(q->info->load_running))
+		alice_front_load_fill(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (done)
+		schedule_work(&q->done_work);
+	else if (bulk_ms)
+		wake_up(&q->info->bulk_wait);
+
+	return IRQ_HANDLED;
+}
+
+/* Finish data requests answered since last run. Read data is copied out
+ * of persistent grants without the lock, the shadow is ours till freed */
+static void alice_front_done_work(struct work_struct *work)
+{
+	struct alice_front_queue *q =
+		container_of(work, struct alice_front_queue, done_work);
+	struct alice_front_shadow *sh;
+	unsigned long flags;
+	unsigned int id, next;
+
+	spin_lock_irqsave(&q->lock, flags);
+	id = q->shadow_done;
+	q->shadow_done = RING_SIZE(&q->ring);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	for (; id < RING_SIZE(&q->ring); id = next) {
+		sh = &q->shadow[id];
+		next = sh->next_free;
+		if (sh->ok && sh->op == ALICE_OP_READ)
+			alice_front_copy_back(sh);
+
+		spin_lock_irqsave(&q->lock, flags);
+		alice_front_end_shadow(q, sh);
+		sh->next_free = q->shadow_free;
+		q->shadow_free = id;
+		q->nr_done--;
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	wake_up(&q->info->bulk_wait);
+}
+
+/* Take a free ring slot and shadow, lock held */
+static struct as_request *alice_front_get_request(struct alice_front_queue *q,
+		struct alice_front_shadow **sh)
+{
+	struct as_request *req;
+	unsigned int id = q->shadow_free;
+
+	if (RING_FULL(&q->ring) || id >= RING_SIZE(&q->ring))
+		return NULL;
+	q->shadow_free = q->shadow[id].next_free;
+	*sh = &q->shadow[id];
+	(*sh)->sent = ktime_get();
+
+	req = RING_GET_REQUEST(&q->ring, q->ring.req_prod_pvt);
+	req->id = id;
+	q->ring.req_prod_pvt++;
+	return req;
+}
+
+/* Publish queued requests and kick backend if it waits, lock held */
+static void alice_front_flush(struct alice_front_queue *q)
+{
+	int notify;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q->ring, notify);
+	if (notify)
+		notify_remote_via_irq(q->irq);
+}
+
+/* Put a request on a queue and kick backend if it waits */
+static int alice_front_send(struct alice_front_queue *q, int hello)
+{
+	struct alice_front_shadow *sh;
+	struct as_request *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	req = alice_front_get_request(q, &sh);
+	if (!req) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		return -EBUSY;
+	}
+	sh->op = ALICE_OP_HELLO;
+	req->operation = ALICE_OP_HELLO;
+	req->nr_segments = 0;
+	req->hello = hello;
+	alice_front_flush(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return 0;
+}
+
+/* Keep load_depth hellos in flight, lock held */
+static void alice_front_load_fill(struct alice_front_queue *q)
+{
+	struct alice_front_shadow *sh;
+	struct as_request *req;
+
+	while (q->ring.req_prod_pvt - q->ring.rsp_cons < load_depth) {
+		req = alice_front_get_request(q, &sh);
+		if (!req)
+			break;
+		sh->op = ALICE_OP_HELLO;
+		req->operation = ALICE_OP_HELLO;
+		req->nr_segments = 0;
+		req->hello = 233;
+	}
+	alice_front_flush(q);
+}
+
+/* Start load_ms of hellos on every queue, stats start over */
+static void alice_front_load_start(struct alice_front_info *info)
+{
+	struct alice_front_queue *q;
+	unsigned long flags;
+	unsigned int i;
+
+	if (load_ms == 0 || load_depth == 0 || info->load_running)
+		return;
+
+	info->load_start = ktime_get();
+	WRITE_ONCE(info->load_running, true);
+	for (i = 0; i < info->nr_queues; i++) {
+		q = &info->queues[i];
+		spin_lock_irqsave(&q->lock, flags);
+		q->nr_received = 0;
+		q->nr_irqs = 0;
+		q->lat_sum_ns = 0;
+		q->lat_max_ns = 0;
+		alice_front_load_fill(q);
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	schedule_delayed_work(&info->load_work, msecs_to_jiffies(load_ms));
+}
+
+/* Stop load and tell what interrupts and latency it cost */
+static void alice_front_load_work(struct work_struct *work)
+{
+	struct alice_front_info *info = container_of(to_delayed_work(work),
+			struct alice_front_info, load_work);
+	unsigned long received = 0, irqs = 0;
+	u64 lat_sum = 0, lat_max = 0, us;
+	struct alice_front_queue *q;
+	unsigned long flags;
+	unsigned int i;
+
+	WRITE_ONCE(info->load_running, false);
+	us = ktime_us_delta(ktime_get(), info->load_start);
+	for (i = 0; i < info->nr_queues; i++) {
+		q = &info->queues[i];
+		spin_lock_irqsave(&q->lock, flags);
+		received += q->nr_received;
+		irqs += q->nr_irqs;
+		lat_sum += q->lat_sum_ns;
+		lat_max = max(lat_max, q->lat_max_ns);
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	if (us == 0 || received == 0)
+		return;
+
+	pr_info("DomU: load %llu us, %lu responses, %llu interrupts/s, "
+			"%lu responses each\n", us, received,
+			div64_u64((u64)irqs * USEC_PER_SEC, us),
+			irqs ? received / irqs : 0);
+	pr_info("DomU: latency avg %llu ns, max %llu ns, moderation %u us, "
+			"%u responses%s\n", div64_u64(lat_sum, received), lat_max,
+			intr_moderation_us, intr_moderation_rsps,
+			intr_moderation_us && intr_moderation_adaptive ?
+			", adaptive" : "");
+}
+
+/* Put segment list on indirect pages and grant them, readonly */
+static int alice_front_setup_indirect(struct alice_front_queue *q,
+		struct alice_front_shadow *sh, struct alice_seg *segs,
+		unsigned int nr_segs)
+{
+	domid_t domid = q->info->dev->otherend_id;
+	struct alice_seg *ind;
+	unsigned int i, n;
+	int ref;
+
+	sh->nr_indirect = 0;
+	for (i = 0; i < nr_segs; i += ALICE_SEGS_PER_INDIRECT) {
+		ind = (struct alice_seg *)get_zeroed_page(GFP_KERNEL);
+		if (!ind)
+			return -ENOMEM;
+		n = min_t(unsigned int, nr_segs - i, ALICE_SEGS_PER_INDIRECT);
+		memcpy(ind, &segs[i], n * sizeof(*ind));
+
+		ref = gnttab_grant_foreign_access(domid, virt_to_gfn(ind), 1);
+		if (ref < 0) {
+			free_page((unsigned long)ind);
+			return ref;
+		}
+		sh->indirect_grefs[sh->nr_indirect] = ref;
+		sh->indirect_pages[sh->nr_indirect++] = (unsigned long)ind;
+	}
+	return 0;
+}
+
+/* Hand len bytes in pages to backend without copying them through ring.
+ * Pages are granted per request and revoked when response arrives, or
+ * copied to/from persistent grants if backend keeps them mapped */
+static int alice_front_submit(struct alice_front_queue *q, uint8_t op,
+		struct page **pages, unsigned int nr_pages, unsigned int len,
+		int hello)
+{
+	domid_t domid = q->info->dev->otherend_id;
+	struct alice_front_shadow tmp = { .op = op, .len = len }, *sh;
+	struct alice_front_pgrant *pg;
+	struct alice_seg *segs;
+	struct as_request *req;
+	unsigned long flags;
+	unsigned int i;
+	int ref, err = 0;
+
+	if (nr_pages == 0 || nr_pages > q->info->max_segs)
+		return -E2BIG;
+
+	segs = kcalloc(nr_pages, sizeof(*segs), GFP_KERNEL);
+	if (q->info->persistent) {
+		tmp.pgrants = kcalloc(nr_pages, sizeof(*tmp.pgrants), GFP_KERNEL);
+		tmp.user_pages = kmemdup(pages, nr_pages * sizeof(*pages), GFP_KERNEL);
+	} else {
+		tmp.grefs = kcalloc(nr_pages, sizeof(*tmp.grefs), GFP_KERNEL);
+	}
+	if (!segs || (q->info->persistent ? !tmp.pgrants || !tmp.user_pages :
+				!tmp.grefs)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		segs[i].offset = 0;
+		segs[i].len = min_t(unsigned int, len, PAGE_SIZE);
+		len -= segs[i].len;
+
+		if (q->info->persistent) {
+			pg = alice_front_get_pgrant(q);
+			if (!pg) {
+				err = -ENOMEM;
+				goto out;
+			}
+			tmp.pgrants[tmp.nr_pgrants++] = pg;
+			if (op == ALICE_OP_WRITE)
+				memcpy(page_address(pg->page), page_address(pages[i]),
+						segs[i].len);
+			segs[i].gref = pg->gref;
+			continue;
+		}
+
+		ref = gnttab_grant_foreign_access(domid, xen_page_to_gfn(pages[i]),
+				op == ALICE_OP_WRITE);
+		if (ref < 0) {
+			err = ref;
+			goto out;
+		}
+		tmp.grefs[tmp.nr_grefs++] = ref;
+		segs[i].gref = ref;
+	}
+
+	if (nr_pages > ALICE_MAX_SEGS) {
+		err = alice_front_setup_indirect(q, &tmp, segs, nr_pages);
+		if (err)
+			goto out;
+	}
+
+	spin_lock_irqsave(&q->lock, flags);
+	req = alice_front_get_request(q, &sh);
+	if (!req) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		err = -EBUSY;
+		goto out;
+	}
+	/* Keep the send time get_request stamped */
+	tmp.sent = sh->sent;
+	*sh = tmp;
+	req->nr_segments = nr_pages;
+	req->hello = hello;
+	if (tmp.nr_indirect) {
+		req->operation = ALICE_OP_INDIRECT;
+		req->indirect_op = op;
+		memcpy(req->u.indirect_grefs, tmp.indirect_grefs,
+				sizeof(req->u.indirect_grefs));
+	} else {
+		req->operation = op;
+		memcpy(req->u.seg, segs, nr_pages * sizeof(*segs));
+	}
+	alice_front_flush(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	kfree(segs);
+	return 0;
+
+out:
+	spin_lock_irqsave(&q->lock, flags);
+	alice_front_end_shadow(q, &tmp);
+	spin_unlock_irqrestore(&q->lock, flags);
+	kfree(segs);
+	return err;
+}
+
+static void alice_front_destroy_queue(struct alice_front_queue *q)
+{
+	unsigned int i;
+
+	if (q->irq > 0) {
+		irq_set_affinity_hint(q->irq, NULL);
+		unbind_from_irqhandler(q->irq, q);
+		q->irq = 0;
+	}
+	if (q->shadow) {
+		cancel_work_sync(&q->done_work);
+		for (i = 0; i < RING_SIZE(&q->ring); i++)
+			alice_front_end_shadow(q, &q->shadow[i]);
+		kfree(q->shadow);
+		q->shadow = NULL;
+	}
+	alice_front_free_pgrants(q);
+	if (!q->ring.sring)
+		return;
+
+	/* Each page is freed once backend unmaps it, which may be later */
+	for (i = 0; i < (1U << q->info->ring_order); i++)
+		gnttab_end_foreign_access(q->ring_ref[i], 0,
+				(unsigned long)q->ring.sring + i * PAGE_SIZE);
+	q->ring.sring = NULL;
+}
+
+/* Keep ring pages, their grants, event channel and persistent grants of
+ * a queue, but start the ring over. Requests in flight are dropped, the
+ * backend that took them is gone. Backend binds the same event channel
+ * again, it went back to unbound when backend closed its end */
+static void alice_front_reset_queue(struct alice_front_queue *q)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	cancel_work_sync(&q->done_work);
+	spin_lock_irqsave(&q->lock, flags);
+	for (i = 0; i < RING_SIZE(&q->ring); i++) {
+		alice_front_end_shadow(q, &q->shadow[i]);
+		q->shadow[i].next_free = i + 1;
+	}
+	q->shadow_free = 0;
+	q->shadow_done = RING_SIZE(&q->ring);
+	q->nr_done = 0;
+	SHARED_RING_INIT(q->ring.sring);
+	FRONT_RING_INIT(&q->ring, q->ring.sring, PAGE_SIZE << q->info->ring_order);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Alloc ring pages of one queue, grant them and bind an event channel */
+static int alice_front_setup_queue(struct alice_front_queue *q)
+{
+	struct xenbus_device *dev = q->info->dev;
+	unsigned int order = q->info->ring_order;
+	struct as_sring *sring;
+	unsigned int i;
+	int err;
+
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->pgrants);
+	sring = (struct as_sring *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, order);
+	if (!sring)
+		return -ENOMEM;
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&q->ring, sring, PAGE_SIZE << order);
+
+	/* One shadow per ring slot, chained as free list */
+	q->shadow = kcalloc(RING_SIZE(&q->ring), sizeof(*q->shadow), GFP_KERNEL);
+	if (!q->shadow) {
+		free_pages((unsigned long)sring, order);
+		q->ring.sring = NULL;
+		return -ENOMEM;
+	}
+	for (i = 0; i < RING_SIZE(&q->ring); i++)
+		q->shadow[i].next_free = i + 1;
+	q->shadow_free = 0;
+	q->shadow_done = RING_SIZE(&q->ring);
+	q->nr_done = 0;
+	INIT_WORK(&q->done_work, alice_front_done_work);
+
+	err = xenbus_grant_ring(dev, sring, 1 << order, q->ring_ref);
+	if (err < 0) {
+		free_pages((unsigned long)sring, order);
+		q->ring.sring = NULL;
+		return err;
+	}
+	/* Ring pages are freed one by one as their grants end */
+	split_page(virt_to_page(sring), order);
+
+	err = xenbus_alloc_evtchn(dev, &q->evtchn);
+	if (err)
+		return err;
+
+	snprintf(q->name, sizeof(q->name), "alice_dev-q%u", q->id);
+	err = bind_evtchn_to_irqhandler(q->evtchn, alice_front_interrupt, 0,
+			q->name, q);
+	if (err < 0) {
+		xenbus_free_evtchn(dev, q->evtchn);
+		return err;
+	}
+	q->irq = err;
+	irq_set_affinity_hint(q->irq, cpumask_of(cpumask_local_spread(q->id,
+					dev_to_node(&dev->dev))));
+	return 0;
+}
+
+/* Publish ring refs and event channel of one queue */
+static int alice_front_write_queue(struct alice_front_queue *q,
+		struct xenbus_transaction xbt)
+{
+	struct xenbus_device *dev = q->info->dev;
+	char key[32];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < (1U << q->info->ring_order); i++) {
+		snprintf(key, sizeof(key), "queue-%u/ring-ref%u", q->id, i);
+		err = xenbus_printf(xbt, dev->nodename, key, "%u", q->ring_ref[i]);
+		if (err)
+			return err;
+	}
+	snprintf(key, sizeof(key), "queue-%u/event-channel", q->id);
+	return xenbus_printf(xbt, dev->nodename, key, "%u", q->evtchn);
+}
+
+/* Publish all queues and their layout in one transaction, so backend
+ * never sees half of them. With fast_negotiate state Connected goes in
+ * too, and backend connects on this single update */
+static int alice_front_publish(struct alice_front_info *info)
+{
+	struct xenbus_device *dev = info->dev;
+	struct xenbus_transaction xbt;
+	unsigned int i, mod_us;
+	int err;
+
+again:
+	err = xenbus_transaction_start(&xbt);
+	if (err)
+		return err;
+
+	for (i = 0; i < info->nr_queues && !err; i++)
+		err = alice_front_write_queue(&info->queues[i], xbt);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "multi-queue-num-queues",
+				"%u", info->nr_queues);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "feature-persistent",
+				"%u", info->persistent);
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "ring-page-order",
+				"%u", info->ring_order);
+	/* Written even when off, so a reconnect drops what we asked before.
+	 * Backend without it sends an event for every response it may */
+	mod_us = intr_moderation_us;
+	if (!xenbus_read_unsigned(dev->otherend, "feature-intr-moderation", 0))
+		mod_us = 0;
+	if (!err)
+		err = xenbus_printf(xbt, dev->nodename, "intr-moderation-usecs",
+				"%u", mod_us);
+	if (!err && mod_us) {
+		err = xenbus_printf(xbt, dev->nodename, "intr-moderation-rsps",
+				"%u", intr_moderation_rsps);
+		if (!err)
+			err = xenbus_printf(xbt, dev->nodename,
+					"intr-moderation-adaptive", "%u",
+					intr_moderation_adaptive);
+	}
+	if (!err && fast_negotiate)
+		err = xenbus_printf(xbt, dev->nodename, "state", "%d",
+				XenbusStateConnected);
+	if (err) {
+		xenbus_transaction_end(xbt, 1);
+		return err;
+	}
+
+	err = xenbus_transaction_end(xbt, 0);
+	if (err == -EAGAIN)
+		goto again;
+	if (!err && fast_negotiate)
+		dev->state = XenbusStateConnected;
+	return err;
+}
+
+static void alice_front_destroy_queues(struct alice_front_info *info)
+{
+	unsigned int i;
+
+	cancel_delayed_work_sync(&info->load_work);
+	WRITE_ONCE(info->load_running, false);
+	WRITE_ONCE(info->bulk_stop, true);
+	wake_up(&info->bulk_wait);
+	cancel_work_sync(&info->bulk_work);
+	info->bulk_stop = false;
+	if (!info->queues)
+		return;
+	for (i = 0; i < info->nr_queues; i++)
+		alice_front_destroy_queue(&info->queues[i]);
+	kfree(info->queues);
+	info->queues = NULL;
+	info->nr_queues = 0;
+}
+
+static void alice_front_bulk_work(struct work_struct *work);
 
 /* The function is called on activation of the device */
 static int alice_front_probe(struct xenbus_device *dev,
               const struct xenbus_device_id *id)
 {
+	struct alice_front_info *info;
+
 	pr_info("DomU: Probe called.\n");
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	info->dev = dev;
+	info->bringup_start = ktime_get();
+	INIT_DELAYED_WORK(&info->load_work, alice_front_load_work);
+	INIT_WORK(&info->bulk_work, alice_front_bulk_work);
+	init_waitqueue_head(&info->bulk_wait);
+	dev_set_drvdata(&dev->dev, info);
 	return 0;
 }
 
-/* This is where we set up xenstore files and event channels */
+/* Nothing in flight on a queue, so the last request got its response
+ * and was finished */
+static bool alice_front_idle(struct alice_front_queue *q)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&q->lock, flags);
+	idle = q->ring.rsp_cons == q->ring.req_prod_pvt && q->nr_done == 0;
+	spin_unlock_irqrestore(&q->lock, flags);
+	return idle || READ_ONCE(q->info->bulk_stop);
+}
+
+/* Read all bulk pages back through queue 0, backend fills them with
+ * hello, and check every byte of it came */
+static int alice_front_bulk_read(struct alice_front_info *info)
+{
+	struct alice_front_queue *q = &info->queues[0];
+	unsigned int nr = info->nr_bulk_pages, i, j;
+	uint8_t *data;
+	int err;
+
+	for (i = 0; i < nr; i++)
+		memset(page_address(info->bulk_pages[i]), 0, PAGE_SIZE);
+	err = alice_front_submit(q, ALICE_OP_READ, info->bulk_pages, nr,
+			nr * PAGE_SIZE, 0x5a);
+	if (!err && !wait_event_timeout(info->bulk_wait, alice_front_idle(q), HZ))
+		err = -ETIMEDOUT;
+	for (i = 0; i < nr && !err; i++) {
+		data = page_address(info->bulk_pages[i]);
+		for (j = 0; j < PAGE_SIZE; j++) {
+			if (data[j] != 0x5a) {
+				err = -EIO;
+				break;
+			}
+		}
+	}
+	return err;
+}
+
+/* Write 1, 2, 4... pages and last all bulk_kb through queue 0, each size
+ * for bulk_ms, and tell throughput. One write is in flight at a time, so
+ * what a request costs besides its data shows at small sizes. Then read
+ * it all back */
+static void alice_front_bulk_work(struct work_struct *work)
+{
+	struct alice_front_info *info = container_of(work,
+			struct alice_front_info, bulk_work);
+	struct alice_front_queue *q = &info->queues[0];
+	unsigned int max = info->nr_bulk_pages, nr, n;
+	ktime_t start, end;
+	u64 us;
+	int err = 0;
+
+	for (nr = 1; nr <= max && !err;
+			nr = nr < max ? min(nr * 2, max) : nr + 1) {
+		start = ktime_get();
+		end = ktime_add(start, ms_to_ktime(bulk_ms));
+		for (n = 0; !err && ktime_before(ktime_get(), end); n++) {
+			err = alice_front_submit(q, ALICE_OP_WRITE, info->bulk_pages,
+					nr, nr * PAGE_SIZE, 0);
+			if (!err && !wait_event_timeout(info->bulk_wait,
+						alice_front_idle(q), HZ))
+				err = -ETIMEDOUT;
+			if (READ_ONCE(info->bulk_stop))
+				return;
+		}
+		us = ktime_us_delta(ktime_get(), start);
+		if (!err && us)
+			pr_info("DomU: bulk %u KB, %u writes, %llu MB/s\n",
+					(nr << PAGE_SHIFT) / 1024, n,
+					div64_u64((u64)n * nr * PAGE_SIZE, us));
+	}
+	if (!err) {
+		err = alice_front_bulk_read(info);
+		if (!err)
+			pr_info("DomU: bulk read back %u KB\n",
+					(max << PAGE_SHIFT) / 1024);
+	}
+	if (err)
+		pr_info("DomU: bulk stopped, err = %d\n", err);
+	else
+		pr_info("DomU: bulk done\n");
+}
+
+/* Write bulk_kb of data to backend through queue 0 */
+static void alice_front_bulk_demo(struct alice_front_info *info)
+{
+	unsigned int nr = DIV_ROUND_UP(bulk_kb * 1024, PAGE_SIZE);
+	unsigned int i;
+	int err;
+
+	if (nr == 0 || info->bulk_pages || info->nr_queues == 0)
+		return;
+
+	info->bulk_pages = kcalloc(nr, sizeof(*info->bulk_pages), GFP_KERNEL);
+	if (!info->bulk_pages)
+		return;
+	for (info->nr_bulk_pages = 0; info->nr_bulk_pages < nr;
+			info->nr_bulk_pages++) {
+		i = info->nr_bulk_pages;
+		info->bulk_pages[i] = alloc_page(GFP_KERNEL);
+		if (!info->bulk_pages[i])
+			return;
+		memset(page_address(info->bulk_pages[i]), 1, PAGE_SIZE);
+	}
+
+	/* It sleeps on every write for long, keep it off the per-cpu pool
+	 * that runs done_work */
+	if (bulk_ms) {
+		queue_work(system_unbound_wq, &info->bulk_work);
+		return;
+	}
+	err = alice_front_submit(&info->queues[0], ALICE_OP_WRITE,
+			info->bulk_pages, nr, bulk_kb * 1024, 0);
+	pr_info("DomU: Submit %u KB in %u pages, err = %d\n", bulk_kb, nr, err);
+}
+
+/* The function is called when the device goes away */
+static int alice_front_remove(struct xenbus_device *dev)
+{
+	struct alice_front_info *info = dev_get_drvdata(&dev->dev);
+	unsigned int i;
+
+	alice_front_destroy_queues(info);
+	for (i = 0; i < info->nr_bulk_pages; i++)
+		__free_page(info->bulk_pages[i]);
+	kfree(info->bulk_pages);
+	dev_set_drvdata(&dev->dev, NULL);
+	kfree(info);
+	return 0;
+}
+
+/* Back from migration. Grants and event channels don't survive it, so
+ * queues are set up again from scratch on connect */
+static int alice_front_resume(struct xenbus_device *dev)
+{
+	struct alice_front_info *info = dev_get_drvdata(&dev->dev);
+
+	pr_info("DomU: Resume\n");
+	alice_front_destroy_queues(info);
+	info->bringup_start = ktime_get();
+	return 0;
+}
+
+/* This is where we set up xenstore files and event channels.
+ * Queues and ring order are cut to what backend offers */
 static int alice_front_connect(struct xenbus_device *dev)
 {
+	struct alice_front_info *info = dev_get_drvdata(&dev->dev);
+	unsigned int max_queues, max_order, nr_queues, order, i;
+	int err;
+
 	pr_info("DomU: Connecting the frontend now\n");
+
+	max_queues = xenbus_read_unsigned(dev->otherend, "multi-queue-max-queues", 1);
+	max_order = xenbus_read_unsigned(dev->otherend, "max-ring-page-order", 0);
+	info->max_segs = min_t(unsigned int, ALICE_MAX_INDIRECT_SEGS,
+			xenbus_read_unsigned(dev->otherend,
+				"feature-max-indirect-segments", 0));
+	if (info->max_segs < ALICE_MAX_SEGS)
+		info->max_segs = ALICE_MAX_SEGS;
+	info->persistent = persistent &&
+		xenbus_read_unsigned(dev->otherend, "feature-persistent", 0);
+
+	nr_queues = min(num_queues ? num_queues : num_online_cpus(), max_queues);
+	order = min3(ring_order, max_order,
+			(unsigned int)XENBUS_MAX_RING_GRANT_ORDER);
+
+	/* Reconnecting with the same layout, only start rings over */
+	if (info->queues && info->nr_queues == nr_queues &&
+	    info->ring_order == order) {
+		for (i = 0; i < info->nr_queues; i++)
+			alice_front_reset_queue(&info->queues[i]);
+		goto publish;
+	}
+
+	alice_front_destroy_queues(info);
+	info->nr_queues = nr_queues;
+	info->ring_order = order;
+	info->queues = kcalloc(info->nr_queues, sizeof(*info->queues), GFP_KERNEL);
+	if (!info->queues)
+		return -ENOMEM;
+
+	for (i = 0; i < info->nr_queues; i++) {
+		info->queues[i].info = info;
+		info->queues[i].id = i;
+		err = alice_front_setup_queue(&info->queues[i]);
+		if (err) {
+			xenbus_dev_fatal(dev, err, "setting up queue %u", i);
+			goto fail;
+		}
+	}
+
+publish:
+	err = alice_front_publish(info);
+	if (err) {
+		xenbus_dev_fatal(dev, err, "writing queue layout");
+		goto fail;
+	}
+
+	pr_info("DomU: %u queues, ring order %u\n", info->nr_queues, info->ring_order);
 	return 0;
+
+fail:
+	alice_front_destroy_queues(info);
+	return err;
 }
 
 /* The function is called on a state change of the backend driver */
 static void alice_front_otherend_changed(struct xenbus_device *dev,
 			    enum xenbus_state backend_state)
 {
+	struct alice_front_info *info = dev_get_drvdata(&dev->dev);
+	unsigned int i;
+
 	switch (backend_state)
 	{
 		case XenbusStateInitialising:
@@ -46,23 +1038,47 @@ static void alice_front_otherend_changed(struct xenbus_device *dev,
 			break;
 
 		case XenbusStateInitWait:
-			if (dev->state != XenbusStateInitialising)
+			/* Closed too, backend came back on its own, e.g. reloaded */
+			if (dev->state != XenbusStateInitialising &&
+			    dev->state != XenbusStateClosed)
 				break;
+			if (dev->state == XenbusStateClosed)
+				info->bringup_start = ktime_get();
             /* Connect */
 			if (alice_front_connect(dev) != 0)
 				break;
 
-			xenbus_switch_state(dev, XenbusStateConnected);
+			/* Already done with rings when negotiating fast */
+			if (dev->state != XenbusStateConnected)
+				xenbus_switch_state(dev, XenbusStateConnected);
 
 			break;
 
 		case XenbusStateConnected:
-			pr_info("DomU: Other side says it is connected as well.\n");
+			pr_info("DomU: Other side says it is connected as well, "
+					"bring-up took %lld us\n",
+					ktime_us_delta(ktime_get(), info->bringup_start));
+			/* Say hello on every queue */
+			for (i = 0; i < info->nr_queues; i++)
+				alice_front_send(&info->queues[i], 233 + i);
+			alice_front_bulk_demo(info);
+			alice_front_load_start(info);
 			break;
 
 		case XenbusStateClosed:
-			if (dev->state == XenbusStateClosed)
+			/* Reconnect asked for already, told again of Closed
+			 * as a watch fires on any node of backend */
+			if (dev->state == XenbusStateInitialising)
+				break;
+			/* Backend stays, so reconnect. Queues are kept and
+			 * only started over */
+			if (dev->state == XenbusStateClosed) {
+				if (xenbus_read_unsigned(dev->otherend, "online", 0)) {
+					info->bringup_start = ktime_get();
+					xenbus_switch_state(dev, XenbusStateInitialising);
+				}
 				break;
+			}
 			/* Missed the backend's CLOSING state -- fallthrough */
 		case XenbusStateClosing:
 			xenbus_frontend_closed(dev);
@@ -80,6 +1096,8 @@ static const struct xenbus_device_id alice_front_ids[] = {
 static struct xenbus_driver alice_front_driver = {
 	.ids  = alice_front_ids,
 	.probe = alice_front_probe,
+	.remove = alice_front_remove,
+	.resume = alice_front_resume,
     .otherend_changed = alice_front_otherend_changed,
 };
 
@@ -0,0 +1,27 @@
+/* Interface of alice_op hypercall, shared by Xen and guest
+ *
+ * HYPERVISOR_alice_op(ops, count) does count ops in one trap, like a
+ * multicall. Each op gets its own status, the call itself fails only if
+ * ops can't be read or written back
+ */
+#ifndef __ALICE_OP_H__
+#define __ALICE_OP_H__
+
+#define __HYPERVISOR_alice_op   39
+
+#define ALICEOP_nop     0   /* Nothing, cost of the trap itself */
+#define ALICEOP_print   1   /* Print arg in Xen console */
+#define ALICEOP_echo    2   /* result = arg */
+
+struct alice_op {
+    uint32_t cmd;       /* ALICEOP_* */
+    int32_t status;     /* Out: 0 or -errno */
+    uint64_t arg;
+    uint64_t result;    /* Out */
+};
+typedef struct alice_op alice_op_t;
+#ifdef __XEN__
+DEFINE_XEN_GUEST_HANDLE(alice_op_t);
+#endif
+
+#endif
@@ -1,20 +1,122 @@
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 
 #include <xen/interface/xen.h>
 #include <asm/xen/hypercall.h>
-/*
-#define __HYPERVISOR_alice_op 39
+
+#include "alice_op.h"
+
+/* alice_op takes an array of ops now, see alice_op.h. Named apart from
+ * HYPERVISOR_alice_op(void) of patched kernel headers */
 static inline long
-HYPERVISOR_alice_op(void)
+HYPERVISOR_alice_op_batch(struct alice_op *ops, unsigned int count)
+{
+	return _hypercall2(long, alice_op, ops, count);
+}
+
+/* Ops are queued here and done by one hypercall on flush */
+#define ALICE_MAX_BATCH 64
+
+static struct alice_op batch[ALICE_MAX_BATCH];
+static unsigned int nr_batched;
+
+static int nr_ops = 1024;
+static int batch_size = ALICE_MAX_BATCH;
+module_param(nr_ops, int, 0444);
+module_param(batch_size, int, 0444);
+
+/* Do all queued ops, return how many of them failed */
+static int alice_op_flush(void)
+{
+	unsigned int i;
+	int failed = 0;
+	long rc;
+
+	if (nr_batched == 0)
+		return 0;
+
+	rc = HYPERVISOR_alice_op_batch(batch, nr_batched);
+	for (i = 0; i < nr_batched; i++) {
+		if (rc == 0 && batch[i].status == 0)
+			continue;
+		failed++;
+		pr_debug("alice_op %u cmd %u failed: %ld/%d\n",
+				i, batch[i].cmd, rc, batch[i].status);
+	}
+	nr_batched = 0;
+	return failed;
+}
+
+/* Queue an op, flush first if batch is full */
+static int alice_op_queue(uint32_t cmd, uint64_t arg)
 {
-	return _hypercall0(long, alice_op);
+	int failed = 0;
+
+	if (nr_batched == min_t(unsigned int, batch_size, ALICE_MAX_BATCH))
+		failed = alice_op_flush();
+
+	batch[nr_batched].cmd = cmd;
+	batch[nr_batched].status = 0;
+	batch[nr_batched].arg = arg;
+	nr_batched++;
+	return failed;
+}
+
+/* Time nr_ops nops done n per hypercall */
+static void time_ops(unsigned int n)
+{
+	int saved = batch_size, failed = 0, i;
+	ktime_t start;
+	s64 ns;
+
+	batch_size = n;
+	start = ktime_get();
+	for (i = 0; i < nr_ops; i++)
+		failed += alice_op_queue(ALICEOP_nop, 0);
+	failed += alice_op_flush();
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	batch_size = saved;
+
+	printk("alice_op: %d ops by %u per call, %lld ns per op, %d failed\n",
+			nr_ops, n, nr_ops ? ns / nr_ops : 0, failed);
+}
+
+/* A bad op fails alone, with its own status, a bad array fails all */
+static void check_status(void)
+{
+	struct alice_op ops[ALICE_MAX_BATCH];
+	int i, wrong = 0;
+	long rc;
+
+	for (i = 0; i < ALICE_MAX_BATCH; i++) {
+		ops[i].cmd = i == 5 ? 0xbad : ALICEOP_echo;
+		ops[i].status = 1;
+		ops[i].arg = i;
+		ops[i].result = 0;
+	}
+	rc = HYPERVISOR_alice_op_batch(ops, ALICE_MAX_BATCH);
+	for (i = 0; i < ALICE_MAX_BATCH; i++)
+		if (i != 5 && (ops[i].status != 0 || ops[i].result != i))
+			wrong++;
+	printk("alice_op: %d echoes: %ld, %d wrong, bad cmd status %d\n",
+			ALICE_MAX_BATCH, rc, wrong, ops[5].status);
+	printk("alice_op: ops at NULL: %ld\n", HYPERVISOR_alice_op_batch(NULL, 1));
 }
-*/
 
 static int init_hypercall(void)
 {
-	HYPERVISOR_alice_op();	
+	if (batch_size < 1)
+		batch_size = 1;
+
+	alice_op_queue(ALICEOP_print, 0xa11ce);
+	alice_op_flush();
+	check_status();
+
+	/* One trap per op against one trap per batch */
+	time_ops(1);
+	time_ops(min_t(unsigned int, batch_size, ALICE_MAX_BATCH));
 	printk("test\n");
 	return 0;
 }
@@ -0,0 +1,59 @@
+/* Xen side of alice_op, as xen/common/alice_op.c
+ *
+ * Also needed in Xen tree:
+ * - alice_op.h as xen/include/public/alice_op.h
+ * - obj-y += alice_op.o in xen/common/Makefile
+ * - in xen/include/xen/hypercall.h
+ *   extern long do_alice_op(XEN_GUEST_HANDLE_PARAM(alice_op_t) uops,
+ *                           unsigned int count);
+ * - HYPERCALL(alice_op) in hypercall table of the arch, slot 39
+ */
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/guest_access.h>
+#include <xen/hypercall.h>
+#include <public/alice_op.h>
+
+long do_alice_op(XEN_GUEST_HANDLE_PARAM(alice_op_t) uops, unsigned int count)
+{
+    struct alice_op op;
+    unsigned int i;
+
+    if ( !guest_handle_okay(uops, count) )
+        return -EFAULT;
+
+    for ( i = 0; i < count; i++ )
+    {
+        /* Long batch must not hog the cpu, go on where we stopped */
+        if ( i && hypercall_preempt_check() )
+            return hypercall_create_continuation(__HYPERVISOR_alice_op,
+                                                 "hi", uops, count - i);
+
+        if ( unlikely(__copy_from_guest(&op, uops, 1)) )
+            return -EFAULT;
+
+        switch ( op.cmd )
+        {
+        case ALICEOP_nop:
+            op.status = 0;
+            break;
+        case ALICEOP_print:
+            printk("Alice: %"PRIx64"\n", op.arg);
+            op.status = 0;
+            break;
+        case ALICEOP_echo:
+            op.result = op.arg;
+            op.status = 0;
+            break;
+        default:
+            op.status = -ENOSYS;
+            break;
+        }
+
+        if ( unlikely(__copy_to_guest(uops, &op, 1)) )
+            return -EFAULT;
+        guest_handle_add_offset(uops, 1);
+    }
+
+    return 0;
+}
@@ -6,12 +6,18 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_dom0.ko gref=<value> domid=<domid>
+ * insmod alice_dom0.ko gref=<value>[,<value>...] domid=<domid>
  *
  * <value>  Taken from dmesg output in alice_domU when you insmod 
- *          alice_domU in domU.
+ *          alice_domU in domU. Several grefs separated by comma are
+ *          mapped by one hypercall into one contiguous area.
  * <domid>  domID of remote domU
  *
+ * Optional:
+ * batch=<n>  Refs per map and unmap hypercall, default 0 for all of
+ *            them in one. batch=1 shows what a hypercall per page costs,
+ *            time taken by each way is printed
+ *
  * This Module is running in dom0 to read info from domU
  */
 
@@ -19,72 +25,155 @@
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
 
 #include <xen/grant_table.h>
 #include <xen/interface/grant_table.h>
 #include <asm/xen/hypercall.h>
 
-struct gnttab_map_grant_ref ops;
-struct gnttab_unmap_grant_ref unmap_ops;
+/* Max pages we map in one batch */
+#define MAX_GREFS 256
+
+struct gnttab_map_grant_ref ops[MAX_GREFS];
+struct gnttab_unmap_grant_ref unmap_ops[MAX_GREFS];
 
 typedef struct info_t {
-    grant_ref_t gref;
+    grant_ref_t gref[MAX_GREFS];
+    int nr_grefs;
     int domid;  /* remote domID */
+    struct vm_struct *area;
+    int nr_mapped;
 } info_t;
 
 info_t info;
-int gref;
+int gref[MAX_GREFS];
+int nr_grefs;
 int domid;
+static int batch;
 
-module_param(gref, int, 0644);
+module_param_array(gref, int, &nr_grefs, 0644);
 module_param(domid, int, 0644);
+module_param(batch, int, 0644);
+
+/* Ops per hypercall, all of nr unless batch asks for fewer */
+static int batch_of(int nr)
+{
+    return batch > 0 && batch < nr ? batch : nr;
+}
+
+/* Unmap nr prepared pages, in one hypercall unless batch says else */
+static void unmap_pages(int nr)
+{
+    int i, n = batch_of(nr), calls = 0;
+    ktime_t start;
+
+    if ( nr == 0 )
+        return;
+
+    start = ktime_get();
+    for ( i = 0; i < nr; i += n, calls++ ) {
+        if ( HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_ops[i],
+                    min(n, nr - i)) ) {
+            pr_err("Alice: unmap shared pages failed\n");
+            return;
+        }
+    }
+    pr_info("Alice: unmapped %d pages in %lld ns by %d hypercalls\n",
+            nr, ktime_to_ns(ktime_sub(ktime_get(), start)), calls);
+
+    for ( i = 0; i < nr; i++ ) {
+        if ( unmap_ops[i].status )
+            pr_err("Alice: unmap %llx failed, status = %d\n",
+                    unmap_ops[i].host_addr, unmap_ops[i].status);
+    }
+    pr_info("Alice: unmap %d shared pages successfully\n", nr);
+}
 
 int init_alice(void)
 {
-    struct vm_struct *v_start;
-    info.gref = gref;
+    unsigned long addr;
+    ktime_t start;
+    int i, n, calls = 0;
+
+    info.nr_grefs = nr_grefs;
     info.domid = domid;
-    pr_info("Alice: init_module with gref = %d, domid = %d\n", info.gref, info.domid);
+    for ( i = 0; i < nr_grefs; i++ )
+        info.gref[i] = gref[i];
+    pr_info("Alice: init_module with %d grefs, domid = %d\n",
+            info.nr_grefs, info.domid);
+
+    if ( info.nr_grefs == 0 ) {
+        pr_err("Alice: no gref given\n");
+        return 0;
+    }
 
     /* Reserve a range of kernel address space, fill page table to map this range 
-     * This PAGE_SIZE is used for map granted page */
-    v_start = alloc_vm_area(PAGE_SIZE, NULL);
-    if ( v_start == 0 ) {
-        free_vm_area(v_start);
+     * All granted pages are mapped contiguously into this area */
+    info.area = alloc_vm_area(info.nr_grefs * PAGE_SIZE, NULL);
+    if ( info.area == 0 ) {
         pr_err("Alice: could not allocate page area\n");
         return 0;
     }
+    addr = (unsigned long)info.area->addr;
 
-    /* Init map ops */
-    gnttab_set_map_op(&ops, (unsigned long)v_start->addr, GNTMAP_host_map,
-            info.gref, info.domid);
-    if ( HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &ops, 1) ) {
-        pr_err("Alice: HYPERVISOR map grant ref failed\n");
-        return 0;
+    /* Init map ops, one per page */
+    for ( i = 0; i < info.nr_grefs; i++ )
+        gnttab_set_map_op(&ops[i], addr + i * PAGE_SIZE, GNTMAP_host_map,
+                info.gref[i], info.domid);
+
+    /* Map all of them by a single hypercall, or batch at a time. Ops
+     * of a call that failed as a whole are marked failed, those mapped
+     * by earlier calls are dropped below */
+    n = batch_of(info.nr_grefs);
+    start = ktime_get();
+    for ( i = 0; i < info.nr_grefs; i += n, calls++ ) {
+        if ( HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &ops[i],
+                    min(n, info.nr_grefs - i)) ) {
+            pr_err("Alice: HYPERVISOR map grant ref failed\n");
+            for ( ; i < info.nr_grefs; i++ )
+                ops[i].status = GNTST_general_error;
+            break;
+        }
+    }
+    pr_info("Alice: mapped %d pages in %lld ns by %d hypercalls\n",
+            info.nr_grefs, ktime_to_ns(ktime_sub(ktime_get(), start)), calls);
+
+    /* Each op has its own status, prepare unmap for those succeeded */
+    info.nr_mapped = 0;
+    for ( i = 0; i < info.nr_grefs; i++ ) {
+        if ( ops[i].status ) {
+            pr_err("Alice: HYPERVISOR map grant ref %d failed, status = %d\n",
+                    info.gref[i], ops[i].status);
+            continue;
+        }
+        gnttab_set_unmap_op(&unmap_ops[info.nr_mapped++], ops[i].host_addr,
+                GNTMAP_host_map, ops[i].handle);
     }
-    if ( ops.status ) {
-        pr_err("Alice: HYPERVISOR map grant ref failed, status = %d\n", ops.status);
+
+    /* A hole in the area is no use, drop all of them */
+    if ( info.nr_mapped != info.nr_grefs ) {
+        unmap_pages(info.nr_mapped);
+        free_vm_area(info.area);
+        info.area = NULL;
         return 0;
     }
-    pr_info("Alice: shared_page = %lx, handle = %x, status = %x\n",
-            (unsigned long)v_start->addr, ops.handle, ops.status);
 
-    pr_info("Alice: info from domU: %s\n", (char *)(v_start->addr));
+    pr_info("Alice: shared_pages = %lx, nr = %d, handle[0] = %x\n",
+            addr, info.nr_mapped, ops[0].handle);
 
-    /* Prepare for unmap */
-    unmap_ops.host_addr = (unsigned long)(v_start->addr);
-    unmap_ops.handle = ops.handle;
+    pr_info("Alice: info from domU: %s\n", (char *)(info.area->addr));
     return 0;
 }
 
 void exit_alice(void)
 {
     pr_info("Alice: cleanup_module\n");
-    if ( HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_ops, 1) ) {
-        pr_err("Alice: unmap shared page failed\n");
-    } else {
-        pr_info("Alice: unmap shared page successfully\n");
-    }
+    if ( info.area == NULL )
+        return;
+
+    /* Unmap all pages by a single hypercall */
+    unmap_pages(info.nr_mapped);
+    free_vm_area(info.area);
 }
 
 module_init(init_alice);
@@ -6,13 +6,19 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run this in domU first:
- * insmod alice_domU.ko
+ * insmod alice_domU.ko [nr_pages=<n>] [backend=<domid>]
+ *
+ * <n>      Pages granted up front in the share pool, default 16
+ * <domid>  Domain the pool is granted to, default dom0
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 #include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
 
 #include <asm/xen/page.h>
 
@@ -20,53 +26,210 @@
 #include <xen/grant_table.h>
 
 #define DOM0_ID 0
-unsigned long vpage;
-unsigned long mfn;
-int gref;
 
-static int init_alice(void)
+/* Share pool: pages granted once, handed out and recycled many times.
+ * Free entries are kept in a lock-free stack of indices. Head packs a
+ * tag in the high 32 bits so a pop racing with pop+push can't ABA. */
+#define POOL_NIL 0xffffffffU
+
+typedef struct alice_share {
+    unsigned long vpage;
+    grant_ref_t gref;
+    int idx;            /* index in pool, -1 if granted on the fly */
+} alice_share_t;
+
+typedef struct alice_pool {
+    alice_share_t *shares;
+    u32 *next;          /* next free index of each entry */
+    u64 head;           /* tag << 32 | index of first free entry */
+    int nr;
+    domid_t domid;
+    atomic_long_t hit;      /* served from pool */
+    atomic_long_t miss;     /* pool empty, granted a fresh page */
+    atomic_long_t exhaust;  /* pool empty and fresh grant failed */
+} alice_pool_t;
+
+static int nr_pages = 16;
+static int backend = DOM0_ID;
+module_param(nr_pages, int, 0444);
+module_param(backend, int, 0444);
+
+static alice_pool_t pool;
+
+static int pool_pop(alice_pool_t *p)
 {
-    /* Step 1: Get a page to be shared with dom0 */ 
-    pr_info("--------->Hello, This is Alice\n");
-    vpage = __get_free_pages(GFP_KERNEL, 1);
-    if ( vpage == 0 ) {
-        pr_err("Alice: Could not get free pages\n");
-        return 0;
-    }
-    pr_info("Alice: Get free page from kernel, virt: 0x%lx\n", vpage);
+    u64 old, new;
+    u32 idx;
+
+    do {
+        old = READ_ONCE(p->head);
+        idx = (u32)old;
+        if ( idx == POOL_NIL )
+            return -1;
+        new = ((old >> 32) + 1) << 32 | READ_ONCE(p->next[idx]);
+    } while ( cmpxchg64(&p->head, old, new) != old );
+
+    return idx;
+}
 
-    mfn = virt_to_mfn(vpage);
+static void pool_push(alice_pool_t *p, u32 idx)
+{
+    u64 old, new;
 
-    gref = gnttab_grant_foreign_access(DOM0_ID, mfn, 0);
+    do {
+        old = READ_ONCE(p->head);
+        WRITE_ONCE(p->next[idx], (u32)old);
+        new = ((old >> 32) + 1) << 32 | idx;
+    } while ( cmpxchg64(&p->head, old, new) != old );
+}
+
+/* Get a page and grant it, used to fill pool and on pool miss */
+static int grant_page(alice_share_t *s, domid_t domid, gfp_t gfp)
+{
+    int gref;
+
+    s->vpage = __get_free_page(gfp);
+    if ( s->vpage == 0 )
+        return -ENOMEM;
+
+    gref = gnttab_grant_foreign_access(domid, virt_to_mfn(s->vpage), 0);
     if ( gref < 0 ) {
-        pr_err("Alice: Could not grant foreign access");
-        return 0;
+        free_page(s->vpage);
+        return gref;
     }
+    s->gref = gref;
+    return 0;
+}
 
-    pr_info("Alice: Grant_Ref is %d, input this as alice_dom0.ko param\n", gref);
+/* end_foreign_access will free page */
+static void ungrant_page(alice_share_t *s)
+{
+    if ( gnttab_query_foreign_access(s->gref) != 0 )
+        pr_info("Alice: Someone is mapping gref %d now\n", s->gref);
+    gnttab_end_foreign_access(s->gref, 0, s->vpage);
+}
 
-    /* Step 2: Write some contents */
-    strcpy((char *)vpage, "Hello, by Alice in domU\n");
+static int alice_pool_init(alice_pool_t *p, int nr, domid_t domid)
+{
+    int i, err;
+
+    p->shares = kcalloc(nr, sizeof(*p->shares), GFP_KERNEL);
+    p->next = kcalloc(nr, sizeof(*p->next), GFP_KERNEL);
+    if ( !p->shares || !p->next ) {
+        kfree(p->shares);
+        kfree(p->next);
+        return -ENOMEM;
+    }
+    p->domid = domid;
+    p->head = POOL_NIL;
+    atomic_long_set(&p->hit, 0);
+    atomic_long_set(&p->miss, 0);
+    atomic_long_set(&p->exhaust, 0);
+
+    /* Grant all pages up front */
+    for ( p->nr = 0; p->nr < nr; p->nr++ ) {
+        err = grant_page(&p->shares[p->nr], domid, GFP_KERNEL);
+        if ( err ) {
+            for ( i = 0; i < p->nr; i++ )
+                ungrant_page(&p->shares[i]);
+            kfree(p->shares);
+            kfree(p->next);
+            return err;
+        }
+        p->shares[p->nr].idx = p->nr;
+    }
+    for ( i = nr - 1; i >= 0; i-- )
+        pool_push(p, i);
 
     return 0;
 }
 
-static void exit_alice(void)
+/* Hand out a granted page, NULL if pool and fallback are exhausted */
+static alice_share_t *alice_pool_alloc(alice_pool_t *p, gfp_t gfp)
 {
-    pr_info("Cleanup grant ref...\n");
+    alice_share_t *s;
+    int idx;
 
-    if ( gnttab_query_foreign_access(gref) == 0 ) {
-        pr_info("Alice: No one is mapping this ref\n");
-        gnttab_end_foreign_access(gref, 0, vpage);
-    } else {
-        pr_info("Alice: Someone is mapping this ref now \n");
-        /* This is exit, we still have to remove this... */
-        gnttab_end_foreign_access(gref, 0, vpage);
+    idx = pool_pop(p);
+    if ( idx >= 0 ) {
+        atomic_long_inc(&p->hit);
+        return &p->shares[idx];
     }
 
-    /* end_foreign_access will free page */
-    //free_pages(vpage, 1);
+    /* Slow path: pool is empty, grant a page just for this user */
+    atomic_long_inc(&p->miss);
+    s = kmalloc(sizeof(*s), gfp);
+    if ( s && grant_page(s, p->domid, gfp) == 0 ) {
+        s->idx = -1;
+        return s;
+    }
+    kfree(s);
+    atomic_long_inc(&p->exhaust);
+    return NULL;
+}
+
+/* Give page back, pool pages keep their grant */
+static void alice_pool_free(alice_pool_t *p, alice_share_t *s)
+{
+    if ( s->idx < 0 ) {
+        ungrant_page(s);
+        kfree(s);
+        return;
+    }
+    pool_push(p, s->idx);
+}
 
+static void alice_pool_destroy(alice_pool_t *p)
+{
+    int i;
+
+    for ( i = 0; i < p->nr; i++ )
+        ungrant_page(&p->shares[i]);
+    kfree(p->shares);
+    kfree(p->next);
+
+    pr_info("Alice: pool hit %ld, miss %ld, exhaust %ld\n",
+            atomic_long_read(&p->hit), atomic_long_read(&p->miss),
+            atomic_long_read(&p->exhaust));
+}
+
+static int init_alice(void)
+{
+    alice_share_t *s;
+    int i, err;
+
+    pr_info("--------->Hello, This is Alice\n");
+
+    /* Step 1: Get pages to be shared with backend, granted once */
+    err = alice_pool_init(&pool, nr_pages, backend);
+    if ( err ) {
+        pr_err("Alice: Could not init share pool, err = %d\n", err);
+        return err;
+    }
+
+    /* Step 2: Write some contents, input gref list as alice_dom0.ko param */
+    pr_info("Alice: Pool of %d pages granted to dom%d, grefs:\n", pool.nr, backend);
+    for ( i = 0; i < pool.nr; i++ ) {
+        s = &pool.shares[i];
+        snprintf((char *)s->vpage, PAGE_SIZE, "Hello, by Alice in domU, page %d\n", i);
+        pr_cont("%s%d", i ? "," : "", s->gref);
+    }
+    pr_cont("\n");
+
+    /* Step 3: Alloc and free recycles page without regranting */
+    s = alice_pool_alloc(&pool, GFP_KERNEL);
+    if ( s ) {
+        pr_info("Alice: Got page gref %d from pool\n", s->gref);
+        alice_pool_free(&pool, s);
+    }
+
+    return 0;
+}
+
+static void exit_alice(void)
+{
+    pr_info("Cleanup grant ref...\n");
+    alice_pool_destroy(&pool);
     pr_info("Alice: Exit Successfully\n");
     return ;
 }
@@ -75,6 +238,3 @@ module_init(init_alice);
 module_exit(exit_alice);
 
 MODULE_LICENSE("GPL");
-
-
-
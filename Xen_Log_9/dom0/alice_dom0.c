@@ -7,26 +7,43 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run:
- * insmod alice_dom0.ko gref=<value> domid=<domid>
+ * insmod alice_dom0.ko gref=<value> domid=<domid> port=<evtchn>
  *
  * <value>  Taken from dmesg output in alice_domU when you insmod
  *          alice_domU in domU. grant ref of shared ring.
  * <domid>  domID of remote domU
+ * <evtchn> evtchn allocated by remote domU, taken from dmesg as well
  *
- * This Module is running in dom0 to read info from domU
+ * Optional:
+ * poll_mode=<0|1|2>  0: sleep on event after each batch (default)
+ *                    1: busy poll req_prod for poll_us before sleeping
+ *                    2: adaptive, poll window follows arrival rate
+ * poll_us=<us>       Max busy poll time after a batch, default 50
+ *
+ * Counters nr_polls, nr_wakeups, nr_empty_spins are readable under
+ * /sys/module/alice_dom0/parameters/. Time from an event to the work
+ * draining the ring is printed at rmmod
+ *
+ * This Module is running in dom0 to serve requests from domU until rmmod
  */
 
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/vmalloc.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 #include <xen/grant_table.h>
+#include <xen/events.h>
 #include <asm/xen/hypercall.h>
 
 #include <xen/interface/grant_table.h>
 #include <xen/interface/io/ring.h>
 
+#include "../../xen_bench/alice_hist.h"
+
 struct as_request {
     int hello;
 };
@@ -44,65 +61,223 @@ typedef struct back_end_t {
     struct as_back_ring ring;  /* Record real ring */
     grant_ref_t gref;          /* gref of sring */
     int domid;
+    int evtchn;                /* evtchn allocated by domU */
+    int irq;
+    struct work_struct work;   /* Drain ring out of irq context */
+    unsigned long nr_handled;
+    unsigned long nr_notify;
+    unsigned long nr_requeues; /* Runs that ended on HANDLE_BUDGET */
+    u64 poll_ns;               /* Current poll window of adaptive mode */
+    ktime_t idle_since;        /* When we last armed req_event */
+    u64 kicked_ns;             /* First event not yet drained, 0 if none */
+    struct alice_hist wakeup;  /* Event to start of drain, ns */
 } back_end_t;
 
+#define POLL_INTR       0
+#define POLL_ALWAYS     1
+#define POLL_ADAPTIVE   2
+/* Adaptive window starts here and is dropped when shrunk below */
+#define POLL_MIN_NS     2000
+/* Requests one run of the work handles, the rest go to a new run so a
+ * frontend that keeps the ring busy can't hold this CPU forever */
+#define HANDLE_BUDGET   64
+
 struct gnttab_map_grant_ref ops;
 struct gnttab_unmap_grant_ref unmap_ops;
 back_end_t back_end;
+struct vm_struct *ring_area;
 
 int gref;
 int domid;
+int port;
 
 module_param(gref, int, 0644);
 module_param(domid, int, 0644);
+module_param(port, int, 0644);
+
+static int poll_mode = POLL_INTR;
+static int poll_us = 50;
+module_param(poll_mode, int, 0644);
+module_param(poll_us, int, 0644);
+
+static unsigned long nr_polls;
+static unsigned long nr_wakeups;
+static unsigned long nr_empty_spins;
+module_param(nr_polls, ulong, 0444);
+module_param(nr_wakeups, ulong, 0444);
+module_param(nr_empty_spins, ulong, 0444);
+
+static void poll_grow(void)
+{
+    u64 max = (u64)poll_us * NSEC_PER_USEC;
+
+    back_end.poll_ns = back_end.poll_ns ? back_end.poll_ns * 2 : POLL_MIN_NS;
+    if ( back_end.poll_ns > max )
+        back_end.poll_ns = max;
+}
 
+static void poll_shrink(void)
+{
+    back_end.poll_ns /= 2;
+    if ( back_end.poll_ns < POLL_MIN_NS )
+        back_end.poll_ns = 0;
+}
+
+/* Spin on req_prod without arming req_event, so frontend sends no event
+ * for requests arriving meanwhile. Return 1 if requests showed up. */
+static int poll_for_requests(void)
+{
+    u64 window;
+    ktime_t start;
+
+    switch ( poll_mode ) {
+    case POLL_ALWAYS:
+        window = (u64)poll_us * NSEC_PER_USEC;
+        break;
+    case POLL_ADAPTIVE:
+        window = back_end.poll_ns;
+        break;
+    default:
+        return 0;
+    }
+    if ( window == 0 )
+        return 0;
+
+    nr_polls++;
+    start = ktime_get();
+    do {
+        if ( RING_HAS_UNCONSUMED_REQUESTS(&back_end.ring) ) {
+            if ( poll_mode == POLL_ADAPTIVE )
+                poll_grow();
+            return 1;
+        }
+        cpu_relax();
+    } while ( ktime_to_ns(ktime_sub(ktime_get(), start)) < window );
+
+    /* Ring stayed empty, arrival rate is low, poll less next time */
+    nr_empty_spins++;
+    if ( poll_mode == POLL_ADAPTIVE )
+        poll_shrink();
+    return 0;
+}
+
+/* Drain requests between req_cons and req_prod, push responses once
+ * per batch and poll a while for next batch if poll_mode asks so. Stops
+ * after HANDLE_BUDGET requests and queues the work again for the rest */
 void handle_request(void)
 {
     RING_IDX rc, rp; 
     as_request_t req;
     as_response_t rsp;
+    int budget = HANDLE_BUDGET;
     int notify;
+    int more_to_do;
 
-    rc = back_end.ring.req_cons;
-    rp = back_end.ring.sring->req_prod;
-    pr_info("req_comsumer: %d, req_producer: %d\n", rc, rp);
+    do {
+        rc = back_end.ring.req_cons;
+        rp = back_end.ring.sring->req_prod;
+        rmb(); /* Ensure we see queued requests up to rp */
 
-    /* Copy this info local */
-    memcpy(&req, RING_GET_REQUEST(&back_end.ring, rc), sizeof(req));
-    pr_info("Alice: Receive hello=%d\n", req.hello);
+        /* More requests than free slots, frontend is broken or hostile.
+         * Serve nothing rather than overwrite responses it has not read */
+        if ( RING_REQUEST_PROD_OVERFLOW(&back_end.ring, rp) ) {
+            pr_warn("Alice: frontend produced %u requests on a ring of %u\n",
+                    rp - back_end.ring.rsp_prod_pvt, RING_SIZE(&back_end.ring));
+            return;
+        }
 
-    /* Fill response hi = hello + 1 */
-    rsp.hi = req.hello + 1;
+        while ( rc != rp && budget > 0 ) {
+            if ( RING_REQUEST_CONS_OVERFLOW(&back_end.ring, rc) )
+                break;
 
-    /* update req-consumer */
-    back_end.ring.req_cons = ++rc;
-    barrier();
-    memcpy(RING_GET_RESPONSE(&back_end.ring, back_end.ring.rsp_prod_pvt),
-            &rsp, sizeof(rsp));
-    back_end.ring.rsp_prod_pvt++;
+            /* Copy this info local */
+            memcpy(&req, RING_GET_REQUEST(&back_end.ring, rc), sizeof(req));
 
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&back_end.ring, notify);
-    /* TODO: Add final checks */
+            /* Fill response hi = hello + 1 */
+            rsp.hi = req.hello + 1;
 
-    if ( notify ) {
-        pr_info("Alice: Need to send notify to dom%d\n", back_end.domid);
-    }
+            /* update req-consumer */
+            back_end.ring.req_cons = ++rc;
+            barrier();
+            memcpy(RING_GET_RESPONSE(&back_end.ring, back_end.ring.rsp_prod_pvt),
+                    &rsp, sizeof(rsp));
+            back_end.ring.rsp_prod_pvt++;
+            back_end.nr_handled++;
+            budget--;
+        }
+
+        /* Only kick frontend if it is waiting, as told by rsp_event */
+        RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&back_end.ring, notify);
+        if ( notify ) {
+            back_end.nr_notify++;
+            notify_remote_via_irq(back_end.irq);
+        }
+
+        /* Budget spent, let others have the CPU. Requests may be left
+         * and req_event is not armed, so the next run is queued here */
+        if ( budget == 0 ) {
+            back_end.nr_requeues++;
+            schedule_work(&back_end.work);
+            return;
+        }
+        cond_resched();
+
+        if ( poll_for_requests() ) {
+            more_to_do = 1;
+            continue;
+        }
 
+        /* Frontend may queue more after we read req_prod, recheck after
+         * setting req_event so that such requests are never missed */
+        RING_FINAL_CHECK_FOR_REQUESTS(&back_end.ring, more_to_do);
+    } while ( more_to_do );
+
+    back_end.idle_since = ktime_get();
+}
+
+static void alice_back_work(struct work_struct *work)
+{
+    u64 kicked = xchg(&back_end.kicked_ns, 0);
+
+    if ( kicked )
+        alice_hist_add(&back_end.wakeup, ktime_to_ns(ktime_get()) - kicked);
+
+    /* Woken soon after going idle, a poll of that long would have saved
+     * this event, so widen the window */
+    if ( poll_mode == POLL_ADAPTIVE &&
+            ktime_to_us(ktime_sub(ktime_get(), back_end.idle_since)) < poll_us )
+        poll_grow();
+
+    handle_request();
+}
+
+/* Frontend pushed requests, drain them in process context */
+static irqreturn_t alice_back_handler(int irq, void *dev_id)
+{
+    back_end_t *be = dev_id;
+
+    nr_wakeups++;
+    /* Events coalesce into one run, it is the first one that waits */
+    cmpxchg(&be->kicked_ns, 0, ktime_to_ns(ktime_get()));
+    schedule_work(&be->work);
+    return IRQ_HANDLED;
 }
 
 int init_alice(void)
 {
     struct vm_struct *v_start;
     as_sring_t *sring;
+    int err;
     back_end.domid = domid;
     back_end.gref = gref;
-    pr_info("Alice: init_module with gref = %d, domid = %d\n", back_end.gref, back_end.domid);
+    back_end.evtchn = port;
+    pr_info("Alice: init_module with gref = %d, domid = %d, port = %d\n",
+            back_end.gref, back_end.domid, back_end.evtchn);
 
     /* Reserve a range of kernel address space, fill page table to map this range 
      * This PAGE_SIZE is used for map granted page */
     v_start = alloc_vm_area(PAGE_SIZE, NULL);
     if ( v_start == 0 ) {
-        free_vm_area(v_start);
         pr_err("Alice: could not allocate page area\n");
         return 0;
     }
@@ -112,34 +287,66 @@ int init_alice(void)
             back_end.gref, back_end.domid);
     if ( HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &ops, 1) ) {
         pr_err("Alice: HYPERVISOR map grant ref failed\n");
+        free_vm_area(v_start);
         return 0;
     }
     if ( ops.status ) {
         pr_err("Alice: HYPERVISOR map grant ref failed, status = %d\n", ops.status);
+        free_vm_area(v_start);
         return 0;
     }
     pr_info("Alice: shared_ring = %lx, handle = %x, status = %x\n",
             (unsigned long)v_start->addr, ops.handle, ops.status);
+    ring_area = v_start;
+
+    /* Prepare for unmap */
+    unmap_ops.host_addr = (unsigned long)(v_start->addr);
+    unmap_ops.handle = ops.handle;
 
     sring = (as_sring_t *)v_start->addr;
     BACK_RING_INIT(&back_end.ring, sring, PAGE_SIZE);
+    INIT_WORK(&back_end.work, alice_back_work);
 
-    handle_request();
+    err = bind_interdomain_evtchn_to_irqhandler(back_end.domid,
+            back_end.evtchn, alice_back_handler, 0, "alice_dev", &back_end);
+    if ( err < 0 ) {
+        pr_err("Alice: bind evtchn %d failed, err = %d\n", back_end.evtchn, err);
+        return 0;
+    }
+    back_end.irq = err;
+    pr_info("Alice: bound local irq:%d to evtchn:%d\n", back_end.irq, back_end.evtchn);
 
-    /* Prepare for unmap */
-    unmap_ops.host_addr = (unsigned long)(v_start->addr);
-    unmap_ops.handle = ops.handle;
+    /* Requests queued before we bound get no event, drain them now */
+    schedule_work(&back_end.work);
     return 0;
 }
 
 void exit_alice(void)
 {
     pr_info("Alice: cleanup_module\n");
+    if ( ring_area == NULL )
+        return;
+    /* Handler queues the work and the work notifies through the irq,
+     * so no more events, then no more work, then the irq goes */
+    if ( back_end.irq > 0 ) {
+        disable_irq(back_end.irq);
+        cancel_work_sync(&back_end.work);
+        unbind_from_irqhandler(back_end.irq, &back_end);
+    }
+    pr_info("Alice: handled %lu requests, sent %lu notifies, requeued %lu times\n",
+            back_end.nr_handled, back_end.nr_notify, back_end.nr_requeues);
+    if ( back_end.wakeup.count )
+        pr_info("Alice: wakeup p50 %llu ns, p99 %llu ns, max %llu ns, "
+                "%llu woken runs\n", alice_hist_percentile(&back_end.wakeup, 500),
+                alice_hist_percentile(&back_end.wakeup, 990),
+                back_end.wakeup.max, back_end.wakeup.count);
+
     if ( HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_ops, 1) ) {
         pr_err("Alice: unmap shared page failed\n");
     } else {
         pr_info("Alice: unmap shared page successfully\n");
     }
+    free_vm_area(ring_area);
 }
 
 module_init(init_alice);
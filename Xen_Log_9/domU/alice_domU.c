@@ -7,23 +7,49 @@
  * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
  *
  * Run this in domU first:
- * insmod alice_domU.ko
+ * insmod alice_domU.ko [nr_requests=<n>] [nr_inflight=<m>] [think_us=<us>]
+ *
+ * <n>  Requests streamed to backend, refilled each time responses
+ *      arrive. Default 1.
+ * <m>  Requests in flight at most, 0 for as many as the ring holds.
+ * <us> Time between responses arriving and the refill, like a frontend
+ *      working on each. Backend goes idle meanwhile and needs an event
+ *
+ * Round trip of each request is printed as percentiles at rmmod, those
+ * queued before backend came are left out
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 #include <linux/gfp.h>
 #include <linux/proc_fs.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 
 #include <asm/xen/page.h>
 #include <xen/grant_table.h>
+#include <xen/events.h>
 
 #include <xen/interface/io/ring.h>
 #include <xen/interface/xen.h>
 
+#include "../../xen_bench/alice_hist.h"
+
 #define DOM0_ID 0
 
+/* Requests streamed to backend */
+static int nr_requests = 1;
+module_param(nr_requests, int, 0444);
+static int nr_inflight;
+module_param(nr_inflight, int, 0444);
+static int think_us;
+module_param(think_us, int, 0444);
+
 /* Ring request & respond, used by DEFINE_RING_TYPES macro */
 struct as_request {
     int hello;
@@ -35,34 +61,165 @@ struct as_response {
 
 /* this macro will create as_sring, as_back_ring, as_front_ring */
 DEFINE_RING_TYPES(as, struct as_request, struct as_response);
+#define AS_RING_SIZE __CONST_RING_SIZE(as, PAGE_SIZE)
 
 typedef struct front_end_t {
     struct as_front_ring ring;  /* Record real ring */
     grant_ref_t gref;           /* gref of shared page */
+    int evtchn;                 /* evtchn for dom0 to bind */
+    int irq;
+    spinlock_t lock;            /* Protect req_prod_pvt and rsp_cons */
+    int sent;                   /* Requests queued so far */
+    int received;               /* Responses consumed so far */
+    int nr_notify;              /* Kicks of backend */
+    ktime_t first;              /* First response, backend connected */
+    ktime_t last;               /* Last response of the stream */
+    struct hrtimer think;       /* Refill after think_us */
+    u64 sent_ns[AS_RING_SIZE];  /* Queued at, by ring slot, 0 if untimed */
+    struct alice_hist rtt;      /* Queued to response seen, ns */
 } front_end_t;
 
 front_end_t front_end;
 
-void send_request(int hello)
+/* Queue a request, it is not seen by backend until flush_requests() */
+int queue_request(int hello)
 {
     struct as_request *ring_req;
-    int notify;
-    /* Write a request and update the req-prod pointer */
+
+    if ( RING_FULL(&(front_end.ring)) )
+        return -EBUSY;
+
     ring_req = RING_GET_REQUEST(&(front_end.ring), front_end.ring.req_prod_pvt);
     ring_req->hello = hello;
+    front_end.sent_ns[front_end.ring.req_prod_pvt % AS_RING_SIZE] =
+        front_end.received ? ktime_to_ns(ktime_get()) : 0;
     front_end.ring.req_prod_pvt += 1;
+    return 0;
+}
+
+/* Publish all queued requests by one push, notify at most once */
+void flush_requests(void)
+{
+    int notify;
 
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&(front_end.ring), notify);
 
+    /* Backend is draining and will see them, no need to kick it */
     if ( notify ) {
-        pr_info("Alice: Need notify");
+        notify_remote_via_irq(front_end.irq);
+        front_end.nr_notify++;
+    }
+}
+
+void send_request(int hello)
+{
+    if ( queue_request(hello) == 0 )
+        flush_requests();
+}
+
+/* Fill free slots with the rest of the stream, lock held */
+static void refill_requests(void)
+{
+    while ( front_end.sent < nr_requests && (nr_inflight <= 0 ||
+                front_end.sent - front_end.received < nr_inflight) ) {
+        if ( queue_request(233 + front_end.sent) )
+            break;
+        front_end.sent++;
     }
+    flush_requests();
+}
+
+/* Consume all responses, lock held */
+static void consume_responses(void)
+{
+    RING_IDX rc, rp;
+    struct as_response *rsp;
+    u64 now, sent;
+    int more_to_do;
+
+    do {
+        rc = front_end.ring.rsp_cons;
+        rp = front_end.ring.sring->rsp_prod;
+        rmb(); /* Ensure we see responses up to rp */
+        now = ktime_to_ns(ktime_get());
+
+        for ( ; rc != rp; rc++ ) {
+            rsp = RING_GET_RESPONSE(&front_end.ring, rc); 
+            pr_debug("Alice: Get response, hi = %d\n", rsp->hi);
+            /* Backend answers in order, slot of response is that of request */
+            sent = front_end.sent_ns[rc % AS_RING_SIZE];
+            if ( sent )
+                alice_hist_add(&front_end.rtt, now - sent);
+            if ( front_end.received++ == 0 )
+                front_end.first = ktime_get();
+        }
+        if ( rc != front_end.ring.rsp_cons )
+            front_end.last = ktime_get();
+        front_end.ring.rsp_cons = rc;
+
+        /* Set rsp_event so backend notifies us for the next response */
+        RING_FINAL_CHECK_FOR_RESPONSES(&front_end.ring, more_to_do);
+    } while ( more_to_do );
+}
+
+static enum hrtimer_restart alice_front_think(struct hrtimer *timer)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&front_end.lock, flags);
+    refill_requests();
+    spin_unlock_irqrestore(&front_end.lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Backend pushed responses, recycle their slots for new requests */
+static irqreturn_t alice_front_handler(int irq, void *dev_id)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&front_end.lock, flags);
+    consume_responses();
+    if ( think_us > 0 )
+        hrtimer_start(&front_end.think, ns_to_ktime((u64)think_us * NSEC_PER_USEC),
+                HRTIMER_MODE_REL);
+    else
+        refill_requests();
+    spin_unlock_irqrestore(&front_end.lock, flags);
+
+    return IRQ_HANDLED;
+}
+
+/* Get a unbound evtchn for dom0 and bind our handler to it */
+static int setup_evtchn(void)
+{
+    struct evtchn_alloc_unbound alloc_unbound;
+    int err;
+
+    alloc_unbound.dom = DOMID_SELF;
+    alloc_unbound.remote_dom = DOM0_ID;
+    err = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &alloc_unbound);
+    if ( err < 0 ) {
+        pr_err("Alice: Can't alloc unbound evtchn, err:%d\n", err);
+        return err;
+    }
+    front_end.evtchn = alloc_unbound.port;
+
+    err = bind_evtchn_to_irqhandler(front_end.evtchn, alice_front_handler,
+            0, "alice_dev", &front_end);
+    if ( err < 0 ) {
+        pr_err("Alice: Can't bind evtchn %d, err:%d\n", front_end.evtchn, err);
+        return err;
+    }
+    front_end.irq = err;
+    return 0;
 }
 
 static int init_alice(void)
 {
     unsigned long mfn;
     unsigned long vpage;
+    unsigned long flags;
     struct as_sring *sring;
     int gref;
 
@@ -82,6 +239,9 @@ static int init_alice(void)
 
     /* Step 3: Front init */
     FRONT_RING_INIT(&(front_end.ring), sring, PAGE_SIZE);
+    spin_lock_init(&front_end.lock);
+    hrtimer_init(&front_end.think, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    front_end.think.function = alice_front_think;
 
     /* Step 4: Share this ring with dom0, readonly */
     mfn = virt_to_mfn(vpage);
@@ -93,23 +253,45 @@ static int init_alice(void)
     front_end.gref = gref;
     pr_info("Alice: Grant_Ref is %d, input this as param of alice_dom0.ko\n", gref);
 
-    /* Step 5: fill content, and send this by request */
-    send_request(233);
+    /* Step 5: Event channel for both directions of ring */
+    if ( setup_evtchn() )
+        return 0;
+    pr_info("Alice: Evtchn is %d, input this as param of alice_dom0.ko\n",
+            front_end.evtchn);
+
+    /* Step 6: fill content, and send them by one batch. Backend is not
+     * bound yet, it will drain them after it connects */
+    spin_lock_irqsave(&front_end.lock, flags);
+    refill_requests();
+    spin_unlock_irqrestore(&front_end.lock, flags);
 
     return 0;
 }
 
 static void exit_alice(void)
 {
-    RING_IDX rc, rp;
-    struct as_response *rsp;
-    
-    rc = front_end.ring.rsp_cons;
-    rp = front_end.ring.sring->rsp_prod;
-    rsp = RING_GET_RESPONSE(&front_end.ring, rc); 
+    unsigned long flags;
+    s64 us;
+
+    if ( front_end.irq > 0 )
+        unbind_from_irqhandler(front_end.irq, &front_end);
+    hrtimer_cancel(&front_end.think);
 
-    pr_info("Alice: Get response, hi = %d\n", rsp->hi);
-    front_end.ring.rsp_cons = ++rc;
+    spin_lock_irqsave(&front_end.lock, flags);
+    consume_responses();
+    spin_unlock_irqrestore(&front_end.lock, flags);
+    pr_info("Alice: Sent %d requests, got %d responses\n",
+            front_end.sent, front_end.received);
+    /* Rate from first to last response, time before backend came is out */
+    us = ktime_us_delta(front_end.last, front_end.first);
+    if ( front_end.received > 1 && us > 0 )
+        pr_info("Alice: rate %llu requests/s, sent %d notifies\n",
+                div64_u64((u64)(front_end.received - 1) * USEC_PER_SEC, us),
+                front_end.nr_notify);
+    if ( front_end.rtt.count )
+        pr_info("Alice: round trip p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                alice_hist_percentile(&front_end.rtt, 500),
+                alice_hist_percentile(&front_end.rtt, 990), front_end.rtt.max);
 
     pr_info("Alice: Cleanup grant ref...\n");
     if ( gnttab_query_foreign_access(front_end.gref) == 0 ) {
@@ -132,6 +314,3 @@ module_init(init_alice);
 module_exit(exit_alice);
 
 MODULE_LICENSE("GPL");
-
-
-
@@ -0,0 +1,358 @@
+/* Demo: Cost of Xen primitives
+ * This kernel module is under GPL License
+ * Environment: Debian 8, Linux 4.10.2, Xen 4.5.1
+ *
+ * Compile:
+ * make -C /lib/modules/$(shell uname -r)/build M=$(PWD) modules
+ *
+ * Run:
+ * insmod alice_bench.ko [arg1=<n>] [arg2=<mask>]
+ *
+ * <n>      Samples of each primitive, default 10000
+ * <mask>   Primitives to time, one bit each, default all
+ *          bit 0 null hypercall, 1 grant map and unmap, 2 grant copy,
+ *          3 event channel send until its bound handler runs,
+ *          4 xenstore read
+ *
+ * Results in cycles:
+ * cat /sys/kernel/debug/alice_bench/stats
+ * Run again:
+ * echo 1 > /sys/kernel/debug/alice_bench/run
+ *
+ * Grants and event channel are to ourselves, so one domain will do
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/timex.h>            /* get_cycles */
+
+#include <xen/xen.h>
+#include <xen/xenbus.h>
+#include <xen/events.h>
+#include <xen/grant_table.h>
+#include <xen/page.h>
+#include <xen/interface/version.h>
+#include <asm/xen/hypercall.h>
+
+#include "alice_hist.h"
+
+#define NR_BENCH    5
+
+/* Histograms of one cpu, samples go to cpu they were taken on */
+struct alice_hists {
+    struct alice_hist h[NR_BENCH];
+};
+
+static const char * const bench_names[NR_BENCH] = {
+    "null_hypercall",
+    "grant_map_unmap",
+    "grant_copy",
+    "evtchn_deliver",
+    "xenstore_read",
+};
+
+static int arg1 = 10000;
+static int arg2 = (1 << NR_BENCH) - 1;
+
+static struct alice_hists __percpu *hists;
+static struct dentry *bench_dir;
+static DEFINE_MUTEX(bench_lock);
+static domid_t self_domid;
+
+/* Event in flight on the loopback channel */
+static cycles_t evtchn_sent;
+static DECLARE_COMPLETION(evtchn_done);
+
+static void record(int bench, u64 cycles)
+{
+    alice_hist_add(&get_cpu_ptr(hists)->h[bench], cycles);
+    put_cpu_ptr(hists);
+}
+
+/* Sample n cycles of stmt into bench */
+#define TIME(bench, n, stmt)\
+    do {\
+        cycles_t __t;\
+        int __i;\
+        for ( __i = 0; __i < (n); __i++ ) {\
+            __t = get_cycles();\
+            stmt;\
+            record((bench), get_cycles() - __t);\
+        }\
+    } while ( 0 )
+
+static int bench_hypercall(int n)
+{
+    TIME(0, n, HYPERVISOR_xen_version(XENVER_version, NULL));
+    return 0;
+}
+
+/* Map our own grant and unmap it again */
+static int bench_map(int n, grant_ref_t ref)
+{
+    struct gnttab_map_grant_ref map;
+    struct gnttab_unmap_grant_ref unmap;
+    struct page *page;
+    unsigned long addr;
+    int i, err = 0;
+    cycles_t t;
+
+    if ( gnttab_alloc_pages(1, &page) )
+        return -ENOMEM;
+    addr = (unsigned long)pfn_to_kaddr(page_to_pfn(page));
+
+    for ( i = 0; i < n; i++ ) {
+        t = get_cycles();
+        gnttab_set_map_op(&map, addr, GNTMAP_host_map, ref, self_domid);
+        if ( gnttab_map_refs(&map, NULL, &page, 1) || map.status ) {
+            err = -EIO;
+            break;
+        }
+        gnttab_set_unmap_op(&unmap, addr, GNTMAP_host_map, map.handle);
+        if ( gnttab_unmap_refs(&unmap, NULL, &page, 1) ) {
+            err = -EIO;
+            break;
+        }
+        record(1, get_cycles() - t);
+    }
+
+    gnttab_free_pages(1, &page);
+    return err;
+}
+
+/* Copy a whole page out of our own grant */
+static int bench_copy(int n, grant_ref_t ref)
+{
+    struct gnttab_copy op;
+    struct page *page;
+    int i, err = 0;
+    cycles_t t;
+
+    page = alloc_page(GFP_KERNEL);
+    if ( page == NULL )
+        return -ENOMEM;
+
+    for ( i = 0; i < n; i++ ) {
+        t = get_cycles();
+        op.source.u.ref = ref;
+        op.source.domid = self_domid;
+        op.source.offset = 0;
+        op.dest.u.gmfn = xen_page_to_gfn(page);
+        op.dest.domid = DOMID_SELF;
+        op.dest.offset = 0;
+        op.len = PAGE_SIZE;
+        op.flags = GNTCOPY_source_gref;
+        gnttab_batch_copy(&op, 1);
+        if ( op.status != GNTST_okay ) {
+            err = -EIO;
+            break;
+        }
+        record(2, get_cycles() - t);
+    }
+
+    __free_page(page);
+    return err;
+}
+
+/* Receiving end of the loopback channel, the sample ends here */
+static irqreturn_t bench_interrupt(int irq, void *dev_id)
+{
+    record(3, get_cycles() - READ_ONCE(evtchn_sent));
+    complete(&evtchn_done);
+    return IRQ_HANDLED;
+}
+
+/* Sending end, never sent to */
+static irqreturn_t bench_nop_interrupt(int irq, void *dev_id)
+{
+    return IRQ_HANDLED;
+}
+
+/* Send on a loopback channel, both ends are ours, and wait for the
+ * handler bound to the other end to run */
+static int bench_evtchn(int n)
+{
+    struct evtchn_alloc_unbound alloc = {
+        .dom = DOMID_SELF,
+        .remote_dom = self_domid,
+    };
+    struct evtchn_close close;
+    int irq_recv, irq_send, i, err = 0;
+
+    err = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &alloc);
+    if ( err )
+        return err;
+    irq_recv = bind_evtchn_to_irqhandler(alloc.port, bench_interrupt, 0,
+            "alice_bench", NULL);
+    if ( irq_recv < 0 ) {
+        close.port = alloc.port;
+        HYPERVISOR_event_channel_op(EVTCHNOP_close, &close);
+        return irq_recv;
+    }
+    irq_send = bind_interdomain_evtchn_to_irqhandler(self_domid, alloc.port,
+            bench_nop_interrupt, 0, "alice_bench", NULL);
+    if ( irq_send < 0 ) {
+        unbind_from_irqhandler(irq_recv, NULL);
+        return irq_send;
+    }
+
+    for ( i = 0; i < n; i++ ) {
+        reinit_completion(&evtchn_done);
+        WRITE_ONCE(evtchn_sent, get_cycles());
+        notify_remote_via_irq(irq_send);
+        if ( !wait_for_completion_timeout(&evtchn_done, HZ) ) {
+            err = -ETIMEDOUT;
+            break;
+        }
+    }
+
+    /* Unbinding closes each end */
+    unbind_from_irqhandler(irq_send, NULL);
+    unbind_from_irqhandler(irq_recv, NULL);
+    return err;
+}
+
+static int bench_xenstore(int n)
+{
+    TIME(4, n, kfree(xenbus_read(XBT_NIL, "domid", "", NULL)));
+    return 0;
+}
+
+/* Time primitives picked by arg2, arg1 samples each */
+static void run_benches(void)
+{
+    struct page *page = NULL;
+    int cpu, ref = -1, err;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(hists, cpu), 0, sizeof(struct alice_hists));
+
+    /* Page granted to ourselves, for map and copy */
+    if ( arg2 & 0x6 ) {
+        page = alloc_page(GFP_KERNEL);
+        if ( page )
+            ref = gnttab_grant_foreign_access(self_domid,
+                    xen_page_to_gfn(page), 0);
+        if ( ref < 0 )
+            pr_err("alice_bench: grant failed: %d\n", ref);
+    }
+
+    if ( arg2 & 0x1 )
+        bench_hypercall(arg1);
+    if ( (arg2 & 0x2) && ref >= 0 && (err = bench_map(arg1, ref)) )
+        pr_err("alice_bench: grant map failed: %d\n", err);
+    if ( (arg2 & 0x4) && ref >= 0 && (err = bench_copy(arg1, ref)) )
+        pr_err("alice_bench: grant copy failed: %d\n", err);
+    if ( (arg2 & 0x8) && (err = bench_evtchn(arg1)) )
+        pr_err("alice_bench: evtchn failed: %d\n", err);
+    if ( (arg2 & 0x10) && (err = bench_xenstore(arg1)) )
+        pr_err("alice_bench: xenstore failed: %d\n", err);
+
+    if ( ref >= 0 )
+        gnttab_end_foreign_access(ref, 0, (unsigned long)page_address(page));
+    else if ( page )
+        __free_page(page);
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    struct alice_hist *sum;
+    int bench, cpu;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if ( sum == NULL )
+        return -ENOMEM;
+
+    mutex_lock(&bench_lock);
+    seq_printf(m, "%-16s %10s %10s %10s %10s %10s\n",
+            "cycles", "count", "p50", "p99", "p999", "max");
+    for ( bench = 0; bench < NR_BENCH; bench++ ) {
+        memset(sum, 0, sizeof(*sum));
+        for_each_possible_cpu(cpu)
+            alice_hist_sum(sum, &per_cpu_ptr(hists, cpu)->h[bench]);
+        if ( sum->count == 0 )
+            continue;
+        seq_printf(m, "%-16s %10llu %10llu %10llu %10llu %10llu\n",
+                bench_names[bench], sum->count,
+                alice_hist_percentile(sum, 500),
+                alice_hist_percentile(sum, 990),
+                alice_hist_percentile(sum, 999), sum->max);
+    }
+    mutex_unlock(&bench_lock);
+
+    kfree(sum);
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t run_write(struct file *file, const char __user *buf,
+        size_t count, loff_t *ppos)
+{
+    mutex_lock(&bench_lock);
+    run_benches();
+    mutex_unlock(&bench_lock);
+    return count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int init_alice(void)
+{
+    if ( !xen_domain() )
+        return -ENODEV;
+
+    hists = alloc_percpu(struct alice_hists);
+    if ( hists == NULL )
+        return -ENOMEM;
+
+    self_domid = xenbus_read_unsigned("domid", "", 0);
+
+    bench_dir = debugfs_create_dir("alice_bench", NULL);
+    debugfs_create_file("stats", 0444, bench_dir, NULL, &stats_fops);
+    debugfs_create_file("run", 0200, bench_dir, NULL, &run_fops);
+
+    pr_info("alice_bench: dom%u, %d samples each\n", self_domid, arg1);
+    mutex_lock(&bench_lock);
+    run_benches();
+    mutex_unlock(&bench_lock);
+    return 0;
+}
+
+static void exit_alice(void)
+{
+    debugfs_remove_recursive(bench_dir);
+    free_percpu(hists);
+}
+
+module_init(init_alice);
+module_exit(exit_alice);
+
+module_param(arg1, int, 0644);
+module_param(arg2, int, 0644);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Cost of Xen primitives");
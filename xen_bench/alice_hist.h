@@ -0,0 +1,80 @@
+/* Log-linear histogram of the timing modules
+ * This is under GPL License
+ *
+ * 4 buckets per power of 2, so a percentile read off one is under the
+ * true value by less than 25%. Not locked, each writer keeps its own,
+ * a reader sums them. Included by Xen_Log_12 too
+ */
+#ifndef __ALICE_HIST_H__
+#define __ALICE_HIST_H__
+
+#include <linux/kernel.h>
+
+#define ALICE_HIST_SUB_BITS 2
+#define ALICE_HIST_BUCKETS  (64 << ALICE_HIST_SUB_BITS)
+
+struct alice_hist {
+    u64 buckets[ALICE_HIST_BUCKETS];
+    u64 count;
+    u64 max;
+};
+
+static inline unsigned int alice_hist_bucket(u64 v)
+{
+    unsigned int msb;
+
+    if ( v < (1 << ALICE_HIST_SUB_BITS) )
+        return v;
+    msb = fls64(v) - 1;
+    return ((msb - ALICE_HIST_SUB_BITS + 1) << ALICE_HIST_SUB_BITS) |
+        ((v >> (msb - ALICE_HIST_SUB_BITS)) & ((1 << ALICE_HIST_SUB_BITS) - 1));
+}
+
+/* Smallest value falling into bucket b */
+static inline u64 alice_hist_floor(unsigned int b)
+{
+    unsigned int msb;
+
+    if ( b < (1 << ALICE_HIST_SUB_BITS) )
+        return b;
+    msb = (b >> ALICE_HIST_SUB_BITS) + ALICE_HIST_SUB_BITS - 1;
+    return (1ULL << msb) |
+        ((u64)(b & ((1 << ALICE_HIST_SUB_BITS) - 1)) << (msb - ALICE_HIST_SUB_BITS));
+}
+
+static inline void alice_hist_add(struct alice_hist *h, u64 v)
+{
+    h->buckets[alice_hist_bucket(v)]++;
+    h->count++;
+    if ( v > h->max )
+        h->max = v;
+}
+
+/* Add samples of h to sum */
+static inline void alice_hist_sum(struct alice_hist *sum,
+        const struct alice_hist *h)
+{
+    unsigned int b;
+
+    for ( b = 0; b < ALICE_HIST_BUCKETS; b++ )
+        sum->buckets[b] += h->buckets[b];
+    sum->count += h->count;
+    sum->max = max(sum->max, h->max);
+}
+
+/* Value under which permille of samples fall */
+static inline u64 alice_hist_percentile(const struct alice_hist *h,
+        unsigned int permille)
+{
+    u64 want = DIV_ROUND_UP(h->count * permille, 1000), seen = 0;
+    unsigned int b;
+
+    for ( b = 0; b < ALICE_HIST_BUCKETS; b++ ) {
+        seen += h->buckets[b];
+        if ( seen >= want && seen > 0 )
+            return alice_hist_floor(b);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/* Xen simulation: hypercall table of Xen side code built in
+ * This is under GPL License
+ */
+#include <stdarg.h>
+
+#include <xen/hypercall.h>
+#include <public/alice_op.h>
+
+long do_alice_op(XEN_GUEST_HANDLE_PARAM(alice_op_t) uops, unsigned int count);
+
+static unsigned int preempt_checks;
+/* Set by a continuation */
+static unsigned int cont_op;
+static unsigned long cont_args[2];
+
+bool hypercall_preempt_check(void)
+{
+	return ++preempt_checks % SIM_PREEMPT_CHECKS == 0;
+}
+
+long hypercall_create_continuation(unsigned int op, const char *format, ...)
+{
+	va_list args;
+	int i;
+
+	va_start(args, format);
+	cont_op = op;
+	for (i = 0; format[i] && i < 2; i++)
+		cont_args[i] = format[i] == 'h' ?
+			(unsigned long)va_arg(args, void *) : va_arg(args, unsigned int);
+	va_end(args);
+	return SIM_HV_CONTINUATION;
+}
+
+long sim_hv_call(unsigned int *op, unsigned long args[2])
+{
+	long rc;
+
+	switch (*op) {
+	case __HYPERVISOR_alice_op:
+		rc = do_alice_op((alice_op_t *)args[0], args[1]);
+		break;
+	default:
+		return -ENOSYS;
+	}
+	if (rc == SIM_HV_CONTINUATION) {
+		*op = cont_op;
+		args[0] = cont_args[0];
+		args[1] = cont_args[1];
+	}
+	return rc;
+}
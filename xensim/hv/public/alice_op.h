@@ -0,0 +1,2 @@
+/* Xen simulation: interface of Xen_Log_3 as Xen has it */
+#include "../../../Xen_Log_3/alice_op.h"
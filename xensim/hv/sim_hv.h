@@ -0,0 +1,46 @@
+/* Xen simulation: what Xen side code of the demos needs of Xen
+ * This is under GPL License
+ *
+ * Xen side sources, like Xen_Log_3/xen/alice_op.c, build unchanged
+ * against this with -D__XEN__ and are linked into the module program.
+ * Guest memory is the memory of that program, so a guest handle is a
+ * plain pointer
+ */
+#ifndef SIM_HV_H
+#define SIM_HV_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim_hv_call.h"
+
+#define unlikely(x)             __builtin_expect(!!(x), 0)
+#define likely(x)               __builtin_expect(!!(x), 1)
+
+#define printk(fmt, ...)        printf("(XEN) " fmt, ##__VA_ARGS__)
+
+/* Guest handles */
+#define DEFINE_XEN_GUEST_HANDLE(t)      typedef t *__guest_handle_ ## t
+#define XEN_GUEST_HANDLE_PARAM(t)       __guest_handle_ ## t
+#define guest_handle_okay(hnd, nr)      ((hnd) != NULL || (nr) == 0)
+#define guest_handle_add_offset(hnd, nr) ((hnd) += (nr))
+#define __copy_from_guest(ptr, hnd, nr) \
+	(memcpy((ptr), (hnd), (nr) * sizeof(*(hnd))), 0)
+#define __copy_to_guest(hnd, ptr, nr)   \
+	(memcpy((hnd), (ptr), (nr) * sizeof(*(hnd))), 0)
+
+/* Continuations. A softirq is taken as pending every
+ * SIM_PREEMPT_CHECKS checks, so long batches do get preempted. The
+ * kernel shim then makes the hypercall again with the args saved here,
+ * as Xen makes the guest redo it */
+#define SIM_PREEMPT_CHECKS      32
+
+bool hypercall_preempt_check(void);
+/* Only "h" and "i" args, 2 at most */
+long hypercall_create_continuation(unsigned int op, const char *format, ...);
+
+#endif
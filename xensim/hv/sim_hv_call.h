@@ -0,0 +1,14 @@
+/* Xen simulation: kernel shim calling into Xen side code built in
+ * This is under GPL License
+ */
+#ifndef SIM_HV_CALL_H
+#define SIM_HV_CALL_H
+
+/* Hypercall op was preempted, make it again with op and args as
+ * sim_hv_call left them */
+#define SIM_HV_CONTINUATION     (-1000L)
+
+/* Hypercall op of 2 args, -ENOSYS if none of the Xen side has it */
+long sim_hv_call(unsigned int *op, unsigned long args[2]);
+
+#endif
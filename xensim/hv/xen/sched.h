@@ -0,0 +1,2 @@
+/* Xen simulation, all of it is in sim_hv.h */
+#include <sim_hv.h>
@@ -0,0 +1,1082 @@
+/* Xen simulation: kernel services for the Xen_Log_* modules
+ * This is under GPL License
+ *
+ * Threads stand in for all the contexts of a kernel: work queues have
+ * a worker for each vCPU, hrtimers and delayed work a timer thread.
+ * One lock covers all work queues, another all timers
+ */
+#include "sim_kernel.h"
+
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+int (*sim_module_init)(void);
+void (*sim_module_exit)(void);
+
+struct page sim_pages[SIM_NR_FRAMES];
+unsigned int nr_cpu_ids = 1;
+static struct cpumask cpu_masks[NR_CPUS];
+static struct cpumask online_mask;
+const struct cpumask *cpu_online_mask = &online_mask;
+const struct cpumask *cpu_possible_mask = &online_mask;
+
+/* Time */
+
+ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ktime_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void msleep(unsigned int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * NSEC_PER_MSEC };
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/* udelay keeps its vCPU busy. vCPUs of the sim are threads sharing host
+ * CPUs, spinning would also hold up vCPUs that have CPUs of their own
+ * on Xen, so the thread sleeps to the end instead */
+void sim_delay_ns(u64 ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_nsec += ns % NSEC_PER_SEC;
+	ts.tv_sec += ns / NSEC_PER_SEC + ts.tv_nsec / NSEC_PER_SEC;
+	ts.tv_nsec %= NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+long schedule_timeout(long timeout)
+{
+	msleep(timeout);
+	return 0;
+}
+
+char *kasprintf(gfp_t gfp, const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+
+	va_start(ap, fmt);
+	if (vasprintf(&s, fmt, ap) < 0)
+		s = NULL;
+	va_end(ap);
+	return s;
+}
+
+/* Memory */
+
+/* Pages the module holds, a leak shows at exit */
+static long nr_pages_used;
+
+unsigned long __get_free_pages(gfp_t gfp, unsigned int order)
+{
+	void *p = sim_alloc_pages(1 << order);
+
+	if (p)
+		__atomic_add_fetch(&nr_pages_used, 1 << order, __ATOMIC_RELAXED);
+	return (unsigned long)p;
+}
+
+void free_pages(unsigned long addr, unsigned int order)
+{
+	if (!addr)
+		return;
+	sim_free_pages((void *)addr, 1 << order);
+	__atomic_sub_fetch(&nr_pages_used, 1 << order, __ATOMIC_RELAXED);
+}
+
+struct page *alloc_pages(gfp_t gfp, unsigned int order)
+{
+	unsigned long addr = __get_free_pages(gfp, order);
+
+	return addr ? virt_to_page(addr) : NULL;
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+	if (page)
+		free_pages((unsigned long)page_address(page), order);
+}
+
+/* Address space only, grants get mapped into it */
+struct vm_struct *alloc_vm_area(size_t size, void *ptes)
+{
+	struct vm_struct *area = malloc(sizeof(*area));
+
+	if (!area)
+		return NULL;
+	area->size = ALIGN(size, PAGE_SIZE);
+	area->addr = mmap(NULL, area->size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area->addr == MAP_FAILED) {
+		free(area);
+		return NULL;
+	}
+	return area;
+}
+
+void free_vm_area(struct vm_struct *area)
+{
+	if (!area)
+		return;
+	munmap(area->addr, area->size);
+	free(area);
+}
+
+/* Tree */
+
+static void rb_replace(struct rb_node *old, struct rb_node *new,
+		struct rb_root *root)
+{
+	struct rb_node *parent = old->rb_parent;
+
+	if (!parent)
+		root->rb_node = new;
+	else if (parent->rb_left == old)
+		parent->rb_left = new;
+	else
+		parent->rb_right = new;
+	if (new)
+		new->rb_parent = parent;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *next;
+
+	if (!node->rb_left) {
+		rb_replace(node, node->rb_right, root);
+	} else if (!node->rb_right) {
+		rb_replace(node, node->rb_left, root);
+	} else {
+		next = node->rb_right;
+		while (next->rb_left)
+			next = next->rb_left;
+		if (next->rb_parent != node) {
+			rb_replace(next, next->rb_right, root);
+			next->rb_right = node->rb_right;
+			next->rb_right->rb_parent = next;
+		}
+		rb_replace(node, next, root);
+		next->rb_left = node->rb_left;
+		next->rb_left->rb_parent = next;
+	}
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *n = root->rb_node;
+
+	while (n && n->rb_left)
+		n = n->rb_left;
+	return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return (struct rb_node *)node;
+	}
+	while ((parent = node->rb_parent) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
+const struct cpumask *cpumask_of(int cpu)
+{
+	return &cpu_masks[cpu];
+}
+
+/* Wait queues */
+
+/* Longest sleep before condition is checked again */
+#define WAIT_SLICE_NS   (10 * NSEC_PER_MSEC)
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	wq->gen = 0;
+}
+
+void sim_wake_up(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	wq->gen++;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+unsigned long sim_wait_gen(wait_queue_head_t *wq)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&wq->lock);
+	gen = wq->gen;
+	pthread_mutex_unlock(&wq->lock);
+	return gen;
+}
+
+bool sim_wait(wait_queue_head_t *wq, unsigned long gen, s64 timeout)
+{
+	struct timespec ts;
+	bool woken;
+
+	if (timeout < 0 || timeout > WAIT_SLICE_NS)
+		timeout = WAIT_SLICE_NS;
+	/* Condition of a static wait queue runs on realtime clock */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += timeout;
+	ts.tv_sec += ts.tv_nsec / NSEC_PER_SEC;
+	ts.tv_nsec %= NSEC_PER_SEC;
+
+	pthread_mutex_lock(&wq->lock);
+	while (wq->gen == gen &&
+	       pthread_cond_timedwait(&wq->cond, &wq->lock, &ts) == 0)
+		;
+	woken = wq->gen != gen;
+	pthread_mutex_unlock(&wq->lock);
+	return woken;
+}
+
+void init_completion(struct completion *x)
+{
+	x->done = 0;
+	init_waitqueue_head(&x->wait);
+}
+
+void complete(struct completion *x)
+{
+	pthread_mutex_lock(&x->wait.lock);
+	if (x->done != UINT_MAX)
+		x->done++;
+	x->wait.gen++;
+	pthread_cond_broadcast(&x->wait.cond);
+	pthread_mutex_unlock(&x->wait.lock);
+}
+
+void complete_all(struct completion *x)
+{
+	pthread_mutex_lock(&x->wait.lock);
+	x->done = UINT_MAX;
+	x->wait.gen++;
+	pthread_cond_broadcast(&x->wait.cond);
+	pthread_mutex_unlock(&x->wait.lock);
+}
+
+bool try_wait_for_completion(struct completion *x)
+{
+	bool ret;
+
+	pthread_mutex_lock(&x->wait.lock);
+	ret = x->done != 0;
+	if (ret && x->done != UINT_MAX)
+		x->done--;
+	pthread_mutex_unlock(&x->wait.lock);
+	return ret;
+}
+
+/* Threads */
+
+static __thread struct task_struct *current_task;
+static struct task_struct insmod_task = { .comm = "insmod" };
+
+struct task_struct *sim_current(void)
+{
+	return current_task ? current_task : &insmod_task;
+}
+
+static void *kthread(void *arg)
+{
+	struct task_struct *t = arg;
+
+	current_task = t;
+	t->ret = t->fn(t->data);
+	return NULL;
+}
+
+struct task_struct *kthread_create(int (*fn)(void *), void *data,
+		const char *fmt, ...)
+{
+	struct task_struct *t = calloc(1, sizeof(*t));
+	va_list ap;
+
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->fn = fn;
+	t->data = data;
+	va_start(ap, fmt);
+	vsnprintf(t->comm, sizeof(t->comm), fmt, ap);
+	va_end(ap);
+	return t;
+}
+
+int wake_up_process(struct task_struct *t)
+{
+	if (t->started)
+		return 0;
+	t->started = true;
+	if (pthread_create(&t->thread, NULL, kthread, t)) {
+		t->started = false;
+		return 0;
+	}
+	return 1;
+}
+
+bool kthread_should_stop(void)
+{
+	return READ_ONCE(sim_current()->should_stop);
+}
+
+/* Sleeps of the thread end within a wait slice and see it */
+int kthread_stop(struct task_struct *t)
+{
+	int ret = -EINTR;
+
+	WRITE_ONCE(t->should_stop, true);
+	if (t->started) {
+		pthread_join(t->thread, NULL);
+		ret = t->ret;
+	}
+	free(t);
+	return ret;
+}
+
+/* Timers, callbacks run in timer thread on vCPU timer was started on */
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static pthread_cond_t timer_done = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(timers);       /* Queued, soonest first */
+static pthread_t timer_thread;
+static bool timer_stop;
+
+/* Called with timer lock held */
+static void timer_enqueue(struct hrtimer *timer)
+{
+	struct hrtimer *t;
+
+	list_for_each_entry(t, &timers, entry)
+		if (t->expires > timer->expires)
+			break;
+	list_add_tail(&timer->entry, &t->entry);
+	timer->queued = true;
+	pthread_cond_signal(&timer_cond);
+}
+
+static void *timer_loop(void *unused)
+{
+	enum hrtimer_restart restart;
+	struct hrtimer *t;
+	struct timespec ts;
+	ktime_t now;
+
+	pthread_mutex_lock(&timer_lock);
+	while (!timer_stop) {
+		if (list_empty(&timers)) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+			continue;
+		}
+		t = list_first_entry(&timers, struct hrtimer, entry);
+		now = ktime_get();
+		if (t->expires > now) {
+			ts.tv_sec = t->expires / NSEC_PER_SEC;
+			ts.tv_nsec = t->expires % NSEC_PER_SEC;
+			pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+			continue;
+		}
+
+		list_del(&t->entry);
+		t->queued = false;
+		t->running = true;
+		sim_set_this_vcpu(t->cpu);
+		pthread_mutex_unlock(&timer_lock);
+
+		restart = t->function(t);
+
+		pthread_mutex_lock(&timer_lock);
+		t->running = false;
+		if (restart == HRTIMER_RESTART && !t->queued)
+			timer_enqueue(t);
+		pthread_cond_broadcast(&timer_done);
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return NULL;
+}
+
+void hrtimer_init(struct hrtimer *timer, clockid_t clock, enum hrtimer_mode mode)
+{
+	memset(timer, 0, sizeof(*timer));
+	INIT_LIST_HEAD(&timer->entry);
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode)
+{
+	if (mode & HRTIMER_MODE_REL)
+		tim += ktime_get();
+
+	pthread_mutex_lock(&timer_lock);
+	if (timer->queued)
+		list_del(&timer->entry);
+	timer->expires = tim;
+	timer->cpu = smp_processor_id();
+	timer_enqueue(timer);
+	pthread_mutex_unlock(&timer_lock);
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *timer)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&timer_lock);
+	if (timer->running) {
+		ret = -1;
+	} else if (timer->queued) {
+		list_del(&timer->entry);
+		timer->queued = false;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return ret;
+}
+
+/* Waits for a running callback, which may have queued it again */
+int hrtimer_cancel(struct hrtimer *timer)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&timer_lock);
+	for (;;) {
+		if (timer->queued) {
+			list_del(&timer->entry);
+			timer->queued = false;
+			ret = 1;
+		}
+		if (!timer->running || pthread_equal(pthread_self(), timer_thread))
+			break;
+		pthread_cond_wait(&timer_done, &timer_lock);
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return ret;
+}
+
+bool hrtimer_is_queued(struct hrtimer *timer)
+{
+	return READ_ONCE(timer->queued);
+}
+
+bool hrtimer_active(struct hrtimer *timer)
+{
+	return READ_ONCE(timer->queued) || READ_ONCE(timer->running);
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval)
+{
+	ktime_t now = ktime_get();
+	u64 overruns;
+
+	if (timer->expires > now)
+		return 0;
+	overruns = (now - timer->expires) / interval + 1;
+	timer->expires += overruns * interval;
+	return overruns;
+}
+
+/* Work queues */
+
+struct sim_worker {
+	pthread_t thread;
+	struct workqueue_struct *wq;
+	int cpu;
+	struct list_head works;
+	pthread_cond_t cond;
+	struct work_struct *cur;    /* Work it runs */
+};
+
+struct workqueue_struct {
+	struct list_head list;
+	char name[32];
+	unsigned int flags;
+	int nr_workers;
+	unsigned int next;          /* Worker of next unbound work */
+	bool stop;
+	struct sim_worker workers[NR_CPUS];
+};
+
+static pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wq_done = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(workqueues);
+struct workqueue_struct *system_wq;
+struct workqueue_struct *system_unbound_wq;
+struct workqueue_struct *system_highpri_wq;
+
+/* Called with wq lock held, worker the work runs on */
+static struct sim_worker *work_running(struct work_struct *work)
+{
+	struct workqueue_struct *wq;
+	int i;
+
+	list_for_each_entry(wq, &workqueues, list)
+		for (i = 0; i < wq->nr_workers; i++)
+			if (wq->workers[i].cur == work)
+				return &wq->workers[i];
+	return NULL;
+}
+
+static void *worker_loop(void *arg)
+{
+	struct sim_worker *w = arg;
+	struct work_struct *work;
+
+	sim_set_this_vcpu(w->cpu);
+	pthread_mutex_lock(&wq_lock);
+	for (;;) {
+		while (list_empty(&w->works) && !w->wq->stop)
+			pthread_cond_wait(&w->cond, &wq_lock);
+		if (list_empty(&w->works))
+			break;
+
+		work = list_first_entry(&w->works, struct work_struct, entry);
+		list_del_init(&work->entry);
+		work->pending = false;
+		w->cur = work;
+		pthread_mutex_unlock(&wq_lock);
+
+		/* May free work, it is not touched after */
+		work->func(work);
+
+		pthread_mutex_lock(&wq_lock);
+		w->cur = NULL;
+		pthread_cond_broadcast(&wq_done);
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+		int max_active, ...)
+{
+	struct workqueue_struct *wq = calloc(1, sizeof(*wq));
+	struct sim_worker *w;
+	va_list ap;
+	int i;
+
+	if (!wq)
+		return NULL;
+	va_start(ap, max_active);
+	vsnprintf(wq->name, sizeof(wq->name), fmt, ap);
+	va_end(ap);
+	wq->flags = flags;
+	wq->nr_workers = (flags & __WQ_ORDERED) ? 1 : nr_cpu_ids;
+
+	pthread_mutex_lock(&wq_lock);
+	for (i = 0; i < wq->nr_workers; i++) {
+		w = &wq->workers[i];
+		w->wq = wq;
+		w->cpu = i;
+		INIT_LIST_HEAD(&w->works);
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->thread, NULL, worker_loop, w))
+			break;
+	}
+	wq->nr_workers = i;
+	list_add_tail(&wq->list, &workqueues);
+	pthread_mutex_unlock(&wq_lock);
+	return wq;
+}
+
+/* Called with wq lock held, work is pending */
+static void __queue_work(int cpu, struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	struct sim_worker *w = work_running(work);
+
+	/* Never runs on two workers at once, as on Linux */
+	if (!w || w->wq != wq) {
+		if (wq->nr_workers == 1)
+			cpu = 0;
+		else if (cpu == WORK_CPU_UNBOUND)
+			cpu = (wq->flags & WQ_UNBOUND) ? wq->next++ :
+				smp_processor_id();
+		w = &wq->workers[cpu % wq->nr_workers];
+	}
+	list_add_tail(&work->entry, &w->works);
+	pthread_cond_signal(&w->cond);
+}
+
+bool queue_work_on(int cpu, struct workqueue_struct *wq, struct work_struct *work)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&wq_lock);
+	if (!work->pending) {
+		work->pending = queued = true;
+		__queue_work(cpu, wq, work);
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return queued;
+}
+
+void sim_init_work(struct work_struct *work, work_func_t func)
+{
+	INIT_LIST_HEAD(&work->entry);
+	work->func = func;
+	work->pending = false;
+}
+
+static enum hrtimer_restart delayed_work_timer(struct hrtimer *timer)
+{
+	struct delayed_work *dwork = container_of(timer, struct delayed_work, timer);
+
+	pthread_mutex_lock(&wq_lock);
+	__queue_work(dwork->cpu, dwork->wq, &dwork->work);
+	pthread_mutex_unlock(&wq_lock);
+	return HRTIMER_NORESTART;
+}
+
+void sim_init_delayed_work(struct delayed_work *dwork, work_func_t func)
+{
+	sim_init_work(&dwork->work, func);
+	hrtimer_init(&dwork->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+}
+
+/* Pending from now on, though in the timer till delay is over */
+bool queue_delayed_work_on(int cpu, struct workqueue_struct *wq,
+		struct delayed_work *dwork, unsigned long delay)
+{
+	pthread_mutex_lock(&wq_lock);
+	if (dwork->work.pending) {
+		pthread_mutex_unlock(&wq_lock);
+		return false;
+	}
+	dwork->work.pending = true;
+	dwork->wq = wq;
+	dwork->cpu = cpu;
+	if (!delay)
+		__queue_work(cpu, wq, &dwork->work);
+	pthread_mutex_unlock(&wq_lock);
+
+	if (delay) {
+		/* Static ones were never initialized */
+		if (!dwork->timer.entry.next)
+			hrtimer_init(&dwork->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		dwork->timer.function = delayed_work_timer;
+		hrtimer_start(&dwork->timer, ms_to_ktime(jiffies_to_msecs(delay)),
+				HRTIMER_MODE_REL);
+	}
+	return true;
+}
+
+/* Called with wq lock held */
+static bool work_grab_pending(struct work_struct *work)
+{
+	if (!work->pending)
+		return false;
+	list_del_init(&work->entry);
+	work->pending = false;
+	return true;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	struct sim_worker *w;
+	bool ret;
+
+	pthread_mutex_lock(&wq_lock);
+	/* A run that queues the work again is waited for, and that is
+	 * taken off too, as the work is marked canceling on Linux */
+	for (ret = false;;) {
+		ret |= work_grab_pending(work);
+		w = work_running(work);
+		if (!w || pthread_equal(pthread_self(), w->thread))
+			break;
+		pthread_cond_wait(&wq_done, &wq_lock);
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return ret;
+}
+
+bool cancel_delayed_work(struct delayed_work *dwork)
+{
+	bool ret;
+
+	if (dwork->timer.entry.next)
+		hrtimer_cancel(&dwork->timer);
+	pthread_mutex_lock(&wq_lock);
+	ret = work_grab_pending(&dwork->work);
+	pthread_mutex_unlock(&wq_lock);
+	return ret;
+}
+
+/* Work may queue itself again while cancelled */
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+	bool ret = false;
+
+	do {
+		ret |= cancel_delayed_work(dwork);
+		ret |= cancel_work_sync(&dwork->work);
+	} while (delayed_work_pending(dwork));
+	return ret;
+}
+
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+		unsigned long delay)
+{
+	bool ret = cancel_delayed_work(dwork);
+
+	queue_delayed_work(wq, dwork, delay);
+	return ret;
+}
+
+bool flush_work(struct work_struct *work)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&wq_lock);
+	while (work->pending || work_running(work)) {
+		ret = true;
+		pthread_cond_wait(&wq_done, &wq_lock);
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return ret;
+}
+
+/* Called with wq lock held */
+static bool wq_busy(struct workqueue_struct *wq)
+{
+	int i;
+
+	for (i = 0; i < wq->nr_workers; i++)
+		if (!list_empty(&wq->workers[i].works) || wq->workers[i].cur)
+			return true;
+	return false;
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	pthread_mutex_lock(&wq_lock);
+	while (wq_busy(wq))
+		pthread_cond_wait(&wq_done, &wq_lock);
+	pthread_mutex_unlock(&wq_lock);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	flush_workqueue(wq);
+	pthread_mutex_lock(&wq_lock);
+	wq->stop = true;
+	for (i = 0; i < wq->nr_workers; i++)
+		pthread_cond_signal(&wq->workers[i].cond);
+	pthread_mutex_unlock(&wq_lock);
+
+	for (i = 0; i < wq->nr_workers; i++)
+		pthread_join(wq->workers[i].thread, NULL);
+	pthread_mutex_lock(&wq_lock);
+	list_del(&wq->list);
+	pthread_mutex_unlock(&wq_lock);
+	free(wq);
+}
+
+/* Debugfs */
+
+struct dentry {
+	struct dentry *next;
+	struct dentry *parent;
+	char name[64];
+	void *data;
+	const struct file_operations *fops;     /* NULL for a dir */
+	bool removed;
+};
+
+static pthread_mutex_t debugfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dentry *dentries;
+
+static struct dentry *debugfs_create(const char *name, struct dentry *parent,
+		void *data, const struct file_operations *fops)
+{
+	struct dentry *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		return ERR_PTR(-ENOMEM);
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	d->parent = parent;
+	d->data = data;
+	d->fops = fops;
+
+	pthread_mutex_lock(&debugfs_lock);
+	d->next = dentries;
+	dentries = d;
+	pthread_mutex_unlock(&debugfs_lock);
+	return d;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return debugfs_create(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+		struct dentry *parent, void *data, const struct file_operations *fops)
+{
+	return debugfs_create(name, parent, data, fops);
+}
+
+static bool dentry_under(struct dentry *d, struct dentry *dir)
+{
+	for (; d; d = d->parent)
+		if (d == dir)
+			return true;
+	return false;
+}
+
+/* Dentries are kept, nothing of the module is touched after */
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	struct dentry *d;
+
+	if (IS_ERR_OR_NULL(dentry))
+		return;
+	pthread_mutex_lock(&debugfs_lock);
+	for (d = dentries; d; d = d->next)
+		if (dentry_under(d, dentry))
+			d->removed = true;
+	pthread_mutex_unlock(&debugfs_lock);
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	struct seq_file *m = calloc(1, sizeof(*m));
+
+	if (!m)
+		return -ENOMEM;
+	m->show = show;
+	m->private = data;
+	file->private_data = m;
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	free(file->private_data);
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	size_t len;
+	char *out;
+	ssize_t n;
+
+	m->out = open_memstream(&out, &len);
+	if (!m->out)
+		return -ENOMEM;
+	m->show(m, m->private);
+	fclose(m->out);
+	n = *ppos < (loff_t)len ? min(size, len - (size_t)*ppos) : 0;
+	memcpy(buf, out + *ppos, n);
+	*ppos += n;
+	free(out);
+	return n;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return offset;
+}
+
+static int debugfs_path(struct dentry *d, char *buf, int len)
+{
+	int n;
+
+	if (!d)
+		return snprintf(buf, len, "/sys/kernel/debug");
+	n = debugfs_path(d->parent, buf, len);
+	if (n < len)
+		n += snprintf(buf + n, len - n, "/%s", d->name);
+	return n;
+}
+
+/* Each file as cat would print it, what a test reads before rmmod */
+void sim_debugfs_dump(void)
+{
+	struct inode inode;
+	struct file file;
+	struct dentry *d;
+	char path[256], buf[4096];
+	loff_t pos = 0;
+	ssize_t n;
+
+	for (d = dentries; d; d = d->next) {
+		if (d->removed || !d->fops || !d->fops->open)
+			continue;
+		inode.i_private = d->data;
+		file.private_data = NULL;
+		if (d->fops->open(&inode, &file))
+			continue;
+		debugfs_path(d, path, sizeof(path));
+		printf("==> %s <==\n", path);
+		if (d->fops->read == seq_read) {
+			((struct seq_file *)file.private_data)->out = stdout;
+			((struct seq_file *)file.private_data)->show(file.private_data,
+					((struct seq_file *)file.private_data)->private);
+		} else if (d->fops->read) {
+			while ((n = d->fops->read(&file, buf, sizeof(buf), &pos)) > 0)
+				fwrite(buf, 1, n, stdout);
+		}
+		if (d->fops->release)
+			d->fops->release(&inode, &file);
+	}
+	fflush(stdout);
+}
+
+/* Module parameters */
+
+static struct sim_param {
+	const char *name;
+	void *var;
+	int type;
+	int *nump;
+	int max;
+} params[64];
+static int nr_params;
+
+void sim_module_param(const char *name, void *var, int type, int *nump, int max)
+{
+	if (nr_params == ARRAY_SIZE(params))
+		BUG();
+	params[nr_params++] = (struct sim_param) { name, var, type, nump, max };
+}
+
+static int param_parse(struct sim_param *p, int i, const char *val)
+{
+	char *end;
+
+	errno = 0;
+	switch (p->type) {
+	case SIM_PARAM_bool:
+		if (strchr("1yY", val[0]) && val[0])
+			((bool *)p->var)[i] = true;
+		else if (strchr("0nN", val[0]) && val[0])
+			((bool *)p->var)[i] = false;
+		else
+			return -EINVAL;
+		return 0;
+	case SIM_PARAM_charp:
+		((char **)p->var)[i] = strdup(val);
+		return 0;
+	case SIM_PARAM_int:
+		((int *)p->var)[i] = strtol(val, &end, 0);
+		break;
+	case SIM_PARAM_uint:
+		((unsigned int *)p->var)[i] = strtoul(val, &end, 0);
+		break;
+	case SIM_PARAM_long:
+		((long *)p->var)[i] = strtol(val, &end, 0);
+		break;
+	case SIM_PARAM_ulong:
+		((unsigned long *)p->var)[i] = strtoul(val, &end, 0);
+		break;
+	case SIM_PARAM_ushort:
+		((unsigned short *)p->var)[i] = strtoul(val, &end, 0);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return (errno || end == val || *end) ? -EINVAL : 0;
+}
+
+/* As insmod takes them, an array is values split by commas */
+int sim_module_param_set(const char *arg)
+{
+	char *name = strdup(arg), *val, *next;
+	struct sim_param *p = NULL;
+	int i, n = 0, err = -ENOENT;
+
+	val = strchr(name, '=');
+	if (!val)
+		goto out;
+	*val++ = '\0';
+	for (i = 0; i < nr_params; i++)
+		if (strcmp(params[i].name, name) == 0)
+			p = &params[i];
+	if (!p)
+		goto out;
+
+	err = 0;
+	for (; val && !err; val = next, n++) {
+		next = strchr(val, ',');
+		if (next)
+			*next++ = '\0';
+		err = n < p->max ? param_parse(p, n, val) : -EINVAL;
+	}
+	if (!err && p->nump)
+		*p->nump = n;
+out:
+	if (err)
+		fprintf(stderr, "%s: bad parameter %s\n", name, arg);
+	free(name);
+	return err;
+}
+
+void sim_kernel_start(void)
+{
+	pthread_condattr_t attr;
+	int cpu;
+
+	nr_cpu_ids = sim_nr_vcpus();
+	for (cpu = 0; cpu < (int)nr_cpu_ids; cpu++) {
+		cpu_masks[cpu].bits[0] = 1UL << cpu;
+		online_mask.bits[0] |= 1UL << cpu;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&timer_thread, NULL, timer_loop, NULL))
+		BUG();
+
+	system_wq = system_highpri_wq = alloc_workqueue("events", 0, 0);
+	system_unbound_wq = alloc_workqueue("events_unbound", WQ_UNBOUND, 0);
+	if (!system_wq || !system_unbound_wq)
+		BUG();
+	sim_xen_start();
+}
+
+/* Leftovers of the module are reported, as a leak would be */
+void sim_kernel_stop(void)
+{
+	sim_xen_stop();
+	destroy_workqueue(system_wq);
+	destroy_workqueue(system_unbound_wq);
+
+	pthread_mutex_lock(&timer_lock);
+	if (!list_empty(&timers))
+		printf("xensim: hrtimer left queued by module\n");
+	timer_stop = true;
+	pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_lock);
+	pthread_join(timer_thread, NULL);
+
+	if (nr_pages_used)
+		printf("xensim: %ld pages left allocated by module\n", nr_pages_used);
+}
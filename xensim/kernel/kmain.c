@@ -0,0 +1,89 @@
+/* Xen simulation: kernel of a domain with one module loaded
+ * This is under GPL License
+ *
+ * Usage: <module> [-d domid] [-c vcpus] [-t ms | -x] [param=value]...
+ *  -d  domain to run in, default 0
+ *  -c  vCPUs of the domain, default 1
+ *  -t  rmmod after ms, default on SIGTERM or SIGINT
+ *  -x  rmmod right after insmod
+ * Run under simrun, which passes the sim in XENSIM_FD. Debugfs files of
+ * the module are printed before rmmod. Exit status is that of insmod
+ */
+#include "sim_kernel.h"
+
+#include <signal.h>
+#include <time.h>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d domid] [-c vcpus] [-t ms | -x] [param=value]...\n",
+			prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int domid = 0, vcpus = 1, ms = -1, opt, err, i;
+	struct timespec ts;
+	sigset_t set;
+
+	while ((opt = getopt(argc, argv, "d:c:t:x")) != -1) {
+		switch (opt) {
+		case 'd':
+			domid = atoi(optarg);
+			break;
+		case 'c':
+			vcpus = atoi(optarg);
+			break;
+		case 't':
+			ms = atoi(optarg);
+			break;
+		case 'x':
+			ms = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* Threads inherit it, only sigwait below takes the signal */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	err = sim_attach_vcpus(domid, vcpus);
+	if (err) {
+		fprintf(stderr, "%s: attach to dom%d: %s\n", argv[0], domid,
+				strerror(-err));
+		return 1;
+	}
+	sim_kernel_start();
+	for (i = optind; i < argc; i++)
+		if (sim_module_param_set(argv[i]))
+			return 1;
+
+	err = sim_module_init ? sim_module_init() : 0;
+	if (err) {
+		printf("insmod: ERROR: could not insert module: %s\n", strerror(-err));
+		sim_kernel_stop();
+		sim_detach();
+		return 1;
+	}
+
+	if (ms > 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * NSEC_PER_MSEC;
+		sigtimedwait(&set, NULL, &ts);
+	} else if (ms < 0) {
+		sigwaitinfo(&set, NULL);
+	}
+
+	sim_debugfs_dump();
+	if (sim_module_exit)
+		sim_module_exit();
+	sim_kernel_stop();
+	sim_detach();
+	return 0;
+}
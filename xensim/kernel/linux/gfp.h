@@ -0,0 +1,2 @@
+/* Xen simulation, all of it is in sim_kernel.h */
+#include <sim_kernel.h>
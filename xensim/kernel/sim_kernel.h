@@ -0,0 +1,1025 @@
+/* Xen simulation: kernel API used by the Xen_Log_* modules
+ * This is under GPL License
+ *
+ * Every linux/, xen/ and asm/ header under kernel/ includes this one,
+ * so a module builds unchanged. Linked with kernel.c and kmain.c it is
+ * a program acting as the kernel of one domain with that module loaded:
+ * - module_init runs in main thread, module_exit on SIGTERM
+ * - irq handlers run in event threads of xensim, an irq is its port
+ * - work items run in a worker per vCPU, hrtimers in a timer thread
+ * - xenbus drivers are probed off xenstore watches as xenbus does
+ * Only what the modules use is here, and only as far as they use it
+ */
+#ifndef __SIM_KERNEL_H__
+#define __SIM_KERNEL_H__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "../xensim.h"
+
+/* Types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+/* Kernel has them as long long, printed with %llu */
+#define uint64_t u64
+#define int64_t s64
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+typedef unsigned long long cycles_t;
+typedef int irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int, void *);
+
+#define IRQ_NONE        0
+#define IRQ_HANDLED     1
+
+/* Annotations */
+#define __init
+#define __exit
+#define __user
+#define __percpu
+#define __iomem
+#define __read_mostly
+#define __must_check
+#define __maybe_unused  __attribute__((unused))
+#define __always_unused __attribute__((unused))
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+#define THIS_MODULE     NULL
+#define KBUILD_MODNAME  "sim"
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_ALIAS(x)
+#define MODULE_PARM_DESC(name, desc)
+
+/* Kernel the shim stands for, what modules check for APIs it has */
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE      KERNEL_VERSION(4, 9, 0)
+
+/* Printing */
+#define KERN_EMERG      ""
+#define KERN_ALERT      ""
+#define KERN_CRIT       ""
+#define KERN_ERR        ""
+#define KERN_WARNING    ""
+#define KERN_NOTICE     ""
+#define KERN_INFO       ""
+#define KERN_DEBUG      ""
+#define KERN_CONT       ""
+#ifndef pr_fmt
+#define pr_fmt(fmt)     fmt
+#endif
+#define printk(fmt, ...)        printf(fmt, ##__VA_ARGS__)
+#define pr_emerg(fmt, ...)      printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_err(fmt, ...)        printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...)       printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warning(fmt, ...)    printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_notice(fmt, ...)     printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...)       printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_cont(fmt, ...)       printf(fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...)      do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define pr_devel(fmt, ...)      do { } while (0)
+#define dev_err(dev, fmt, ...)  printf(fmt, ##__VA_ARGS__)
+#define dev_warn(dev, fmt, ...) printf(fmt, ##__VA_ARGS__)
+#define dev_info(dev, fmt, ...) printf(fmt, ##__VA_ARGS__)
+#define dev_dbg(dev, fmt, ...)  do { } while (0)
+
+#define BUG()           do { fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } while (0)
+#define BUG_ON(c)       do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c)      ({ int __c = !!(c); if (unlikely(__c)) { \
+			fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); } __c; })
+#define WARN_ON_ONCE(c) WARN_ON(c)
+#define WARN(c, fmt, ...) ({ int __c = !!(c); if (unlikely(__c)) { \
+			fprintf(stderr, fmt, ##__VA_ARGS__); } __c; })
+#define BUILD_BUG_ON(c) ((void)sizeof(char[1 - 2 * !!(c)]))
+
+/* Helpers */
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)       ({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b)       ({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
+#define min3(a, b, c)   min(min(a, b), c)
+#define max3(a, b, c)   max(max(a, b), c)
+#define min_t(t, a, b)  ({ t __a = (a); t __b = (b); __a < __b ? __a : __b; })
+#define max_t(t, a, b)  ({ t __a = (a); t __b = (b); __a > __b ? __a : __b; })
+#define clamp(v, lo, hi)        min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi)   min_t(t, max_t(t, v, lo), hi)
+#define swap(a, b)      do { typeof(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+#define DIV_ROUND_UP(n, d)      (((n) + (d) - 1) / (d))
+#define roundup(x, y)   (DIV_ROUND_UP(x, y) * (y))
+#define ALIGN(x, a)     (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define BITS_PER_LONG   64
+
+#define READ_ONCE(x)        (*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)    (*(volatile typeof(x) *)&(x) = (v))
+#define ACCESS_ONCE(x)      (*(volatile typeof(x) *)&(x))
+#define barrier()           __asm__ __volatile__("" ::: "memory")
+#define mb()                __sync_synchronize()
+#define rmb()               __sync_synchronize()
+#define wmb()               __sync_synchronize()
+#define smp_mb()            mb()
+#define smp_rmb()           rmb()
+#define smp_wmb()           wmb()
+#define virt_mb()           mb()
+#define virt_rmb()          rmb()
+#define virt_wmb()          wmb()
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define cpu_relax()         __builtin_ia32_pause()
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long __ffs(unsigned long x)
+{
+	return __builtin_ctzl(x);
+}
+
+#define ilog2(n)            (fls64(n) - 1)
+#define is_power_of_2(n)    ((n) != 0 && (((n) & ((n) - 1)) == 0))
+#define roundup_pow_of_two(n)   (1ULL << fls64((u64)(n) - 1))
+
+#define MAX_ERRNO       4095
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long err)
+{
+	return (void *)err;
+}
+
+static inline long PTR_ERR(const void *p)
+{
+	return (long)p;
+}
+
+static inline bool IS_ERR(const void *p)
+{
+	return IS_ERR_VALUE(p);
+}
+
+static inline bool IS_ERR_OR_NULL(const void *p)
+{
+	return !p || IS_ERR_VALUE(p);
+}
+
+static inline int kstrtou32(const char *s, unsigned int base, u32 *res)
+{
+	char *end;
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(s, &end, base);
+	if (end == s || (*end && *end != '\n'))
+		return -EINVAL;
+	if (errno || v > UINT32_MAX)
+		return -ERANGE;
+	*res = v;
+	return 0;
+}
+#define kstrtouint(s, base, res)    kstrtou32((s), (base), (res))
+
+/* Time */
+#define HZ              1000
+#define NSEC_PER_USEC   1000L
+#define NSEC_PER_MSEC   1000000L
+#define NSEC_PER_SEC    1000000000L
+#define USEC_PER_SEC    1000000L
+#define MSEC_PER_SEC    1000L
+#define jiffies         ((unsigned long)(ktime_get() / NSEC_PER_MSEC))
+
+ktime_t ktime_get(void);
+#define ktime_get_ns()          ((u64)ktime_get())
+#define ktime_to_ns(t)          ((s64)(t))
+#define ktime_to_us(t)          ((s64)(t) / NSEC_PER_USEC)
+#define ktime_to_ms(t)          ((s64)(t) / NSEC_PER_MSEC)
+#define ns_to_ktime(ns)         ((ktime_t)(ns))
+#define ms_to_ktime(ms)         ((ktime_t)(ms) * NSEC_PER_MSEC)
+#define ktime_set(s, ns)        ((ktime_t)(s) * NSEC_PER_SEC + (ns))
+#define ktime_sub(a, b)         ((a) - (b))
+#define ktime_add(a, b)         ((a) + (b))
+#define ktime_add_ns(t, ns)     ((t) + (ns))
+#define ktime_add_us(t, us)     ((t) + (s64)(us) * NSEC_PER_USEC)
+#define ktime_us_delta(a, b)    ktime_to_us((a) - (b))
+#define ktime_before(a, b)      ((a) < (b))
+#define ktime_after(a, b)       ((a) > (b))
+#define ktime_compare(a, b)     ((a) < (b) ? -1 : (a) > (b))
+#define msecs_to_jiffies(ms)    ((unsigned long)(ms))
+#define usecs_to_jiffies(us)    ((unsigned long)DIV_ROUND_UP((us), 1000))
+#define jiffies_to_msecs(j)     ((unsigned int)(j))
+#define time_after(a, b)        ((long)((b) - (a)) < 0)
+#define time_before(a, b)       time_after(b, a)
+
+static inline u64 div_u64(u64 n, u32 d)
+{
+	return n / d;
+}
+
+static inline u64 div64_u64(u64 n, u64 d)
+{
+	return n / d;
+}
+
+static inline s64 div_s64(s64 n, s32 d)
+{
+	return n / d;
+}
+
+#define do_div(n, base) ({ u32 __rem = (n) % (base); (n) /= (base); __rem; })
+
+static inline cycles_t get_cycles(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+
+void msleep(unsigned int ms);
+#define ssleep(s)               msleep((s) * 1000)
+#define usleep_range(lo, hi)    usleep(lo)
+#define udelay(us)              sim_delay_ns((u64)(us) * NSEC_PER_USEC)
+#define ndelay(ns)              sim_delay_ns(ns)
+void sim_delay_ns(u64 ns);
+
+/* Random */
+#define prandom_u32()           ((u32)random())
+
+/* Atomics */
+typedef struct {
+	int counter;
+} atomic_t;
+typedef struct {
+	long counter;
+} atomic_long_t;
+typedef struct {
+	s64 counter;
+} atomic64_t;
+#define ATOMIC_INIT(i)  { (i) }
+#define ATOMIC_LONG_INIT(i) { (i) }
+
+#define __atomic_ops(pfx, type, t)                                      \
+static inline t pfx##_read(const type *v)                               \
+{ return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }              \
+static inline void pfx##_set(type *v, t i)                              \
+{ __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }                 \
+static inline void pfx##_add(t i, type *v)                              \
+{ __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }               \
+static inline void pfx##_sub(t i, type *v)                              \
+{ __atomic_sub_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }               \
+static inline void pfx##_inc(type *v)                                   \
+{ __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }               \
+static inline void pfx##_dec(type *v)                                   \
+{ __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }               \
+static inline t pfx##_add_return(t i, type *v)                          \
+{ return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }        \
+static inline t pfx##_sub_return(t i, type *v)                          \
+{ return __atomic_sub_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }        \
+static inline t pfx##_inc_return(type *v)                               \
+{ return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }        \
+static inline t pfx##_dec_return(type *v)                               \
+{ return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }        \
+static inline bool pfx##_dec_and_test(type *v)                          \
+{ return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0; }   \
+static inline t pfx##_xchg(type *v, t i)                                \
+{ return __atomic_exchange_n(&v->counter, i, __ATOMIC_SEQ_CST); }       \
+static inline t pfx##_cmpxchg(type *v, t o, t n)                        \
+{ return __sync_val_compare_and_swap(&v->counter, o, n); }
+__atomic_ops(atomic, atomic_t, int)
+__atomic_ops(atomic_long, atomic_long_t, long)
+__atomic_ops(atomic64, atomic64_t, s64)
+#undef __atomic_ops
+
+#define cmpxchg(p, o, n)    __sync_val_compare_and_swap((p), (o), (n))
+#define cmpxchg64(p, o, n)  __sync_val_compare_and_swap((p), (o), (n))
+#define xchg(p, v)          __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static inline bool test_bit(long nr, const volatile unsigned long *addr)
+{
+	return (__atomic_load_n(&addr[nr / 64], __ATOMIC_RELAXED) >> (nr % 64)) & 1;
+}
+
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[nr / 64], 1UL << (nr % 64), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[nr / 64], ~(1UL << (nr % 64)), __ATOMIC_SEQ_CST);
+}
+
+static inline bool test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	return (__atomic_fetch_or(&addr[nr / 64], 1UL << (nr % 64),
+				__ATOMIC_SEQ_CST) >> (nr % 64)) & 1;
+}
+
+static inline bool test_and_clear_bit(long nr, volatile unsigned long *addr)
+{
+	return (__atomic_fetch_and(&addr[nr / 64], ~(1UL << (nr % 64)),
+				__ATOMIC_SEQ_CST) >> (nr % 64)) & 1;
+}
+
+/* Locks, irqs are threads so a mutex does for a spinlock */
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+#define __SPIN_LOCK_UNLOCKED(x) { PTHREAD_MUTEX_INITIALIZER }
+#define DEFINE_SPINLOCK(x)      spinlock_t x = __SPIN_LOCK_UNLOCKED(x)
+#define spin_lock_init(l)       pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l)            pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l)          pthread_mutex_unlock(&(l)->m)
+#define spin_trylock(l)         (pthread_mutex_trylock(&(l)->m) == 0)
+#define spin_lock_bh(l)         spin_lock(l)
+#define spin_unlock_bh(l)       spin_unlock(l)
+#define spin_lock_irq(l)        spin_lock(l)
+#define spin_unlock_irq(l)      spin_unlock(l)
+#define spin_lock_irqsave(l, flags)         do { (flags) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags)    do { (void)(flags); spin_unlock(l); } while (0)
+#define local_irq_save(flags)       ((flags) = 0)
+#define local_irq_restore(flags)    ((void)(flags))
+#define local_irq_disable()         do { } while (0)
+#define local_irq_enable()          do { } while (0)
+#define preempt_disable()           do { } while (0)
+#define preempt_enable()            do { } while (0)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+#define DEFINE_MUTEX(x)     struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(l)       pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)       pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)     pthread_mutex_unlock(&(l)->m)
+#define mutex_trylock(l)    (pthread_mutex_trylock(&(l)->m) == 0)
+
+/* Memory */
+#define GFP_KERNEL      0x01u
+#define GFP_ATOMIC      0x02u
+#define GFP_NOIO        0x04u
+#define GFP_NOWAIT      0x08u
+#define __GFP_HIGHMEM   0x10u
+#define __GFP_ZERO      0x20u
+#define __GFP_NOWARN    0x40u
+
+static inline void *kmalloc(size_t size, gfp_t gfp)
+{
+	return (gfp & __GFP_ZERO) ? calloc(1, size) : malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t gfp)
+{
+	return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t gfp)
+{
+	return calloc(n, size);
+}
+
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t gfp)
+{
+	return kmalloc(n * size, gfp);
+}
+
+static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
+{
+	void *p = malloc(len);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+static inline char *kstrdup(const char *s, gfp_t gfp)
+{
+	return s ? strdup(s) : NULL;
+}
+
+char *kasprintf(gfp_t gfp, const char *fmt, ...);
+#define kfree(p)        free((void *)(p))
+#define kvfree(p)       free((void *)(p))
+#define vmalloc(size)   malloc(size)
+#define vzalloc(size)   calloc(1, (size))
+#define vfree(p)        free((void *)(p))
+
+/* Pages are frames of xensim, pfn is gfn */
+#define PAGE_SIZE       SIM_PAGE_SIZE
+#define PAGE_SHIFT      12
+#define PAGE_MASK       (~(PAGE_SIZE - 1))
+#define XEN_PAGE_SIZE   PAGE_SIZE
+#define offset_in_page(p)   ((unsigned long)(p) & ~PAGE_MASK)
+
+struct page {
+	int unused;
+};
+extern struct page sim_pages[SIM_NR_FRAMES];
+
+#define page_to_pfn(p)      ((unsigned long)((p) - sim_pages))
+#define pfn_to_page(pfn)    (&sim_pages[(pfn)])
+#define page_address(p)     sim_gfn_to_virt(page_to_pfn(p))
+#define pfn_to_kaddr(pfn)   sim_gfn_to_virt(pfn)
+#define virt_to_page(v)     pfn_to_page(sim_virt_to_gfn((void *)(v)))
+#define virt_to_pfn(v)      ((unsigned long)sim_virt_to_gfn((void *)(v)))
+#define virt_to_gfn(v)      virt_to_pfn(v)
+#define virt_to_mfn(v)      virt_to_pfn(v)
+#define gfn_to_virt(g)      sim_gfn_to_virt(g)
+#define pfn_to_gfn(p)       (p)
+#define xen_page_to_gfn(p)  page_to_pfn(p)
+#define page_to_xen_pfn(p)  page_to_pfn(p)
+
+struct page *alloc_pages(gfp_t gfp, unsigned int order);
+void __free_pages(struct page *page, unsigned int order);
+#define alloc_page(gfp)     alloc_pages((gfp), 0)
+#define __free_page(p)      __free_pages((p), 0)
+unsigned long __get_free_pages(gfp_t gfp, unsigned int order);
+void free_pages(unsigned long addr, unsigned int order);
+#define __get_free_page(gfp)    __get_free_pages((gfp), 0)
+#define get_zeroed_page(gfp)    __get_free_pages((gfp), 0)
+#define free_page(addr)         free_pages((addr), 0)
+/* Frames are freed one by one anyway */
+#define split_page(page, order) do { } while (0)
+
+/* Range of address space pages are mapped into */
+struct vm_struct {
+	void *addr;
+	unsigned long size;
+};
+struct vm_struct *alloc_vm_area(size_t size, void *ptes);
+void free_vm_area(struct vm_struct *area);
+
+/* Lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(name)    { &(name), &(name) }
+#define LIST_HEAD(name)         struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *l)
+{
+	l->next = l->prev = l;
+}
+
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+		struct list_head *next)
+{
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	prev->next = n;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head->prev, head);
+}
+
+static inline void __list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	__list_del(entry);
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	__list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *l, struct list_head *head)
+{
+	__list_del(l);
+	list_add(l, head);
+}
+
+static inline void list_move_tail(struct list_head *l, struct list_head *head)
+{
+	__list_del(l);
+	list_add_tail(l, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_splice_init(struct list_head *list, struct list_head *head)
+{
+	if (list_empty(list))
+		return;
+	list->next->prev = head;
+	list->prev->next = head->next;
+	head->next->prev = list->prev;
+	head->next = list->next;
+	INIT_LIST_HEAD(list);
+}
+
+#define list_entry(ptr, type, member)       container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member)  list_entry((ptr)->prev, type, member)
+#define list_first_entry_or_null(ptr, type, member) \
+	(list_empty(ptr) ? NULL : list_first_entry(ptr, type, member))
+#define list_next_entry(pos, member) \
+	list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_for_each(pos, head) \
+	for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_entry(pos, head, member)                          \
+	for (pos = list_first_entry(head, typeof(*pos), member);        \
+	     &pos->member != (head);                                    \
+	     pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member)                  \
+	for (pos = list_first_entry(head, typeof(*pos), member),        \
+	     n = list_next_entry(pos, member);                          \
+	     &pos->member != (head);                                    \
+	     pos = n, n = list_next_entry(n, member))
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+struct hlist_head {
+	struct hlist_node *first;
+};
+#define HLIST_HEAD_INIT     { .first = NULL }
+#define INIT_HLIST_HEAD(h)  ((h)->first = NULL)
+#define INIT_HLIST_NODE(n)  ((n)->next = NULL, (n)->pprev = NULL)
+#define hlist_unhashed(n)   (!(n)->pprev)
+#define hlist_empty(h)      (!(h)->first)
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	n->next = h->first;
+	if (h->first)
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+static inline void hlist_del(struct hlist_node *n)
+{
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!hlist_unhashed(n))
+		hlist_del(n);
+}
+
+#define hlist_entry(ptr, type, member)  container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) \
+	({ typeof(ptr) ____ptr = (ptr); ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member)                                 \
+	for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), member);     \
+	     pos;                                                               \
+	     pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
+#define hlist_for_each_entry_safe(pos, n, head, member)                         \
+	for (pos = hlist_entry_safe((head)->first, typeof(*pos), member);       \
+	     pos && ({ n = pos->member.next; 1; });                             \
+	     pos = hlist_entry_safe(n, typeof(*pos), member))
+
+/* Hash tables */
+#define GOLDEN_RATIO_32 0x61C88647
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+static inline u32 hash_64(u64 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_64) >> (64 - bits);
+}
+
+#define hash_long(val, bits)    hash_64((val), (bits))
+#define DEFINE_HASHTABLE(name, bits)    struct hlist_head name[1 << (bits)]
+#define DECLARE_HASHTABLE(name, bits)   struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name)     (ARRAY_SIZE(name))
+#define HASH_BITS(name)     ilog2(HASH_SIZE(name))
+#define hash_min(val, bits) \
+	(sizeof(val) <= 4 ? hash_32((val), (bits)) : hash_64((val), (bits)))
+#define hash_init(ht)       memset((ht), 0, sizeof(ht))
+#define hash_add(ht, node, key) \
+	hlist_add_head((node), &(ht)[hash_min((key), HASH_BITS(ht))])
+#define hash_del(node)      hlist_del_init(node)
+#define hash_hashed(node)   (!hlist_unhashed(node))
+#define hash_for_each(ht, bkt, obj, member)                             \
+	for ((bkt) = 0; (bkt) < (int)HASH_SIZE(ht); (bkt)++)            \
+		hlist_for_each_entry(obj, &(ht)[bkt], member)
+#define hash_for_each_safe(ht, bkt, tmp, obj, member)                   \
+	for ((bkt) = 0; (bkt) < (int)HASH_SIZE(ht); (bkt)++)            \
+		hlist_for_each_entry_safe(obj, tmp, &(ht)[bkt], member)
+#define hash_for_each_possible(ht, obj, member, key) \
+	hlist_for_each_entry(obj, &(ht)[hash_min((key), HASH_BITS(ht))], member)
+
+/* Not Bob Jenkins' hash, spreads keys as well for a table */
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+	const u8 *p = key;
+	u32 h = 2166136261u ^ initval;
+
+	while (length--)
+		h = (h ^ *p++) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+static inline u32 jhash_1word(u32 a, u32 initval)
+{
+	return jhash(&a, sizeof(a), initval);
+}
+
+/* Red-black tree API over a plain binary tree, lookups are the same */
+struct rb_node {
+	struct rb_node *rb_parent;
+	struct rb_node *rb_left;
+	struct rb_node *rb_right;
+};
+struct rb_root {
+	struct rb_node *rb_node;
+};
+#define RB_ROOT             ((struct rb_root) { NULL })
+#define RB_EMPTY_ROOT(r)    ((r)->rb_node == NULL)
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_entry_safe(ptr, type, member) \
+	({ typeof(ptr) ____ptr = (ptr); ____ptr ? rb_entry(____ptr, type, member) : NULL; })
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+		struct rb_node **link)
+{
+	node->rb_parent = parent;
+	node->rb_left = node->rb_right = NULL;
+	*link = node;
+}
+
+static inline void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+
+/* CPUs are vCPUs of the domain */
+#define NR_CPUS         SIM_MAX_VCPUS
+#define NUMA_NO_NODE    (-1)
+struct cpumask {
+	unsigned long bits[1];
+};
+typedef struct cpumask cpumask_t;
+extern unsigned int nr_cpu_ids;
+extern const struct cpumask *cpu_online_mask;
+extern const struct cpumask *cpu_possible_mask;
+const struct cpumask *cpumask_of(int cpu);
+
+static inline bool cpumask_test_cpu(int cpu, const struct cpumask *m)
+{
+	return cpu >= 0 && cpu < NR_CPUS && (m->bits[0] >> cpu) & 1;
+}
+
+static inline unsigned int cpumask_next(int n, const struct cpumask *m)
+{
+	for (n++; n < (int)nr_cpu_ids; n++)
+		if (cpumask_test_cpu(n, m))
+			return n;
+	return nr_cpu_ids;
+}
+
+#define cpumask_first(m)        cpumask_next(-1, (m))
+#define cpumask_weight(m)       __builtin_popcountl((m)->bits[0])
+#define cpumask_equal(a, b)     ((a)->bits[0] == (b)->bits[0])
+#define for_each_cpu(cpu, m) \
+	for ((cpu) = cpumask_first(m); (cpu) < (int)nr_cpu_ids; (cpu) = cpumask_next((cpu), (m)))
+#define for_each_online_cpu(cpu)    for_each_cpu((cpu), cpu_online_mask)
+#define for_each_possible_cpu(cpu)  for_each_cpu((cpu), cpu_possible_mask)
+#define num_online_cpus()           nr_cpu_ids
+#define num_possible_cpus()         nr_cpu_ids
+#define smp_processor_id()          sim_this_vcpu()
+#define raw_smp_processor_id()      sim_this_vcpu()
+#define get_cpu()                   sim_this_vcpu()
+#define put_cpu()                   do { } while (0)
+#define numa_node_id()              0
+#define cpu_to_node(cpu)            0
+#define dev_to_node(dev)            0
+#define cpumask_local_spread(i, node)   ((unsigned int)(i) % nr_cpu_ids)
+
+#define alloc_percpu(type)      ((type *)calloc(NR_CPUS, sizeof(type)))
+#define free_percpu(p)          free(p)
+#define per_cpu_ptr(p, cpu)     (&(p)[(cpu)])
+#define this_cpu_ptr(p)         per_cpu_ptr((p), smp_processor_id())
+#define get_cpu_ptr(p)          this_cpu_ptr(p)
+#define put_cpu_ptr(p)          ((void)(p))
+
+/* Wait queues, a generation bumped by each wake_up. Sleeps are cut in
+ * slices, so a stop asked by kthread_stop is seen */
+typedef struct wait_queue_head {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long gen;
+} wait_queue_head_t;
+#define __WAIT_QUEUE_HEAD_INITIALIZER(n) \
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+#define DECLARE_WAIT_QUEUE_HEAD(n)  wait_queue_head_t n = __WAIT_QUEUE_HEAD_INITIALIZER(n)
+void init_waitqueue_head(wait_queue_head_t *wq);
+void sim_wake_up(wait_queue_head_t *wq);
+unsigned long sim_wait_gen(wait_queue_head_t *wq);
+/* Sleep until gen moves on or timeout ns, false on timeout */
+bool sim_wait(wait_queue_head_t *wq, unsigned long gen, s64 timeout);
+#define wake_up(wq)                 sim_wake_up(wq)
+#define wake_up_all(wq)             sim_wake_up(wq)
+#define wake_up_interruptible(wq)   sim_wake_up(wq)
+
+#define wait_event_timeout(wq, cond, timeout) ({                        \
+	ktime_t __end = ktime_get() + (s64)(timeout) * NSEC_PER_MSEC;   \
+	long __left = (timeout);                                        \
+	for (;;) {                                                      \
+		unsigned long __g = sim_wait_gen(&(wq));                \
+		if (cond) {                                             \
+			__left = max(__left, 1L);                       \
+			break;                                          \
+		}                                                       \
+		if (__left <= 0)                                        \
+			break;                                          \
+		sim_wait(&(wq), __g, __end - ktime_get());              \
+		__left = (__end - ktime_get()) / NSEC_PER_MSEC;         \
+		if (__left <= 0 && !(cond))                             \
+			__left = 0;                                     \
+	}                                                               \
+	__left;                                                         \
+})
+#define wait_event(wq, cond) do {                                       \
+	for (;;) {                                                      \
+		unsigned long __g = sim_wait_gen(&(wq));                \
+		if (cond)                                               \
+			break;                                          \
+		sim_wait(&(wq), __g, -1);                               \
+	}                                                               \
+} while (0)
+#define wait_event_interruptible(wq, cond)  ({ wait_event(wq, cond); 0; })
+#define wait_event_interruptible_timeout(wq, cond, timeout) \
+	wait_event_timeout(wq, cond, timeout)
+
+struct completion {
+	unsigned int done;
+	wait_queue_head_t wait;
+};
+#define COMPLETION_INITIALIZER(x)   { 0, __WAIT_QUEUE_HEAD_INITIALIZER((x).wait) }
+#define DECLARE_COMPLETION(x)       struct completion x = COMPLETION_INITIALIZER(x)
+void init_completion(struct completion *x);
+#define reinit_completion(x)        ((x)->done = 0)
+void complete(struct completion *x);
+void complete_all(struct completion *x);
+bool try_wait_for_completion(struct completion *x);
+#define completion_done(x)          (READ_ONCE((x)->done) != 0)
+#define wait_for_completion(x)      wait_event((x)->wait, try_wait_for_completion(x))
+#define wait_for_completion_timeout(x, timeout) \
+	((unsigned long)wait_event_timeout((x)->wait, try_wait_for_completion(x), (timeout)))
+#define wait_for_completion_interruptible(x)    ({ wait_for_completion(x); 0; })
+
+/* Threads */
+struct task_struct {
+	pthread_t thread;
+	int (*fn)(void *data);
+	void *data;
+	bool should_stop;
+	bool started;
+	int ret;
+	char comm[16];
+};
+struct task_struct *sim_current(void);
+#define current             sim_current()
+struct task_struct *kthread_create(int (*fn)(void *), void *data, const char *fmt, ...);
+int wake_up_process(struct task_struct *t);
+#define kthread_run(fn, data, fmt, ...) ({                              \
+	struct task_struct *__t = kthread_create(fn, data, fmt, ##__VA_ARGS__); \
+	if (!IS_ERR(__t))                                               \
+		wake_up_process(__t);                                   \
+	__t;                                                            \
+})
+bool kthread_should_stop(void);
+int kthread_stop(struct task_struct *t);
+#define TASK_RUNNING            0
+#define TASK_INTERRUPTIBLE      1
+#define TASK_UNINTERRUPTIBLE    2
+#define set_current_state(s)    do { } while (0)
+#define __set_current_state(s)  do { } while (0)
+/* Nothing signals a kernel thread here */
+#define signal_pending(t)       0
+#define ERESTARTSYS             512
+#define cond_resched()          sched_yield()
+#define schedule()              sched_yield()
+long schedule_timeout(long timeout);
+#define schedule_timeout_interruptible(t)   schedule_timeout(t)
+#define schedule_timeout_uninterruptible(t) schedule_timeout(t)
+#define in_interrupt()          0
+
+/* Timers */
+enum hrtimer_mode {
+	HRTIMER_MODE_ABS = 0,
+	HRTIMER_MODE_REL = 1,
+	HRTIMER_MODE_PINNED = 2,
+	HRTIMER_MODE_ABS_PINNED = 2,
+	HRTIMER_MODE_REL_PINNED = 3,
+};
+enum hrtimer_restart {
+	HRTIMER_NORESTART,
+	HRTIMER_RESTART,
+};
+struct hrtimer {
+	struct list_head entry;
+	ktime_t expires;
+	enum hrtimer_restart (*function)(struct hrtimer *);
+	bool queued;
+	bool running;
+	int cpu;                    /* Callback runs on */
+};
+void hrtimer_init(struct hrtimer *timer, clockid_t clock, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+bool hrtimer_is_queued(struct hrtimer *timer);
+bool hrtimer_active(struct hrtimer *timer);
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+#define hrtimer_get_expires(t)      ((t)->expires)
+#define hrtimer_set_expires(t, e)   ((t)->expires = (e))
+#define hrtimer_cb_get_time(t)      ktime_get()
+
+/* Work queues */
+#define WQ_UNBOUND          (1 << 1)
+#define WQ_FREEZABLE        (1 << 2)
+#define WQ_MEM_RECLAIM      (1 << 3)
+#define WQ_HIGHPRI          (1 << 4)
+#define WQ_CPU_INTENSIVE    (1 << 5)
+#define __WQ_ORDERED        (1 << 17)
+#define WORK_CPU_UNBOUND    NR_CPUS
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+struct workqueue_struct;
+struct work_struct {
+	struct list_head entry;
+	work_func_t func;
+	bool pending;
+};
+struct delayed_work {
+	struct work_struct work;
+	struct hrtimer timer;
+	struct workqueue_struct *wq;
+	int cpu;
+};
+#define __WORK_INITIALIZER(n, f)    { { &(n).entry, &(n).entry }, (f), false }
+#define DECLARE_WORK(n, f)          struct work_struct n = __WORK_INITIALIZER(n, f)
+#define DECLARE_DELAYED_WORK(n, f)  struct delayed_work n = { __WORK_INITIALIZER((n).work, f) }
+void sim_init_work(struct work_struct *work, work_func_t func);
+void sim_init_delayed_work(struct delayed_work *dwork, work_func_t func);
+#define INIT_WORK(w, f)             sim_init_work((w), (f))
+#define INIT_DELAYED_WORK(w, f)     sim_init_delayed_work((w), (f))
+#define to_delayed_work(w)          container_of(w, struct delayed_work, work)
+#define work_pending(w)             READ_ONCE((w)->pending)
+#define delayed_work_pending(w)     work_pending(&(w)->work)
+
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_unbound_wq;
+extern struct workqueue_struct *system_highpri_wq;
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+		int max_active, ...);
+#define alloc_ordered_workqueue(fmt, flags, ...) \
+	alloc_workqueue(fmt, WQ_UNBOUND | __WQ_ORDERED | (flags), 1, ##__VA_ARGS__)
+#define create_workqueue(name)  alloc_workqueue("%s", WQ_MEM_RECLAIM, 1, (name))
+#define create_singlethread_workqueue(name) alloc_ordered_workqueue("%s", WQ_MEM_RECLAIM, (name))
+void destroy_workqueue(struct workqueue_struct *wq);
+void flush_workqueue(struct workqueue_struct *wq);
+bool queue_work_on(int cpu, struct workqueue_struct *wq, struct work_struct *work);
+bool queue_delayed_work_on(int cpu, struct workqueue_struct *wq,
+		struct delayed_work *dwork, unsigned long delay);
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+		unsigned long delay);
+bool cancel_work_sync(struct work_struct *work);
+bool cancel_delayed_work(struct delayed_work *dwork);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+bool flush_work(struct work_struct *work);
+#define queue_work(wq, w)           queue_work_on(WORK_CPU_UNBOUND, (wq), (w))
+#define schedule_work(w)            queue_work(system_wq, (w))
+#define schedule_work_on(cpu, w)    queue_work_on((cpu), system_wq, (w))
+#define queue_delayed_work(wq, w, d)    queue_delayed_work_on(WORK_CPU_UNBOUND, (wq), (w), (d))
+#define schedule_delayed_work(w, d) queue_delayed_work(system_wq, (w), (d))
+#define flush_scheduled_work()      flush_workqueue(system_wq)
+
+/* Files, only debugfs files backed by seq_file. Their content is
+ * printed when module is removed */
+struct inode {
+	void *i_private;
+};
+struct file {
+	void *private_data;
+};
+struct file_operations {
+	void *owner;
+	int (*open)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+	int (*release)(struct inode *, struct file *);
+};
+struct seq_file {
+	FILE *out;
+	int (*show)(struct seq_file *, void *);
+	void *private;
+};
+struct dentry;
+#define seq_printf(m, fmt, ...)     fprintf((m)->out, fmt, ##__VA_ARGS__)
+#define seq_puts(m, s)              fputs((s), (m)->out)
+#define seq_putc(m, c)              fputc((c), (m)->out)
+int single_open(struct file *file, int (*show)(struct seq_file *, void *), void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+		struct dentry *parent, void *data, const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+#define debugfs_remove(d)   debugfs_remove_recursive(d)
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0)
+#define copy_to_user(to, from, n)   (memcpy((to), (from), (n)), 0)
+
+/* Module glue, kmain runs these */
+enum {
+	SIM_PARAM_int,
+	SIM_PARAM_uint,
+	SIM_PARAM_long,
+	SIM_PARAM_ulong,
+	SIM_PARAM_ushort,
+	SIM_PARAM_bool,
+	SIM_PARAM_charp,
+};
+void sim_module_param(const char *name, void *var, int type, int *nump, int max);
+int sim_module_param_set(const char *arg);      /* name=value */
+extern int (*sim_module_init)(void);
+extern void (*sim_module_exit)(void);
+#define __sim_param(name, var, type, nump, max)                         \
+	static void __attribute__((constructor)) __sim_param_##name(void) \
+	{                                                               \
+		sim_module_param(#name, (var), (type), (nump), (max));  \
+	}
+#define module_param_named(name, var, type, perm)                       \
+	__sim_param(name, &(var), SIM_PARAM_##type, NULL, 1)
+#define module_param(name, type, perm)                                  \
+	__sim_param(name, &(name), SIM_PARAM_##type, NULL, 1)
+#define module_param_array(name, type, nump, perm)                      \
+	__sim_param(name, (name), SIM_PARAM_##type, (nump), ARRAY_SIZE(name))
+#define module_init(fn)                                                 \
+	static void __attribute__((constructor)) __sim_module_init(void) \
+	{                                                               \
+		sim_module_init = (fn);                                 \
+	}
+#define module_exit(fn)                                                 \
+	static void __attribute__((constructor)) __sim_module_exit(void) \
+	{                                                               \
+		sim_module_exit = (fn);                                 \
+	}
+void sim_kernel_start(void);
+void sim_kernel_stop(void);
+void sim_debugfs_dump(void);
+
+#include "sim_xen.h"
+
+#endif
@@ -0,0 +1,287 @@
+/* Xen simulation: Xen part of kernel API, grant tables, event channels
+ * and xenbus, as Linux has them on xensim
+ * This is under GPL License
+ *
+ * A grant handle indexes a table of this process, an irq is the port
+ * it is bound to. A xenbus device is probed when its node shows with
+ * state Initialising, the other end's state is watched after
+ */
+#ifndef __SIM_XEN_H__
+#define __SIM_XEN_H__
+
+typedef uint16_t domid_t;
+typedef uint32_t grant_ref_t;
+typedef uint32_t grant_handle_t;
+typedef uint32_t evtchn_port_t;
+typedef unsigned long xen_pfn_t;
+typedef u64 phys_addr_t;
+
+#define DOMID_FIRST_RESERVED    0x7FF0U
+#define DOMID_SELF              0x7FF0U
+
+/* Only the store of start_info */
+struct start_info {
+	xen_pfn_t store_mfn;
+	uint32_t store_evtchn;
+};
+extern struct start_info *xen_start_info;
+#define xen_domain()            1
+#define xen_pv_domain()         1
+#define xen_hvm_domain()        0
+#define xen_initial_domain()    (sim_domid() == 0)
+
+/* A trap into host kernel stands for one into Xen */
+#define XENVER_version  0
+int HYPERVISOR_xen_version(int cmd, void *arg);
+/* Hypercalls of Xen side code a module program is built with, see hv/ */
+long sim_hypercall2(unsigned int op, unsigned long a1, unsigned long a2);
+#define _hypercall2(type, name, a1, a2)                                 \
+	((type)sim_hypercall2(__HYPERVISOR_##name, (unsigned long)(a1),   \
+			(unsigned long)(a2)))
+
+/* Grant tables */
+#define GNTTABOP_map_grant_ref      0
+#define GNTTABOP_unmap_grant_ref    1
+#define GNTTABOP_copy               5
+#define GNTMAP_device_map       (1 << 0)
+#define GNTMAP_host_map         (1 << 1)
+#define GNTMAP_readonly         (1 << 2)
+#define GNTCOPY_source_gref     (1 << 0)
+#define GNTCOPY_dest_gref       (1 << 1)
+#define GNTST_okay              (0)
+#define GNTST_general_error     (-1)
+#define GNTST_bad_domain        (-2)
+#define GNTST_bad_gntref        (-3)
+#define GNTST_bad_handle        (-4)
+#define GNTST_bad_virt_addr     (-5)
+#define GNTST_no_device_space   (-7)
+#define GNTST_permission_denied (-8)
+#define GNTST_bad_copy_arg      (-10)
+
+struct gnttab_map_grant_ref {
+	u64 host_addr;
+	uint32_t flags;
+	grant_ref_t ref;
+	domid_t dom;
+	int16_t status;
+	grant_handle_t handle;
+	uint64_t dev_bus_addr;
+};
+
+struct gnttab_unmap_grant_ref {
+	u64 host_addr;
+	uint64_t dev_bus_addr;
+	grant_handle_t handle;
+	int16_t status;
+};
+
+struct gnttab_copy {
+	struct {
+		union {
+			grant_ref_t ref;
+			xen_pfn_t gmfn;
+		} u;
+		domid_t domid;
+		uint16_t offset;
+	} source, dest;
+	uint16_t len;
+	uint16_t flags;
+	int16_t status;
+};
+
+static inline void gnttab_set_map_op(struct gnttab_map_grant_ref *map,
+		phys_addr_t addr, uint32_t flags, grant_ref_t ref, domid_t domid)
+{
+	map->host_addr = addr;
+	map->flags = flags;
+	map->ref = ref;
+	map->dom = domid;
+}
+
+static inline void gnttab_set_unmap_op(struct gnttab_unmap_grant_ref *unmap,
+		phys_addr_t addr, uint32_t flags, grant_handle_t handle)
+{
+	unmap->host_addr = addr;
+	unmap->handle = handle;
+	unmap->dev_bus_addr = 0;
+}
+
+int HYPERVISOR_grant_table_op(unsigned int cmd, void *uop, unsigned int count);
+int gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly);
+int gnttab_end_foreign_access_ref(grant_ref_t ref, int readonly);
+/* Page is freed once remote unmaps it, retried until then */
+void gnttab_end_foreign_access(grant_ref_t ref, int readonly, unsigned long page);
+int gnttab_query_foreign_access(grant_ref_t ref);
+int gnttab_alloc_pages(int nr_pages, struct page **pages);
+void gnttab_free_pages(int nr_pages, struct page **pages);
+int gnttab_map_refs(struct gnttab_map_grant_ref *map_ops,
+		struct gnttab_map_grant_ref *kmap_ops,
+		struct page **pages, unsigned int count);
+int gnttab_unmap_refs(struct gnttab_unmap_grant_ref *unmap_ops,
+		struct gnttab_unmap_grant_ref *kunmap_ops,
+		struct page **pages, unsigned int count);
+void gnttab_batch_copy(struct gnttab_copy *batch, unsigned int count);
+
+/* Event channels */
+#define EVTCHNOP_bind_interdomain   0
+#define EVTCHNOP_close              3
+#define EVTCHNOP_send               4
+#define EVTCHNOP_alloc_unbound      6
+#define EVTCHNOP_bind_vcpu          8
+
+struct evtchn_alloc_unbound {
+	domid_t dom, remote_dom;
+	evtchn_port_t port;
+};
+
+struct evtchn_bind_interdomain {
+	domid_t remote_dom;
+	evtchn_port_t remote_port;
+	evtchn_port_t local_port;
+};
+
+struct evtchn_send {
+	evtchn_port_t port;
+};
+
+struct evtchn_close {
+	evtchn_port_t port;
+};
+
+struct evtchn_bind_vcpu {
+	evtchn_port_t port;
+	uint32_t vcpu;
+};
+
+int HYPERVISOR_event_channel_op(int cmd, void *arg);
+int bind_evtchn_to_irq(unsigned int evtchn);
+int bind_evtchn_to_irqhandler(unsigned int evtchn, irq_handler_t handler,
+		unsigned long irqflags, const char *devname, void *dev_id);
+int bind_interdomain_evtchn_to_irqhandler(unsigned int remote_domain,
+		unsigned int remote_port, irq_handler_t handler,
+		unsigned long irqflags, const char *devname, void *dev_id);
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev_id);
+void unbind_from_irqhandler(unsigned int irq, void *dev_id);
+void unbind_from_irq(unsigned int irq);
+void disable_irq(unsigned int irq);
+void disable_irq_nosync(unsigned int irq);
+void enable_irq(unsigned int irq);
+void notify_remote_via_irq(int irq);
+void notify_remote_via_evtchn(int port);
+int irq_from_evtchn(unsigned int evtchn);
+#define evtchn_from_irq(irq)    ((unsigned int)(irq))
+/* Moves the port to first cpu of mask, hint does too as on Linux */
+int irq_set_affinity(unsigned int irq, const struct cpumask *mask);
+int irq_set_affinity_hint(unsigned int irq, const struct cpumask *mask);
+const struct cpumask *irq_get_affinity_mask(int irq);
+
+/* Xenbus */
+#define XENBUS_MAX_RING_GRANT_ORDER 4
+#define XENBUS_MAX_RING_GRANTS  (1U << XENBUS_MAX_RING_GRANT_ORDER)
+#define XS_WATCH_PATH   0
+#define XS_WATCH_TOKEN  1
+
+struct device_driver {
+	const char *name;
+	void *owner;
+};
+
+struct device {
+	void *driver_data;
+};
+#define dev_get_drvdata(d)      ((d)->driver_data)
+#define dev_set_drvdata(d, p)   ((d)->driver_data = (p))
+#define dev_name(d)             (to_xenbus_device(d)->nodename)
+
+struct xenbus_watch {
+	struct list_head list;
+	const char *node;
+	void (*callback)(struct xenbus_watch *, const char **vec, unsigned int len);
+};
+
+struct xenbus_driver;
+struct xenbus_device {
+	const char *devicetype;
+	const char *nodename;
+	const char *otherend;
+	int otherend_id;
+	struct xenbus_watch otherend_watch;
+	struct device dev;
+	enum xenbus_state state;
+	struct completion down;
+	struct xenbus_driver *drv;
+	struct list_head list;
+};
+#define to_xenbus_device(d)     container_of(d, struct xenbus_device, dev)
+
+struct xenbus_device_id {
+	char devicetype[32];
+};
+
+struct xenbus_driver {
+	const char *name;
+	const struct xenbus_device_id *ids;
+	int (*probe)(struct xenbus_device *dev, const struct xenbus_device_id *id);
+	void (*otherend_changed)(struct xenbus_device *dev, enum xenbus_state state);
+	int (*remove)(struct xenbus_device *dev);
+	int (*suspend)(struct xenbus_device *dev);
+	int (*resume)(struct xenbus_device *dev);
+	struct device_driver driver;
+	bool backend;
+};
+
+struct xenbus_transaction {
+	u32 id;
+};
+#define XBT_NIL ((struct xenbus_transaction) { 0 })
+
+int xenbus_register_frontend(struct xenbus_driver *drv);
+int xenbus_register_backend(struct xenbus_driver *drv);
+void xenbus_unregister_driver(struct xenbus_driver *drv);
+void device_unregister(struct device *dev);
+
+void *xenbus_read(struct xenbus_transaction t, const char *dir,
+		const char *node, unsigned int *len);
+int xenbus_write(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *string);
+__attribute__((format(printf, 4, 5)))
+int xenbus_printf(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *fmt, ...);
+__attribute__((format(scanf, 4, 5)))
+int xenbus_scanf(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *fmt, ...);
+unsigned int xenbus_read_unsigned(const char *dir, const char *node,
+		unsigned int default_val);
+int xenbus_exists(struct xenbus_transaction t, const char *dir, const char *node);
+int xenbus_transaction_start(struct xenbus_transaction *t);
+int xenbus_transaction_end(struct xenbus_transaction t, int abort);
+int register_xenbus_watch(struct xenbus_watch *watch);
+void unregister_xenbus_watch(struct xenbus_watch *watch);
+/* Raw request as /dev/xen/xenbus sends, header then body in one
+ * buffer. Reply is kmalloc'ed, header updated to it */
+void *xenbus_dev_request_and_reply(struct xsd_sockmsg *msg);
+
+int xenbus_switch_state(struct xenbus_device *dev, enum xenbus_state state);
+int xenbus_frontend_closed(struct xenbus_device *dev);
+__attribute__((format(printf, 3, 4)))
+void xenbus_dev_fatal(struct xenbus_device *dev, int err, const char *fmt, ...);
+__attribute__((format(printf, 3, 4)))
+void xenbus_dev_error(struct xenbus_device *dev, int err, const char *fmt, ...);
+int xenbus_dev_is_online(struct xenbus_device *dev);
+const char *xenbus_strstate(enum xenbus_state state);
+int xenbus_grant_ring(struct xenbus_device *dev, void *vaddr,
+		unsigned int nr_pages, grant_ref_t *grefs);
+int xenbus_map_ring_valloc(struct xenbus_device *dev, grant_ref_t *gnt_refs,
+		unsigned int nr_grefs, void **vaddr);
+int xenbus_unmap_ring_vfree(struct xenbus_device *dev, void *vaddr);
+int xenbus_alloc_evtchn(struct xenbus_device *dev, evtchn_port_t *port);
+int xenbus_free_evtchn(struct xenbus_device *dev, evtchn_port_t port);
+
+/* Set up and torn down around the module by sim_kernel_start/stop */
+void sim_xen_start(void);
+void sim_xen_stop(void);
+void sim_xenbus_start(void);
+
+#endif
@@ -0,0 +1,567 @@
+/* Xen simulation: grant tables, event channels and hypercalls
+ * This is under GPL License
+ *
+ * Hypercalls are done as calls into xensim. Map ops of a batch go down
+ * in one sim_map_grants, like the one hypercall they are on Xen
+ */
+#include "sim_kernel.h"
+
+#include <sys/syscall.h>
+
+#include "../hv/sim_hv_call.h"
+
+/* Grant handles of this process */
+#define MAX_HANDLES     4096
+/* How often an end of access still in use is tried again */
+#define DEFERRED_MS     100
+
+/* xenbus of the shim talks to xensim directly and leaves the store ring
+ * and its port alone. start_info still points at them, for whoever asks */
+static struct start_info start_info;
+struct start_info *xen_start_info = &start_info;
+
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_map_op handles[MAX_HANDLES];
+static bool handle_used[MAX_HANDLES];
+
+struct deferred_entry {
+	struct list_head list;
+	grant_ref_t ref;
+	unsigned long page;
+};
+static DEFINE_SPINLOCK(deferred_lock);
+static LIST_HEAD(deferred_list);
+static struct hrtimer deferred_timer;
+
+/* Irq of each port bound to a handler */
+static struct sim_irq {
+	irq_handler_t handler;
+	void *dev_id;
+	const char *name;
+	struct cpumask affinity;
+	int depth;                  /* Disabled while nonzero */
+	bool pending;               /* Event came while disabled */
+	bool active;                /* Handler is running */
+	bool mapped;                /* Port has an irq, handler or not */
+} irqs[SIM_MAX_PORTS];
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_done = PTHREAD_COND_INITIALIZER;
+
+/* Entry to Xen costs a trap, a syscall stands in for it so that a
+ * batch of ops is timed as cheaper than a hypercall for each */
+static void hypercall_trap(void)
+{
+	syscall(SYS_getppid);
+}
+
+int HYPERVISOR_xen_version(int cmd, void *arg)
+{
+	hypercall_trap();
+	return cmd == XENVER_version ? (4 << 16) | 10 : -ENOSYS;
+}
+
+/* Weak, programs without Xen side code have none */
+long sim_hv_call(unsigned int *op, unsigned long args[2]) __attribute__((weak));
+
+/* A preempted hypercall traps again to go on */
+long sim_hypercall2(unsigned int op, unsigned long a1, unsigned long a2)
+{
+	unsigned long args[2] = { a1, a2 };
+	long rc;
+
+	if (!sim_hv_call)
+		return -ENOSYS;
+	do {
+		hypercall_trap();
+		rc = sim_hv_call(&op, args);
+	} while (rc == SIM_HV_CONTINUATION);
+	return rc;
+}
+
+/* Grants */
+
+static int16_t gnttab_status(int err, int16_t bad_arg)
+{
+	switch (err) {
+	case 0:
+		return GNTST_okay;
+	case -EPERM:
+		return GNTST_permission_denied;
+	case -EINVAL:
+		return bad_arg;
+	default:
+		return GNTST_general_error;
+	}
+}
+
+static void map_grant_refs(struct gnttab_map_grant_ref *ops, unsigned int count)
+{
+	struct sim_map_op *sops = calloc(count, sizeof(*sops));
+	unsigned int i;
+	int h = 0;
+
+	if (!sops) {
+		for (i = 0; i < count; i++)
+			ops[i].status = GNTST_general_error;
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		sops[i].domid = ops[i].dom == DOMID_SELF ? sim_domid() : ops[i].dom;
+		sops[i].ref = ops[i].ref;
+		sops[i].readonly = ops[i].flags & GNTMAP_readonly;
+		sops[i].addr = (void *)(unsigned long)ops[i].host_addr;
+	}
+	sim_map_grants(sops, count);
+
+	pthread_mutex_lock(&handle_lock);
+	for (i = 0; i < count; i++) {
+		ops[i].status = gnttab_status(sops[i].status, GNTST_bad_gntref);
+		if (ops[i].status)
+			continue;
+		while (h < MAX_HANDLES && handle_used[h])
+			h++;
+		if (h == MAX_HANDLES) {
+			sim_unmap_grants(&sops[i], 1);
+			ops[i].status = GNTST_no_device_space;
+			continue;
+		}
+		handle_used[h] = true;
+		handles[h] = sops[i];
+		ops[i].handle = h;
+		ops[i].host_addr = (unsigned long)sops[i].addr;
+	}
+	pthread_mutex_unlock(&handle_lock);
+	free(sops);
+}
+
+static void unmap_grant_refs(struct gnttab_unmap_grant_ref *ops, unsigned int count)
+{
+	struct sim_map_op *h;
+	unsigned int i;
+
+	pthread_mutex_lock(&handle_lock);
+	for (i = 0; i < count; i++) {
+		if (ops[i].handle >= MAX_HANDLES || !handle_used[ops[i].handle]) {
+			ops[i].status = GNTST_bad_handle;
+			continue;
+		}
+		h = &handles[ops[i].handle];
+		if ((unsigned long)h->addr != ops[i].host_addr) {
+			ops[i].status = GNTST_bad_virt_addr;
+		} else {
+			sim_unmap_grants(h, 1);
+			handle_used[ops[i].handle] = false;
+			ops[i].status = GNTST_okay;
+		}
+	}
+	pthread_mutex_unlock(&handle_lock);
+}
+
+static void copy_ptr(struct sim_copy_ptr *p, bool gref, grant_ref_t ref,
+		xen_pfn_t gmfn, domid_t domid, uint16_t offset)
+{
+	p->domid = domid == DOMID_SELF ? sim_domid() : domid;
+	p->ref = gref ? (int)ref : 0;
+	p->gfn = gref ? 0 : gmfn;
+	p->offset = offset;
+}
+
+static void copy_grants(struct gnttab_copy *ops, unsigned int count)
+{
+	struct sim_copy_op *sops = calloc(count, sizeof(*sops));
+	unsigned int i;
+
+	for (i = 0; i < count && sops; i++) {
+		copy_ptr(&sops[i].src, ops[i].flags & GNTCOPY_source_gref,
+				ops[i].source.u.ref, ops[i].source.u.gmfn,
+				ops[i].source.domid, ops[i].source.offset);
+		copy_ptr(&sops[i].dst, ops[i].flags & GNTCOPY_dest_gref,
+				ops[i].dest.u.ref, ops[i].dest.u.gmfn,
+				ops[i].dest.domid, ops[i].dest.offset);
+		sops[i].len = ops[i].len;
+	}
+	if (sops)
+		sim_copy_grants(sops, count);
+	for (i = 0; i < count; i++)
+		ops[i].status = sops ? gnttab_status(sops[i].status,
+				GNTST_bad_copy_arg) : GNTST_general_error;
+	free(sops);
+}
+
+int HYPERVISOR_grant_table_op(unsigned int cmd, void *uop, unsigned int count)
+{
+	hypercall_trap();
+	switch (cmd) {
+	case GNTTABOP_map_grant_ref:
+		map_grant_refs(uop, count);
+		return 0;
+	case GNTTABOP_unmap_grant_ref:
+		unmap_grant_refs(uop, count);
+		return 0;
+	case GNTTABOP_copy:
+		copy_grants(uop, count);
+		return 0;
+	default:
+		return -ENOSYS;
+	}
+}
+
+int gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly)
+{
+	return sim_grant_access(domid, frame, readonly);
+}
+
+int gnttab_end_foreign_access_ref(grant_ref_t ref, int readonly)
+{
+	return sim_end_access(ref) == 0;
+}
+
+int gnttab_query_foreign_access(grant_ref_t ref)
+{
+	return sim_grant_mapped(ref) > 0;
+}
+
+static enum hrtimer_restart deferred_retry(struct hrtimer *timer)
+{
+	struct deferred_entry *e, *n;
+	bool left;
+
+	spin_lock(&deferred_lock);
+	list_for_each_entry_safe(e, n, &deferred_list, list) {
+		if (!gnttab_end_foreign_access_ref(e->ref, 0))
+			continue;
+		free_page(e->page);
+		list_del(&e->list);
+		free(e);
+	}
+	left = !list_empty(&deferred_list);
+	spin_unlock(&deferred_lock);
+
+	if (!left)
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, ms_to_ktime(DEFERRED_MS));
+	return HRTIMER_RESTART;
+}
+
+/* As Linux, a grant still mapped is ended, and its page freed, later */
+void gnttab_end_foreign_access(grant_ref_t ref, int readonly, unsigned long page)
+{
+	struct deferred_entry *e;
+
+	if (gnttab_end_foreign_access_ref(ref, readonly)) {
+		free_page(page);
+		return;
+	}
+
+	pr_warn("xen:grant_table: WARNING: g.e. %#x still in use!\n", ref);
+	e = malloc(sizeof(*e));
+	if (!e) {
+		pr_warn("xen:grant_table: leaking g.e. and page still in use!\n");
+		return;
+	}
+	e->ref = ref;
+	e->page = page;
+	spin_lock(&deferred_lock);
+	list_add_tail(&e->list, &deferred_list);
+	spin_unlock(&deferred_lock);
+	if (!hrtimer_active(&deferred_timer))
+		hrtimer_start(&deferred_timer, ms_to_ktime(DEFERRED_MS), HRTIMER_MODE_REL);
+}
+
+int gnttab_alloc_pages(int nr_pages, struct page **pages)
+{
+	int i;
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			gnttab_free_pages(i, pages);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void gnttab_free_pages(int nr_pages, struct page **pages)
+{
+	int i;
+
+	for (i = 0; i < nr_pages; i++) {
+		__free_page(pages[i]);
+		pages[i] = NULL;
+	}
+}
+
+int gnttab_map_refs(struct gnttab_map_grant_ref *map_ops,
+		struct gnttab_map_grant_ref *kmap_ops,
+		struct page **pages, unsigned int count)
+{
+	return HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, map_ops, count);
+}
+
+int gnttab_unmap_refs(struct gnttab_unmap_grant_ref *unmap_ops,
+		struct gnttab_unmap_grant_ref *kunmap_ops,
+		struct page **pages, unsigned int count)
+{
+	return HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, unmap_ops, count);
+}
+
+void gnttab_batch_copy(struct gnttab_copy *batch, unsigned int count)
+{
+	HYPERVISOR_grant_table_op(GNTTABOP_copy, batch, count);
+}
+
+/* Event channels */
+
+int HYPERVISOR_event_channel_op(int cmd, void *arg)
+{
+	struct evtchn_alloc_unbound *alloc = arg;
+	struct evtchn_bind_interdomain *bind = arg;
+	struct evtchn_bind_vcpu *bind_vcpu = arg;
+	int port;
+
+	switch (cmd) {
+	case EVTCHNOP_alloc_unbound:
+		port = sim_alloc_unbound(alloc->remote_dom);
+		if (port < 0)
+			return port;
+		alloc->port = port;
+		return 0;
+	case EVTCHNOP_bind_interdomain:
+		port = sim_bind_interdomain(bind->remote_dom, bind->remote_port);
+		if (port < 0)
+			return port;
+		bind->local_port = port;
+		return 0;
+	case EVTCHNOP_send:
+		return sim_notify(((struct evtchn_send *)arg)->port);
+	case EVTCHNOP_close:
+		return sim_close_port(((struct evtchn_close *)arg)->port);
+	case EVTCHNOP_bind_vcpu:
+		return sim_bind_vcpu(bind_vcpu->port, bind_vcpu->vcpu);
+	default:
+		return -ENOSYS;
+	}
+}
+
+static void run_handler(struct sim_irq *irq, int port)
+{
+	irq->active = true;
+	pthread_mutex_unlock(&irq_lock);
+	irq->handler(port, irq->dev_id);
+	pthread_mutex_lock(&irq_lock);
+	irq->active = false;
+	pthread_cond_broadcast(&irq_done);
+}
+
+static int irq_trampoline(int port, void *arg)
+{
+	struct sim_irq *irq = arg;
+
+	pthread_mutex_lock(&irq_lock);
+	if (irq->depth)
+		irq->pending = true;
+	else if (irq->handler)
+		run_handler(irq, port);
+	pthread_mutex_unlock(&irq_lock);
+	return 0;
+}
+
+void disable_irq_nosync(unsigned int irq)
+{
+	pthread_mutex_lock(&irq_lock);
+	irqs[irq].depth++;
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/* Waits for the handler, deadlocks if called from it as on Linux */
+void disable_irq(unsigned int irq)
+{
+	pthread_mutex_lock(&irq_lock);
+	irqs[irq].depth++;
+	while (irqs[irq].active)
+		pthread_cond_wait(&irq_done, &irq_lock);
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/* An event that came while disabled is handled here, in place of the
+ * resend Linux does */
+void enable_irq(unsigned int irq)
+{
+	struct sim_irq *i = &irqs[irq];
+
+	pthread_mutex_lock(&irq_lock);
+	if (WARN(i->depth == 0, "Unbalanced enable for IRQ %u\n", irq)) {
+		pthread_mutex_unlock(&irq_lock);
+		return;
+	}
+	if (--i->depth == 0 && i->pending && i->handler) {
+		i->pending = false;
+		run_handler(i, irq);
+	}
+	pthread_mutex_unlock(&irq_lock);
+}
+
+int bind_evtchn_to_irq(unsigned int evtchn)
+{
+	if (evtchn == 0 || evtchn >= SIM_MAX_PORTS)
+		return -EINVAL;
+	irqs[evtchn].mapped = true;
+	return evtchn;
+}
+
+int irq_from_evtchn(unsigned int evtchn)
+{
+	return evtchn > 0 && evtchn < SIM_MAX_PORTS && irqs[evtchn].mapped ?
+		(int)evtchn : -1;
+}
+
+/* One handler an irq, none is shared */
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev)
+{
+	int err;
+
+	if (irq == 0 || irq >= SIM_MAX_PORTS)
+		return -EINVAL;
+	if (irqs[irq].handler)
+		return -EBUSY;
+	irqs[irq].mapped = true;
+	irqs[irq].handler = handler;
+	irqs[irq].dev_id = dev;
+	irqs[irq].name = name;
+	irqs[irq].affinity = *cpumask_of(0);
+	err = sim_bind_handler(irq, irq_trampoline, &irqs[irq]);
+	return err < 0 ? err : 0;
+}
+
+int bind_evtchn_to_irqhandler(unsigned int evtchn, irq_handler_t handler,
+		unsigned long irqflags, const char *devname, void *dev_id)
+{
+	int irq = bind_evtchn_to_irq(evtchn);
+	int err;
+
+	if (irq < 0)
+		return irq;
+	err = request_irq(irq, handler, irqflags, devname, dev_id);
+	return err ? err : irq;
+}
+
+int bind_interdomain_evtchn_to_irqhandler(unsigned int remote_domain,
+		unsigned int remote_port, irq_handler_t handler,
+		unsigned long irqflags, const char *devname, void *dev_id)
+{
+	int port = sim_bind_interdomain(remote_domain, remote_port);
+	int err;
+
+	if (port < 0)
+		return port;
+	err = request_irq(port, handler, irqflags, devname, dev_id);
+	if (err) {
+		sim_close_port(port);
+		return err;
+	}
+	return port;
+}
+
+/* Handler goes, port stays bound to the irq */
+void free_irq(unsigned int irq, void *dev_id)
+{
+	if (irq == 0 || irq >= SIM_MAX_PORTS)
+		return;
+	pthread_mutex_lock(&irq_lock);
+	irqs[irq].handler = NULL;
+	irqs[irq].dev_id = NULL;
+	while (irqs[irq].active)
+		pthread_cond_wait(&irq_done, &irq_lock);
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/* Closes the port, as unbinding does on Linux */
+void unbind_from_irq(unsigned int irq)
+{
+	if (sim_close_port(irq))
+		return;
+	pthread_mutex_lock(&irq_lock);
+	irqs[irq].mapped = false;
+	irqs[irq].handler = NULL;
+	irqs[irq].dev_id = NULL;
+	irqs[irq].depth = 0;
+	irqs[irq].pending = false;
+	pthread_mutex_unlock(&irq_lock);
+}
+
+void unbind_from_irqhandler(unsigned int irq, void *dev_id)
+{
+	unbind_from_irq(irq);
+}
+
+void notify_remote_via_irq(int irq)
+{
+	sim_notify(irq);
+}
+
+void notify_remote_via_evtchn(int port)
+{
+	sim_notify(port);
+}
+
+int irq_set_affinity(unsigned int irq, const struct cpumask *mask)
+{
+	unsigned int cpu = cpumask_first(mask);
+	int err;
+
+	if (irq == 0 || irq >= SIM_MAX_PORTS || cpu >= nr_cpu_ids)
+		return -EINVAL;
+	err = sim_bind_vcpu(irq, cpu);
+	if (!err)
+		irqs[irq].affinity = *cpumask_of(cpu);
+	return err;
+}
+
+int irq_set_affinity_hint(unsigned int irq, const struct cpumask *mask)
+{
+	return mask ? irq_set_affinity(irq, mask) : 0;
+}
+
+const struct cpumask *irq_get_affinity_mask(int irq)
+{
+	return irq > 0 && irq < SIM_MAX_PORTS ? &irqs[irq].affinity : NULL;
+}
+
+void sim_xen_start(void)
+{
+	start_info.store_mfn = SIM_STORE_GFN(sim_domid());
+	start_info.store_evtchn = SIM_STORE_PORT;
+	hrtimer_init(&deferred_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	deferred_timer.function = deferred_retry;
+	sim_xenbus_start();
+}
+
+void sim_xen_stop(void)
+{
+	struct deferred_entry *e;
+	int h, n = 0;
+
+	/* Other end may unmap a while after this rmmod, retries go on for
+	 * a second as they would in a kernel still running */
+	for (h = 0; h < 1000 / DEFERRED_MS; h++) {
+		spin_lock(&deferred_lock);
+		n = !list_empty(&deferred_list);
+		spin_unlock(&deferred_lock);
+		if (!n)
+			break;
+		msleep(DEFERRED_MS);
+	}
+	hrtimer_cancel(&deferred_timer);
+	deferred_retry(&deferred_timer);
+	n = 0;
+	list_for_each_entry(e, &deferred_list, list)
+		n++;
+	if (n)
+		printf("xen:grant_table: %d g.e. still in use at exit\n", n);
+	for (h = n = 0; h < MAX_HANDLES; h++)
+		n += handle_used[h];
+	if (n)
+		printf("xen:grant_table: %d grants left mapped at exit\n", n);
+}
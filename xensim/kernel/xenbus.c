@@ -0,0 +1,621 @@
+/* Xen simulation: xenbus on the xensim store
+ * This is under GPL License
+ *
+ * Devices are found as xenbus_probe does: a driver watches device/<type>
+ * (frontend) or backend/<type> (backend) of its domain, and a node with
+ * state Initialising not yet known is probed. Then state of the other
+ * end is watched for otherend_changed. All callbacks run in the xenwatch
+ * thread. Relative paths are under /local/domain/<self>
+ */
+#include "sim_kernel.h"
+
+#define MAX_DRIVERS     4
+#define PATH_LEN        (2 * SIM_KEY_LEN)
+
+struct xenbus_map {
+	struct list_head list;
+	struct vm_struct *area;
+	unsigned int nr;
+	struct sim_map_op ops[XENBUS_MAX_RING_GRANTS];
+};
+
+static char home[32];
+static DEFINE_MUTEX(xenbus_lock);       /* Lists below */
+static LIST_HEAD(devices);
+static LIST_HEAD(maps);
+static struct {
+	struct xenbus_driver *drv;
+	char prefix[SIM_KEY_LEN];
+} drivers[MAX_DRIVERS];
+
+static const char *const states[] = {
+	"Unknown", "Initialising", "InitWait", "Initialised", "Connected",
+	"Closing", "Closed", "Reconfiguring", "Reconfigured",
+};
+
+static void join(char *path, const char *dir, const char *node)
+{
+	snprintf(path, PATH_LEN, "%s%s%s%s%s", dir[0] == '/' ? "" : home,
+			dir[0] == '/' ? "" : "/", dir, node[0] ? "/" : "", node);
+}
+
+/* Path as the watch was given, relative ones are relative again */
+static const char *watch_path(const char *node, const char *path)
+{
+	size_t len = strlen(home);
+
+	if (node[0] != '/' && strncmp(path, home, len) == 0 && path[len] == '/')
+		return path + len + 1;
+	return path;
+}
+
+void *xenbus_read(struct xenbus_transaction t, const char *dir,
+		const char *node, unsigned int *len)
+{
+	char path[PATH_LEN], value[SIM_VALUE_LEN];
+	int err;
+
+	join(path, dir, node);
+	err = sim_xs_tx_read(t.id, path, value, sizeof(value));
+	if (err)
+		return ERR_PTR(err);
+	if (len)
+		*len = strlen(value);
+	return kstrdup(value, GFP_KERNEL);
+}
+
+int xenbus_write(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *string)
+{
+	char path[PATH_LEN];
+
+	join(path, dir, node);
+	return sim_xs_tx_write(t.id, path, string);
+}
+
+int xenbus_printf(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *fmt, ...)
+{
+	char value[SIM_VALUE_LEN];
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vsnprintf(value, sizeof(value), fmt, ap) >= (int)sizeof(value)) {
+		va_end(ap);
+		return -E2BIG;
+	}
+	va_end(ap);
+	return xenbus_write(t, dir, node, value);
+}
+
+int xenbus_scanf(struct xenbus_transaction t, const char *dir,
+		const char *node, const char *fmt, ...)
+{
+	va_list ap;
+	char *val;
+	int ret;
+
+	val = xenbus_read(t, dir, node, NULL);
+	if (IS_ERR(val))
+		return PTR_ERR(val);
+	va_start(ap, fmt);
+	ret = vsscanf(val, fmt, ap);
+	va_end(ap);
+	kfree(val);
+	return ret == 0 ? -ERANGE : ret;
+}
+
+unsigned int xenbus_read_unsigned(const char *dir, const char *node,
+		unsigned int default_val)
+{
+	unsigned int val;
+
+	if (xenbus_scanf(XBT_NIL, dir, node, "%u", &val) != 1)
+		return default_val;
+	return val;
+}
+
+int xenbus_exists(struct xenbus_transaction t, const char *dir, const char *node)
+{
+	char *val = xenbus_read(t, dir, node, NULL);
+
+	if (IS_ERR(val))
+		return 0;
+	kfree(val);
+	return 1;
+}
+
+int xenbus_transaction_start(struct xenbus_transaction *t)
+{
+	int id = sim_xs_transaction_start();
+
+	if (id < 0)
+		return id;
+	t->id = id;
+	return 0;
+}
+
+int xenbus_transaction_end(struct xenbus_transaction t, int abort)
+{
+	return sim_xs_transaction_end(t.id, abort);
+}
+
+static void watch_trampoline(const char *path, void *arg)
+{
+	struct xenbus_watch *watch = arg;
+	char token[32];
+	const char *vec[2] = { watch_path(watch->node, path), token };
+
+	snprintf(token, sizeof(token), "%lX", (unsigned long)watch);
+	watch->callback(watch, vec, 2);
+}
+
+int register_xenbus_watch(struct xenbus_watch *watch)
+{
+	char path[PATH_LEN];
+
+	join(path, watch->node, "");
+	return sim_xs_watch(path, watch_trampoline, watch);
+}
+
+/* Waits for its callback, unless called from one */
+void unregister_xenbus_watch(struct xenbus_watch *watch)
+{
+	char path[PATH_LEN];
+
+	join(path, watch->node, "");
+	sim_xs_unwatch(path, watch_trampoline, watch);
+}
+
+static const char *xs_errname(int err)
+{
+	switch (-err) {
+	case ENOENT:
+		return "ENOENT";
+	case EAGAIN:
+		return "EAGAIN";
+	case ENOSPC:
+		return "ENOSPC";
+	case E2BIG:
+		return "E2BIG";
+	case ENOSYS:
+		return "ENOSYS";
+	default:
+		return "EINVAL";
+	}
+}
+
+/* Only what a user space tool sends, watches go their own way */
+void *xenbus_dev_request_and_reply(struct xsd_sockmsg *msg)
+{
+	char *body = (char *)(msg + 1), *reply, value[SIM_VALUE_LEN];
+	const char *ok = "OK";
+	int err = -ENOSYS;
+	size_t len;
+
+	if (msg->len > XENSTORE_PAYLOAD_MAX || (msg->len && body[msg->len - 1] &&
+				msg->type != XS_WRITE))
+		return ERR_PTR(-EINVAL);
+
+	switch (msg->type) {
+	case XS_READ:
+		err = sim_xs_tx_read(msg->tx_id, body, value, sizeof(value));
+		ok = value;
+		break;
+	case XS_WRITE:
+		len = strnlen(body, msg->len);
+		if (len == msg->len || msg->len - len - 1 >= SIM_VALUE_LEN) {
+			err = len == msg->len ? -EINVAL : -E2BIG;
+			break;
+		}
+		memcpy(value, body + len + 1, msg->len - len - 1);
+		value[msg->len - len - 1] = '\0';
+		err = sim_xs_tx_write(msg->tx_id, body, value);
+		break;
+	case XS_TRANSACTION_START:
+		err = sim_xs_transaction_start();
+		if (err > 0) {
+			snprintf(value, sizeof(value), "%d", err);
+			ok = value;
+			err = 0;
+		}
+		break;
+	case XS_TRANSACTION_END:
+		err = sim_xs_transaction_end(msg->tx_id, strcmp(body, "T") != 0);
+		break;
+	case XS_SET_PERMS:
+		/* No permissions in xensim, node has to be there */
+		err = sim_xs_tx_read(msg->tx_id, body, value, sizeof(value));
+		break;
+	}
+
+	if (err) {
+		msg->type = XS_ERROR;
+		ok = xs_errname(err);
+	}
+	/* Reads have no NUL in reply, the rest do */
+	msg->len = strlen(ok) + (msg->type != XS_READ);
+	reply = kmalloc(msg->len + 1, GFP_KERNEL);
+	if (!reply)
+		return ERR_PTR(-ENOMEM);
+	memcpy(reply, ok, msg->len);
+	reply[msg->len] = '\0';
+	return reply;
+}
+
+/* Devices */
+
+const char *xenbus_strstate(enum xenbus_state state)
+{
+	return (unsigned int)state < ARRAY_SIZE(states) ? states[state] : "INVALID";
+}
+
+int xenbus_switch_state(struct xenbus_device *dev, enum xenbus_state state)
+{
+	int err;
+
+	if (state == dev->state)
+		return 0;
+	err = xenbus_printf(XBT_NIL, dev->nodename, "state", "%d", state);
+	if (err) {
+		if (state != XenbusStateClosing)
+			xenbus_dev_fatal(dev, err, "writing new state");
+		return err;
+	}
+	dev->state = state;
+	return 0;
+}
+
+int xenbus_frontend_closed(struct xenbus_device *dev)
+{
+	xenbus_switch_state(dev, XenbusStateClosed);
+	complete(&dev->down);
+	return 0;
+}
+
+static void dev_error(struct xenbus_device *dev, int err, const char *fmt,
+		va_list ap)
+{
+	char msg[256];
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	pr_err("xenbus: %s: error %d %s\n", dev->nodename, err, msg);
+}
+
+void xenbus_dev_error(struct xenbus_device *dev, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	dev_error(dev, err, fmt, ap);
+	va_end(ap);
+}
+
+void xenbus_dev_fatal(struct xenbus_device *dev, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	dev_error(dev, err, fmt, ap);
+	va_end(ap);
+	xenbus_switch_state(dev, XenbusStateClosing);
+}
+
+int xenbus_dev_is_online(struct xenbus_device *dev)
+{
+	return xenbus_read_unsigned(dev->nodename, "online", 0);
+}
+
+int xenbus_grant_ring(struct xenbus_device *dev, void *vaddr,
+		unsigned int nr_pages, grant_ref_t *grefs)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nr_pages; i++) {
+		err = gnttab_grant_foreign_access(dev->otherend_id,
+				virt_to_gfn((char *)vaddr + i * PAGE_SIZE), 0);
+		if (err < 0) {
+			xenbus_dev_fatal(dev, err, "granting access to ring page");
+			while (i--)
+				gnttab_end_foreign_access_ref(grefs[i], 0);
+			return err;
+		}
+		grefs[i] = err;
+	}
+	return 0;
+}
+
+int xenbus_map_ring_valloc(struct xenbus_device *dev, grant_ref_t *gnt_refs,
+		unsigned int nr_grefs, void **vaddr)
+{
+	struct xenbus_map *map;
+	unsigned int i;
+	int err = 0;
+
+	*vaddr = NULL;
+	if (nr_grefs > XENBUS_MAX_RING_GRANTS)
+		return -EINVAL;
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	map->area = alloc_vm_area(nr_grefs * PAGE_SIZE, NULL);
+	if (!map->area) {
+		free(map);
+		return -ENOMEM;
+	}
+	map->nr = nr_grefs;
+	for (i = 0; i < nr_grefs; i++) {
+		map->ops[i].domid = dev->otherend_id;
+		map->ops[i].ref = gnt_refs[i];
+		map->ops[i].addr = (char *)map->area->addr + i * PAGE_SIZE;
+	}
+	sim_map_grants(map->ops, nr_grefs);
+	for (i = 0; i < nr_grefs && !err; i++) {
+		if (!map->ops[i].status)
+			continue;
+		err = map->ops[i].status;
+		xenbus_dev_fatal(dev, err, "mapping in shared page %d from domain %d",
+				gnt_refs[i], dev->otherend_id);
+	}
+	if (err) {
+		sim_unmap_grants(map->ops, nr_grefs);
+		free_vm_area(map->area);
+		free(map);
+		return err;
+	}
+
+	mutex_lock(&xenbus_lock);
+	list_add(&map->list, &maps);
+	mutex_unlock(&xenbus_lock);
+	*vaddr = map->area->addr;
+	return 0;
+}
+
+int xenbus_unmap_ring_vfree(struct xenbus_device *dev, void *vaddr)
+{
+	struct xenbus_map *map;
+
+	mutex_lock(&xenbus_lock);
+	list_for_each_entry(map, &maps, list)
+		if (map->area->addr == vaddr)
+			break;
+	if (&map->list == &maps) {
+		mutex_unlock(&xenbus_lock);
+		xenbus_dev_error(dev, -ENOENT, "can't find mapped virtual address %p",
+				vaddr);
+		return -ENOENT;
+	}
+	list_del(&map->list);
+	mutex_unlock(&xenbus_lock);
+
+	sim_unmap_grants(map->ops, map->nr);
+	free_vm_area(map->area);
+	free(map);
+	return 0;
+}
+
+int xenbus_alloc_evtchn(struct xenbus_device *dev, evtchn_port_t *port)
+{
+	int err = sim_alloc_unbound(dev->otherend_id);
+
+	if (err < 0) {
+		xenbus_dev_fatal(dev, err, "allocating event channel");
+		return err;
+	}
+	*port = err;
+	return 0;
+}
+
+int xenbus_free_evtchn(struct xenbus_device *dev, evtchn_port_t port)
+{
+	int err = sim_close_port(port);
+
+	if (err)
+		xenbus_dev_error(dev, err, "freeing event channel %d", port);
+	return err;
+}
+
+static void otherend_changed(struct xenbus_watch *watch, const char **vec,
+		unsigned int len)
+{
+	struct xenbus_device *dev = container_of(watch, struct xenbus_device,
+			otherend_watch);
+	enum xenbus_state state;
+
+	state = xenbus_read_unsigned(dev->otherend, "state", XenbusStateUnknown);
+	dev->drv->otherend_changed(dev, state);
+}
+
+/* Called with xenbus lock held */
+static struct xenbus_device *find_device(const char *nodename)
+{
+	struct xenbus_device *dev;
+
+	list_for_each_entry(dev, &devices, list)
+		if (strcmp(dev->nodename, nodename) == 0)
+			return dev;
+	return NULL;
+}
+
+static void probe_node(struct xenbus_driver *drv, const char *nodename)
+{
+	const char *end = drv->backend ? "frontend" : "backend";
+	struct xenbus_device *dev;
+	char key[16];
+	int err;
+
+	mutex_lock(&xenbus_lock);
+	dev = find_device(nodename);
+	mutex_unlock(&xenbus_lock);
+	if (dev || xenbus_read_unsigned(nodename, "state", XenbusStateUnknown) !=
+			XenbusStateInitialising)
+		return;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return;
+	dev->nodename = strdup(nodename);
+	dev->devicetype = drv->ids[0].devicetype;
+	dev->drv = drv;
+	dev->state = XenbusStateInitialising;
+	init_completion(&dev->down);
+	dev->otherend = xenbus_read(XBT_NIL, nodename, end, NULL);
+	snprintf(key, sizeof(key), "%s-id", end);
+	dev->otherend_id = xenbus_read_unsigned(nodename, key, DOMID_SELF);
+	if (IS_ERR(dev->otherend) || dev->otherend_id >= SIM_MAX_DOMS) {
+		pr_warn("xenbus: %s: no %s or %s-id\n", nodename, end, end);
+		goto fail;
+	}
+
+	err = drv->probe(dev, &drv->ids[0]);
+	if (err) {
+		pr_warn("xenbus_probe: %s: probe failed %d\n", nodename, err);
+		xenbus_switch_state(dev, XenbusStateClosed);
+		goto fail;
+	}
+	mutex_lock(&xenbus_lock);
+	list_add_tail(&dev->list, &devices);
+	mutex_unlock(&xenbus_lock);
+
+	dev->otherend_watch.node = kasprintf(GFP_KERNEL, "%s/state", dev->otherend);
+	dev->otherend_watch.callback = otherend_changed;
+	register_xenbus_watch(&dev->otherend_watch);
+	return;
+fail:
+	if (!IS_ERR(dev->otherend))
+		kfree(dev->otherend);
+	kfree(dev->nodename);
+	free(dev);
+}
+
+/* Devices are never freed, a watch callback may be on its way */
+static void remove_device(struct xenbus_device *dev)
+{
+	mutex_lock(&xenbus_lock);
+	list_del(&dev->list);
+	mutex_unlock(&xenbus_lock);
+
+	unregister_xenbus_watch(&dev->otherend_watch);
+	if (dev->drv->remove)
+		dev->drv->remove(dev);
+	xenbus_switch_state(dev, XenbusStateClosed);
+}
+
+void device_unregister(struct device *dev)
+{
+	remove_device(to_xenbus_device(dev));
+}
+
+/* Node of the device a changed path is under, type/id for a frontend,
+ * type/frontend domain/id for a backend */
+static bool device_node(const char *path, const char *prefix, bool backend,
+		char *nodename)
+{
+	const char *p = path + strlen(prefix);
+	int parts = backend ? 2 : 1;
+
+	if (*p != '/')
+		return false;
+	while (parts--) {
+		p++;
+		if (!*p || *p == '/')
+			return false;
+		p = strchrnul(p, '/');
+	}
+	snprintf(nodename, PATH_LEN, "%.*s", (int)(p - path - strlen(home) - 1),
+			path + strlen(home) + 1);
+	return true;
+}
+
+static void probe_dir(struct xenbus_driver *drv, const char *dir, int depth)
+{
+	char names[XENSTORE_PAYLOAD_MAX], path[PATH_LEN];
+	const char *name;
+	int n;
+
+	n = sim_xs_directory(dir, names, sizeof(names));
+	for (name = names; n > 0; n--, name += strlen(name) + 1) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+				sizeof(path))
+			continue;
+		if (depth > 1)
+			probe_dir(drv, path, depth - 1);
+		else
+			probe_node(drv, path + strlen(home) + 1);
+	}
+}
+
+static void driver_changed(const char *path, void *arg)
+{
+	struct xenbus_driver *drv = arg;
+	char nodename[PATH_LEN];
+	const char *prefix = NULL;
+	int i;
+
+	for (i = 0; i < MAX_DRIVERS; i++)
+		if (drivers[i].drv == drv)
+			prefix = drivers[i].prefix;
+	if (!prefix)
+		return;
+
+	/* Once on register, for devices there already */
+	if (strcmp(path, prefix) == 0)
+		probe_dir(drv, prefix, drv->backend ? 2 : 1);
+	else if (device_node(path, prefix, drv->backend, nodename))
+		probe_node(drv, nodename);
+}
+
+static int register_driver(struct xenbus_driver *drv, bool backend)
+{
+	int i;
+
+	for (i = 0; i < MAX_DRIVERS && drivers[i].drv; i++)
+		;
+	if (i == MAX_DRIVERS)
+		return -ENOSPC;
+	drv->backend = backend;
+	drivers[i].drv = drv;
+	snprintf(drivers[i].prefix, SIM_KEY_LEN, "%s/%s/%s", home,
+			backend ? "backend" : "device", drv->ids[0].devicetype);
+	return sim_xs_watch(drivers[i].prefix, driver_changed, drv);
+}
+
+int xenbus_register_frontend(struct xenbus_driver *drv)
+{
+	return register_driver(drv, false);
+}
+
+int xenbus_register_backend(struct xenbus_driver *drv)
+{
+	return register_driver(drv, true);
+}
+
+void xenbus_unregister_driver(struct xenbus_driver *drv)
+{
+	struct xenbus_device *dev;
+	int i;
+
+	for (i = 0; i < MAX_DRIVERS; i++) {
+		if (drivers[i].drv != drv)
+			continue;
+		sim_xs_unwatch(drivers[i].prefix, driver_changed, drv);
+		drivers[i].drv = NULL;
+	}
+
+	for (;;) {
+		mutex_lock(&xenbus_lock);
+		list_for_each_entry(dev, &devices, list)
+			if (dev->drv == drv)
+				break;
+		mutex_unlock(&xenbus_lock);
+		if (&dev->list == &devices)
+			break;
+		remove_device(dev);
+	}
+}
+
+void sim_xenbus_start(void)
+{
+	snprintf(home, sizeof(home), "/local/domain/%d", sim_domid());
+}
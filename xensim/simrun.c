@@ -0,0 +1,49 @@
+/* Xen simulation: run a command on a fresh sim
+ * This is under GPL License
+ *
+ * Usage: simrun <command> [arg]...
+ * Sets up xensim, runs xenstored as dom0, then the command with the sim
+ * in XENSIM_FD, for module programs and xenstore tools it starts to
+ * attach to. Exit status is the command's
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "xensim.h"
+
+int main(int argc, char **argv)
+{
+	int err, status;
+	pid_t pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <command> [arg]...\n", argv[0]);
+		return 2;
+	}
+
+	err = sim_init();
+	if (!err)
+		err = sim_attach(0);
+	if (!err)
+		err = sim_xenstored_start();
+	if (err) {
+		fprintf(stderr, "simrun: %s\n", strerror(-err));
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		perror(argv[1]);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+		perror("simrun");
+		return 1;
+	}
+	sim_detach();
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,115 @@
+/* Xen simulation: activate of Xen_Log_15 losing races to another writer
+ * This is under GPL License
+ *
+ * Usage: simrun tests/activate
+ * Builds the tool source in, against libxenstore of xs.c. Right after
+ * a transaction starts, another writer rewrites a key it is about to
+ * write for the first tries of each, so their commits fail with EAGAIN.
+ * Those must be retried after a backoff growing with each try, and a
+ * transaction raced every time given up with EAGAIN
+ */
+#include <xenstore.h>
+
+static xs_transaction_t raced_start(struct xs_handle *h);
+#define xs_transaction_start raced_start
+#define main activate_main
+#include "../../Xen_Log_15/dom0/activate.c"
+#undef main
+#undef xs_transaction_start
+
+#define TRANSACTIONS 50
+
+static struct xs_handle *xs_writer;
+static int races;       /* Tries of each transaction raced */
+static int tries;       /* Of transaction being made */
+static int failed;
+
+static xs_transaction_t raced_start(struct xs_handle *h)
+{
+	xs_transaction_t t = xs_transaction_start(h);
+
+	if (t != XBT_NULL && tries++ < races)
+		xs_write(xs_writer, XBT_NULL,
+				"/local/domain/1/device/" DEVICE "/0/state", "1", 1);
+	return t;
+}
+
+/* Make TRANSACTIONS of dom1-3 with the first r tries of each raced,
+ * mean us each one took, retries made in *retries */
+static long run(struct xs_handle *xs, int r, int expect, int *retries)
+{
+	unsigned int seed = r;
+	long start = now_us();
+	int i, err;
+
+	races = r;
+	*retries = 0;
+	for (i = 0; i < TRANSACTIONS; i++) {
+		tries = 0;
+		err = activate_batch(xs, 0, nr_domids, retries, &seed);
+		if (err != expect) {
+			printf("activate: FAIL %d races: %s\n", r,
+					err ? strerror(-err) : "committed");
+			failed = 1;
+		}
+	}
+	return (now_us() - start) / TRANSACTIONS;
+}
+
+int main(void)
+{
+	static int doms[] = { 1, 2, 3 };
+	struct xs_handle *xs;
+	long us, prev = 0;
+	int r, retries;
+	char *value;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	xs = xs_open(0);
+	xs_writer = xs_open(0);
+	if (!xs || !xs_writer) {
+		perror("activate: xs_open");
+		return 1;
+	}
+	domids = doms;
+	nr_domids = sizeof(doms) / sizeof(doms[0]);
+
+	/* Waits double each retry, so a transaction raced more takes
+	 * longer on the mean, random parts averaged out */
+	for (r = 0; r <= 6; r += 2) {
+		us = run(xs, r, 0, &retries);
+		if (retries != r * TRANSACTIONS) {
+			printf("activate: FAIL %d retries for %d races\n", retries,
+					r * TRANSACTIONS);
+			failed = 1;
+		}
+		if (r > 2 && us <= prev) {
+			printf("activate: FAIL %ld us after %d races, %ld before\n",
+					us, r, prev);
+			failed = 1;
+		}
+		printf("activate: %d races, %ld us per transaction\n", r, us);
+		prev = us;
+	}
+
+	value = xs_read(xs, XBT_NULL, "/local/domain/0/backend/" DEVICE "/3/0/state",
+			NULL);
+	if (!value || strcmp(value, "1") != 0) {
+		printf("activate: FAIL dom3 backend state %s\n", value ? value : "none");
+		failed = 1;
+	}
+	free(value);
+
+	/* Raced every time, given up once the retries are spent */
+	us = run(xs, MAX_RETRIES, -EAGAIN, &retries);
+	printf("activate: raced every try, gave up after %ld us\n", us);
+	if (us > MAX_RETRIES * (long)BACKOFF_MAX_US) {
+		printf("activate: FAIL backoff past its cap\n");
+		failed = 1;
+	}
+
+	xs_close(xs_writer);
+	xs_close(xs);
+	printf("activate: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
@@ -0,0 +1,70 @@
+# Xen simulation: helpers of the tests, sourced by each under simrun
+# This is under GPL License
+#
+# A test starts module programs of mod/ as domains, in the background
+# for those that stay loaded, reads what they print and fails on the
+# first thing that is off
+
+PATH=$PWD:$PATH
+LOG=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf $LOG' EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    for f in $LOG/*; do
+        [ -f "$f" ] && { echo "--- $f"; cat "$f"; }
+    done
+    exit 1
+}
+
+# wait_for <log> <pattern>: until a domain printed it, 5s at most
+wait_for()
+{
+    i=0
+    while ! grep -q "$2" "$1"; do
+        i=$((i + 1))
+        [ $i -gt 50 ] && fail "no '$2' in $1"
+        sleep 0.1
+    done
+}
+
+# value <log> <prefix>: last number printed right after prefix
+value()
+{
+    sed -n "s/.*$2 *\([0-9][0-9]*\).*/\1/p" "$1" | tail -n 1
+}
+
+# rmmod <pid>: unload a module started in the background
+rmmod()
+{
+    kill -TERM $1
+    wait $1 || fail "module of pid $1 exited with $?"
+}
+
+# clean <log>...: xensim found nothing wrong, like a page freed while
+# the other end maps it, or one leaked
+clean()
+{
+    for f in "$@"; do
+        grep "xensim:\|still in use at exit\|left mapped" $f && fail "$f"
+    done
+    return 0
+}
+
+# alice_dev <domid> "<dom0 params>" "<domU params>": load both ends of
+# Xen_Log_15 on $vcpus vCPUs each, 2 if unset, and connect them, pids
+# in $dom0 and $domU.
+# Nodes of a device are left in xenstore after it closed, so each pair
+# in a test takes a domid of its own
+alice_dev()
+{
+    mod/Xen_Log_15-dom0 -d 0 -c ${vcpus:-2} $2 > $LOG/dom0 2>&1 &
+    dom0=$!
+    mod/Xen_Log_15-domU -d $1 -c ${vcpus:-2} $3 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/dom0 "inited"
+    wait_for $LOG/domU "inited"
+    bash ../Xen_Log_15/dom0/activate.sh $1 > /dev/null || fail "activate.sh"
+    wait_for $LOG/domU "Other side says it is connected"
+}
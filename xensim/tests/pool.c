@@ -0,0 +1,118 @@
+/* Xen simulation: share pool of Xen_Log_8 domU hammered by threads
+ * This is under GPL License
+ *
+ * Usage: simrun tests/pool [threads [seconds]]
+ * Builds the module source in, so the pool tested is the one it ships.
+ * Each thread holds up to HOLD shares at a time, more than the pool has
+ * between all of them, so both the lock-free stack and the fallback
+ * grant get hit, the latter with GFP_ATOMIC from odd threads. A share is
+ * stamped by its holder, a share handed out twice at once shows as a
+ * stamp overwritten
+ */
+#include "../../Xen_Log_8/domU/alice_domU.c"
+
+#define POOL_PAGES  64
+#define HOLD        16
+
+static volatile bool stop;
+static int failed;
+
+struct worker {
+	pthread_t thread;
+	long id;
+	long allocs;
+};
+
+static void *hammer(void *arg)
+{
+	struct worker *w = arg;
+	alice_share_t *held[HOLD];
+	unsigned int seed = w->id;
+	int n = 0, i;
+
+	while (!stop) {
+		/* Take or give back, at random, to mix pops and pushes */
+		if (n < HOLD && (n == 0 || rand_r(&seed) & 1)) {
+			held[n] = alice_pool_alloc(&pool,
+					w->id & 1 ? GFP_ATOMIC : GFP_KERNEL);
+			if (!held[n])
+				continue;
+			*(long *)held[n]->vpage = w->id;
+			n++;
+			w->allocs++;
+		} else {
+			i = rand_r(&seed) % n;
+			if (*(long *)held[i]->vpage != w->id) {
+				printf("pool: FAIL share gref %d held by %ld and %ld\n",
+						held[i]->gref, w->id,
+						*(long *)held[i]->vpage);
+				failed = 1;
+			}
+			alice_pool_free(&pool, held[i]);
+			held[i] = held[--n];
+		}
+	}
+	while (n > 0)
+		alice_pool_free(&pool, held[--n]);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int nr = argc > 1 ? atoi(argv[1]) : 8;
+	int secs = argc > 2 ? atoi(argv[2]) : 1;
+	struct worker *workers = calloc(nr, sizeof(*workers));
+	long allocs = 0, hit, miss, exhaust;
+	int i, err;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	err = sim_attach(1);
+	if (err) {
+		fprintf(stderr, "pool: attach: %s\n", strerror(-err));
+		return 1;
+	}
+	sim_kernel_start();
+	err = alice_pool_init(&pool, POOL_PAGES, 0);
+	if (err) {
+		fprintf(stderr, "pool: init: %s\n", strerror(-err));
+		return 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		workers[i].id = i + 1;
+		pthread_create(&workers[i].thread, NULL, hammer, &workers[i]);
+	}
+	sleep(secs);
+	stop = true;
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		allocs += workers[i].allocs;
+	}
+
+	/* Every pool entry is back on the stack, each once */
+	for (i = 0; pool_pop(&pool) >= 0; i++)
+		;
+	if (i != POOL_PAGES) {
+		printf("pool: FAIL %d of %d entries back in pool\n", i, POOL_PAGES);
+		failed = 1;
+	}
+	for (i = POOL_PAGES - 1; i >= 0; i--)
+		pool_push(&pool, i);
+
+	hit = atomic_long_read(&pool.hit);
+	miss = atomic_long_read(&pool.miss);
+	exhaust = atomic_long_read(&pool.exhaust);
+	if (hit + miss - exhaust != allocs) {
+		printf("pool: FAIL hit %ld + miss %ld - exhaust %ld != %ld allocs\n",
+				hit, miss, exhaust, allocs);
+		failed = 1;
+	}
+	printf("pool: %d threads, %ld allocs/s, %ld%% from pool\n", nr,
+			allocs / secs, allocs ? hit * 100 / allocs : 0);
+
+	alice_pool_destroy(&pool);
+	sim_kernel_stop();
+	sim_detach();
+	printf("pool: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
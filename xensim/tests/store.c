@@ -0,0 +1,238 @@
+/* Xen simulation: checks of xenstore and argument bounds
+ * This is under GPL License
+ *
+ * Usage: simrun tests/store
+ * Runs as dom1 talking to xenstored over its store ring the way a
+ * guest kernel does: requests go in chunks with a notify each, replies
+ * are taken only when the ring port fires
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../xensim.h"
+
+#define WAIT_MS 2000
+
+static struct xenstore_domain_interface *intf;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static char rsp[sizeof(struct xsd_sockmsg) + XENSTORE_PAYLOAD_MAX + 1];
+static unsigned int rsp_got;
+static int nr_events;
+static int failed;
+
+#define CHECK(cond, ...)                                        \
+	do {                                                    \
+		if (!(cond)) {                                  \
+			printf("store: FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__);                    \
+			printf("\n");                           \
+			failed = 1;                             \
+		}                                               \
+	} while (0)
+
+/* Take what xenstored put on the ring, and tell it space is free */
+static int store_event(int port, void *arg)
+{
+	XENSTORE_RING_IDX cons, prod;
+
+	pthread_mutex_lock(&lock);
+	nr_events++;
+	cons = intf->rsp_cons;
+	prod = __atomic_load_n(&intf->rsp_prod, __ATOMIC_ACQUIRE);
+	xen_rmb();
+	for (; cons != prod && rsp_got < sizeof(rsp) - 1; cons++)
+		rsp[rsp_got++] = intf->rsp[MASK_XENSTORE_IDX(cons)];
+	xen_mb();
+	intf->rsp_cons = cons;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	sim_notify(SIM_STORE_PORT);
+	return 0;
+}
+
+static int write_chunks(const void *buf, unsigned int len)
+{
+	const char *p = buf;
+	XENSTORE_RING_IDX prod;
+	unsigned int chunk;
+	int waited = 0;
+
+	while (len > 0) {
+		prod = intf->req_prod;
+		while (prod - __atomic_load_n(&intf->req_cons, __ATOMIC_ACQUIRE) ==
+				XENSTORE_RING_SIZE) {
+			if (waited++ == WAIT_MS * 10)
+				return -ETIMEDOUT;
+			usleep(100);
+		}
+		xen_mb();
+		chunk = XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod);
+		if (chunk > XENSTORE_RING_SIZE - (prod - intf->req_cons))
+			chunk = XENSTORE_RING_SIZE - (prod - intf->req_cons);
+		if (chunk > len)
+			chunk = len;
+		memcpy(intf->req + MASK_XENSTORE_IDX(prod), p, chunk);
+		p += chunk;
+		len -= chunk;
+		xen_wmb();
+		intf->req_prod = prod + chunk;
+		sim_notify(SIM_STORE_PORT);
+	}
+	return 0;
+}
+
+/* Send a request and wait for its reply, the body of which is left in
+ * rsp after the header. Returns type of reply or -errno */
+static int request(uint32_t type, uint32_t tx, const void *body,
+		unsigned int len, int *events)
+{
+	struct xsd_sockmsg msg = { .type = type, .req_id = 1, .tx_id = tx,
+				   .len = len };
+	struct xsd_sockmsg *reply = (struct xsd_sockmsg *)rsp;
+	struct timespec ts;
+	int err = 0;
+
+	pthread_mutex_lock(&lock);
+	rsp_got = 0;
+	nr_events = 0;
+	pthread_mutex_unlock(&lock);
+
+	err = write_chunks(&msg, sizeof(msg));
+	if (!err)
+		err = write_chunks(body, len);
+	if (err)
+		return err;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += WAIT_MS / 1000;
+	pthread_mutex_lock(&lock);
+	while (!err && (rsp_got < sizeof(*reply) ||
+			rsp_got < sizeof(*reply) + reply->len))
+		err = pthread_cond_timedwait(&cond, &lock, &ts);
+	rsp[rsp_got] = '\0';
+	if (events)
+		*events = nr_events;
+	pthread_mutex_unlock(&lock);
+	return err ? -err : (int)reply->type;
+}
+
+static const char *body(void)
+{
+	return rsp + sizeof(struct xsd_sockmsg);
+}
+
+static int body_len(void)
+{
+	return ((struct xsd_sockmsg *)rsp)->len;
+}
+
+/* A commit fails with EAGAIN once a key the transaction read changed */
+static void test_transaction(void)
+{
+	char value[SIM_VALUE_LEN], req[SIM_KEY_LEN + SIM_VALUE_LEN];
+	int tx, err, len;
+
+	sim_xs_write("/test/tx/a", "1");
+
+	tx = sim_xs_transaction_start();
+	CHECK(tx > 0, "transaction_start %d", tx);
+	sim_xs_tx_read(tx, "/test/tx/a", value, sizeof(value));
+	sim_xs_write("/test/tx/a", "2");
+	sim_xs_tx_write(tx, "/test/tx/b", "1");
+	err = sim_xs_transaction_end(tx, false);
+	CHECK(err == -EAGAIN, "end after conflict %d", err);
+	err = sim_xs_read("/test/tx/b", value, sizeof(value));
+	CHECK(err == -ENOENT, "write of failed transaction seen, %d", err);
+
+	tx = sim_xs_transaction_start();
+	sim_xs_tx_read(tx, "/test/tx/a", value, sizeof(value));
+	sim_xs_tx_write(tx, "/test/tx/b", "1");
+	err = sim_xs_transaction_end(tx, false);
+	CHECK(err == 0, "end of retry %d", err);
+
+	/* Same over the ring */
+	err = request(XS_TRANSACTION_START, 0, "", 1, NULL);
+	CHECK(err == XS_TRANSACTION_START, "XS_TRANSACTION_START %d", err);
+	tx = atoi(body());
+	err = request(XS_READ, tx, "/test/tx/a", 11, NULL);
+	CHECK(err == XS_READ, "XS_READ %d", err);
+	sim_xs_write("/test/tx/a", "3");
+	len = snprintf(req, sizeof(req), "/test/tx/b%c2", 0);
+	err = request(XS_WRITE, tx, req, len, NULL);
+	CHECK(err == XS_WRITE, "XS_WRITE %d", err);
+	err = request(XS_TRANSACTION_END, tx, "T", 2, NULL);
+	CHECK(err == XS_ERROR && strcmp(body(), "EAGAIN") == 0,
+			"XS_TRANSACTION_END %d %s", err, body());
+}
+
+/* Out of range refs and ports are refused, not indexed with */
+static void test_bounds(void)
+{
+	CHECK(sim_end_access(-1) == -EINVAL, "end_access(-1)");
+	CHECK(sim_end_access(SIM_MAX_GRANTS) == -EINVAL, "end_access(max)");
+	CHECK(sim_notify(-1) == -EINVAL, "notify(-1)");
+	CHECK(sim_notify(SIM_MAX_PORTS) == -EINVAL, "notify(max)");
+}
+
+/* Request and reply bigger than the ring pass in pieces */
+static void test_big(void)
+{
+	char req[XENSTORE_PAYLOAD_MAX], path[SIM_KEY_LEN];
+	char value[SIM_VALUE_LEN];
+	const char *name;
+	int i, n, err, events;
+
+	n = snprintf(req, sizeof(req), "/test/big/value") + 1;
+	memset(req + n, 'x', 2 * XENSTORE_RING_SIZE);
+	err = request(XS_WRITE, 0, req, n + 2 * XENSTORE_RING_SIZE, NULL);
+	CHECK(err == XS_WRITE, "XS_WRITE of %d bytes %d", 2 * XENSTORE_RING_SIZE,
+			err);
+	err = sim_xs_read("/test/big/value", value, sizeof(value));
+	CHECK(err == 0 && value[0] == 'x', "read back %d", err);
+
+	for (i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path),
+				"/test/big/dir/child-with-a-rather-long-name-%03d", i);
+		sim_xs_write(path, "1");
+	}
+	err = request(XS_DIRECTORY, 0, "/test/big/dir", 14, &events);
+	CHECK(err == XS_DIRECTORY, "XS_DIRECTORY %d", err);
+	CHECK(body_len() > XENSTORE_RING_SIZE, "reply of %d bytes", body_len());
+	for (n = 0, name = body(); name < body() + body_len();
+			name += strlen(name) + 1)
+		n++;
+	CHECK(n == 64, "%d children", n);
+	CHECK(events > 1, "%d notifies for %d bytes", events, body_len());
+	printf("store: %d byte reply in %d notifies\n", body_len(), events);
+}
+
+int main(void)
+{
+	int err;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	err = sim_attach(1);
+	if (err) {
+		fprintf(stderr, "store: attach: %s\n", strerror(-err));
+		return 1;
+	}
+	intf = sim_xenstore_ring();
+	err = sim_bind_handler(SIM_STORE_PORT, store_event, NULL);
+	if (err < 0) {
+		fprintf(stderr, "store: bind: %s\n", strerror(-err));
+		return 1;
+	}
+
+	test_transaction();
+	test_bounds();
+	test_big();
+
+	sim_detach();
+	printf("store: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
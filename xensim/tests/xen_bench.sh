@@ -0,0 +1,13 @@
+# xen_bench: each primitive timed as often as asked, the event channel
+# sample ending in the handler bound to the receiving end
+. tests/lib.sh
+
+mod/xen_bench -x arg1=1000 > $LOG/bench 2>&1 || fail "insmod"
+clean $LOG/bench
+for b in null_hypercall grant_map_unmap grant_copy evtchn_deliver \
+        xenstore_read; do
+    [ "$(awk -v b=$b '$1 == b { print $2 }' $LOG/bench)" = 1000 ] ||
+        fail "$b samples"
+done
+grep -q "failed" $LOG/bench && fail "bench failed"
+sed -n '/^cycles/,$p' $LOG/bench
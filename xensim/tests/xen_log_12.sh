@@ -0,0 +1,87 @@
+# Xen_Log_12: 4 evtchns of a domU ping-ponged by dom0 on 2 vCPUs. Left
+# where Xen puts them as baseline, spread round-robin, and left on one
+# vCPU with rebalance to even them out. Then 3 domUs against a dom0 with
+# work to do on every event, on 1 vCPU and spread over 4
+. tests/lib.sh
+
+# pingpong <name> "<dom0 params>": run one, its log in $LOG/<name>
+pingpong()
+{
+    mod/Xen_Log_12-domU -d 1 -c 2 nr_ports=4 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/domU "Bound local irq: [0-9]* to evtchn:[0-9]*"
+    while [ $(grep -c "Bound local irq" $LOG/domU) -lt 4 ]; do sleep 0.1; done
+    ports=$(sed -n "s/.*Get new evtchn: \([0-9]*\).*/\1/p" $LOG/domU | \
+        paste -sd,)
+    mod/Xen_Log_12-dom0 -d 0 -c 2 -x domid=1 port=$ports rounds=20000 $2 \
+        > $LOG/$1 2>&1 || fail "$1"
+    rmmod $domU
+    clean $LOG/domU $LOG/$1
+    grep -q "events ran on\|Cant bind\|timed out" $LOG/$1 && fail "$1"
+    printf "%-10s %9s  %s\n" $1 \
+        $(sed -n "s/.* \([0-9]*\) events.s$/\1/p" $LOG/$1) \
+        "$(sed -n "s/.*port [0-9]*: cpu \([0-9]*\),.*/\1/p" $LOG/$1 | paste -sd " ")"
+}
+
+# cpus <name>: vCPUs of evtchns at the end, sorted
+cpus()
+{
+    sed -n "s/.*port [0-9]*: cpu \([0-9]*\),.*/\1/p" $LOG/$1 | sort | paste -sd " "
+}
+
+echo "spread    events/s  vCPU of each evtchn"
+pingpong none "spread=0 rebalance_ms=0"
+[ "$(cpus none)" = "0 0 0 0" ] || fail "Xen put evtchns on $(cpus none)"
+[ "$(value $LOG/none 'rebalance:')" = 0 ] || fail "moved with rebalance off"
+
+pingpong rr "spread=1 rebalance_ms=0"
+[ "$(cpus rr)" = "0 0 1 1" ] || fail "round-robin put evtchns on $(cpus rr)"
+
+pingpong rebalance "spread=0"
+[ "$(value $LOG/rebalance 'rebalance:')" -gt 0 ] || fail "nothing moved"
+[ "$(cpus rebalance)" = "0 0 1 1" ] || \
+    fail "rebalance left evtchns on $(cpus rebalance)"
+
+# Three domUs with 2 evtchns each. dom0 is busy 50 us on every event, so
+# one vCPU tops out well below what the domUs bounce. Left where Xen puts
+# them, all 6 stay on vCPU 0 of 4 and do no better than dom0 on 1 vCPU.
+# Spread, or moved by rebalance, they run on all 4
+ports=""
+doms=""
+for d in 1 2 3; do
+    mod/Xen_Log_12-domU -d $d -c 2 nr_ports=2 > $LOG/domU$d 2>&1 &
+    eval domU$d=\$!
+    wait_for $LOG/domU$d "Bound local irq: [0-9]* to evtchn:[0-9]*"
+    while [ $(grep -c "Bound local irq" $LOG/domU$d) -lt 2 ]; do sleep 0.1; done
+    for p in $(sed -n "s/.*Get new evtchn: \([0-9]*\).*/\1/p" $LOG/domU$d); do
+        ports="$ports${ports:+,}$p"
+        doms="$doms${doms:+,}$d"
+    done
+done
+
+# busy <name> "<dom0 params>": events/s in $rate
+busy()
+{
+    mod/Xen_Log_12-dom0 -d 0 -x domid=$doms port=$ports rounds=2000 work_us=50 \
+        $2 > $LOG/$1 2>&1 || fail "$1"
+    clean $LOG/$1
+    grep -q "events ran on\|Cant bind\|timed out" $LOG/$1 && fail "$1"
+    rate=$(sed -n "s/.* \([0-9]*\) events.s$/\1/p" $LOG/$1)
+    printf "%-16s %9s  %s\n" $1 $rate "$(cpus $1)"
+}
+
+echo "3 domUs         events/s  vCPU of each evtchn"
+busy one_vcpu "-c 1 spread=0 rebalance_ms=0"
+base=$rate
+busy unspread "-c 4 spread=0 rebalance_ms=0"
+[ $((rate * 10)) -le $((base * 13)) ] || fail "unspread $rate events/s, base $base"
+busy round-robin "-c 4 spread=1 rebalance_ms=0"
+[ $((rate * 10)) -ge $((base * 25)) ] || fail "round-robin $rate events/s, base $base"
+busy least-loaded "-c 4 spread=3 rebalance_ms=0"
+[ $((rate * 10)) -ge $((base * 25)) ] || fail "least-loaded $rate events/s, base $base"
+busy rebalance "-c 4 spread=0"
+[ $((rate * 10)) -ge $((base * 25)) ] || fail "rebalance $rate events/s, base $base"
+for d in 1 2 3; do
+    eval rmmod \$domU$d
+    clean $LOG/domU$d
+done
@@ -0,0 +1,72 @@
+# Xen_Log_13: xenstore client of its own on the store ring of dom1 in
+# xen_start_info, which xenbus of the shim leaves alone. Pipelined reads,
+# one with a callback, a payload over the max refused, a watch, the
+# activation of alice_dev of dom2 in one transaction, cached reads and
+# their invalidation by a write
+. tests/lib.sh
+
+# Listing of alice_dir is about three rings long
+for i in $(seq 100 163); do
+    xenstore-write /local/domain/1/alice_dir/child-with-a-rather-long-name-$i 1
+done
+timeout -s KILL 20 mod/Xen_Log_13-pvdom -d 1 -x activate=2 > $LOG/pvdom 2>&1 ||
+    fail "insmod"
+clean $LOG/pvdom
+grep -q "read alice:test$" $LOG/pvdom || fail "write and read back"
+grep -q "write of 4096 bytes: -7$" $LOG/pvdom || fail "payload over max"
+grep -q "name:domU1" $LOG/pvdom || fail "pipelined read"
+grep -q "callback domid:1$" $LOG/pvdom || fail "read with callback"
+grep -q "callback of req [0-9]* done" $LOG/pvdom || fail "req after callback"
+grep -q "alice_dir has 64 children" $LOG/pvdom || fail "listing"
+grep -q "activate alice_dev of dom2: 0 after 0 retries" $LOG/pvdom || fail "activate"
+[ "$(xenstore-read /local/domain/0/backend/alice_dev/2/0/frontend-id)" = 2 ] ||
+    fail "frontend-id"
+[ "$(xenstore-read /local/domain/2/device/alice_dev/0/state)" = 1 ] ||
+    fail "state"
+[ "$(value $LOG/pvdom 'callbacks')" -gt 0 ] || fail "no watch callback"
+[ "$(value $LOG/pvdom 'cache hits')" -ge 99 ] || fail "cache hits"
+grep -q "cached alice:uncached" $LOG/pvdom || fail "stale cached value"
+[ "$(value $LOG/pvdom 'invalidations')" -gt 0 ] || fail "no invalidation"
+plain=$(value $LOG/pvdom "100 reads took")
+cached=$(value $LOG/pvdom "100 cached reads took")
+[ "$cached" -lt "$plain" ] || fail "cached reads no faster"
+grep "took\|waits\|cache hits" $LOG/pvdom | sed "s/^Alice: //"
+
+# Activation raced by a write of one of its keys on its first 3 tries
+# commits on the 4th, after backing off. Raced on all 16 it gives up
+timeout -s KILL 20 mod/Xen_Log_13-pvdom -d 2 -x activate=1 race=3 \
+    > $LOG/pvdom 2>&1 || fail "insmod race=3"
+clean $LOG/pvdom
+grep -q "activate alice_dev of dom1: 0 after 3 retries" $LOG/pvdom ||
+    fail "raced activate"
+[ "$(xenstore-read /local/domain/0/backend/alice_dev/1/0/state)" = 1 ] ||
+    fail "raced activate state"
+grep "activate" $LOG/pvdom | sed "s/^Alice: //"
+timeout -s KILL 20 mod/Xen_Log_13-pvdom -d 2 -x activate=1 race=16 \
+    > $LOG/pvdom 2>&1 || fail "insmod race=16"
+grep -q "activate alice_dev of dom1: -11 after 15 retries" $LOG/pvdom ||
+    fail "activate raced every time"
+[ "$(value $LOG/pvdom "retries in")" -lt 320000 ] || fail "backoff past its cap"
+grep "activate" $LOG/pvdom | sed "s/^Alice: //"
+
+# Watch storm: 2000 writes of the watched key, each an event, end in few
+# callbacks, the last one reading the last value. Events come in order,
+# so once alice/end is called back all of them are in. Ring given by
+# hand this time, as for a second connection
+mod/Xen_Log_13-pvdom -d 3 ring_gfn=4 ring_port=1 > $LOG/pvdom 2>&1 &
+pvdom=$!
+wait_for $LOG/pvdom "cached alice:"
+args=""
+for i in $(seq 1 2000); do
+    args="$args /local/domain/3/alice v$i"
+done
+xenstore-write $args /local/domain/3/alice/end 1
+wait_for $LOG/pvdom "alice/end changed to 1"
+grep -q "alice changed to v2000" $LOG/pvdom || fail "last value not seen"
+rmmod $pvdom
+clean $LOG/pvdom
+events=$(value $LOG/pvdom "watch events")
+callbacks=$(value $LOG/pvdom "callbacks")
+[ "$events" -ge 2000 ] || fail "$events watch events for 2000 writes"
+[ "$callbacks" -lt 200 ] || fail "$callbacks callbacks, not coalesced"
+grep "watch events" $LOG/pvdom | sed "s/^Alice: //"
@@ -0,0 +1,76 @@
+# Xen_Log_13: ring copy of the xenstore client, memcpy of whole chunks
+# against the byte at a time copy it replaced. 4000 messages of 4000
+# bytes, about four rings each, half written and half read back
+. tests/lib.sh
+
+# bench <domid> <params>: msgs/s and KB/s in $msgs and $kbs
+bench()
+{
+    timeout -s KILL 60 mod/Xen_Log_13-pvdom -d $1 -x bench=4000 bench_len=4000 $2 \
+        > $LOG/pvdom 2>&1 || fail "insmod $2"
+    clean $LOG/pvdom
+    msgs=$(value $LOG/pvdom "ns,")
+    kbs=$(value $LOG/pvdom "msgs.s,")
+}
+
+bench 1 bytewise=0
+chunk_msgs=$msgs
+chunk_kbs=$kbs
+bench 2 bytewise=1
+echo "copy      msgs/s   MB/s"
+echo "memcpy  $(printf '%8d %6d' $chunk_msgs $((chunk_kbs / 1024)))"
+echo "bytes   $(printf '%8d %6d' $msgs $((kbs / 1024)))"
+[ $((chunk_msgs * 100)) -ge $((msgs * 110)) ] ||
+    fail "memcpy $chunk_msgs msgs/s, not 10% over $msgs a byte at a time"
+
+# Waits of the client: sleeping on the store event channel after a short
+# spin, against spinning all along. One small message in flight, so each
+# is a whole round trip. CPU of every thread of the domain, taken while
+# it is still loaded, over its messages. Best of 3 runs, the host CPU is
+# shared with the rest of the sim
+cpu_ns()
+{
+    cat /proc/$1/task/*/schedstat | awk '{ s += $1 } END { print s }'
+}
+
+# wait_run <domid> <params>: CPU ns and round trip ns a message in
+# $cpu and $rtt
+wait_run()
+{
+    # Emptied here, the child truncating it may come after wait_for
+    # finds the line of the run before
+    : > $LOG/pvdom
+    mod/Xen_Log_13-pvdom -d $1 bench=4000 bench_len=16 bench_depth=1 $2 \
+        > $LOG/pvdom 2>&1 &
+    pvdom=$!
+    wait_for $LOG/pvdom "bench "
+    cpu=$(($(cpu_ns $pvdom) / 4000))
+    rmmod $pvdom
+    clean $LOG/pvdom
+    rtt=$(($(value $LOG/pvdom "bytes in") / 4000))
+}
+
+# wait_bench <domid> <params>: lowest $cpu and $rtt of 3 runs
+wait_bench()
+{
+    wait_run $1 $2
+    best_cpu=$cpu
+    best_rtt=$rtt
+    for i in 2 3; do
+        wait_run $1 $2
+        [ $cpu -lt $best_cpu ] && best_cpu=$cpu
+        [ $rtt -lt $best_rtt ] && best_rtt=$rtt
+    done
+    cpu=$best_cpu
+    rtt=$best_rtt
+}
+
+wait_bench 3 spin_only=0
+sleep_cpu=$cpu
+sleep_rtt=$rtt
+wait_bench 3 spin_only=1
+echo "wait      CPU ns/op  round trip ns"
+echo "sleep   $(printf '%11d %14d' $sleep_cpu $sleep_rtt)"
+echo "spin    $(printf '%11d %14d' $cpu $rtt)"
+[ $((sleep_cpu * 115)) -le $((cpu * 100)) ] ||
+    fail "sleeping takes $sleep_cpu ns CPU a message, not 15% under $cpu spinning"
@@ -0,0 +1,34 @@
+# Xen_Log_15: alice_dev with several queues of multi-page rings, taken
+# down from either end while hellos and bulk writes are in flight, and
+# one kept full
+. tests/lib.sh
+
+# Frontend first, backend still maps the rings, their pages are freed
+# once it unmaps them
+alice_dev 1 "" "num_queues=2 ring_order=2 load_ms=300 bulk_kb=64"
+grep -q "Connected 2 queues, ring order 2" $LOG/dom0 || fail "negotiation"
+wait_for $LOG/domU "latency"
+rmmod $domU
+rmmod $dom0
+clean $LOG/domU $LOG/dom0
+echo "frontend first: $(grep -c 'still in use!' $LOG/domU) ring pages freed late"
+
+# Backend first, under load
+alice_dev 2 "" "num_queues=2 ring_order=2 load_ms=2000"
+sleep 0.3
+rmmod $dom0
+rmmod $domU
+grep -q "Disconnect the backend" $LOG/dom0 || fail "disconnect"
+clean $LOG/domU $LOG/dom0
+echo "backend first: $(value $LOG/dom0 'queue 0 sent') events on queue 0"
+
+# A ring kept full is served in runs of a budget each
+alice_dev 3 "" "num_queues=1 ring_order=4 load_ms=200 load_depth=1024"
+wait_for $LOG/domU "latency"
+rmmod $domU
+rmmod $dom0
+clean $LOG/domU $LOG/dom0
+requeues=$(value $LOG/dom0 "requeued")
+[ "$requeues" -gt 0 ] || fail "full ring never ran out of budget"
+echo "full ring: $(value $LOG/domU 'ns, max') ns max latency," \
+    "$requeues requeues of the work"
@@ -0,0 +1,22 @@
+# Xen_Log_15: activate, the libxenstore tool, connecting devices of two
+# domUs in one transaction instead of activate.sh
+. tests/lib.sh
+
+for d in 1 2; do
+    mod/Xen_Log_15-domU -d $d -c 1 > $LOG/domU$d 2>&1 &
+    eval domU$d=$!
+done
+mod/Xen_Log_15-dom0 -d 0 -c 2 > $LOG/dom0 2>&1 &
+dom0=$!
+wait_for $LOG/dom0 "inited"
+wait_for $LOG/domU1 "inited"
+wait_for $LOG/domU2 "inited"
+mod/Xen_Log_15-activate -b 2 1 2 > $LOG/activate || fail "activate"
+grep -q "dom2: activated" $LOG/activate || fail "dom2 not activated"
+wait_for $LOG/domU1 "Other side says it is connected"
+wait_for $LOG/domU2 "Other side says it is connected"
+rmmod $domU1
+rmmod $domU2
+rmmod $dom0
+clean $LOG/domU1 $LOG/domU2 $LOG/dom0
+tail -n 1 $LOG/activate
@@ -0,0 +1,51 @@
+# Xen_Log_15: mass attach, many devices of one domU activated at once,
+# each connected on a work of its own. Prints time from activation until
+# all are connected against the time one device alone takes
+. tests/lib.sh
+
+# attach <domid> <devices>: activate that many devices of domid with all
+# their nodes in one write, like activate.sh writes those of device 0,
+# and wait until each frontend is connected. Simulated frames run out at
+# about a dozen devices, each backend queue keeps pages of its own
+attach()
+{
+    mod/Xen_Log_15-dom0 -d 0 -c 2 > $LOG/dom0 2>&1 &
+    dom0=$!
+    mod/Xen_Log_15-domU -d $1 -c 2 num_queues=1 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/dom0 "inited"
+    wait_for $LOG/domU "inited"
+    nodes=""
+    states=""
+    for n in $(seq 0 $(($2 - 1))); do
+        u=/local/domain/$1/device/alice_dev/$n
+        b=/local/domain/0/backend/alice_dev/$1/$n
+        nodes="$nodes $u/backend-id 0 $u/backend $b"
+        nodes="$nodes $b/frontend-id $1 $b/frontend $u"
+        states="$states $u/state 1 $b/state 1"
+    done
+    start=$(date +%s%N)
+    xenstore-write $nodes && xenstore-write $states || fail "activate"
+    i=0
+    while [ $(grep -c "Other side says it is connected" $LOG/domU) -lt $2 ]; do
+        i=$((i + 1))
+        [ $i -gt 1000 ] && fail "$2 devices not connected"
+        sleep 0.01
+    done
+    took=$((($(date +%s%N) - start) / 1000))
+    [ $(grep -c "Dom0: Connected" $LOG/dom0) -eq $2 ] || fail "dom0 connects"
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    # Slowest bring-up of a frontend and sum of connect of backends
+    slow=$(sed -n "s/.*bring-up took \([0-9]*\).*/\1/p" $LOG/domU | \
+        sort -n | tail -n 1)
+    sum=$(sed -n "s/.*Dom0: Connected .* in \([0-9]*\) us.*/\1/p" $LOG/dom0 | \
+        awk '{ s += $1 } END { print s }')
+    printf "%-7s %9s %14s %17s\n" $2 $took $slow $sum
+}
+
+echo "devices  all (us)  slowest (us)  dom0 connect sum"
+attach 1 1
+attach 2 4
+attach 3 8
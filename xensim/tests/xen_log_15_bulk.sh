@@ -0,0 +1,12 @@
+# Xen_Log_15: throughput of bulk writes from a page up to 1 MB, one in
+# flight at a time, through grants of each request
+. tests/lib.sh
+
+alice_dev 1 "" "num_queues=1 persistent=0 bulk_kb=1024 bulk_ms=100"
+wait_for $LOG/domU "bulk done\|bulk stopped"
+grep -q "bulk done" $LOG/domU || fail "bulk"
+grep -q "bulk read back" $LOG/domU || fail "read back"
+rmmod $domU
+rmmod $dom0
+clean $LOG/domU $LOG/dom0
+sed -n "s/.*DomU: \(bulk [0-9]* KB.*\)/\1/p" $LOG/domU
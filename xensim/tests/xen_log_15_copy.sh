@@ -0,0 +1,52 @@
+# Xen_Log_15: where grant copy stops being cheaper than mapping. Bulk
+# writes of 1 to 16 pages are copied, then mapped, then writes of 1 to
+# 3 pages are left to the backend to calibrate the threshold between the
+# two from its default of 2 pages
+. tests/lib.sh
+
+# bulk <domid> "<dom0 params>" [kb]: run the sweep of xen_log_15_bulk.sh
+# without persistent grants, MB/s of each size left in $LOG/<domid>
+bulk()
+{
+    alice_dev $1 "$2" "num_queues=1 persistent=0 bulk_kb=${3:-64} bulk_ms=100"
+    wait_for $LOG/domU "bulk done\|bulk stopped"
+    grep -q "bulk done" $LOG/domU || fail "bulk"
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    sed -n "s/.*DomU: bulk \([0-9]*\) KB, .*, \([0-9]*\) MB.*/\1 \2/p" \
+        $LOG/domU > $LOG/$1
+}
+
+# mbs <domid> <kb>: MB/s of that size in a sweep
+mbs()
+{
+    awk -v kb=$2 '$1 == kb { print $2 }' $LOG/$1
+}
+
+bulk 1 "copy_calibrate=0 copy_threshold=65536"
+[ "$(value $LOG/dom0 'mapped')" -le 1 ] || fail "mapped with copy only"
+
+bulk 2 "copy_calibrate=0 copy_threshold=0"
+[ "$(value $LOG/dom0 'copied')" -eq 0 ] || fail "copied with map only"
+
+# The threshold moves only on what sizes at and one page over it cost
+bulk 3 "copy_calibrate=1" 12
+thresh=$(value $LOG/dom0 "copy threshold")
+if [ $(mbs 1 8) -gt $(mbs 2 8) ] && [ $(mbs 1 16) -gt $(mbs 2 16) ]; then
+    [ "$thresh" -ge 3 ] || fail "threshold $thresh, copy is cheaper"
+elif [ $(mbs 1 8) -lt $(mbs 2 8) ] && [ $(mbs 1 16) -lt $(mbs 2 16) ]; then
+    [ "$thresh" -le 1 ] || fail "threshold $thresh, map is cheaper"
+fi
+
+echo "KB    copy   map (MB/s)"
+paste -d " " $LOG/1 $LOG/2 | \
+    while read kb copy _ map; do
+        printf "%-5s %4s %5s\n" $kb $copy $map
+    done
+cross=$(paste -d " " $LOG/1 $LOG/2 | \
+    while read kb copy _ map; do
+        [ $map -ge $copy ] && { echo $kb; break; }
+    done)
+echo "map as fast as copy from ${cross:-over 64} KB," \
+    "calibrated threshold $thresh pages"
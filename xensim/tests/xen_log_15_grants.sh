@@ -0,0 +1,40 @@
+# Xen_Log_15: bulk writes through grants of each request against
+# persistent grants the backend keeps mapped, and persistent grants
+# with a cache smaller than the working set
+. tests/lib.sh
+
+# bulk <domid> "<dom0 params>" "<domU params>": run the sweep of
+# xen_log_15_bulk.sh, MB/s of each size left in $LOG/<domid>
+bulk()
+{
+    alice_dev $1 "$2" "num_queues=1 bulk_kb=1024 bulk_ms=100 $3"
+    wait_for $LOG/domU "bulk done\|bulk stopped"
+    grep -q "bulk done" $LOG/domU || fail "bulk"
+    grep -q "bulk read back" $LOG/domU || fail "read back"
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    sed -n "s/.*DomU: bulk \([0-9]*\) KB, .*, \([0-9]*\) MB.*/\1 \2/p" \
+        $LOG/domU > $LOG/$1
+}
+
+bulk 1 "" "persistent=0"
+grep -q "persistent grants" $LOG/dom0 && fail "persistent grants used"
+
+bulk 2 "" "persistent=1"
+hit=$(value $LOG/dom0 "persistent grants hit")
+miss=$(value $LOG/dom0 "miss")
+[ "$hit" -gt 0 ] || fail "no persistent grant hit"
+[ "$miss" -le 256 ] || fail "$miss misses for 256 pages"
+
+bulk 3 "max_pgrants=64" "persistent=1"
+evict=$(value $LOG/dom0 "evict")
+[ "$evict" -gt 0 ] || fail "no eviction past max_pgrants"
+
+echo "KB    map  persistent  persistent,64 kept (MB/s)"
+paste -d " " $LOG/1 $LOG/2 $LOG/3 | \
+    while read kb map _ pers _ cap; do
+        printf "%-5s %4s %11s %14s\n" $kb $map $pers $cap
+    done
+echo "persistent: hit $hit, miss $miss;" \
+    "64 kept: $(grep -o 'hit.*evict [0-9]*' $LOG/dom0 | tail -n 1)"
@@ -0,0 +1,49 @@
+# Xen_Log_15: latency of hellos kept load_depth deep for load_ms while
+# a bulk write goes through the same queue, so responses to both are timed.
+# Then interrupts and latency of the same load without moderation, with a
+# 100 us window, and with the window ended by every 4 responses
+. tests/lib.sh
+
+alice_dev 1 "" "num_queues=1 bulk_kb=64 load_ms=200 load_depth=8"
+wait_for $LOG/domU "DomU: latency"
+rmmod $domU
+rmmod $dom0
+clean $LOG/domU $LOG/dom0
+line=$(grep "DomU: latency" $LOG/domU)
+avg=$(echo "$line" | sed -n "s/.*avg \([0-9]*\) ns.*/\1/p")
+max=$(echo "$line" | sed -n "s/.*max \([0-9]*\) ns.*/\1/p")
+[ -n "$avg" ] && [ "$avg" -gt 0 ] || fail "avg latency $avg"
+# A response is seen well within the second load runs for
+[ "$max" -lt 1000000000 ] || fail "max latency $max ns"
+sed -n "s/.*DomU: \(load .*\)/\1/p; s/.*DomU: \(latency .*\)/\1/p" $LOG/domU
+
+# moderated <name> "<domU params>": interrupts/s and avg latency ns of
+# half a second of load in $irqs and $lat
+moderated()
+{
+    alice_dev 1 "" "num_queues=1 load_ms=500 load_depth=8 $2"
+    wait_for $LOG/domU "DomU: latency"
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    irqs=$(sed -n "s/.* \([0-9]*\) interrupts.s.*/\1/p" $LOG/domU)
+    lat=$(sed -n "s/.*latency avg \([0-9]*\) ns.*/\1/p" $LOG/domU)
+    [ -n "$irqs" ] && [ -n "$lat" ] || fail "$1 load"
+    printf "%-10s %12d %14d\n" $1 $irqs $lat
+}
+
+echo "moderation  interrupts/s  avg latency ns"
+moderated off ""
+grep -q "moderation 0 us, 0 responses$" $LOG/domU || fail "off print"
+off_irqs=$irqs
+off_lat=$lat
+moderated 100us "intr_moderation_us=100"
+# One event a window, responses wait it out
+[ $((irqs * 5)) -le $off_irqs ] || fail "100 us window: $irqs interrupts/s, $off_irqs off"
+[ $lat -ge $((off_lat * 5)) ] || fail "100 us window: $lat ns latency, $off_lat off"
+grep -q "moderation 100 us, 0 responses, adaptive$" $LOG/domU || fail "100 us window print"
+win_lat=$lat
+moderated rsps=4 "intr_moderation_us=100 intr_moderation_rsps=4"
+# 8 in flight fill 4 responses long before the window ends
+[ $((irqs * 2)) -ge $off_irqs ] || fail "rsps=4: $irqs interrupts/s, $off_irqs off"
+[ $((lat * 4)) -le $win_lat ] || fail "rsps=4: $lat ns latency, $win_lat on the window"
@@ -0,0 +1,48 @@
+# Xen_Log_15: bring-up of a device with negotiation step by step against
+# fast_negotiate, in time and in xenstore requests of each side. Devices
+# 0 to 4 of a domU are brought up one after another, the median is
+# printed. Requests of dom0 count those of the toolstack activating,
+# same in both
+. tests/lib.sh
+
+DEVICES=5
+
+# bringup <domid> <fast_negotiate>
+bringup()
+{
+    mod/Xen_Log_15-dom0 -d 0 -c 2 fast_negotiate=$2 > $LOG/dom0 2>&1 &
+    dom0=$!
+    mod/Xen_Log_15-domU -d $1 -c 2 fast_negotiate=$2 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/dom0 "inited"
+    wait_for $LOG/domU "inited"
+    : > $LOG/ops
+    for n in $(seq 0 $((DEVICES - 1))); do
+        u=/local/domain/$1/device/alice_dev/$n
+        b=/local/domain/0/backend/alice_dev/$1/$n
+        before=$(xenstore-ops 0 $1 | paste -sd " ")
+        xenstore-write $u/backend-id 0 $u/backend $b \
+            $b/frontend-id $1 $b/frontend $u $u/state 1 $b/state 1 || \
+            fail "activate"
+        i=0
+        while [ $(grep -c "Dom0: Connected" $LOG/dom0) -le $n ] ||
+            [ $(grep -c "bring-up took" $LOG/domU) -le $n ]; do
+            i=$((i + 1))
+            [ $i -gt 500 ] && fail "device $n not connected"
+            sleep 0.01
+        done
+        echo $before $(xenstore-ops 0 $1) >> $LOG/ops
+    done
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    us=$(sed -n "s/.*bring-up took \([0-9]*\).*/\1/p" $LOG/domU | sort -n | \
+        sed -n "$((DEVICES / 2 + 1))p")
+    awk -v fast=$2 -v us=$us '{ d0 += $3 - $1; dU += $4 - $2 }
+        END { printf "%-15s %9s %13.1f %13.1f\n", fast, us, d0 / NR, dU / NR }' \
+        $LOG/ops
+}
+
+echo "fast_negotiate  us (median)  dom0 requests  domU requests"
+bringup 1 0
+bringup 2 1
@@ -0,0 +1,27 @@
+# Xen_Log_15: hellos kept 8 deep on every queue for 300 ms, with 1, 2
+# and 4 queues on 4 vCPUs. Each queue is served by the work of its own
+# vCPU and the backend sleeps service_us on each request, as if a device
+# served it, so responses/s grow with queues whatever CPUs the host has
+. tests/lib.sh
+
+vcpus=4
+
+# queues <domid> <num_queues>: responses/s into $rate
+queues()
+{
+    alice_dev $1 "max_queues=4 service_us=100" "num_queues=$2 load_ms=300"
+    grep -q "Connected $2 queues" $LOG/dom0 || fail "$2 queues"
+    wait_for $LOG/domU "DomU: latency"
+    rmmod $domU
+    rmmod $dom0
+    clean $LOG/domU $LOG/dom0
+    rate=$(sed -n "s/.*DomU: load \([0-9]*\) us, \([0-9]*\) responses.*/\1 \2/p" \
+        $LOG/domU | awk '{ printf "%d", $2 * 1000000 / $1 }')
+}
+
+queues 1 1; r1=$rate
+queues 2 2; r2=$rate
+queues 3 4; r4=$rate
+echo "1 queue $r1, 2 queues $r2, 4 queues $r4 responses/s"
+[ $((r2 * 10)) -ge $((r1 * 15)) ] || fail "2 queues $r2, 1 queue $r1"
+[ $((r4 * 10)) -ge $((r1 * 25)) ] || fail "4 queues $r4, 1 queue $r1"
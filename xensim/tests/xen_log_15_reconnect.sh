@@ -0,0 +1,47 @@
+# Xen_Log_15: bring-up of a device against reconnects keeping queues of
+# both ends, the backend closing while its node stays online, and a
+# reconnect to a backend module loaded again
+. tests/lib.sh
+
+B=/local/domain/0/backend/alice_dev/1/0
+RECONNECTS=5
+
+# bringups <count>: until frontend was brought up that often
+bringups()
+{
+    i=0
+    while [ $(grep -c "bring-up took" $LOG/domU) -lt $1 ]; do
+        i=$((i + 1))
+        [ $i -gt 500 ] && fail "no bring-up $1"
+        sleep 0.01
+    done
+}
+
+alice_dev 1 "" "num_queues=2"
+first=$(value $LOG/domU "bring-up took")
+
+# Backend closing on its own, both ends come back on their queues
+for n in $(seq 1 $RECONNECTS); do
+    xenstore-write $B/state 5 || fail "close"
+    bringups $((n + 1))
+done
+[ $(grep -c "Dom0: Connected" $LOG/dom0) -eq $((RECONNECTS + 1)) ] || \
+    fail "backend connects"
+reconnect=$(sed -n "s/.*bring-up took \([0-9]*\).*/\1/p" $LOG/domU | \
+    sed 1d | sort -n | sed -n "$((RECONNECTS / 2 + 1))p")
+
+# Backend loaded again, the toolstack activates its node anew
+rmmod $dom0
+mod/Xen_Log_15-dom0 -d 0 -c 2 > $LOG/dom0 2>&1 &
+dom0=$!
+wait_for $LOG/dom0 "inited"
+xenstore-write $B/state 1 || fail "activate"
+bringups $((RECONNECTS + 2))
+reload=$(value $LOG/domU "bring-up took")
+
+rmmod $domU
+rmmod $dom0
+clean $LOG/domU $LOG/dom0
+echo "bring-up $first us, reconnect $reconnect us (median)," \
+    "to a backend loaded again $reload us"
+[ $reconnect -lt $first ] || fail "reconnect not faster than bring-up"
@@ -0,0 +1,18 @@
+# Xen_Log_3: alice_op hypercall with its Xen side built in. One op per
+# trap against 64 per trap, per op status of a batch, and a batch longer
+# than Xen lets run at once going on in continuations
+. tests/lib.sh
+
+timeout -s KILL 20 mod/Xen_Log_3-hypercall -d 1 -x nr_ops=65536 \
+    > $LOG/hypercall 2>&1 || fail "insmod"
+clean $LOG/hypercall
+grep -q "(XEN) Alice: a11ce" $LOG/hypercall || fail "print op"
+grep -q "64 echoes: 0, 0 wrong, bad cmd status -38$" $LOG/hypercall ||
+    fail "per op status"
+grep -q "ops at NULL: -14$" $LOG/hypercall || fail "bad array"
+[ "$(grep -c "per op, 0 failed" $LOG/hypercall)" = 2 ] || fail "failed ops"
+one=$(value $LOG/hypercall "by 1 per call,")
+batched=$(value $LOG/hypercall "by 64 per call,")
+grep "per call" $LOG/hypercall | sed "s/^alice_op: //"
+[ $((batched * 4)) -le "$one" ] ||
+    fail "$batched ns per op batched, not a quarter of $one"
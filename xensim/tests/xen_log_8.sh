@@ -0,0 +1,22 @@
+# Xen_Log_8: dom0 maps the share pool of domU, all grefs in one
+# hypercall and then one hypercall per gref, and times both
+. tests/lib.sh
+
+mod/Xen_Log_8-domU -d 1 nr_pages=256 > $LOG/domU 2>&1 &
+domU=$!
+wait_for $LOG/domU "Got page gref"
+grefs=$(sed -n '/grefs:/{n;p;}' $LOG/domU)
+
+for batch in 0 1; do
+    mod/Xen_Log_8-dom0 -x gref=$grefs domid=1 batch=$batch > $LOG/dom0 2>&1 ||
+        fail "dom0 batch=$batch"
+    grep -q "info from domU: Hello, by Alice in domU, page 0" $LOG/dom0 ||
+        fail "batch=$batch: page content"
+    map=$(value $LOG/dom0 "Alice: mapped 256 pages in")
+    unmap=$(value $LOG/dom0 "unmapped 256 pages in")
+    echo "batch=$batch: map $map ns, unmap $unmap ns, by" \
+        "$(value $LOG/dom0 'ns by') hypercalls each"
+    clean $LOG/dom0
+done
+rmmod $domU
+clean $LOG/domU
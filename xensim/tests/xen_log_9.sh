@@ -0,0 +1,83 @@
+# Xen_Log_9: domU streams requests over the I/O ring, dom0 answers
+# them in each poll mode. Every request gets its response, dom0
+# notifies far less often than once per response and a run of its work
+# stops at its budget, as 10000 requests keep the ring busy. With one
+# request in flight and a pause before the next dom0 goes idle after
+# each. Time from its event to the work draining and the round trip of
+# each request are printed for each mode. A busy poll window longer than
+# the pause catches the next request without an event, quicker
+. tests/lib.sh
+
+for mode in "poll_mode=0" "poll_mode=1 poll_us=20" "poll_mode=2 poll_us=20"; do
+    mod/Xen_Log_9-domU -d 1 nr_requests=10000 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/domU "Evtchn is"
+    gref=$(value $LOG/domU "Grant_Ref is")
+    port=$(value $LOG/domU "Evtchn is")
+
+    mod/Xen_Log_9-dom0 -t 1000 gref=$gref domid=1 port=$port $mode \
+        > $LOG/dom0 2>&1 || fail "dom0 $mode"
+    rmmod $domU
+
+    handled=$(value $LOG/dom0 "handled")
+    notifies=$(value $LOG/dom0 "requests, sent")
+    requeues=$(value $LOG/dom0 "requeued")
+    rate=$(value $LOG/domU "rate")
+    kicks=$(value $LOG/domU "sent")
+    echo "$mode: $handled requests, $rate requests/s, $(awk \
+        "BEGIN { printf \"%.4f\", ($notifies + $kicks) / $handled }")" \
+        "notifies per request, $requeues requeues"
+    grep -q "Sent 10000 requests, got 10000 responses" $LOG/domU ||
+        fail "$mode: responses lost"
+    [ "$handled" -eq 10000 ] || fail "$mode: handled $handled"
+    [ "$notifies" -lt 1000 ] || fail "$mode: $notifies notifies"
+    [ "$requeues" -gt 0 ] || fail "$mode: never ran out of budget"
+done
+
+for mode in "poll_mode=0" "poll_mode=1 poll_us=200" "poll_mode=2 poll_us=200"; do
+    mod/Xen_Log_9-domU -d 1 nr_requests=2000 nr_inflight=1 \
+        think_us=20 > $LOG/domU 2>&1 &
+    domU=$!
+    wait_for $LOG/domU "Evtchn is"
+    mod/Xen_Log_9-dom0 -t 1000 gref=$(value $LOG/domU "Grant_Ref is") domid=1 \
+        port=$(value $LOG/domU "Evtchn is") $mode > $LOG/dom0 2>&1 ||
+        fail "dom0 $mode one in flight"
+    rmmod $domU
+    grep -q "Sent 2000 requests, got 2000 responses" $LOG/domU ||
+        fail "$mode: one in flight, responses lost"
+
+    runs=$(value $LOG/dom0 "ns, max [0-9]* ns,")
+    p50=$(value $LOG/dom0 "wakeup p50")
+    p99=$(value $LOG/dom0 "p99")
+    rtt50=$(value $LOG/domU "round trip p50")
+    rtt99=$(value $LOG/domU "p99")
+    echo "$mode one in flight: $(value $LOG/domU rate) requests/s," \
+        "round trip p50 $rtt50 ns, p99 $rtt99 ns," \
+        "wakeup p50 ${p50:--} ns, p99 ${p99:--} ns, ${runs:-0} woken runs"
+    [ -n "$rtt50" ] && [ "$rtt50" -gt 0 -a "$rtt99" -ge "$rtt50" ] ||
+        fail "$mode: round trip p50 $rtt50 p99 $rtt99"
+    # Polling may catch every request before it needs an event
+    [ "$mode" != "poll_mode=0" ] || [ "${runs:-0}" -gt 1000 ] ||
+        fail "$mode: ${runs:-0} woken runs for 2000 requests"
+    [ -z "$p50" ] || [ "$p50" -gt 0 -a "$p99" -ge "$p50" ] ||
+        fail "$mode: wakeup p50 $p50 p99 $p99"
+    case $mode in
+    poll_mode=0) intr_runs=${runs:-0} intr_rtt=$rtt50 ;;
+    poll_mode=1*)
+        [ "${runs:-0}" -lt $((intr_runs / 2)) ] ||
+            fail "$mode: ${runs:-0} woken runs, $intr_runs without polling"
+        [ "$rtt50" -lt "$intr_rtt" ] ||
+            fail "$mode: round trip p50 $rtt50 ns, $intr_rtt without polling"
+        ;;
+    esac
+done
+
+# rmmod of dom0 while domU keeps the ring busy
+mod/Xen_Log_9-domU -d 1 nr_requests=100000000 > $LOG/domU 2>&1 &
+domU=$!
+wait_for $LOG/domU "Evtchn is"
+mod/Xen_Log_9-dom0 -t 200 gref=$(value $LOG/domU "Grant_Ref is") domid=1 \
+    port=$(value $LOG/domU "Evtchn is") > $LOG/dom0 2>&1 || fail "busy rmmod"
+rmmod $domU
+grep -q "unmap shared page successfully" $LOG/dom0 || fail "busy rmmod unmap"
+echo "busy rmmod: $(value $LOG/dom0 handled) requests handled"
@@ -0,0 +1,1501 @@
+/* Xen simulation for running the Xen_Log_* examples without Xen
+ * This is under GPL License
+ *
+ * All shared state lives in one region set up by sim_init(), frames in
+ * a memfd, event channels are eventfds. They are all inherited, the fd
+ * of shared region goes to exec'd domains in XENSIM_FD
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "xensim.h"
+
+/* Port of xenstored in dom0 the store ring of domain d is bound to */
+#define STORED_PORT(d)  (SIM_MAX_PORTS / 2 + (d))
+/* Epoll tag besides ports */
+#define EV_STOP         SIM_MAX_PORTS
+#define MAX_RING_WATCHES 64
+/* A domain not reading replies for this long loses its store ring */
+#define RING_WAIT_MS    1000
+/* Store changes remembered, a watch further behind sees only what
+ * changed, not each write */
+#define CHANGE_LOG      4096
+
+enum { PORT_FREE, PORT_UNBOUND, PORT_BOUND };
+
+struct sim_grant {
+	uint8_t in_use;
+	uint8_t readonly;
+	uint16_t domid;             /* Domain allowed to map it */
+	uint32_t gfn;
+	uint32_t maps;              /* Held by remote, can't end access */
+};
+
+struct sim_port {
+	uint8_t state;
+	uint16_t remote_dom;
+	uint16_t remote_port;
+	uint32_t events;            /* Notifies that came to it */
+};
+
+struct sim_key {
+	bool in_use;
+	uint64_t seq;               /* Store change it was last written by */
+	char path[SIM_KEY_LEN];
+	char value[SIM_VALUE_LEN];
+};
+
+/* Key read or written by a transaction, writes wait for commit */
+struct sim_tx_key {
+	bool write;
+	char path[SIM_KEY_LEN];
+	char value[SIM_VALUE_LEN];
+};
+
+struct sim_tx {
+	bool in_use;
+	uint64_t start;             /* Store generation it started at */
+	int nr;
+	struct sim_tx_key keys[SIM_TX_KEYS];
+};
+
+struct sim_shared {
+	pthread_mutex_t lock;       /* Protects all of below but rings */
+	int mem_fd;
+	int port_fds[SIM_MAX_DOMS][SIM_MAX_PORTS];
+	int proc_fds[SIM_MAX_PROCS];    /* Kicked on every store change */
+	bool proc_used[SIM_MAX_PROCS];
+	uint8_t frame_used[SIM_NR_FRAMES];
+	struct sim_grant grants[SIM_MAX_DOMS][SIM_MAX_GRANTS];
+	struct sim_port ports[SIM_MAX_DOMS][SIM_MAX_PORTS];
+	struct sim_key keys[SIM_MAX_KEYS];
+	uint64_t seq;
+	char changes[CHANGE_LOG][SIM_KEY_LEN];  /* Path of change seq */
+	struct sim_tx txs[SIM_MAX_TX];
+	uint64_t store_ops[SIM_MAX_DOMS];   /* Requests each domain made */
+};
+
+struct sim_watch_ent {
+	struct sim_watch_ent *next;
+	char prefix[SIM_KEY_LEN];
+	sim_watch_t fn;
+	void *arg;
+	uint64_t seq;               /* Changes up to this one are told */
+	bool initial;               /* Fire once on register */
+	bool dead;                  /* Unwatched, never freed */
+};
+
+/* Watch of a domain on its store ring, kept by xenstored */
+struct ring_watch {
+	bool in_use;
+	int dom;
+	char path[SIM_KEY_LEN];
+	char token[64];
+};
+
+/* Set up by sim_init, or found by sim_attach in XENSIM_FD */
+static struct sim_shared *shared;
+static char *mem;               /* Frames as this process sees them */
+static char *raw;               /* Frames, never hidden by a mapping */
+
+/* Of this process */
+static int self = -1;
+static int proc = -1;
+static pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handler_done = PTHREAD_COND_INITIALIZER;
+static struct {
+	sim_handler_t fn;
+	void *arg;
+	bool polled;                /* In epoll of its vCPU */
+	bool running;
+} handlers[SIM_MAX_PORTS];
+static struct sim_watch_ent *watches;
+static struct sim_watch_ent *firing;    /* Callback xenwatch thread runs */
+static int nr_vcpus;
+static pthread_t event_threads[SIM_MAX_VCPUS];
+static pthread_t watch_thread;
+static int epfds[SIM_MAX_VCPUS];
+static int port_vcpu[SIM_MAX_PORTS];
+static int stop_fd = -1;
+static __thread int this_vcpu;
+/* Domain whose ring request xenstored serves, requests of this
+ * process are its own otherwise */
+static __thread int store_client = -1;
+
+/* Of xenstored, one request or watch event at a time */
+static pthread_mutex_t stored_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring_watch ring_watches[MAX_RING_WATCHES];
+static bool store_dead[SIM_MAX_DOMS];
+/* Request being read off store ring of each domain */
+static struct stored_in {
+	struct xsd_sockmsg msg;
+	char body[XENSTORE_PAYLOAD_MAX + 1];
+	unsigned int got;
+} stored_in[SIM_MAX_DOMS];
+
+static void kick(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		perror("xensim: kick");
+}
+
+static void drain(int fd)
+{
+	uint64_t v;
+
+	while (read(fd, &v, sizeof(v)) == sizeof(v))
+		;
+}
+
+/* key is path or under it, empty path covers everything */
+static bool under_path(const char *key, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len == 0)
+		return true;
+	return strncmp(key, path, len) == 0 &&
+		(key[len] == '\0' || key[len] == '/');
+}
+
+static int map_frames(void)
+{
+	size_t size = (size_t)SIM_NR_FRAMES * SIM_PAGE_SIZE;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shared->mem_fd, 0);
+	raw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shared->mem_fd, 0);
+	if (mem == MAP_FAILED || raw == MAP_FAILED)
+		return -errno;
+	return 0;
+}
+
+/* Called with shared lock held */
+static struct sim_key *find_key(const char *path)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_KEYS; i++)
+		if (shared->keys[i].in_use && strcmp(shared->keys[i].path, path) == 0)
+			return &shared->keys[i];
+	return NULL;
+}
+
+/* Called with shared lock held */
+static void count_op(void)
+{
+	shared->store_ops[store_client >= 0 ? store_client : self]++;
+}
+
+/* Called with shared lock held */
+static int store_key(const char *path, const char *value)
+{
+	struct sim_key *k;
+	int i;
+
+	k = find_key(path);
+	for (i = 0; !k && i < SIM_MAX_KEYS; i++)
+		if (!shared->keys[i].in_use)
+			k = &shared->keys[i];
+	if (!k)
+		return -ENOSPC;
+	k->in_use = true;
+	strcpy(k->path, path);
+	strcpy(k->value, value);
+	k->seq = ++shared->seq;
+	strcpy(shared->changes[k->seq % CHANGE_LOG], path);
+	return 0;
+}
+
+int sim_init(void)
+{
+	pthread_mutexattr_t attr;
+	char env[16];
+	int fd, d, p, i;
+
+	fd = memfd_create("xensim-shared", 0);
+	if (fd < 0 || ftruncate(fd, sizeof(*shared)))
+		return -errno;
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED)
+		return -errno;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&shared->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	shared->mem_fd = memfd_create("xensim", 0);
+	if (shared->mem_fd < 0 ||
+	    ftruncate(shared->mem_fd, (off_t)SIM_NR_FRAMES * SIM_PAGE_SIZE))
+		return -errno;
+	if (map_frames())
+		return -errno;
+	/* Frame 0 is never handed out, gfn 0 looks like a bug */
+	shared->frame_used[0] = 1;
+
+	for (i = 0; i < SIM_MAX_PROCS; i++) {
+		shared->proc_fds[i] = eventfd(0, EFD_NONBLOCK);
+		if (shared->proc_fds[i] < 0)
+			return -errno;
+	}
+	for (d = 0; d < SIM_MAX_DOMS; d++) {
+		for (p = 0; p < SIM_MAX_PORTS; p++) {
+			shared->port_fds[d][p] = eventfd(0, EFD_NONBLOCK);
+			if (shared->port_fds[d][p] < 0)
+				return -errno;
+		}
+
+		/* Store ring of every domain is bound to xenstored */
+		shared->frame_used[SIM_STORE_GFN(d)] = 1;
+		shared->ports[d][SIM_STORE_PORT].state = PORT_BOUND;
+		shared->ports[d][SIM_STORE_PORT].remote_dom = 0;
+		shared->ports[d][SIM_STORE_PORT].remote_port = STORED_PORT(d);
+		shared->ports[0][STORED_PORT(d)].state = PORT_BOUND;
+		shared->ports[0][STORED_PORT(d)].remote_dom = d;
+		shared->ports[0][STORED_PORT(d)].remote_port = SIM_STORE_PORT;
+		shared->grants[d][0].in_use = 1;    /* Ref 0 is reserved */
+
+		/* As toolstack writes them */
+		snprintf(shared->keys[2 * d].path, SIM_KEY_LEN,
+				"/local/domain/%d/domid", d);
+		snprintf(shared->keys[2 * d].value, SIM_VALUE_LEN, "%d", d);
+		snprintf(shared->keys[2 * d + 1].path, SIM_KEY_LEN,
+				"/local/domain/%d/name", d);
+		snprintf(shared->keys[2 * d + 1].value, SIM_VALUE_LEN,
+				d ? "domU%d" : "Domain-0", d);
+		shared->keys[2 * d].in_use = shared->keys[2 * d + 1].in_use = true;
+	}
+
+	snprintf(env, sizeof(env), "%d", fd);
+	setenv("XENSIM_FD", env, 1);
+	return 0;
+}
+
+/* Sim of a parent that ran sim_init() and exec'd us */
+static int sim_import(void)
+{
+	const char *env = getenv("XENSIM_FD");
+
+	if (!env)
+		return -ENOENT;
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED, atoi(env), 0);
+	if (shared == MAP_FAILED) {
+		shared = NULL;
+		return -errno;
+	}
+	return map_frames();
+}
+
+static void fire_watches(void);
+
+/* Interrupts of one vCPU of this process: ports bound to it */
+static void *event_loop(void *vcpu)
+{
+	int epfd = epfds[(long)vcpu];
+	struct epoll_event evs[16];
+	sim_handler_t fn;
+	uint64_t v;
+	void *arg;
+	int i, n, tag;
+
+	this_vcpu = (long)vcpu;
+	for (;;) {
+		n = epoll_wait(epfd, evs, 16, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return NULL;
+
+		for (i = 0; i < n; i++) {
+			tag = evs[i].data.u32;
+			if (tag == EV_STOP)
+				return NULL;
+
+			pthread_mutex_lock(&local_lock);
+			fn = handlers[tag].fn;
+			arg = handlers[tag].arg;
+			/* Events of a closed port are drained by close */
+			if (!fn || read(shared->port_fds[self][tag], &v,
+						sizeof(v)) != sizeof(v))
+				fn = NULL;
+			else
+				handlers[tag].running = true;
+			pthread_mutex_unlock(&local_lock);
+			if (!fn)
+				continue;
+
+			fn(tag, arg);
+
+			pthread_mutex_lock(&local_lock);
+			handlers[tag].running = false;
+			pthread_cond_broadcast(&handler_done);
+			pthread_mutex_unlock(&local_lock);
+		}
+	}
+}
+
+/* Store changed, like the xenwatch thread of a kernel */
+static void *watch_loop(void *unused)
+{
+	struct pollfd fds[2] = {
+		{ .fd = shared->proc_fds[proc], .events = POLLIN },
+		{ .fd = stop_fd, .events = POLLIN },
+	};
+	uint64_t v;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		if (fds[1].revents)
+			return NULL;
+		if (read(fds[0].fd, &v, sizeof(v)) == sizeof(v))
+			fire_watches();
+	}
+}
+
+static int epoll_add(int epfd, int fd, uint32_t tag)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int sim_attach(int domid)
+{
+	return sim_attach_vcpus(domid, 1);
+}
+
+/* vCPU v runs on host cpu v, or shares when there are fewer */
+int sim_attach_vcpus(int domid, int vcpus)
+{
+	long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	int v, err;
+
+	if (!shared && (err = sim_import()))
+		return err;
+	if (domid < 0 || domid >= SIM_MAX_DOMS ||
+			vcpus < 1 || vcpus > SIM_MAX_VCPUS)
+		return -EINVAL;
+	self = domid;
+
+	pthread_mutex_lock(&shared->lock);
+	for (proc = 0; proc < SIM_MAX_PROCS; proc++)
+		if (!shared->proc_used[proc])
+			break;
+	if (proc < SIM_MAX_PROCS)
+		shared->proc_used[proc] = true;
+	pthread_mutex_unlock(&shared->lock);
+	if (proc == SIM_MAX_PROCS)
+		return -EBUSY;
+	drain(shared->proc_fds[proc]);
+
+	stop_fd = eventfd(0, EFD_NONBLOCK);
+	if (stop_fd < 0)
+		return -errno;
+	for (v = 0; v < vcpus; v++) {
+		epfds[v] = epoll_create1(0);
+		if (epfds[v] < 0 || epoll_add(epfds[v], stop_fd, EV_STOP))
+			return -errno;
+	}
+
+	err = pthread_create(&watch_thread, NULL, watch_loop, NULL);
+	if (err)
+		return -err;
+	for (nr_vcpus = 0; nr_vcpus < vcpus; nr_vcpus++) {
+		err = pthread_create(&event_threads[nr_vcpus], NULL, event_loop,
+				(void *)(long)nr_vcpus);
+		if (err)
+			return -err;
+		if (host_cpus > 0) {
+			CPU_ZERO(&set);
+			CPU_SET(nr_vcpus % host_cpus, &set);
+			pthread_setaffinity_np(event_threads[nr_vcpus], sizeof(set), &set);
+		}
+	}
+	return 0;
+}
+
+void sim_detach(void)
+{
+	int v;
+
+	/* Never read, so every thread sees it */
+	kick(stop_fd);
+	pthread_join(watch_thread, NULL);
+	for (v = 0; v < nr_vcpus; v++) {
+		pthread_join(event_threads[v], NULL);
+		close(epfds[v]);
+	}
+	close(stop_fd);
+	nr_vcpus = 0;
+
+	pthread_mutex_lock(&shared->lock);
+	shared->proc_used[proc] = false;
+	pthread_mutex_unlock(&shared->lock);
+	proc = -1;
+}
+
+int sim_nr_vcpus(void)
+{
+	return nr_vcpus;
+}
+
+int sim_this_vcpu(void)
+{
+	return this_vcpu;
+}
+
+void sim_set_this_vcpu(int vcpu)
+{
+	this_vcpu = vcpu;
+}
+
+int sim_domid(void)
+{
+	return self;
+}
+
+void *sim_alloc_pages(int nr)
+{
+	int f, run = 0;
+
+	pthread_mutex_lock(&shared->lock);
+	for (f = 0; f < SIM_NR_FRAMES && run < nr; f++)
+		run = shared->frame_used[f] ? 0 : run + 1;
+	if (run == nr) {
+		f -= nr;
+		memset(&shared->frame_used[f], 1, nr);
+	}
+	pthread_mutex_unlock(&shared->lock);
+
+	if (nr < 1 || run < nr)
+		return NULL;
+	memset(mem + (size_t)f * SIM_PAGE_SIZE, 0, (size_t)nr * SIM_PAGE_SIZE);
+	return mem + (size_t)f * SIM_PAGE_SIZE;
+}
+
+void *sim_alloc_page(void)
+{
+	return sim_alloc_pages(1);
+}
+
+/* A frame freed while a remote still maps it would be reused under
+ * the remote's feet, that is reported */
+void sim_free_pages(void *page, int nr)
+{
+	uint32_t gfn = sim_virt_to_gfn(page);
+	struct sim_grant *g;
+	int ref;
+
+	pthread_mutex_lock(&shared->lock);
+	for (ref = 1; ref < SIM_MAX_GRANTS; ref++) {
+		g = &shared->grants[self][ref];
+		if (g->in_use && g->maps && g->gfn >= gfn && g->gfn < gfn + nr)
+			fprintf(stderr, "xensim: dom%d freed frame %u still mapped "
+					"by dom%d through gref %d\n", self, g->gfn,
+					g->domid, ref);
+	}
+	memset(&shared->frame_used[gfn], 0, nr);
+	pthread_mutex_unlock(&shared->lock);
+}
+
+void sim_free_page(void *page)
+{
+	sim_free_pages(page, 1);
+}
+
+uint32_t sim_virt_to_gfn(void *page)
+{
+	return ((char *)page - mem) / SIM_PAGE_SIZE;
+}
+
+void *sim_gfn_to_virt(uint32_t gfn)
+{
+	return gfn < SIM_NR_FRAMES ? mem + (size_t)gfn * SIM_PAGE_SIZE : NULL;
+}
+
+int sim_grant_access(int domid, uint32_t gfn, bool readonly)
+{
+	struct sim_grant *g;
+	int ref;
+
+	if (domid < 0 || domid >= SIM_MAX_DOMS || gfn >= SIM_NR_FRAMES)
+		return -EINVAL;
+
+	pthread_mutex_lock(&shared->lock);
+	for (ref = 1; ref < SIM_MAX_GRANTS; ref++) {
+		g = &shared->grants[self][ref];
+		if (g->in_use)
+			continue;
+		g->in_use = 1;
+		g->readonly = readonly;
+		g->domid = domid;
+		g->gfn = gfn;
+		g->maps = 0;
+		break;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	return ref < SIM_MAX_GRANTS ? ref : -ENOSPC;
+}
+
+int sim_end_access(int ref)
+{
+	struct sim_grant *g;
+	int err = 0;
+
+	if (ref <= 0 || ref >= SIM_MAX_GRANTS)
+		return -EINVAL;
+	g = &shared->grants[self][ref];
+
+	pthread_mutex_lock(&shared->lock);
+	if (!g->in_use)
+		err = -EINVAL;
+	else if (g->maps)
+		err = -EBUSY;
+	else
+		g->in_use = 0;
+	pthread_mutex_unlock(&shared->lock);
+	return err;
+}
+
+int sim_grant_mapped(int ref)
+{
+	int maps;
+
+	if (ref <= 0 || ref >= SIM_MAX_GRANTS)
+		return -EINVAL;
+	pthread_mutex_lock(&shared->lock);
+	maps = shared->grants[self][ref].maps;
+	pthread_mutex_unlock(&shared->lock);
+	return maps;
+}
+
+/* Each granted frame is mmapped on its own, as a real map costs a page
+ * table update too */
+int sim_map_grants(struct sim_map_op *ops, int nr)
+{
+	struct sim_grant *g;
+	uint32_t gfn;
+	void *addr;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		addr = ops[i].addr;
+		ops[i].fixed = addr != NULL;
+		ops[i].addr = NULL;
+		ops[i].status = -EPERM;
+		if (ops[i].domid < 0 || ops[i].domid >= SIM_MAX_DOMS ||
+		    ops[i].ref <= 0 || ops[i].ref >= SIM_MAX_GRANTS)
+			continue;
+
+		pthread_mutex_lock(&shared->lock);
+		g = &shared->grants[ops[i].domid][ops[i].ref];
+		if (!g->in_use || g->domid != self ||
+		    (g->readonly && !ops[i].readonly)) {
+			pthread_mutex_unlock(&shared->lock);
+			continue;
+		}
+		g->maps++;
+		gfn = g->gfn;
+		pthread_mutex_unlock(&shared->lock);
+
+		ops[i].addr = mmap(addr, SIM_PAGE_SIZE, ops[i].readonly ?
+				PROT_READ : PROT_READ | PROT_WRITE,
+				MAP_SHARED | (addr ? MAP_FIXED : 0),
+				shared->mem_fd, (off_t)gfn * SIM_PAGE_SIZE);
+		if (ops[i].addr == MAP_FAILED) {
+			ops[i].addr = NULL;
+			ops[i].status = -errno;
+			pthread_mutex_lock(&shared->lock);
+			g->maps--;
+			pthread_mutex_unlock(&shared->lock);
+			continue;
+		}
+		ops[i].status = 0;
+	}
+	return 0;
+}
+
+/* A page of ours hidden by the mapping shows again, any other address
+ * the caller gave stays reserved */
+void sim_unmap_grants(struct sim_map_op *ops, int nr)
+{
+	char *addr;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (ops[i].status || !ops[i].addr)
+			continue;
+		addr = ops[i].addr;
+		if (addr >= mem && addr < mem + (size_t)SIM_NR_FRAMES * SIM_PAGE_SIZE)
+			mmap(addr, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_FIXED, shared->mem_fd, addr - mem);
+		else if (ops[i].fixed)
+			mmap(addr, SIM_PAGE_SIZE, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		else
+			munmap(addr, SIM_PAGE_SIZE);
+		ops[i].addr = NULL;
+		pthread_mutex_lock(&shared->lock);
+		shared->grants[ops[i].domid][ops[i].ref].maps--;
+		pthread_mutex_unlock(&shared->lock);
+	}
+}
+
+/* Called with shared lock held, frame an end of a copy refers to */
+static int copy_frame(const struct sim_copy_ptr *p, int len, bool write)
+{
+	struct sim_grant *g;
+
+	if (p->offset < 0 || len < 0 || p->offset + len > SIM_PAGE_SIZE)
+		return -EINVAL;
+	if (p->ref <= 0)
+		return p->gfn < SIM_NR_FRAMES ? (int)p->gfn : -EINVAL;
+	if (p->domid < 0 || p->domid >= SIM_MAX_DOMS || p->ref >= SIM_MAX_GRANTS)
+		return -EINVAL;
+	g = &shared->grants[p->domid][p->ref];
+	if (!g->in_use || g->domid != self || (write && g->readonly))
+		return -EPERM;
+	return g->gfn;
+}
+
+void sim_copy_grants(struct sim_copy_op *ops, int nr)
+{
+	int i, src, dst;
+
+	for (i = 0; i < nr; i++) {
+		pthread_mutex_lock(&shared->lock);
+		src = copy_frame(&ops[i].src, ops[i].len, false);
+		dst = copy_frame(&ops[i].dst, ops[i].len, true);
+		pthread_mutex_unlock(&shared->lock);
+
+		ops[i].status = src < 0 ? src : dst < 0 ? dst : 0;
+		if (ops[i].status)
+			continue;
+		memcpy(raw + (size_t)dst * SIM_PAGE_SIZE + ops[i].dst.offset,
+				raw + (size_t)src * SIM_PAGE_SIZE + ops[i].src.offset,
+				ops[i].len);
+	}
+}
+
+/* Called with shared lock held */
+static int find_free_port(void)
+{
+	int p;
+
+	for (p = 1; p < SIM_MAX_PORTS; p++)
+		if (shared->ports[self][p].state == PORT_FREE)
+			return p;
+	return -ENOSPC;
+}
+
+int sim_alloc_unbound(int remote_domid)
+{
+	int p;
+
+	if (remote_domid < 0 || remote_domid >= SIM_MAX_DOMS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&shared->lock);
+	p = find_free_port();
+	if (p > 0) {
+		shared->ports[self][p].state = PORT_UNBOUND;
+		shared->ports[self][p].remote_dom = remote_domid;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	return p;
+}
+
+int sim_bind_interdomain(int remote_domid, int remote_port)
+{
+	struct sim_port *rp;
+	int p;
+
+	if (remote_domid < 0 || remote_domid >= SIM_MAX_DOMS ||
+	    remote_port <= 0 || remote_port >= SIM_MAX_PORTS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&shared->lock);
+	rp = &shared->ports[remote_domid][remote_port];
+	if (rp->state != PORT_UNBOUND || rp->remote_dom != self) {
+		pthread_mutex_unlock(&shared->lock);
+		return -EINVAL;
+	}
+	p = find_free_port();
+	if (p > 0) {
+		shared->ports[self][p].state = PORT_BOUND;
+		shared->ports[self][p].remote_dom = remote_domid;
+		shared->ports[self][p].remote_port = remote_port;
+		rp->state = PORT_BOUND;
+		rp->remote_port = p;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	return p;
+}
+
+/* Events sent before are kept in the eventfd and come now */
+int sim_bind_handler(int port, sim_handler_t fn, void *arg)
+{
+	int err = 0;
+
+	if (port <= 0 || port >= SIM_MAX_PORTS || !nr_vcpus)
+		return -EINVAL;
+
+	pthread_mutex_lock(&local_lock);
+	handlers[port].fn = fn;
+	handlers[port].arg = arg;
+	if (!handlers[port].polled) {
+		if (epoll_add(epfds[port_vcpu[port]], shared->port_fds[self][port], port))
+			err = -errno;
+		else
+			handlers[port].polled = true;
+	}
+	pthread_mutex_unlock(&local_lock);
+	return err ? err : port;
+}
+
+/* Like EVTCHNOP_bind_vcpu, events of port are handled by vcpu from now
+ * on. One already taken by old vCPU may still run there */
+int sim_bind_vcpu(int port, int vcpu)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = port };
+	int fd, old, err = 0;
+
+	if (port <= 0 || port >= SIM_MAX_PORTS || vcpu < 0 || vcpu >= nr_vcpus)
+		return -EINVAL;
+	fd = shared->port_fds[self][port];
+
+	pthread_mutex_lock(&local_lock);
+	old = port_vcpu[port];
+	if (old != vcpu && handlers[port].polled) {
+		/* eventfd keeps count, nothing sent meanwhile is lost */
+		if (epoll_ctl(epfds[old], EPOLL_CTL_DEL, fd, NULL) ||
+				epoll_ctl(epfds[vcpu], EPOLL_CTL_ADD, fd, &ev))
+			err = -errno;
+	}
+	if (!err)
+		port_vcpu[port] = vcpu;
+	pthread_mutex_unlock(&local_lock);
+	return err;
+}
+
+/* Remote end of a bound port goes back to unbound, so it may be bound
+ * again, as Xen does. Waits for a handler still running, as free_irq */
+int sim_close_port(int port)
+{
+	struct sim_port *pt;
+	int fd;
+
+	if (port <= 0 || port >= SIM_MAX_PORTS)
+		return -EINVAL;
+	pt = &shared->ports[self][port];
+	fd = shared->port_fds[self][port];
+
+	pthread_mutex_lock(&local_lock);
+	if (handlers[port].polled)
+		epoll_ctl(epfds[port_vcpu[port]], EPOLL_CTL_DEL, fd, NULL);
+	handlers[port].polled = false;
+	handlers[port].fn = NULL;
+	/* Next bind of this port starts on vCPU 0 again */
+	port_vcpu[port] = 0;
+	while (handlers[port].running)
+		pthread_cond_wait(&handler_done, &local_lock);
+	drain(fd);
+	pthread_mutex_unlock(&local_lock);
+
+	pthread_mutex_lock(&shared->lock);
+	if (pt->state == PORT_BOUND) {
+		shared->ports[pt->remote_dom][pt->remote_port].state = PORT_UNBOUND;
+		shared->ports[pt->remote_dom][pt->remote_port].remote_dom = self;
+	}
+	pt->state = PORT_FREE;
+	pthread_mutex_unlock(&shared->lock);
+	return 0;
+}
+
+/* Send on a port not bound yet is dropped, as Xen does */
+int sim_notify(int port)
+{
+	struct sim_port *pt;
+	int fd = -1;
+
+	if (port <= 0 || port >= SIM_MAX_PORTS)
+		return -EINVAL;
+	pt = &shared->ports[self][port];
+
+	pthread_mutex_lock(&shared->lock);
+	if (pt->state == PORT_BOUND) {
+		fd = shared->port_fds[pt->remote_dom][pt->remote_port];
+		shared->ports[pt->remote_dom][pt->remote_port].events++;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	if (fd >= 0)
+		kick(fd);
+	return 0;
+}
+
+/* Every process checks its watches */
+static void kick_watches(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_PROCS; i++)
+		if (shared->proc_used[i])
+			kick(shared->proc_fds[i]);
+}
+
+/* Called with shared lock held */
+static struct sim_tx *find_tx(int tx)
+{
+	if (tx <= 0 || tx > SIM_MAX_TX || !shared->txs[tx - 1].in_use)
+		return NULL;
+	return &shared->txs[tx - 1];
+}
+
+/* Called with shared lock held, entry of path in t, added if new */
+static struct sim_tx_key *tx_key(struct sim_tx *t, const char *path)
+{
+	struct sim_tx_key *tk;
+	int i;
+
+	for (i = 0; i < t->nr; i++)
+		if (strcmp(t->keys[i].path, path) == 0)
+			return &t->keys[i];
+	if (t->nr == SIM_TX_KEYS)
+		return NULL;
+	tk = &t->keys[t->nr++];
+	tk->write = false;
+	strcpy(tk->path, path);
+	return tk;
+}
+
+int sim_xs_tx_write(int tx, const char *path, const char *value)
+{
+	struct sim_tx_key *tk;
+	struct sim_tx *t;
+	int err = 0;
+
+	if (strlen(path) >= SIM_KEY_LEN || strlen(value) >= SIM_VALUE_LEN)
+		return -E2BIG;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	if (tx == 0) {
+		err = store_key(path, value);
+	} else if (!(t = find_tx(tx))) {
+		err = -EINVAL;
+	} else if (!(tk = tx_key(t, path))) {
+		err = -ENOSPC;
+	} else {
+		tk->write = true;
+		strcpy(tk->value, value);
+	}
+	pthread_mutex_unlock(&shared->lock);
+
+	if (tx == 0 && !err)
+		kick_watches();
+	return err;
+}
+
+int sim_xs_tx_read(int tx, const char *path, char *value, int len)
+{
+	struct sim_tx_key *tk = NULL;
+	struct sim_key *k;
+	struct sim_tx *t;
+	int err = -ENOENT;
+
+	if (strlen(path) >= SIM_KEY_LEN)
+		return -E2BIG;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	if (tx && !(t = find_tx(tx))) {
+		err = -EINVAL;
+		goto out;
+	}
+	/* Remember it was read, a write to it since fails the commit */
+	if (tx && !(tk = tx_key(t, path))) {
+		err = -ENOSPC;
+		goto out;
+	}
+	if (tk && tk->write) {
+		snprintf(value, len, "%s", tk->value);
+		err = 0;
+	} else if ((k = find_key(path))) {
+		snprintf(value, len, "%s", k->value);
+		err = 0;
+	}
+out:
+	pthread_mutex_unlock(&shared->lock);
+	return err;
+}
+
+int sim_xs_write(const char *path, const char *value)
+{
+	return sim_xs_tx_write(0, path, value);
+}
+
+int sim_xs_read(const char *path, char *value, int len)
+{
+	return sim_xs_tx_read(0, path, value, len);
+}
+
+/* Names of nodes right under path, each ended by NUL as XS_DIRECTORY
+ * replies. Number of names, or -ENOSPC if they don't fit in len */
+int sim_xs_directory(const char *path, char *names, int len)
+{
+	size_t plen = strlen(path);
+	const char *name, *end;
+	char *p;
+	int i, n = 0, used = 0, err = 0;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	for (i = 0; i < SIM_MAX_KEYS && !err; i++) {
+		if (!shared->keys[i].in_use ||
+		    !under_path(shared->keys[i].path, path) ||
+		    shared->keys[i].path[plen] != '/')
+			continue;
+		name = shared->keys[i].path + plen + 1;
+		end = strchrnul(name, '/');
+		for (p = names; p < names + used; p += strlen(p) + 1)
+			if ((size_t)(end - name) == strlen(p) &&
+			    strncmp(p, name, end - name) == 0)
+				break;
+		if (p < names + used)
+			continue;
+		if (used + (end - name) + 1 > len) {
+			err = -ENOSPC;
+			break;
+		}
+		memcpy(names + used, name, end - name);
+		names[used + (end - name)] = '\0';
+		used += end - name + 1;
+		n++;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	return err ? err : n;
+}
+
+int sim_xs_transaction_start(void)
+{
+	int i;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	for (i = 0; i < SIM_MAX_TX; i++)
+		if (!shared->txs[i].in_use)
+			break;
+	if (i < SIM_MAX_TX) {
+		shared->txs[i].in_use = true;
+		shared->txs[i].start = shared->seq;
+		shared->txs[i].nr = 0;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	return i < SIM_MAX_TX ? i + 1 : -ENOSPC;
+}
+
+/* Commit if no key the transaction touched was written since it began,
+ * as xenstored checks generation of nodes */
+int sim_xs_transaction_end(int tx, bool abort)
+{
+	struct sim_key *k;
+	struct sim_tx *t;
+	bool wrote = false;
+	int i, err = 0;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	t = find_tx(tx);
+	if (!t) {
+		pthread_mutex_unlock(&shared->lock);
+		return -EINVAL;
+	}
+	for (i = 0; i < t->nr && !abort && !err; i++) {
+		k = find_key(t->keys[i].path);
+		if (k && k->seq > t->start)
+			err = -EAGAIN;
+	}
+	for (i = 0; i < t->nr && !abort && !err; i++) {
+		if (!t->keys[i].write)
+			continue;
+		err = store_key(t->keys[i].path, t->keys[i].value);
+		wrote = true;
+	}
+	t->in_use = false;
+	pthread_mutex_unlock(&shared->lock);
+
+	if (wrote)
+		kick_watches();
+	return err;
+}
+
+int sim_xs_watch(const char *prefix, sim_watch_t fn, void *arg)
+{
+	struct sim_watch_ent *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	snprintf(w->prefix, sizeof(w->prefix), "%s", prefix);
+	w->fn = fn;
+	w->arg = arg;
+	w->initial = true;
+
+	pthread_mutex_lock(&shared->lock);
+	count_op();
+	w->seq = shared->seq;
+	pthread_mutex_unlock(&shared->lock);
+
+	pthread_mutex_lock(&local_lock);
+	w->next = watches;
+	__atomic_store_n(&watches, w, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&local_lock);
+
+	kick(shared->proc_fds[proc]);
+	return 0;
+}
+
+uint64_t sim_xs_ops(int domid)
+{
+	uint64_t n;
+
+	if (domid < 0 || domid >= SIM_MAX_DOMS)
+		return 0;
+	pthread_mutex_lock(&shared->lock);
+	n = shared->store_ops[domid];
+	pthread_mutex_unlock(&shared->lock);
+	return n;
+}
+
+/* Waits for callback of the watch still running, as unregister_xenbus_watch,
+ * unless called from it */
+void sim_xs_unwatch(const char *prefix, sim_watch_t fn, void *arg)
+{
+	struct sim_watch_ent *w;
+
+	pthread_mutex_lock(&local_lock);
+	for (w = watches; w; w = w->next) {
+		if (w->fn != fn || w->arg != arg || strcmp(w->prefix, prefix))
+			continue;
+		__atomic_store_n(&w->dead, true, __ATOMIC_RELEASE);
+		while (firing == w && !pthread_equal(pthread_self(), watch_thread))
+			pthread_cond_wait(&handler_done, &local_lock);
+	}
+	pthread_mutex_unlock(&local_lock);
+}
+
+/* Call fn of watch unless unwatched meanwhile */
+static void fire(struct sim_watch_ent *w, const char *path)
+{
+	pthread_mutex_lock(&local_lock);
+	if (__atomic_load_n(&w->dead, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&local_lock);
+		return;
+	}
+	firing = w;
+	pthread_mutex_unlock(&local_lock);
+
+	w->fn(path, w->arg);
+
+	pthread_mutex_lock(&local_lock);
+	firing = NULL;
+	pthread_cond_broadcast(&handler_done);
+	pthread_mutex_unlock(&local_lock);
+}
+
+/* Tell each watch about every write under it since it last looked, as
+ * xenstored does, or about keys changed if the log moved past it.
+ * Watches are never freed, so the list is walked without lock */
+static void fire_watches(void)
+{
+	static char fired[CHANGE_LOG][SIM_KEY_LEN];
+	struct sim_watch_ent *w;
+	struct sim_key *k;
+	uint64_t seq;
+	int i, n;
+
+	for (w = __atomic_load_n(&watches, __ATOMIC_ACQUIRE); w; w = w->next) {
+		if (__atomic_load_n(&w->dead, __ATOMIC_ACQUIRE))
+			continue;
+		if (w->initial) {
+			w->initial = false;
+			fire(w, w->prefix);
+		}
+
+		n = 0;
+		seq = w->seq;
+		pthread_mutex_lock(&shared->lock);
+		if (shared->seq - w->seq <= CHANGE_LOG) {
+			for (seq = w->seq + 1; seq <= shared->seq; seq++)
+				if (under_path(shared->changes[seq % CHANGE_LOG], w->prefix))
+					strcpy(fired[n++], shared->changes[seq % CHANGE_LOG]);
+			seq = shared->seq;
+		} else {
+			for (i = 0; i < SIM_MAX_KEYS; i++) {
+				k = &shared->keys[i];
+				if (!k->in_use || k->seq <= w->seq ||
+						!under_path(k->path, w->prefix))
+					continue;
+				strcpy(fired[n++], k->path);
+				if (k->seq > seq)
+					seq = k->seq;
+			}
+		}
+		pthread_mutex_unlock(&shared->lock);
+
+		w->seq = seq;
+		for (i = 0; i < n; i++)
+			fire(w, fired[i]);
+	}
+}
+
+struct xenstore_domain_interface *sim_xenstore_ring(void)
+{
+	return sim_gfn_to_virt(SIM_STORE_GFN(self));
+}
+
+/* Store ring of domain d, as xenstored sees it */
+static struct xenstore_domain_interface *store_ring(int d)
+{
+	return (void *)(raw + (size_t)SIM_STORE_GFN(d) * SIM_PAGE_SIZE);
+}
+
+static void ring_read(struct xenstore_domain_interface *intf,
+		XENSTORE_RING_IDX idx, void *buf, int len)
+{
+	char *p = buf;
+	int chunk;
+
+	while (len > 0) {
+		chunk = XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(idx);
+		if (chunk > len)
+			chunk = len;
+		memcpy(p, intf->req + MASK_XENSTORE_IDX(idx), chunk);
+		p += chunk;
+		idx += chunk;
+		len -= chunk;
+	}
+}
+
+/* Domain is told of each chunk, so a reply over the free space is read
+ * while it is written. It gets RING_WAIT_MS to make room. Like xenstored,
+ * a full ring is looked at again only once the domain notified, so one
+ * that frees space without saying so is not served further */
+static int ring_write(int d, const void *buf, int len)
+{
+	struct xenstore_domain_interface *intf = store_ring(d);
+	uint32_t *events = &shared->ports[0][STORED_PORT(d)].events;
+	const char *p = buf;
+	XENSTORE_RING_IDX prod;
+	uint32_t seen;
+	int chunk, waited;
+
+	while (len > 0) {
+		prod = intf->rsp_prod;
+		seen = __atomic_load_n(events, __ATOMIC_ACQUIRE);
+		if (prod - __atomic_load_n(&intf->rsp_cons, __ATOMIC_ACQUIRE) ==
+				XENSTORE_RING_SIZE) {
+			for (waited = 0; __atomic_load_n(events,
+						__ATOMIC_ACQUIRE) == seen; waited++) {
+				if (waited == RING_WAIT_MS * 10)
+					return -ETIMEDOUT;
+				usleep(100);
+			}
+			continue;
+		}
+		xen_mb();
+
+		chunk = XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod);
+		if (chunk > (int)(XENSTORE_RING_SIZE - (prod - intf->rsp_cons)))
+			chunk = XENSTORE_RING_SIZE - (prod - intf->rsp_cons);
+		if (chunk > len)
+			chunk = len;
+		memcpy(intf->rsp + MASK_XENSTORE_IDX(prod), p, chunk);
+		p += chunk;
+		len -= chunk;
+
+		xen_wmb();
+		intf->rsp_prod = prod + chunk;
+		sim_notify(STORED_PORT(d));
+	}
+	return 0;
+}
+
+/* Half a reply is on the ring if it fails, nothing more is sent to a
+ * domain after that */
+static void reply(int d, const struct xsd_sockmsg *req, uint32_t type,
+		const char *body, int len)
+{
+	struct xsd_sockmsg msg = *req;
+
+	if (store_dead[d])
+		return;
+	msg.type = type;
+	msg.len = len;
+	if (ring_write(d, &msg, sizeof(msg)) || ring_write(d, body, len)) {
+		fprintf(stderr, "xensim: dom%d does not read its store ring, "
+				"dropped\n", d);
+		store_dead[d] = true;
+	}
+}
+
+static void reply_error(int d, const struct xsd_sockmsg *req, int err)
+{
+	const char *name;
+
+	switch (err) {
+	case -ENOENT:
+		name = "ENOENT";
+		break;
+	case -EAGAIN:
+		name = "EAGAIN";
+		break;
+	case -ENOSPC:
+		name = "ENOSPC";
+		break;
+	case -E2BIG:
+		name = "E2BIG";
+		break;
+	default:
+		name = "EINVAL";
+		break;
+	}
+	reply(d, req, XS_ERROR, name, strlen(name) + 1);
+}
+
+/* Relative paths are under home of the domain */
+static void abs_path(int d, const char *path, char *out)
+{
+	if (path[0] == '/')
+		snprintf(out, SIM_KEY_LEN, "%s", path);
+	else
+		snprintf(out, SIM_KEY_LEN, "/local/domain/%d/%s", d, path);
+}
+
+static void send_watch_event(struct ring_watch *rw, const char *path)
+{
+	struct xsd_sockmsg msg = { .type = XS_WATCH_EVENT };
+	char body[SIM_KEY_LEN + 64];
+	char home[32];
+	int len;
+
+	/* Relative watch sees relative paths */
+	if (rw->path[0] != '/') {
+		len = snprintf(home, sizeof(home), "/local/domain/%d/", rw->dom);
+		if (strncmp(path, home, len) == 0)
+			path += len;
+	}
+	len = snprintf(body, sizeof(body), "%s%c%s", path, 0, rw->token) + 1;
+	reply(rw->dom, &msg, XS_WATCH_EVENT, body, len);
+}
+
+/* Store changed, tell domains watching it on their rings */
+static void stored_watch(const char *path, void *unused)
+{
+	char abs[SIM_KEY_LEN];
+	int i;
+
+	if (path[0] == '\0')
+		return;
+	pthread_mutex_lock(&stored_lock);
+	for (i = 0; i < MAX_RING_WATCHES; i++) {
+		if (!ring_watches[i].in_use)
+			continue;
+		abs_path(ring_watches[i].dom, ring_watches[i].path, abs);
+		if (under_path(path, abs))
+			send_watch_event(&ring_watches[i], path);
+	}
+	pthread_mutex_unlock(&stored_lock);
+}
+
+static void stored_handle(int d, const struct xsd_sockmsg *req, char *body)
+{
+	char path[SIM_KEY_LEN], value[SIM_VALUE_LEN];
+	char names[XENSTORE_PAYLOAD_MAX];
+	struct ring_watch *rw;
+	int i, klen, err;
+
+	klen = strnlen(body, req->len);
+	abs_path(d, body, path);
+	store_client = d;
+
+	switch (req->type) {
+	case XS_READ:
+		err = sim_xs_tx_read(req->tx_id, path, value, sizeof(value));
+		if (err)
+			reply_error(d, req, err);
+		else
+			reply(d, req, XS_READ, value, strlen(value));
+		break;
+
+	case XS_WRITE:
+		/* Value follows NUL of path, not terminated itself */
+		if (klen >= (int)req->len) {
+			reply_error(d, req, -EINVAL);
+			break;
+		}
+		snprintf(value, sizeof(value), "%.*s",
+				(int)req->len - klen - 1, body + klen + 1);
+		err = sim_xs_tx_write(req->tx_id, path, value);
+		if (err)
+			reply_error(d, req, err);
+		else
+			reply(d, req, XS_WRITE, "OK", 3);
+		break;
+
+	case XS_TRANSACTION_START:
+		err = sim_xs_transaction_start();
+		if (err < 0) {
+			reply_error(d, req, err);
+			break;
+		}
+		snprintf(value, sizeof(value), "%d", err);
+		reply(d, req, XS_TRANSACTION_START, value, strlen(value) + 1);
+		break;
+	case XS_TRANSACTION_END:
+		err = sim_xs_transaction_end(req->tx_id, body[0] != 'T');
+		if (err)
+			reply_error(d, req, err);
+		else
+			reply(d, req, XS_TRANSACTION_END, "OK", 3);
+		break;
+
+	case XS_DIRECTORY:
+		err = sim_xs_directory(path, names, sizeof(names));
+		if (err < 0) {
+			reply_error(d, req, err);
+			break;
+		}
+		for (i = 0, klen = 0; i < err; i++)
+			klen += strlen(names + klen) + 1;
+		reply(d, req, XS_DIRECTORY, names, klen);
+		break;
+
+	/* Permissions are not enforced */
+	case XS_SET_PERMS:
+		reply(d, req, XS_SET_PERMS, "OK", 3);
+		break;
+
+	case XS_WATCH:
+		rw = NULL;
+		for (i = 0; i < MAX_RING_WATCHES && !rw; i++)
+			if (!ring_watches[i].in_use)
+				rw = &ring_watches[i];
+		if (!rw || klen + 1 >= (int)req->len) {
+			reply_error(d, req, -ENOSPC);
+			break;
+		}
+		rw->in_use = true;
+		rw->dom = d;
+		snprintf(rw->path, sizeof(rw->path), "%s", body);
+		snprintf(rw->token, sizeof(rw->token), "%s", body + klen + 1);
+		reply(d, req, XS_WATCH, "OK", 3);
+		/* New watch fires at once */
+		send_watch_event(rw, path);
+		break;
+
+	case XS_UNWATCH:
+		for (i = 0; i < MAX_RING_WATCHES; i++) {
+			rw = &ring_watches[i];
+			if (rw->in_use && rw->dom == d && strcmp(rw->path, body) == 0 &&
+			    klen + 1 < (int)req->len &&
+			    strcmp(rw->token, body + klen + 1) == 0)
+				rw->in_use = false;
+		}
+		reply(d, req, XS_UNWATCH, "OK", 3);
+		break;
+
+	default:
+		reply_error(d, req, -EINVAL);
+		break;
+	}
+	store_client = -1;
+}
+
+/* Take what is on store ring of domain arg, a request bigger than the
+ * ring comes in pieces. Serve each once it is whole */
+static int stored_interrupt(int port, void *arg)
+{
+	int d = (int)(long)arg;
+	struct xenstore_domain_interface *intf = store_ring(d);
+	struct stored_in *in = &stored_in[d];
+	XENSTORE_RING_IDX cons, prod;
+	unsigned int want;
+	char *dst;
+
+	pthread_mutex_lock(&stored_lock);
+	while (!store_dead[d]) {
+		cons = intf->req_cons;
+		prod = __atomic_load_n(&intf->req_prod, __ATOMIC_ACQUIRE);
+		xen_rmb();
+		if (prod == cons)
+			break;
+
+		if (in->got < sizeof(in->msg)) {
+			want = sizeof(in->msg) - in->got;
+			dst = (char *)&in->msg + in->got;
+		} else {
+			want = sizeof(in->msg) + in->msg.len - in->got;
+			dst = in->body + in->got - sizeof(in->msg);
+		}
+		if (want > prod - cons)
+			want = prod - cons;
+		ring_read(intf, cons, dst, want);
+		xen_mb();
+		intf->req_cons = cons + want;
+		in->got += want;
+
+		if (in->got < sizeof(in->msg))
+			continue;
+		if (in->msg.len > XENSTORE_PAYLOAD_MAX) {
+			fprintf(stderr, "xensim: dom%d sent %u bytes of payload, "
+					"dropped\n", d, in->msg.len);
+			store_dead[d] = true;
+			break;
+		}
+		if (in->got < sizeof(in->msg) + in->msg.len)
+			continue;
+
+		in->body[in->msg.len] = '\0';
+		in->got = 0;
+		stored_handle(d, &in->msg, in->body);
+	}
+	pthread_mutex_unlock(&stored_lock);
+	/* Space freed for requests */
+	sim_notify(STORED_PORT(d));
+	return 0;
+}
+
+int sim_xenstored_start(void)
+{
+	int d, err;
+
+	if (self != 0)
+		return -EINVAL;
+	for (d = 0; d < SIM_MAX_DOMS; d++) {
+		err = sim_bind_handler(STORED_PORT(d), stored_interrupt, (void *)(long)d);
+		if (err < 0)
+			return err;
+	}
+	return sim_xs_watch("", stored_watch, NULL);
+}
@@ -0,0 +1,144 @@
+/* Xen simulation for running the Xen_Log_* examples without Xen
+ * This is under GPL License
+ *
+ * Domains are processes attached after sim_init(), either forked from
+ * its caller or run by simrun, which passes the sim on in XENSIM_FD.
+ * They share:
+ * - memory frames, in a memfd every domain maps pages of
+ * - grant tables, a grant is mapped by mmap of the granted frame
+ * - event channels, one eventfd per port, handlers run in the event
+ *   thread of the vCPU the port is bound to, as interrupts would
+ * - xenstore, a key table with watches and transactions, and
+ *   xenstore_domain_interface rings served by xenstored in dom0
+ *
+ * kernel/ builds the example modules against these unchanged
+ */
+#ifndef __XENSIM_H__
+#define __XENSIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Public Xen headers leave barriers to includer */
+#ifndef xen_mb
+#define xen_mb()    __sync_synchronize()
+#define xen_rmb()   __sync_synchronize()
+#define xen_wmb()   __sync_synchronize()
+#endif
+
+#include <xen/io/ring.h>
+#include <xen/io/xs_wire.h>
+#include <xen/io/xenbus.h>
+
+#define SIM_PAGE_SIZE   4096
+#define SIM_MAX_DOMS    4
+#define SIM_MAX_PROCS   16      /* Processes attached at once */
+#define SIM_NR_FRAMES   4096    /* Frames of all domains together */
+#define SIM_MAX_GRANTS  1024    /* Grant entries of each domain */
+#define SIM_MAX_PORTS   64      /* Event channels of each domain */
+#define SIM_MAX_VCPUS   16      /* Event threads of each domain */
+#define SIM_MAX_KEYS    512
+#define SIM_KEY_LEN     128
+#define SIM_VALUE_LEN   128
+#define SIM_MAX_TX      16      /* Transactions open at once */
+#define SIM_TX_KEYS     256     /* Keys one transaction may touch */
+
+/* Xenstore ring of domain d and its event channel, as store_mfn and
+ * store_evtchn. Nothing in the domain uses it but who asks for it */
+#define SIM_STORE_GFN(d)    (1 + (d))
+#define SIM_STORE_PORT      1
+
+/* Setup, sim_init() once, then sim_attach() in each domain. A domain
+ * may be several processes, each handles ports it binds itself.
+ * sim_attach() gives one vCPU */
+int sim_init(void);
+int sim_attach(int domid);
+int sim_attach_vcpus(int domid, int vcpus);
+void sim_detach(void);
+int sim_domid(void);
+int sim_nr_vcpus(void);
+/* vCPU the calling thread runs on, 0 out of event threads */
+int sim_this_vcpu(void);
+void sim_set_this_vcpu(int vcpu);
+
+/* Memory */
+void *sim_alloc_page(void);
+void *sim_alloc_pages(int nr);  /* Contiguous frames */
+void sim_free_page(void *page);
+void sim_free_pages(void *page, int nr);
+uint32_t sim_virt_to_gfn(void *page);
+void *sim_gfn_to_virt(uint32_t gfn);
+
+/* Grant table, to remote domid */
+int sim_grant_access(int domid, uint32_t gfn, bool readonly);
+int sim_end_access(int ref);    /* -EBUSY while mapped by remote */
+int sim_grant_mapped(int ref);  /* Times remote has it mapped */
+
+/* Map ops are done in one go, like GNTTABOP_map_grant_ref. A page of
+ * this domain at addr is hidden by the mapping until unmap */
+struct sim_map_op {
+	int domid;                  /* Granting domain */
+	int ref;
+	bool readonly;
+	void *addr;                 /* In: where, or NULL. Out: mapped page */
+	int status;                 /* Out: 0 or -errno */
+	bool fixed;                 /* Mapped where caller asked */
+};
+int sim_map_grants(struct sim_map_op *ops, int nr);
+void sim_unmap_grants(struct sim_map_op *ops, int nr);
+
+/* Like GNTTABOP_copy, each end is a grant of domid if ref > 0, else a
+ * frame of this domain */
+struct sim_copy_ptr {
+	int domid;
+	int ref;
+	uint32_t gfn;
+	int offset;
+};
+struct sim_copy_op {
+	struct sim_copy_ptr src, dst;
+	int len;
+	int status;                 /* Out: 0 or -errno */
+};
+void sim_copy_grants(struct sim_copy_op *ops, int nr);
+
+/* Event channels. Handler runs in event thread of its vCPU, one at a
+ * time on each vCPU. Ports start on vCPU 0, events sent before a
+ * handler is bound are kept */
+typedef int (*sim_handler_t)(int port, void *arg);
+int sim_alloc_unbound(int remote_domid);
+int sim_bind_interdomain(int remote_domid, int remote_port);
+int sim_bind_handler(int port, sim_handler_t fn, void *arg);
+int sim_bind_vcpu(int port, int vcpu);
+int sim_close_port(int port);
+int sim_notify(int port);
+
+/* Xenstore, paths are absolute. Watch fires once on register too and
+ * runs in the xenwatch thread of the process, unwatch waits for a
+ * callback running meanwhile unless called from one.
+ * Transaction 0 is none. Writes in one are seen by it alone until it
+ * ends, which fails with -EAGAIN if a key it touched was written since
+ * it started */
+typedef void (*sim_watch_t)(const char *path, void *arg);
+int sim_xs_write(const char *path, const char *value);
+int sim_xs_read(const char *path, char *value, int len);
+int sim_xs_tx_write(int tx, const char *path, const char *value);
+int sim_xs_tx_read(int tx, const char *path, char *value, int len);
+/* Names of children of path, one after another with their NULs */
+int sim_xs_directory(const char *path, char *names, int len);
+int sim_xs_transaction_start(void);
+int sim_xs_transaction_end(int tx, bool abort);
+int sim_xs_watch(const char *prefix, sim_watch_t fn, void *arg);
+void sim_xs_unwatch(const char *prefix, sim_watch_t fn, void *arg);
+/* Reads, writes, listings, transaction steps and watches domid asked
+ * xenstore for so far, by call or over its store ring */
+uint64_t sim_xs_ops(int domid);
+
+/* Ring of xenstore protocol of this domain, served by sim_xenstored
+ * running in dom0. Notify SIM_STORE_PORT after writing requests, it is
+ * notified after each chunk of a reply. Takes READ, WRITE, DIRECTORY,
+ * WATCH, UNWATCH, SET_PERMS and TRANSACTION_START/END */
+struct xenstore_domain_interface *sim_xenstore_ring(void);
+int sim_xenstored_start(void);
+
+#endif
@@ -0,0 +1,67 @@
+/* Xen simulation: xenstore-read, xenstore-write and xenstore-chmod
+ * This is under GPL License
+ *
+ * Same usage as the Xen tools, so toolstack scripts like activate.sh
+ * run as they are under simrun. Permissions are not simulated, chmod
+ * does nothing. xenstore-ops <domid>... is of the simulation alone, it
+ * prints how many requests each domain made of xenstore so far
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "xensim.h"
+
+static const char *cmd_name(const char *argv0)
+{
+	const char *p = strrchr(argv0, '/');
+
+	p = p ? p + 1 : argv0;
+	return strncmp(p, "xenstore-", 9) == 0 ? p + 9 : NULL;
+}
+
+int main(int argc, char **argv)
+{
+	char value[SIM_VALUE_LEN];
+	const char *cmd = cmd_name(argv[0]);
+	int i, err = 0;
+
+	if (!cmd && argc > 1) {
+		cmd = argv[1];
+		argv++;
+		argc--;
+	}
+	if (!cmd || argc < 2) {
+		fprintf(stderr, "usage: xenstore-{read,write,chmod,ops} <path> [arg]...\n");
+		return 2;
+	}
+	err = sim_attach(0);
+	if (err) {
+		fprintf(stderr, "xenstore: attach: %s\n", strerror(-err));
+		return 1;
+	}
+
+	if (strcmp(cmd, "read") == 0) {
+		for (i = 1; i < argc && !err; i++) {
+			err = sim_xs_read(argv[i], value, sizeof(value));
+			if (!err)
+				printf("%s\n", value);
+		}
+	} else if (strcmp(cmd, "write") == 0) {
+		for (i = 1; i + 1 < argc && !err; i += 2)
+			err = sim_xs_write(argv[i], argv[i + 1]);
+		if (i < argc)
+			err = -EINVAL;
+	} else if (strcmp(cmd, "ops") == 0) {
+		for (i = 1; i < argc; i++)
+			printf("%" PRIu64 "\n", sim_xs_ops(atoi(argv[i])));
+	} else if (strcmp(cmd, "chmod") != 0) {
+		err = -EINVAL;
+	}
+	if (err)
+		fprintf(stderr, "xenstore-%s: %s\n", cmd, strerror(-err));
+	sim_detach();
+	return err ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+/* Xen simulation: libxenstore on the xensim store
+ * This is under GPL License
+ *
+ * The part of xenstore.h of the Xen tools that toolstack programs like
+ * Xen_Log_15/dom0/activate.c use, so they build unchanged against
+ * libxenstore.a of xs.c. Same return conventions: false or NULL with
+ * errno set on failure
+ */
+#ifndef __XENSIM_XENSTORE_H__
+#define __XENSIM_XENSTORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define XBT_NULL 0
+
+typedef uint32_t xs_transaction_t;
+
+struct xs_handle;
+
+enum xs_perm_type {
+	XS_PERM_NONE = 0,
+	XS_PERM_READ = 1,
+	XS_PERM_WRITE = 2,
+	XS_PERM_OWNER = 4,
+};
+
+struct xs_permissions {
+	unsigned int id;
+	enum xs_perm_type perms;
+};
+
+/* A connection of dom0, flags are ignored */
+struct xs_handle *xs_open(unsigned long flags);
+void xs_close(struct xs_handle *xsh);
+
+/* Value of path, NUL ended, to be freed by caller */
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+		unsigned int *len);
+bool xs_write(struct xs_handle *h, xs_transaction_t t, const char *path,
+		const void *data, unsigned int len);
+/* Permissions are not simulated, always succeeds */
+bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
+		const char *path, struct xs_permissions *perms,
+		unsigned int num_perms);
+
+xs_transaction_t xs_transaction_start(struct xs_handle *h);
+/* Fails with errno EAGAIN if a key it touched was written meanwhile */
+bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t, bool abort);
+
+#endif
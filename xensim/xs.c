@@ -0,0 +1,111 @@
+/* Xen simulation: libxenstore on the xensim store
+ * This is under GPL License
+ *
+ * Every handle of a process shares its one attach as dom0, made on the
+ * first xs_open and undone on the last xs_close
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xensim.h"
+#include "xenstore.h"
+
+struct xs_handle {
+	int unused;
+};
+
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nr_open;
+
+/* -errno of the sim to false and errno */
+static bool xs_err(int err)
+{
+	if (err < 0) {
+		errno = -err;
+		return false;
+	}
+	return true;
+}
+
+struct xs_handle *xs_open(unsigned long flags)
+{
+	struct xs_handle *h = calloc(1, sizeof(*h));
+	int err = 0;
+
+	if (!h)
+		return NULL;
+	pthread_mutex_lock(&open_lock);
+	if (nr_open == 0)
+		err = sim_attach(0);
+	if (!err)
+		nr_open++;
+	pthread_mutex_unlock(&open_lock);
+	if (err) {
+		free(h);
+		errno = -err;
+		return NULL;
+	}
+	return h;
+}
+
+void xs_close(struct xs_handle *xsh)
+{
+	if (!xsh)
+		return;
+	pthread_mutex_lock(&open_lock);
+	if (--nr_open == 0)
+		sim_detach();
+	pthread_mutex_unlock(&open_lock);
+	free(xsh);
+}
+
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+		unsigned int *len)
+{
+	char *value = malloc(SIM_VALUE_LEN);
+	int err;
+
+	if (!value)
+		return NULL;
+	err = sim_xs_tx_read(t, path, value, SIM_VALUE_LEN);
+	if (!xs_err(err)) {
+		free(value);
+		return NULL;
+	}
+	if (len)
+		*len = strlen(value);
+	return value;
+}
+
+bool xs_write(struct xs_handle *h, xs_transaction_t t, const char *path,
+		const void *data, unsigned int len)
+{
+	char value[SIM_VALUE_LEN];
+
+	if (len >= sizeof(value))
+		return xs_err(-E2BIG);
+	memcpy(value, data, len);
+	value[len] = '\0';
+	return xs_err(sim_xs_tx_write(t, path, value));
+}
+
+bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
+		const char *path, struct xs_permissions *perms,
+		unsigned int num_perms)
+{
+	return true;
+}
+
+xs_transaction_t xs_transaction_start(struct xs_handle *h)
+{
+	int tx = sim_xs_transaction_start();
+
+	return xs_err(tx) ? (xs_transaction_t)tx : XBT_NULL;
+}
+
+bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t, bool abort)
+{
+	return xs_err(sim_xs_transaction_end(t, abort));
+}